@@ -0,0 +1,3756 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+* Copyright 2008-2010 Pelican Mapping
+* http://osgearth.org
+*
+* osgEarth is free software; you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+/**
+ * Equivalence checks and micro-benchmarks for osgEarth's optimized code paths.
+ * Each mode compares a fast path against the reference implementation it
+ * replaces, reports any mismatches, and times both. The exit code is non-zero
+ * if any check fails, so the modes can be scripted.
+ */
+
+#include <osg/ArgumentParser>
+#include <osg/Timer>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/Stats>
+#include <osg/CoordinateSystemNode>
+#include <osg/PagedLOD>
+#include <osg/NodeVisitor>
+#include <osg/Version>
+#include <osg/ImageSequence>
+#include <osgDB/Registry>
+#include <osgDB/FileUtils>
+#include <osgDB/FileNameUtils>
+#include <osgDB/ReadFile>
+#include <osgDB/WriteFile>
+#include <osgViewer/Viewer>
+#include <OpenThreads/Thread>
+#include <osgEarth/HeightFieldUtils>
+#include <osgEarth/GeoCommon>
+#include <osgEarth/Random>
+#include <osgEarth/Geoid>
+#include <osgEarth/VerticalDatum>
+#include <osgEarth/GeoData>
+#include <osgEarth/SpatialReference>
+#include <osgEarth/Registry>
+#include <osgEarth/TileSource>
+#include <osgEarth/MapNode>
+#include <osgEarth/CompositeTileSource>
+#include <osgEarth/ImageUtils>
+#include <osgEarth/HTTPClient>
+#include <osgEarth/ThreadingUtils>
+#include <osgEarth/XmlUtils>
+#include <osgEarthSymbology/Style>
+#include <osgEarthFeatures/FeatureListSource>
+#include <osgEarthFeatures/FeatureTileSource>
+#include <osgEarthFeatures/FeatureSourceIndexNode>
+#include <osgEarthFeatures/ExtrudeGeometryFilter>
+#include <osgEarthFeatures/SubstituteModelFilter>
+#include <osgEarthFeatures/Session>
+#include <osgEarthFeatures/ScriptEngine>
+#include <osgEarthUtil/SpatialData>
+#include <osgEarthDrivers/agglite/AGGLiteOptions>
+#include <osgEarthDrivers/mbtiles/MBTilesOptions>
+#include <osgEarthDrivers/kml/KML>
+#include <osgEarthDrivers/wms/WMSOptions>
+#include <osgEarthDrivers/feature_wfs/WFSFeatureOptions>
+#include <osgEarthDrivers/cache_filesystem/FileSystemCache>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <set>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#ifndef _WIN32
+#  include <sys/types.h>
+#  include <sys/socket.h>
+#  include <netinet/in.h>
+#  include <arpa/inet.h>
+#  include <unistd.h>
+#  include <sys/resource.h>
+#endif
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+
+using namespace osgEarth;
+using namespace osgEarth::Features;
+using namespace osgEarth::Symbology;
+using namespace osgEarth::Drivers;
+using namespace osgEarth::Util;
+
+#define LC "[osgearth_benchmark] "
+
+int resample( osg::ArgumentParser& args );
+int vdatum( osg::ArgumentParser& args );
+int agglite( osg::ArgumentParser& args );
+int wfs( osg::ArgumentParser& args );
+int zip( osg::ArgumentParser& args );
+int featureIndex( osg::ArgumentParser& args );
+int droam( osg::ArgumentParser& args );
+int seamless( osg::ArgumentParser& args );
+int geograph( osg::ArgumentParser& args );
+int extrude( osg::ArgumentParser& args );
+int composite( osg::ArgumentParser& args );
+int instancing( osg::ArgumentParser& args );
+int http( osg::ArgumentParser& args );
+int mbtiles( osg::ArgumentParser& args );
+int kml( osg::ArgumentParser& args );
+int config( osg::ArgumentParser& args );
+int script( osg::ArgumentParser& args );
+int wmst( osg::ArgumentParser& args );
+int blacklist( osg::ArgumentParser& args );
+int usage( const std::string& msg );
+
+int
+main(int argc, char** argv)
+{
+    osg::ArgumentParser args(&argc,argv);
+
+    if ( args.read( "--resample" ) )
+        return resample( args );
+    else if ( args.read( "--vdatum" ) )
+        return vdatum( args );
+    else if ( args.read( "--agglite" ) )
+        return agglite( args );
+    else if ( args.read( "--wfs" ) )
+        return wfs( args );
+    else if ( args.read( "--zip" ) )
+        return zip( args );
+    else if ( args.read( "--index" ) )
+        return featureIndex( args );
+    else if ( args.read( "--droam" ) )
+        return droam( args );
+    else if ( args.read( "--seamless" ) )
+        return seamless( args );
+    else if ( args.read( "--geograph" ) )
+        return geograph( args );
+    else if ( args.read( "--extrude" ) )
+        return extrude( args );
+    else if ( args.read( "--composite" ) )
+        return composite( args );
+    else if ( args.read( "--instancing" ) )
+        return instancing( args );
+    else if ( args.read( "--http" ) )
+        return http( args );
+    else if ( args.read( "--mbtiles" ) )
+        return mbtiles( args );
+    else if ( args.read( "--kml" ) )
+        return kml( args );
+    else if ( args.read( "--config" ) )
+        return config( args );
+    else if ( args.read( "--script" ) )
+        return script( args );
+    else if ( args.read( "--wmst" ) )
+        return wmst( args );
+    else if ( args.read( "--blacklist" ) )
+        return blacklist( args );
+    else
+        return usage("");
+}
+
+int
+usage( const std::string& msg )
+{
+    if ( !msg.empty() )
+    {
+        std::cout << msg << std::endl;
+    }
+
+    std::cout
+        << std::endl
+        << "USAGE: osgearth_benchmark" << std::endl
+        << std::endl
+        << "    --resample                          ; Checks HeightFieldUtils::resample against per-post sampling" << std::endl
+        << "        [--size n]                      ; Input heightfield size (default=257)" << std::endl
+        << "        [--out n]                       ; Output heightfield size (default=193)" << std::endl
+        << "        [--iterations n]                ; Timing iterations (default=20)" << std::endl
+        << std::endl
+        << "    --vdatum                            ; Checks the batch Geoid/VerticalDatum paths against per-point transforms" << std::endl
+        << "        [--size n]                      ; Tile size (default=33)" << std::endl
+        << "        [--tiles n]                     ; Number of tiles (default=256)" << std::endl
+        << std::endl
+        << "    --agglite                           ; Checks banded AGGLite rendering against a single-threaded render" << std::endl
+        << "        [--threads n]                   ; Render threads for the banded renders (default=4)" << std::endl
+        << "        [--features n]                  ; Number of line and polygon features (default=500)" << std::endl
+        << "        [--level n]                     ; Tile level to render (default=5)" << std::endl
+        << "        [--cache-size n]                ; Line buffer cache size for the cached render (default=64)" << std::endl
+        << std::endl
+        << "    --wfs                               ; Checks WFS pages read from the feature cache against the server" << std::endl
+        << "        --url url                       ; WFS service URL" << std::endl
+        << "        --typename name                 ; Feature type to query" << std::endl
+        << "        --cache path                    ; Folder for the feature cache (should start out empty)" << std::endl
+        << "        [--bounds xmin ymin xmax ymax]  ; Query area in degrees (default=whole world)" << std::endl
+        << "        [--level n]                     ; Tile level of the queries (default=2)" << std::endl
+        << "        [--page-size n]                 ; Features per request, 0 for unpaged (default=0)" << std::endl
+        << std::endl
+        << "    --zip                               ; Checks and times concurrent reads through the zipfs plugin" << std::endl
+        << "        [--archive path]                ; Archive to (re)create (default=osgearth_benchmark.zip)" << std::endl
+        << "        [--no-write]                    ; Reuse an existing archive, e.g. one re-packed with zip -0 to time stored entries" << std::endl
+        << "        [--entries n]                   ; Number of images in the archive (default=256)" << std::endl
+        << "        [--size n]                      ; Image size (default=64)" << std::endl
+        << "        [--threads n]                   ; Concurrent readers (default=8)" << std::endl
+        << "        [--reads n]                     ; Reads per reader (default=1000)" << std::endl
+        << std::endl
+        << "    --index                             ; Checks FeatureSourceIndexNode picks against a primitive set scan" << std::endl
+        << "        [--features n]                  ; Number of features (default=100000)" << std::endl
+        << "        [--drawables n]                 ; Number of drawables they are merged into (default=100)" << std::endl
+        << "        [--picks n]                     ; Number of picks (default=100000)" << std::endl
+        << std::endl
+        << "    --droam file.earth                  ; Flies a scripted camera path over the DROAM engine and reports its queues" << std::endl
+        << "        [--frames n]                    ; Number of frames to render (default=1000)" << std::endl
+        << "        [--speed deg]                   ; Camera speed in degrees of longitude per frame (default=0.5)" << std::endl
+        << "        [--altitude m]                  ; Camera altitude in meters (default=250000)" << std::endl
+        << std::endl
+        << "    --seamless file.earth               ; Times seamless engine patch builds, sequential and concurrent" << std::endl
+        << "        [--depth n]                     ; Levels to page in below the face roots (default=3)" << std::endl
+        << "        [--threads n]                   ; Concurrent builders, like pager threads (default=4)" << std::endl
+        << std::endl
+        << "    --geograph                          ; Checks GeoGraph bulk inserts, moves and region queries" << std::endl
+        << "        [--objects n]                   ; Number of objects (default=100000)" << std::endl
+        << "        [--max-objects n]               ; Objects per cell before it splits (default=500)" << std::endl
+        << "        [--priorities n]                ; Distinct priorities, few means many ties (default=4)" << std::endl
+        << "        [--moves n]                     ; Objects to move (default=10000)" << std::endl
+        << "        [--queries n]                   ; Region queries (default=1000)" << std::endl
+        << std::endl
+        << "    --extrude                           ; Compares extruded vertex and byte counts, per-feature vs. shared buffers" << std::endl
+        << "        [--features n]                  ; Number of line and polygon features (default=10000)" << std::endl
+        << "        [--threads n]                   ; Threads for the multi-threaded shared-buffer build (default=4)" << std::endl
+        << std::endl
+        << "    --composite                         ; Checks composite tile blending against ImageUtils::mix, with a nested composite" << std::endl
+        << "        [--layers n]                    ; Number of component layers, at least 3 (default=5)" << std::endl
+        << "        [--size n]                      ; Tile size (default=256)" << std::endl
+        << "        [--level n]                     ; Tile level to composite (default=3)" << std::endl
+        << "        [--threads n]                   ; Concurrent callers for the threaded pass (default=4)" << std::endl
+        << std::endl
+        << "    --instancing                        ; Compares instanced model substitution against the transform and clustering paths" << std::endl
+        << "        [--points n]                    ; Number of point features (default=20000)" << std::endl
+        << "        [--model path]                  ; Marker model to (re)create (default=osgearth_benchmark_marker.osg)" << std::endl
+        << std::endl
+        << "    --http                              ; Checks and times HTTPClient, blocking and asynchronous, against a local stub server" << std::endl
+        << "        [--requests n]                  ; Requests per pass (default=500)" << std::endl
+        << "        [--threads n]                   ; Concurrent callers for the blocking passes (default=8)" << std::endl
+        << "        [--delay ms]                    ; Server latency per request (default=5)" << std::endl
+        << "        [--size n]                      ; Response size in bytes (default=4096)" << std::endl
+        << "        [--per-host n]                  ; Connection limit per host for the engine (default=6)" << std::endl
+        << std::endl
+        << "    --mbtiles                           ; Checks and times batched stores and concurrent reads through the mbtiles driver" << std::endl
+        << "        [--file path]                   ; Database to (re)create (default=osgearth_benchmark.mbtiles)" << std::endl
+        << "        [--level n]                     ; Tile level to fill, every tile is stored (default=4)" << std::endl
+        << "        [--size n]                      ; Tile size (default=256)" << std::endl
+        << "        [--threads n]                   ; Concurrent readers (default=8)" << std::endl
+        << "        [--reads n]                     ; Reads per reader (default=1000)" << std::endl
+        << std::endl
+        << "    --kml                               ; Times streamed KML loads of a synthetic document and reports peak memory" << std::endl
+        << "        [--file path]                   ; Document to (re)create (default=osgearth_benchmark.kml)" << std::endl
+        << "        [--placemarks n]                ; Number of placemarks, a quarter of them lines (default=20000)" << std::endl
+        << "        [--threads n]                   ; Build threads for the threaded load (default=4)" << std::endl
+        << std::endl
+        << "    --config                            ; Checks XmlDocument::loadConfig against the DOM parse and times both" << std::endl
+        << "        [--layers n]                    ; Layers in the synthetic map document (default=2000)" << std::endl
+        << "        [--iterations n]                ; Timing iterations (default=5)" << std::endl
+        << "        [--earth file.earth]            ; Also check and time this file, and a full load of it" << std::endl
+        << std::endl
+        << "    --script                            ; Checks ScriptEngine::runBatch against per-feature runs and times both" << std::endl
+        << "        [--features n]                  ; Number of features per batch (default=100000)" << std::endl
+        << "        [--iterations n]                ; Timing iterations (default=5)" << std::endl
+        << "        [--language name]               ; Also time this script engine plugin, e.g. javascript (default=none)" << std::endl
+        << "        [--code text]                   ; Code for that engine to run (default=\"1+1\")" << std::endl
+        << std::endl
+        << "    --wmst                              ; Checks WMS-T image sequences, blocking and progressive, against a local stub server" << std::endl
+        << "        [--times n]                     ; Number of time steps (default=24)" << std::endl
+        << "        [--window n]                    ; Time steps requested at once (default=4)" << std::endl
+        << "        [--delay ms]                    ; Extra latency per step, earlier steps answer later (default=5)" << std::endl
+        << std::endl
+        << "    --blacklist                         ; Checks TileBlacklist lookups, removal and a write/read round trip, and times lookups" << std::endl
+        << "        [--tiles n]                     ; Number of blacklisted tiles (default=100000)" << std::endl
+        << "        [--probes n]                    ; Number of lookups, mostly misses (default=1000000)" << std::endl
+        << std::endl;
+
+    return -1;
+}
+
+namespace
+{
+    double elapsed_ms( osg::Timer_t start )
+    {
+        return osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() );
+    }
+
+    // comparison within a tolerance; NO_DATA_VALUE must match exactly.
+    template<typename T>
+    unsigned countDifferences( const std::vector<T>& a, const std::vector<T>& b, double tolerance, double& maxDiff )
+    {
+        unsigned bad = 0;
+        maxDiff = 0.0;
+        for( unsigned i=0; i<a.size(); ++i )
+        {
+            if ( (a[i] == NO_DATA_VALUE) != (b[i] == NO_DATA_VALUE) )
+            {
+                ++bad;
+            }
+            else if ( a[i] != NO_DATA_VALUE )
+            {
+                double diff = fabs( (double)a[i] - (double)b[i] );
+                maxDiff = osg::maximum( maxDiff, diff );
+                if ( diff > tolerance )
+                    ++bad;
+            }
+        }
+        return bad;
+    }
+
+    // exact comparison; NO_DATA_VALUE compares equal to itself.
+    unsigned countMismatches( const std::vector<float>& a, const std::vector<float>& b, double& maxDiff )
+    {
+        unsigned bad = 0;
+        maxDiff = 0.0;
+        for( unsigned i=0; i<a.size(); ++i )
+        {
+            if ( a[i] != b[i] )
+            {
+                ++bad;
+                if ( a[i] != NO_DATA_VALUE && b[i] != NO_DATA_VALUE )
+                    maxDiff = osg::maximum( maxDiff, (double)fabs(a[i]-b[i]) );
+            }
+        }
+        return bad;
+    }
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    osg::HeightField* makeHeightField( unsigned size, bool withNoData, Random& prng )
+    {
+        osg::HeightField* hf = new osg::HeightField();
+        hf->allocate( size, size );
+        for( unsigned r=0; r<size; ++r )
+            for( unsigned c=0; c<size; ++c )
+                hf->setHeight( c, r, (float)(1000.0*sin(0.05*c)*cos(0.07*r) + 50.0*prng.next()) );
+
+        if ( withNoData )
+        {
+            for( unsigned i=0; i<size; ++i )
+                hf->setHeight( prng.next(size), prng.next(size), NO_DATA_VALUE );
+        }
+        return hf;
+    }
+
+    // fractional input coordinates for each output post, including the edges
+    // and a few exact post hits.
+    void makeCoords( unsigned numOut, unsigned numIn, Random& prng, std::vector<double>& coords )
+    {
+        coords.resize( numOut );
+        for( unsigned i=0; i<numOut; ++i )
+        {
+            double p = (double)i * (double)(numIn-1) / (double)(numOut-1);
+            if ( i % 7 == 3 )
+                p = floor( p );
+            else if ( i > 0 && i+1 < numOut && i % 5 == 1 )
+                p = osg::clampBetween( p + (prng.next()-0.5)*0.25, 0.0, (double)(numIn-1) );
+            coords[i] = p;
+        }
+    }
+
+    const char* interpName( ElevationInterpolation interp )
+    {
+        return
+            interp == INTERP_NEAREST     ? "nearest" :
+            interp == INTERP_AVERAGE     ? "average" :
+            interp == INTERP_TRIANGULATE ? "triangulate" :
+            "bilinear";
+    }
+}
+
+int
+resample( osg::ArgumentParser& args )
+{
+    unsigned inSize = 257;
+    while( args.read("--size", inSize) );
+
+    unsigned outSize = 193;
+    while( args.read("--out", outSize) );
+
+    unsigned iterations = 20;
+    while( args.read("--iterations", iterations) );
+
+    if ( inSize < 2 || outSize < 2 || iterations < 1 )
+        return usage( "Sizes must be at least 2 and iterations at least 1." );
+
+    const ElevationInterpolation interps[] = { INTERP_NEAREST, INTERP_BILINEAR, INTERP_AVERAGE, INTERP_TRIANGULATE };
+
+    Random prng( 0, Random::METHOD_FAST );
+
+    std::vector<double> cols, rows;
+    makeCoords( outSize, inSize, prng, cols );
+    makeCoords( outSize, inSize, prng, rows );
+
+    unsigned failures = 0;
+
+    for( unsigned n=0; n<2; ++n )
+    {
+        bool withNoData = n == 1;
+        osg::ref_ptr<osg::HeightField> input = makeHeightField( inSize, withNoData, prng );
+
+        for( unsigned i=0; i<4; ++i )
+        {
+            ElevationInterpolation interp = interps[i];
+
+            osg::ref_ptr<osg::HeightField> output = new osg::HeightField();
+            output->allocate( outSize, outSize );
+
+            // reference: one getHeightAtPixel call per post.
+            std::vector<float> expected( outSize*outSize );
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            for( unsigned it=0; it<iterations; ++it )
+            {
+                for( unsigned c=0; c<outSize; ++c )
+                    for( unsigned r=0; r<outSize; ++r )
+                        expected[r*outSize+c] = HeightFieldUtils::getHeightAtPixel( input.get(), cols[c], rows[r], interp );
+            }
+            double refTime = elapsed_ms( t0 ) / (double)iterations;
+
+            t0 = osg::Timer::instance()->tick();
+            for( unsigned it=0; it<iterations; ++it )
+                HeightFieldUtils::resample( input.get(), cols, rows, output.get(), interp );
+            double fastTime = elapsed_ms( t0 ) / (double)iterations;
+
+            double maxDiff;
+            unsigned bad = countMismatches( expected, output->getHeightList(), maxDiff );
+            if ( bad > 0 )
+                ++failures;
+
+            std::cout
+                << interpName(interp) << (withNoData ? " (with NO_DATA)" : "") << ": "
+                << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " of " << expected.size() << " posts differ"
+                << " (max diff " << maxDiff << "); per-post " << refTime << " ms, resample " << fastTime << " ms"
+                << std::endl;
+        }
+    }
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    // A synthetic, globe-spanning 1-degree geoid so the check does not depend
+    // on a geoid file being installed.
+    Geoid* makeGeoid( Random& prng )
+    {
+        osg::HeightField* hf = new osg::HeightField();
+        hf->allocate( 360, 180 );
+        hf->setOrigin( osg::Vec3(-180.0f, -90.0f, 0.0f) );
+        hf->setXInterval( 1.0f );
+        hf->setYInterval( 1.0f );
+        for( unsigned r=0; r<180; ++r )
+            for( unsigned c=0; c<360; ++c )
+                hf->setHeight( c, r, (float)(80.0*sin(0.11*c)*cos(0.13*r) + 5.0*prng.next()) );
+
+        Geoid* geoid = new Geoid();
+        geoid->setName( "benchmark" );
+        geoid->setHeightField( hf );
+        return geoid;
+    }
+
+    struct Tile
+    {
+        double   _west, _south, _east, _north;
+    };
+
+    void makeTiles( unsigned numTiles, Random& prng, std::vector<Tile>& tiles )
+    {
+        tiles.resize( numTiles );
+        for( unsigned i=0; i<numTiles; ++i )
+        {
+            double size = 0.1 + 10.0*prng.next();
+            tiles[i]._west  = -180.0 + (360.0-size)*prng.next();
+            tiles[i]._south =  -90.0 + (180.0-size)*prng.next();
+            tiles[i]._east  = tiles[i]._west  + size;
+            tiles[i]._north = tiles[i]._south + size;
+        }
+    }
+
+    // Checks one datum pair: the heightfield path (cold and cached) and the point
+    // batch path, each against the per-point scalar transform.
+    unsigned checkDatums(
+        const char*              name,
+        const VerticalDatum*     from,
+        const VerticalDatum*     to,
+        const std::vector<Tile>& tiles,
+        unsigned                 size,
+        Random&                  prng )
+    {
+        const SpatialReference* wgs84 = SpatialReference::create( "wgs84" );
+        const double tolerance = 1e-3;
+        unsigned failures = 0;
+
+        // source heights, with a few NO_DATA posts:
+        std::vector<float> source( size*size );
+        for( unsigned i=0; i<source.size(); ++i )
+            source[i] = i % 37 == 5 ? NO_DATA_VALUE : (float)(3000.0*prng.next());
+
+        // reference: the scalar transform per post.
+        std::vector< std::vector<float> > expected( tiles.size() );
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for( unsigned t=0; t<tiles.size(); ++t )
+        {
+            const Tile& tile = tiles[t];
+            double latInterval = (tile._north-tile._south) / double(size-1);
+            double lonInterval = (tile._east-tile._west) / double(size-1);
+
+            expected[t] = source;
+            for( unsigned r=0; r<size; ++r )
+            {
+                for( unsigned c=0; c<size; ++c )
+                {
+                    float& h = expected[t][r*size+c];
+                    if ( h != NO_DATA_VALUE )
+                        VerticalDatum::transform( from, to, tile._south + latInterval*double(r), tile._west + lonInterval*double(c), h );
+                }
+            }
+        }
+        double refTime = elapsed_ms( t0 );
+
+        // the heightfield path, twice: once to build the offset grids and once
+        // from the cache.
+        for( unsigned pass=0; pass<2; ++pass )
+        {
+            unsigned bad = 0;
+            double   maxDiff = 0.0;
+
+            std::vector< osg::ref_ptr<osg::HeightField> > hfs( tiles.size() );
+            for( unsigned t=0; t<tiles.size(); ++t )
+            {
+                hfs[t] = new osg::HeightField();
+                hfs[t]->allocate( size, size );
+                hfs[t]->getHeightList() = source;
+            }
+
+            t0 = osg::Timer::instance()->tick();
+            for( unsigned t=0; t<tiles.size(); ++t )
+            {
+                const Tile& tile = tiles[t];
+                GeoExtent extent( wgs84, tile._west, tile._south, tile._east, tile._north );
+                VerticalDatum::transform( from, to, extent, hfs[t].get() );
+            }
+            double fastTime = elapsed_ms( t0 );
+
+            for( unsigned t=0; t<tiles.size(); ++t )
+            {
+                double tileDiff;
+                bad += countDifferences( expected[t], hfs[t]->getHeightList(), tolerance, tileDiff );
+                maxDiff = osg::maximum( maxDiff, tileDiff );
+            }
+
+            if ( bad > 0 )
+                ++failures;
+
+            std::cout
+                << name << ", heightfield " << (pass == 0 ? "(cold)" : "(cached)") << ": "
+                << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " posts differ"
+                << " (max diff " << maxDiff << "); per-post " << refTime << " ms, batch " << fastTime << " ms"
+                << std::endl;
+        }
+
+        // the point batch path, on the same posts:
+        {
+            std::vector<osg::Vec3d> points;
+            std::vector<double>     expectedZ;
+            for( unsigned t=0; t<tiles.size(); ++t )
+            {
+                const Tile& tile = tiles[t];
+                for( unsigned i=0; i<size; ++i )
+                {
+                    osg::Vec3d p(
+                        tile._west  + (tile._east-tile._west)*prng.next(),
+                        tile._south + (tile._north-tile._south)*prng.next(),
+                        3000.0*prng.next() );
+                    points.push_back( p );
+                }
+            }
+
+            expectedZ.resize( points.size() );
+            t0 = osg::Timer::instance()->tick();
+            for( unsigned i=0; i<points.size(); ++i )
+            {
+                double z = points[i].z();
+                VerticalDatum::transform( from, to, points[i].y(), points[i].x(), z );
+                expectedZ[i] = z;
+            }
+            double pointRefTime = elapsed_ms( t0 );
+
+            t0 = osg::Timer::instance()->tick();
+            VerticalDatum::transform( from, to, points );
+            double pointFastTime = elapsed_ms( t0 );
+
+            std::vector<double> actualZ( points.size() );
+            for( unsigned i=0; i<points.size(); ++i )
+                actualZ[i] = points[i].z();
+
+            double maxDiff;
+            unsigned bad = countDifferences( expectedZ, actualZ, tolerance, maxDiff );
+            if ( bad > 0 )
+                ++failures;
+
+            std::cout
+                << name << ", points: "
+                << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " of " << points.size() << " points differ"
+                << " (max diff " << maxDiff << "); per-point " << pointRefTime << " ms, batch " << pointFastTime << " ms"
+                << std::endl;
+        }
+
+        return failures;
+    }
+}
+
+int
+vdatum( osg::ArgumentParser& args )
+{
+    unsigned size = 33;
+    while( args.read("--size", size) );
+
+    unsigned numTiles = 256;
+    while( args.read("--tiles", numTiles) );
+
+    if ( size < 2 || numTiles < 1 )
+        return usage( "Size must be at least 2 and tiles at least 1." );
+
+    Random prng( 0, Random::METHOD_FAST );
+
+    osg::ref_ptr<Geoid> geoid = makeGeoid( prng );
+    unsigned failures = 0;
+
+    // Geoid::getHeights against getHeight on each tile's lattice:
+    {
+        std::vector<Tile> tiles;
+        makeTiles( numTiles, prng, tiles );
+
+        unsigned bad = 0;
+        double   maxDiff = 0.0;
+        double   refTime = 0.0, fastTime = 0.0;
+
+        osg::ref_ptr<osg::HeightField> out = new osg::HeightField();
+        out->allocate( size, size );
+        std::vector<float> expected( size*size );
+
+        for( unsigned t=0; t<tiles.size(); ++t )
+        {
+            const Tile& tile = tiles[t];
+            double latInterval = (tile._north-tile._south) / double(size-1);
+            double lonInterval = (tile._east-tile._west) / double(size-1);
+
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            for( unsigned r=0; r<size; ++r )
+                for( unsigned c=0; c<size; ++c )
+                    expected[r*size+c] = geoid->getHeight( tile._south + latInterval*double(r), tile._west + lonInterval*double(c) );
+            refTime += elapsed_ms( t0 );
+
+            t0 = osg::Timer::instance()->tick();
+            geoid->getHeights( tile._south, tile._west, latInterval, lonInterval, out.get() );
+            fastTime += elapsed_ms( t0 );
+
+            double tileDiff;
+            bad += countDifferences( expected, out->getHeightList(), 1e-3, tileDiff );
+            maxDiff = osg::maximum( maxDiff, tileDiff );
+        }
+
+        if ( bad > 0 )
+            ++failures;
+
+        std::cout
+            << "geoid: "
+            << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " posts differ"
+            << " (max diff " << maxDiff << "); getHeight " << refTime << " ms, getHeights " << fastTime << " ms"
+            << std::endl;
+    }
+
+    // VerticalDatum transforms in both directions, and with a unit change:
+    osg::ref_ptr<VerticalDatum> msl     = new VerticalDatum( "benchmark", "benchmark", geoid.get() );
+    osg::ref_ptr<VerticalDatum> haeFeet = new VerticalDatum( Units::FEET );
+
+    std::vector<Tile> tiles;
+    makeTiles( numTiles, prng, tiles );
+
+    failures += checkDatums( "msl to hae",      msl.get(), 0L,            tiles, size, prng );
+    failures += checkDatums( "hae to msl",      0L,        msl.get(),     tiles, size, prng );
+    failures += checkDatums( "msl to hae feet", msl.get(), haeFeet.get(), tiles, size, prng );
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    // Random lines and polygons in a 40-degree box centered on (0,0), with
+    // unique FIDs so the line buffer cache can key on them.
+    FeatureListSource* makeFeatures( unsigned numFeatures, Random& prng )
+    {
+        const SpatialReference* srs = SpatialReference::create( "epsg:4326" );
+        FeatureListSource* source = new FeatureListSource();
+
+        for( unsigned i=0; i<numFeatures; ++i )
+        {
+            double x = -20.0 + 40.0*prng.next();
+            double y = -20.0 + 40.0*prng.next();
+            Geometry* geom;
+
+            if ( i % 2 == 0 )
+            {
+                LineString* line = new LineString();
+                for( unsigned v=0; v<8; ++v )
+                {
+                    line->push_back( osg::Vec3d(x, y, 0) );
+                    x += 2.0*(prng.next()-0.5);
+                    y += 2.0*(prng.next()-0.5);
+                }
+                geom = line;
+            }
+            else
+            {
+                Polygon* poly = new Polygon();
+                double radius = 0.25 + 1.5*prng.next();
+                for( unsigned v=0; v<7; ++v )
+                {
+                    double a = osg::PI * 2.0 * (double)v / 7.0;
+                    double r = radius * (0.5 + 0.5*prng.next());
+                    poly->push_back( osg::Vec3d(x + r*cos(a), y + r*sin(a), 0) );
+                }
+                geom = poly;
+            }
+
+            source->insertFeature( new Feature(geom, srs, Style(), (FeatureID)(i+1)) );
+        }
+        return source;
+    }
+
+    StyleSheet* makeStyleSheet()
+    {
+        Style style;
+
+        LineSymbol* line = style.getOrCreateSymbol<LineSymbol>();
+        line->stroke()->color() = Color::Yellow;
+        line->stroke()->width() = 3.0f;
+
+        PolygonSymbol* poly = style.getOrCreateSymbol<PolygonSymbol>();
+        poly->fill()->color() = Color(Color::Cyan, 0.5f);
+
+        StyleSheet* styles = new StyleSheet();
+        styles->addStyle( style );
+        return styles;
+    }
+
+    TileSource* makeRasterizer( FeatureSource* features, StyleSheet* styles, unsigned threads, unsigned cacheSize )
+    {
+        AGGLiteOptions options;
+        options.styles() = styles;
+        options.renderThreads() = threads;
+        options.lineBufferCacheSize() = cacheSize;
+
+        osg::ref_ptr<TileSource> source = TileSourceFactory::create( options );
+        FeatureTileSource* fts = dynamic_cast<FeatureTileSource*>( source.get() );
+        if ( !fts )
+            return 0L;
+
+        // the feature source does not survive the options' Config round trip,
+        // so hand it over directly.
+        fts->setFeatureSource( features );
+        fts->initialize( 0L, Registry::instance()->getGlobalGeodeticProfile() );
+        return source.release();
+    }
+
+    void renderAll( TileSource* source, const std::vector<TileKey>& keys, std::vector< osg::ref_ptr<osg::Image> >& out_images, double& out_ms )
+    {
+        out_images.resize( keys.size() );
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for( unsigned i=0; i<keys.size(); ++i )
+            out_images[i] = source->createImage( keys[i] );
+        out_ms = elapsed_ms( t0 );
+    }
+
+    bool sameImage( const osg::Image* a, const osg::Image* b )
+    {
+        if ( !a || !b )
+            return a == b;
+        if ( a->s() != b->s() || a->t() != b->t() || a->getPixelFormat() != b->getPixelFormat() || a->getDataType() != b->getDataType() )
+            return false;
+        return ::memcmp( a->data(), b->data(), a->getTotalSizeInBytes() ) == 0;
+    }
+
+    unsigned checkRasterizer(
+        const std::string&                              name,
+        TileSource*                                     source,
+        const std::vector<TileKey>&                     keys,
+        const std::vector< osg::ref_ptr<osg::Image> >&  expected,
+        double                                          refTime )
+    {
+        if ( !source )
+        {
+            std::cout << name << ": FAILED, could not load the agglite driver" << std::endl;
+            return 1;
+        }
+
+        std::vector< osg::ref_ptr<osg::Image> > images;
+        double fastTime;
+        renderAll( source, keys, images, fastTime );
+
+        unsigned bad = 0;
+        for( unsigned i=0; i<keys.size(); ++i )
+        {
+            if ( !sameImage(expected[i].get(), images[i].get()) )
+                ++bad;
+        }
+
+        std::cout
+            << name << ": "
+            << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " of " << keys.size() << " tiles differ"
+            << "; single-threaded " << refTime << " ms, " << name << " " << fastTime << " ms"
+            << std::endl;
+
+        return bad == 0 ? 0 : 1;
+    }
+}
+
+int
+agglite( osg::ArgumentParser& args )
+{
+    unsigned threads = 4;
+    while( args.read("--threads", threads) );
+
+    unsigned numFeatures = 500;
+    while( args.read("--features", numFeatures) );
+
+    unsigned level = 5;
+    while( args.read("--level", level) );
+
+    unsigned cacheSize = 64;
+    while( args.read("--cache-size", cacheSize) );
+
+    if ( threads < 2 || numFeatures < 1 || cacheSize < 1 )
+        return usage( "Threads must be at least 2; features and cache size at least 1." );
+
+    Random prng( 0, Random::METHOD_FAST );
+
+    osg::ref_ptr<FeatureSource> features = makeFeatures( numFeatures, prng );
+    osg::ref_ptr<StyleSheet>    styles   = makeStyleSheet();
+
+    // every tile at the requested level that touches the feature data:
+    const Profile* profile = Registry::instance()->getGlobalGeodeticProfile();
+    GeoExtent dataExtent( profile->getSRS(), -22.0, -22.0, 22.0, 22.0 );
+    std::vector<TileKey> keys;
+    unsigned tilesWide, tilesHigh;
+    profile->getNumTiles( level, tilesWide, tilesHigh );
+    for( unsigned x=0; x<tilesWide; ++x )
+    {
+        for( unsigned y=0; y<tilesHigh; ++y )
+        {
+            TileKey key( level, x, y, profile );
+            if ( key.getExtent().intersects(dataExtent) )
+                keys.push_back( key );
+        }
+    }
+
+    osg::ref_ptr<TileSource> reference = makeRasterizer( features.get(), styles.get(), 1, 0 );
+    if ( !reference.valid() )
+        return usage( "Could not load the agglite driver." );
+
+    std::vector< osg::ref_ptr<osg::Image> > expected;
+    double refTime;
+    renderAll( reference.get(), keys, expected, refTime );
+
+    unsigned failures = 0;
+
+    osg::ref_ptr<TileSource> banded = makeRasterizer( features.get(), styles.get(), threads, 0 );
+    failures += checkRasterizer( "banded", banded.get(), keys, expected, refTime );
+
+    // a cache smaller than the working set, so entries are evicted along the way:
+    osg::ref_ptr<TileSource> cached = makeRasterizer( features.get(), styles.get(), threads, cacheSize );
+    failures += checkRasterizer( "banded+cache", cached.get(), keys, expected, refTime );
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    FeatureSource* makeWFS( const WFSFeatureOptions& base, const CachePolicy& policy, osgDB::Options* dbOptions )
+    {
+        WFSFeatureOptions options( base );
+        options.cachePolicy() = policy;
+
+        FeatureSource* source = FeatureSourceFactory::create( options );
+        if ( source )
+            source->initialize( dbOptions );
+        return source;
+    }
+
+    // reads every query; a failed query reads as an empty page.
+    void queryAll( FeatureSource* source, const std::vector<Bounds>& queries, std::vector<FeatureList>& out_pages, double& out_ms )
+    {
+        out_pages.clear();
+        out_pages.resize( queries.size() );
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for( unsigned i=0; i<queries.size(); ++i )
+        {
+            Symbology::Query query;
+            query.bounds() = queries[i];
+            osg::ref_ptr<FeatureCursor> cursor = source->createFeatureCursor( query );
+            if ( cursor.valid() )
+                cursor->fill( out_pages[i] );
+        }
+        out_ms = elapsed_ms( t0 );
+    }
+
+    bool sameGeometry( const Geometry* a, const Geometry* b )
+    {
+        if ( !a || !b )
+            return a == b;
+        if ( a->getType() != b->getType() || a->size() != b->size() )
+            return false;
+        for( unsigned i=0; i<a->size(); ++i )
+            if ( (*a)[i] != (*b)[i] )
+                return false;
+        return true;
+    }
+
+    bool sameFeature( const Feature* a, const Feature* b )
+    {
+        if ( a->getFID() != b->getFID() || !sameGeometry(a->getGeometry(), b->getGeometry()) )
+            return false;
+
+        const AttributeTable& aa = a->getAttrs();
+        const AttributeTable& ba = b->getAttrs();
+        if ( aa.size() != ba.size() )
+            return false;
+        for( AttributeTable::const_iterator i = aa.begin(), j = ba.begin(); i != aa.end(); ++i, ++j )
+            if ( i->first != j->first || i->second.getString() != j->second.getString() )
+                return false;
+        return true;
+    }
+
+    unsigned checkPages(
+        const std::string&              name,
+        const std::vector<FeatureList>&  expected,
+        const std::vector<FeatureList>&  actual,
+        double                           refTime,
+        double                           time )
+    {
+        unsigned bad = 0, numFeatures = 0;
+        for( unsigned i=0; i<expected.size(); ++i )
+        {
+            numFeatures += expected[i].size();
+            if ( expected[i].size() != actual[i].size() )
+            {
+                ++bad;
+                continue;
+            }
+            FeatureList::const_iterator a = expected[i].begin(), b = actual[i].begin();
+            for( ; a != expected[i].end(); ++a, ++b )
+            {
+                if ( !sameFeature(a->get(), b->get()) )
+                {
+                    ++bad;
+                    break;
+                }
+            }
+        }
+
+        std::cout
+            << name << ": "
+            << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " of " << expected.size() << " queries differ"
+            << " (" << numFeatures << " features); server " << refTime << " ms, " << name << " " << time << " ms"
+            << std::endl;
+
+        return bad == 0 ? 0 : 1;
+    }
+}
+
+int
+wfs( osg::ArgumentParser& args )
+{
+    std::string url;
+    args.read( "--url", url );
+
+    std::string typeName;
+    args.read( "--typename", typeName );
+
+    std::string cachePath;
+    args.read( "--cache", cachePath );
+
+    double xmin = -180.0, ymin = -90.0, xmax = 180.0, ymax = 90.0;
+    while( args.read("--bounds", xmin, ymin, xmax, ymax) );
+
+    unsigned level = 2;
+    while( args.read("--level", level) );
+
+    unsigned pageSize = 0;
+    while( args.read("--page-size", pageSize) );
+
+    if ( url.empty() || typeName.empty() || cachePath.empty() )
+        return usage( "--url, --typename and --cache are required." );
+
+    WFSFeatureOptions options;
+    options.url()      = url;
+    options.typeName() = typeName;
+    if ( pageSize > 0 )
+        options.pageSize() = pageSize;
+
+    FileSystemCacheOptions cacheOptions;
+    cacheOptions.rootPath() = cachePath;
+    osg::ref_ptr<Cache> cache = CacheFactory::create( cacheOptions );
+    if ( !cache.valid() || !cache->isOK() )
+        return usage( "Could not open the cache at " + cachePath );
+
+    osg::ref_ptr<osgDB::Options> cacheDBOptions = new osgDB::Options();
+    cache->store( cacheDBOptions.get() );
+
+    // one query per tile at the requested level that touches the query area:
+    const Profile* profile = Registry::instance()->getGlobalGeodeticProfile();
+    GeoExtent area( profile->getSRS(), xmin, ymin, xmax, ymax );
+    std::vector<Bounds> queries;
+    unsigned tilesWide, tilesHigh;
+    profile->getNumTiles( level, tilesWide, tilesHigh );
+    for( unsigned x=0; x<tilesWide; ++x )
+    {
+        for( unsigned y=0; y<tilesHigh; ++y )
+        {
+            TileKey key( level, x, y, profile );
+            if ( key.getExtent().intersects(area) )
+                queries.push_back( key.getExtent().bounds() );
+        }
+    }
+
+    // reference: straight from the server.
+    osg::ref_ptr<FeatureSource> server = makeWFS( options, CachePolicy::NO_CACHE, 0L );
+    if ( !server.valid() )
+        return usage( "Could not load the WFS driver." );
+
+    std::vector<FeatureList> expected, pages;
+    double refTime, time;
+    queryAll( server.get(), queries, expected, refTime );
+
+    unsigned failures = 0;
+
+    // a read/write cache: the first pass fills it, the second reads from it.
+    osg::ref_ptr<FeatureSource> cached = makeWFS( options, CachePolicy(CachePolicy::USAGE_READ_WRITE), cacheDBOptions.get() );
+    queryAll( cached.get(), queries, pages, time );
+    failures += checkPages( "cold cache", expected, pages, refTime, time );
+
+    queryAll( cached.get(), queries, pages, time );
+    failures += checkPages( "warm cache", expected, pages, refTime, time );
+
+    // cache-only must produce the same pages without going to the server.
+    osg::ref_ptr<FeatureSource> cacheOnly = makeWFS( options, CachePolicy::CACHE_ONLY, cacheDBOptions.get() );
+    queryAll( cacheOnly.get(), queries, pages, time );
+    failures += checkPages( "cache only", expected, pages, refTime, time );
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    std::string zipEntryName( const std::string& archive, unsigned i )
+    {
+        std::stringstream buf;
+        buf << archive << "/tiles/" << i << ".png";
+        return buf.str();
+    }
+
+    bool sameImageData( const osg::Image* image, const std::string& expected )
+    {
+        return
+            image &&
+            image->getTotalSizeInBytes() == expected.size() &&
+            ::memcmp( image->data(), expected.data(), expected.size() ) == 0;
+    }
+
+    /** Reads random entries and checks each one against the single-threaded read. */
+    struct ZipReader : public OpenThreads::Thread
+    {
+        ZipReader(
+            osgDB::ReaderWriter*            rw,
+            const std::string&              archive,
+            const std::vector<std::string>& expected,
+            unsigned                        reads,
+            unsigned                        seed )
+            : _rw( rw ), _archive( archive ), _expected( expected ), _reads( reads ), _prng( seed ), _bad( 0 ) { }
+
+        void run()
+        {
+            for( unsigned i=0; i<_reads; ++i )
+            {
+                unsigned e = _prng.next( _expected.size() );
+                osgDB::ReaderWriter::ReadResult r = _rw->readImage( zipEntryName(_archive, e), 0L );
+                if ( !sameImageData(r.getImage(), _expected[e]) )
+                    ++_bad;
+            }
+        }
+
+        osgDB::ReaderWriter*            _rw;
+        std::string                     _archive;
+        const std::vector<std::string>& _expected;
+        unsigned                        _reads;
+        Random                          _prng;
+        unsigned                        _bad;
+    };
+
+    unsigned runZipReaders(
+        osgDB::ReaderWriter*            rw,
+        const std::string&              archive,
+        const std::vector<std::string>& expected,
+        unsigned                        numThreads,
+        unsigned                        reads,
+        double&                         out_ms )
+    {
+        std::vector<ZipReader*> readers;
+        for( unsigned t=0; t<numThreads; ++t )
+            readers.push_back( new ZipReader(rw, archive, expected, reads, t+1) );
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for( unsigned t=0; t<numThreads; ++t )
+            readers[t]->start();
+
+        unsigned bad = 0;
+        for( unsigned t=0; t<numThreads; ++t )
+        {
+            readers[t]->join();
+            bad += readers[t]->_bad;
+            delete readers[t];
+        }
+        out_ms = elapsed_ms( t0 );
+        return bad;
+    }
+}
+
+int
+zip( osg::ArgumentParser& args )
+{
+    std::string archive = "osgearth_benchmark.zip";
+    while( args.read("--archive", archive) );
+
+    unsigned numEntries = 256;
+    while( args.read("--entries", numEntries) );
+
+    unsigned size = 64;
+    while( args.read("--size", size) );
+
+    unsigned numThreads = 8;
+    while( args.read("--threads", numThreads) );
+
+    unsigned reads = 1000;
+    while( args.read("--reads", reads) );
+
+    if ( numEntries < 1 || size < 1 || numThreads < 1 || reads < 1 )
+        return usage( "Entries, size, threads and reads must be at least 1." );
+
+    bool write = !args.read( "--no-write" );
+
+    osgDB::ReaderWriter* rw = osgDB::Registry::instance()->getReaderWriterForExtension( "zipfs" );
+    if ( !rw )
+        return usage( "Could not load the zipfs plugin." );
+
+    // build the archive through the plugin. (libzip deflates the entries it
+    // writes; re-pack the archive with zip -0 and pass --no-write to read
+    // stored entries instead.)
+    if ( write )
+    {
+        if ( osgDB::fileExists(archive) )
+            ::remove( archive.c_str() );
+
+        Random prng( 0, Random::METHOD_FAST );
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for( unsigned i=0; i<numEntries; ++i )
+        {
+            osg::ref_ptr<osg::Image> image = new osg::Image();
+            image->allocateImage( size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+            for( unsigned b=0; b<image->getTotalSizeInBytes(); ++b )
+                image->data()[b] = (unsigned char)( (b/4 + i) % 7 == 0 ? prng.next(256) : i );
+
+            if ( !rw->writeImage(*image.get(), zipEntryName(archive, i), 0L).success() )
+                return usage( "Could not write " + zipEntryName(archive, i) );
+        }
+        std::cout << "wrote " << numEntries << " entries to " << archive << " in " << elapsed_ms(t0) << " ms" << std::endl;
+    }
+
+    // reference: each entry read once, on one thread.
+    std::vector<std::string> expected( numEntries );
+    for( unsigned i=0; i<numEntries; ++i )
+    {
+        osgDB::ReaderWriter::ReadResult r = rw->readImage( zipEntryName(archive, i), 0L );
+        if ( !r.getImage() )
+            return usage( "Could not read back " + zipEntryName(archive, i) );
+        expected[i].assign( (const char*)r.getImage()->data(), r.getImage()->getTotalSizeInBytes() );
+    }
+
+    unsigned failures = 0;
+
+    double oneTime, manyTime;
+    unsigned bad = runZipReaders( rw, archive, expected, 1, reads, oneTime );
+    bad += runZipReaders( rw, archive, expected, numThreads, reads, manyTime );
+    if ( bad > 0 )
+        ++failures;
+
+    std::cout
+        << "zip: "
+        << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " reads differ; "
+        << "1 reader " << (oneTime > 0.0 ? 1000.0*(double)reads/oneTime : 0.0) << " reads/s, "
+        << numThreads << " readers " << (manyTime > 0.0 ? 1000.0*(double)(reads*numThreads)/manyTime : 0.0) << " reads/s"
+        << std::endl;
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    // the reference pick: walk the drawable's current primitive sets.
+    bool scanFID( const osg::Geometry* geom, unsigned primIndex, FeatureID& output )
+    {
+        unsigned encountered = 0;
+        const osg::Geometry::PrimitiveSetList& psets = geom->getPrimitiveSetList();
+        for( unsigned p=0; p<psets.size(); ++p )
+        {
+            encountered += psets[p]->getNumPrimitives();
+            if ( encountered > primIndex )
+            {
+                const RefFeatureID* fid = dynamic_cast<const RefFeatureID*>( psets[p]->getUserData() );
+                if ( !fid )
+                    return false;
+                output = *fid;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    unsigned countPrimitives( const osg::Geometry* geom )
+    {
+        unsigned n = 0;
+        for( unsigned p=0; p<geom->getNumPrimitiveSets(); ++p )
+            n += geom->getPrimitiveSet(p)->getNumPrimitives();
+        return n;
+    }
+
+    unsigned checkPicks(
+        const std::string&                name,
+        FeatureSourceIndexNode*           node,
+        const std::vector<osg::Geometry*>& geoms,
+        unsigned                          numPicks,
+        Random&                           prng )
+    {
+        std::vector< std::pair<unsigned, unsigned> > picks( numPicks );
+        for( unsigned i=0; i<numPicks; ++i )
+        {
+            unsigned g = prng.next( geoms.size() );
+            unsigned n = countPrimitives( geoms[g] );
+            picks[i] = std::make_pair( g, n > 0 ? prng.next(n) : 0u );
+        }
+
+        std::vector<FeatureID> expected( numPicks ), actual( numPicks );
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for( unsigned i=0; i<numPicks; ++i )
+            if ( !scanFID(geoms[picks[i].first], picks[i].second, expected[i]) )
+                expected[i] = ~(FeatureID)0;
+        double refTime = elapsed_ms( t0 );
+
+        t0 = osg::Timer::instance()->tick();
+        for( unsigned i=0; i<numPicks; ++i )
+            if ( !node->getFID(geoms[picks[i].first], (int)picks[i].second, actual[i]) )
+                actual[i] = ~(FeatureID)0;
+        double fastTime = elapsed_ms( t0 );
+
+        unsigned bad = 0;
+        for( unsigned i=0; i<numPicks; ++i )
+            if ( expected[i] != actual[i] )
+                ++bad;
+
+        std::cout
+            << name << ": "
+            << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " of " << numPicks << " picks differ"
+            << "; scan " << refTime << " ms, index " << fastTime << " ms"
+            << std::endl;
+
+        return bad == 0 ? 0 : 1;
+    }
+}
+
+int
+featureIndex( osg::ArgumentParser& args )
+{
+    unsigned numFeatures = 100000;
+    while( args.read("--features", numFeatures) );
+
+    unsigned numDrawables = 100;
+    while( args.read("--drawables", numDrawables) );
+
+    unsigned numPicks = 100000;
+    while( args.read("--picks", numPicks) );
+
+    if ( numFeatures < 1 || numDrawables < 1 || numPicks < 1 )
+        return usage( "Features, drawables and picks must be at least 1." );
+
+    Random prng( 0, Random::METHOD_FAST );
+
+    // features merged into shared drawables the way the geometry compiler
+    // does it: each feature owns one to three primitive sets of its drawable.
+    osg::ref_ptr<FeatureSourceIndexNode> node = new FeatureSourceIndexNode( 0L );
+    std::vector<osg::Geometry*> geoms;
+    for( unsigned g=0; g<numDrawables; ++g )
+    {
+        osg::Geode* geode = new osg::Geode();
+        osg::Geometry* geom = new osg::Geometry();
+        geode->addDrawable( geom );
+        node->addChild( geode );
+        geoms.push_back( geom );
+    }
+
+    for( unsigned f=0; f<numFeatures; ++f )
+    {
+        osg::Geometry* geom = geoms[f % numDrawables];
+        osg::ref_ptr<RefFeatureID> fid = new RefFeatureID( (FeatureID)(f+1) );
+        unsigned numSets = 1 + prng.next( 3 );
+        for( unsigned p=0; p<numSets; ++p )
+        {
+            osg::DrawArrays* pset = new osg::DrawArrays( GL_TRIANGLES, 0, 3*(1 + prng.next(40)) );
+            pset->setUserData( fid.get() );
+            geom->addPrimitiveSet( pset );
+        }
+    }
+
+    osg::Timer_t t0 = osg::Timer::instance()->tick();
+    node->reindex();
+    double buildTime = elapsed_ms( t0 );
+
+    std::cout
+        << "index: " << node->getNumFeatures() << " features, "
+        << node->getIndexSizeBytes()/1024 << " KB, built in " << buildTime << " ms"
+        << std::endl;
+
+    unsigned failures = node->getNumFeatures() == numFeatures ? 0 : 1;
+
+    failures += checkPicks( "picks", node.get(), geoms, numPicks, prng );
+
+    // hiding a draw set removes its primitive sets; showing it appends them again,
+    // so the drawables no longer match the index until the next reindex.
+    std::set<FeatureID> fids;
+    for( unsigned i=0; i<numDrawables; ++i )
+        fids.insert( (FeatureID)(1 + prng.next(numFeatures)) );
+    std::vector<FeatureID> toggled( fids.begin(), fids.end() );
+
+    for( unsigned i=0; i<toggled.size(); ++i )
+        node->getDrawSet( toggled[i] ).setVisible( false );
+    failures += checkPicks( "picks, some hidden", node.get(), geoms, numPicks, prng );
+
+    for( unsigned i=0; i<toggled.size(); ++i )
+        node->getDrawSet( toggled[i] ).setVisible( true );
+    failures += checkPicks( "picks, shown again", node.get(), geoms, numPicks, prng );
+
+    t0 = osg::Timer::instance()->tick();
+    node->reindex();
+    buildTime = elapsed_ms( t0 );
+    std::cout << "reindexed in " << buildTime << " ms" << std::endl;
+    failures += checkPicks( "picks, reindexed", node.get(), geoms, numPicks, prng );
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    struct DRoamCounter
+    {
+        DRoamCounter() : _sum(0.0), _max(0.0), _n(0) { }
+
+        void add( osg::Stats* stats, unsigned frame, const std::string& name )
+        {
+            double value;
+            if ( stats->getAttribute(frame, name, value) )
+            {
+                _sum += value;
+                _max = std::max( _max, value );
+                ++_n;
+            }
+        }
+
+        double mean() const { return _n > 0 ? _sum/(double)_n : 0.0; }
+
+        double   _sum, _max;
+        unsigned _n;
+    };
+}
+
+int
+droam( osg::ArgumentParser& args )
+{
+    unsigned numFrames = 1000;
+    while( args.read("--frames", numFrames) );
+
+    double speed = 0.5;
+    while( args.read("--speed", speed) );
+
+    double altitude = 250000.0;
+    while( args.read("--altitude", altitude) );
+
+    if ( args.argc() < 2 || numFrames < 1 || altitude <= 0.0 )
+        return usage( "Please specify an earth file, at least 1 frame and a positive altitude." );
+
+    std::string earthFile = args[1];
+    osg::ref_ptr<osg::Node> node = osgDB::readNodeFile( earthFile + ".osgearth_engine_droam" );
+    if ( !node.valid() )
+        return usage( "Could not load " + earthFile + " with the DROAM engine." );
+
+    osgViewer::Viewer viewer;
+    viewer.setThreadingModel( osgViewer::Viewer::SingleThreaded );
+    viewer.setUpViewInWindow( 50, 50, 800, 600 );
+    viewer.setSceneData( node.get() );
+
+    osg::Camera* camera = viewer.getCamera();
+    if ( !camera->getStats() )
+        camera->setStats( new osg::Stats("Camera") );
+    osg::Stats* stats = camera->getStats();
+    stats->collectStats( "droam", true );
+
+    viewer.realize();
+
+    // the path: an eastbound sweep that weaves between 40N and 40S, always
+    // looking straight down, so new terrain keeps scrolling into view.
+    osg::EllipsoidModel ellipsoid;
+
+    DRoamCounter splitQueue, mergeQueue, imageQueue, dirtyQueue;
+    DRoamCounter splits, merges, refreshes, imagesInstalled, imagesCanceled, updateTime;
+    unsigned backedUpFrames = 0;
+
+    osg::Timer_t t0 = osg::Timer::instance()->tick();
+    for( unsigned i=0; i<numFrames && !viewer.done(); ++i )
+    {
+        double lon = fmod( speed * (double)i, 360.0 ) - 180.0;
+        double lat = 40.0 * sin( osg::DegreesToRadians(speed * (double)i) * 3.0 );
+
+        osg::Vec3d eye, center;
+        ellipsoid.convertLatLongHeightToXYZ(
+            osg::DegreesToRadians(lat), osg::DegreesToRadians(lon), altitude, eye.x(), eye.y(), eye.z() );
+        ellipsoid.convertLatLongHeightToXYZ(
+            osg::DegreesToRadians(lat), osg::DegreesToRadians(lon), 0.0, center.x(), center.y(), center.z() );
+        camera->setViewMatrixAsLookAt( eye, center, osg::Vec3d(0,0,1) );
+
+        viewer.frame();
+
+        unsigned frame = viewer.getFrameStamp()->getFrameNumber();
+        splitQueue.add     ( stats, frame, "DROAM split queue" );
+        mergeQueue.add     ( stats, frame, "DROAM merge queue" );
+        imageQueue.add     ( stats, frame, "DROAM image queue" );
+        dirtyQueue.add     ( stats, frame, "DROAM dirty queue" );
+        splits.add         ( stats, frame, "DROAM splits" );
+        merges.add         ( stats, frame, "DROAM merges" );
+        refreshes.add      ( stats, frame, "DROAM refreshes" );
+        imagesInstalled.add( stats, frame, "DROAM images installed" );
+        imagesCanceled.add ( stats, frame, "DROAM images canceled" );
+        updateTime.add     ( stats, frame, "DROAM update time" );
+
+        double depth;
+        if ( stats->getAttribute(frame, "DROAM split queue", depth) && depth > 0.0 )
+            ++backedUpFrames;
+    }
+    double totalTime = elapsed_ms( t0 );
+
+    if ( splitQueue._n == 0 )
+    {
+        std::cout << "droam: no stats were recorded; is the scene using the DROAM engine?" << std::endl;
+        return 1;
+    }
+
+    std::cout
+        << "droam: " << splitQueue._n << " frames in " << totalTime << " ms ("
+        << totalTime/(double)splitQueue._n << " ms/frame)" << std::endl
+        << "  split queue:  mean " << splitQueue.mean() << ", peak " << splitQueue._max
+        << "; " << backedUpFrames << " frames ended with splits pending" << std::endl
+        << "  merge queue:  mean " << mergeQueue.mean() << ", peak " << mergeQueue._max << std::endl
+        << "  image queue:  mean " << imageQueue.mean() << ", peak " << imageQueue._max << std::endl
+        << "  dirty queue:  mean " << dirtyQueue.mean() << ", peak " << dirtyQueue._max << std::endl
+        << "  jobs:         " << splits._sum << " splits, " << merges._sum << " merges, "
+        << refreshes._sum << " refreshes, " << imagesInstalled._sum << " images installed, "
+        << imagesCanceled._sum << " canceled" << std::endl
+        << "  update time:  mean " << updateTime.mean() << " ms, peak " << updateTime._max << " ms" << std::endl;
+
+    return 0;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    const std::string SEAMLESS_PATCH_EXT = "osgearth_engine_seamless_patch";
+
+    /** Collects the seamless engine's patch groups that still have a child to page in. */
+    struct PatchGroupFinder : public osg::NodeVisitor
+    {
+        PatchGroupFinder() : osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN ) { }
+
+        void apply( osg::PagedLOD& plod )
+        {
+            // don't traverse into the group; its traverse() would try to page.
+            if ( plod.getNumFileNames() > 1 && osgDB::getFileExtension(plod.getFileName(1)) == SEAMLESS_PATCH_EXT )
+                _groups.push_back( &plod );
+            else
+                traverse( plod );
+        }
+
+        std::vector< osg::ref_ptr<osg::PagedLOD> > _groups;
+    };
+
+    /** Builds child patches the way a DatabasePager thread does, through the pseudo-loader. */
+    struct PatchBuilder : public OpenThreads::Thread
+    {
+        PatchBuilder(
+            const std::vector< osg::ref_ptr<osg::PagedLOD> >& groups,
+            std::vector< osg::ref_ptr<osg::Node> >&           results,
+            unsigned                                          first,
+            unsigned                                          stride )
+            : _groups( groups ), _results( results ), _first( first ), _stride( stride ) { }
+
+        void run()
+        {
+            for( unsigned i=_first; i<_groups.size(); i += _stride )
+            {
+                const osg::PagedLOD* plod = _groups[i].get();
+                _results[i] = osgDB::readNodeFile( plod->getFileName(1), plod->getDatabaseOptions() );
+            }
+        }
+
+        const std::vector< osg::ref_ptr<osg::PagedLOD> >& _groups;
+        std::vector< osg::ref_ptr<osg::Node> >&           _results;
+        unsigned                                          _first, _stride;
+    };
+
+    /**
+     * Pages in every patch to the given depth below the roots, one level at a
+     * time, and records the bound of each built patch in build order.
+     */
+    unsigned buildPatches(
+        const std::vector< osg::ref_ptr<osg::PagedLOD> >& roots,
+        unsigned                                          depth,
+        unsigned                                          numThreads,
+        std::vector<osg::BoundingSphere>&                 out_bounds,
+        double&                                           out_ms )
+    {
+        out_bounds.clear();
+        out_ms = 0.0;
+
+        std::vector< osg::ref_ptr<osg::PagedLOD> > frontier = roots;
+        for( unsigned level=0; level<depth && !frontier.empty(); ++level )
+        {
+            std::vector< osg::ref_ptr<osg::Node> > results( frontier.size() );
+
+            std::vector<PatchBuilder*> builders;
+            for( unsigned t=0; t<numThreads; ++t )
+                builders.push_back( new PatchBuilder(frontier, results, t, numThreads) );
+
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            if ( numThreads == 1 )
+            {
+                builders[0]->run();
+            }
+            else
+            {
+                for( unsigned t=0; t<numThreads; ++t )
+                    builders[t]->start();
+                for( unsigned t=0; t<numThreads; ++t )
+                    builders[t]->join();
+            }
+            out_ms += elapsed_ms( t0 );
+
+            for( unsigned t=0; t<numThreads; ++t )
+                delete builders[t];
+
+            PatchGroupFinder finder;
+            for( unsigned i=0; i<results.size(); ++i )
+            {
+                if ( results[i].valid() )
+                {
+                    out_bounds.push_back( results[i]->getBound() );
+                    results[i]->accept( finder );
+                }
+                else
+                {
+                    out_bounds.push_back( osg::BoundingSphere() );
+                }
+            }
+            frontier.swap( finder._groups );
+        }
+
+        return out_bounds.size();
+    }
+
+    unsigned checkPatches(
+        const std::string&                      name,
+        const std::vector<osg::BoundingSphere>& expected,
+        const std::vector<osg::BoundingSphere>& actual,
+        double                                  refTime,
+        double                                  fastTime )
+    {
+        unsigned bad = expected.size() == actual.size() ? 0 : 1;
+        for( unsigned i=0; i<expected.size() && i<actual.size(); ++i )
+            if ( expected[i].center() != actual[i].center() || expected[i].radius() != actual[i].radius() )
+                ++bad;
+
+        // each pseudo-loader read builds the four child patches.
+        std::cout
+            << name << ": "
+            << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " of " << expected.size() << " patch groups differ"
+            << "; ref " << refTime << " ms (" << 4000.0*(double)expected.size()/refTime << " patches/s)"
+            << ", fast " << fastTime << " ms (" << 4000.0*(double)actual.size()/fastTime << " patches/s)"
+            << std::endl;
+
+        return bad == 0 ? 0 : 1;
+    }
+}
+
+int
+seamless( osg::ArgumentParser& args )
+{
+    unsigned depth = 3;
+    while( args.read("--depth", depth) );
+
+    unsigned numThreads = 4;
+    while( args.read("--threads", numThreads) );
+
+    if ( args.argc() < 2 || depth < 1 || numThreads < 1 )
+        return usage( "Please specify an earth file, a depth of at least 1 and at least 1 thread." );
+
+    std::string earthFile = args[1];
+    osg::ref_ptr<osg::Node> node = osgDB::readNodeFile( earthFile );
+    MapNode* mapNode = MapNode::findMapNode( node.get() );
+    if ( !mapNode )
+        return usage( "Could not load a map from " + earthFile );
+
+    // the engine builds its face roots when it is initialized.
+    mapNode->getTerrainEngine();
+
+    PatchGroupFinder finder;
+    mapNode->accept( finder );
+    if ( finder._groups.empty() )
+        return usage( earthFile + " does not use the seamless engine (driver: seamless) on a geocentric map." );
+
+    // The first pass fills the lattice cache; later passes reuse what it kept.
+    // Patch building only queues the height field and image requests, so the
+    // times are those of the pager-side work; the heights land asynchronously.
+    std::vector<osg::BoundingSphere> coldBounds, warmBounds, threadedBounds;
+    double coldTime, warmTime, threadedTime;
+
+    unsigned count = buildPatches( finder._groups, depth, 1, coldBounds, coldTime );
+    std::cout
+        << "seamless: " << finder._groups.size() << " face roots, " << 4*count
+        << " patches over " << depth << " levels" << std::endl;
+
+    buildPatches( finder._groups, depth, 1, warmBounds, warmTime );
+    unsigned failures = checkPatches( "sequential, cached lattices", coldBounds, warmBounds, coldTime, warmTime );
+
+    buildPatches( finder._groups, depth, numThreads, threadedBounds, threadedTime );
+    failures += checkPatches( "concurrent", coldBounds, threadedBounds, coldTime, threadedTime );
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    struct BenchObject : public GeoObject
+    {
+        BenchObject( const osg::Vec3d& location, float priority ) : _location( location ), _rank( priority ) { }
+
+        bool getLocation( osg::Vec3d& output ) const { output = _location; return true; }
+        float getPriority() const { return _rank; }
+        osg::Node* getNode() const { return 0L; }
+
+        osg::Vec3d _location;
+        float      _rank;
+    };
+
+    osg::Vec3d randomLocation( Random& prng )
+    {
+        return osg::Vec3d( -180.0 + 360.0*prng.next(), -90.0 + 180.0*prng.next(), 0.0 );
+    }
+
+    // two identical sets of objects, one for the reference path and one for the fast path.
+    void makeObjects( unsigned count, unsigned numPriorities, GeoObjectVector& a, GeoObjectVector& b )
+    {
+        Random prng( 0, Random::METHOD_FAST );
+        for( unsigned i=0; i<count; ++i )
+        {
+            osg::Vec3d location = randomLocation( prng );
+            float priority = (float)prng.next( numPriorities );
+            a.push_back( new BenchObject(location, priority) );
+            b.push_back( new BenchObject(location, priority) );
+        }
+    }
+
+    /** Checks that every object sits in a cell containing it, filed under its current priority. */
+    struct GeoGraphChecker : public GeoCellVisitor
+    {
+        GeoGraphChecker() : _objects( 0 ), _bad( 0 ) { }
+
+        void operator()( const GeoCell* cell, const GeoObjectCollection& objects )
+        {
+            for( GeoObjectCollection::const_iterator i = objects.begin(); i != objects.end(); ++i )
+            {
+                osg::Vec3d location;
+                i->second->getLocation( location );
+                if ( i->second->getGeoCell() != cell || i->first != i->second->getPriority() || !cell->getExtent().contains(location.x(), location.y()) )
+                    ++_bad;
+                ++_objects;
+            }
+        }
+
+        unsigned _objects, _bad;
+    };
+
+    /** Collects the objects in a region, skipping cells that don't intersect it. */
+    struct GeoGraphQuery : public GeoCellVisitor
+    {
+        GeoGraphQuery( const GeoExtent& region ) : _region( region ) { }
+
+        void apply( osg::LOD& node )
+        {
+            // the graph itself (the root) has no extent test to pass.
+            if ( dynamic_cast<GeoGraph*>(&node) || static_cast<GeoCell*>(&node)->getExtent().intersects(_region) )
+                GeoCellVisitor::apply( node );
+        }
+
+        void operator()( const GeoCell* cell, const GeoObjectCollection& objects )
+        {
+            for( GeoObjectCollection::const_iterator i = objects.begin(); i != objects.end(); ++i )
+            {
+                osg::Vec3d location;
+                i->second->getLocation( location );
+                if ( _region.contains(location.x(), location.y()) )
+                    _results.insert( i->second.get() );
+            }
+        }
+
+        GeoExtent                  _region;
+        std::set<const GeoObject*> _results;
+    };
+
+    GeoGraph* makeGraph( const SpatialReference* srs, unsigned maxObjects )
+    {
+        return new GeoGraph( GeoExtent(srs, -180.0, -90.0, 180.0, 90.0), 1e7f, maxObjects );
+    }
+
+    unsigned checkGraph( const std::string& name, GeoGraph* graph, unsigned expected )
+    {
+        GeoGraphChecker checker;
+        graph->accept( checker );
+        if ( checker._bad == 0 && checker._objects == expected )
+            return 0;
+
+        std::cout
+            << name << ": INVALID, " << checker._bad << " misfiled objects, "
+            << checker._objects << " of " << expected << " objects found" << std::endl;
+        return 1;
+    }
+}
+
+int
+geograph( osg::ArgumentParser& args )
+{
+    unsigned numObjects = 100000;
+    while( args.read("--objects", numObjects) );
+
+    unsigned maxObjects = 500;
+    while( args.read("--max-objects", maxObjects) );
+
+    unsigned numPriorities = 4;
+    while( args.read("--priorities", numPriorities) );
+
+    unsigned numMoves = 10000;
+    while( args.read("--moves", numMoves) );
+
+    unsigned numQueries = 1000;
+    while( args.read("--queries", numQueries) );
+
+    if ( numObjects < 1 || maxObjects < 1 || numPriorities < 1 )
+        return usage( "Objects, max objects and priorities must be at least 1." );
+
+    const SpatialReference* srs = SpatialReference::create( "wgs84" );
+    Random prng( 0, Random::METHOD_FAST );
+    unsigned failures = 0;
+
+    // insert: one at a time vs. in bulk. With ties, sequential insertion keeps
+    // the newest of the equal-priority objects, and the bulk load must match.
+    GeoObjectVector refObjects, fastObjects;
+    makeObjects( numObjects, numPriorities, refObjects, fastObjects );
+
+    osg::ref_ptr<GeoGraph> refGraph  = makeGraph( srs, maxObjects );
+    osg::ref_ptr<GeoGraph> fastGraph = makeGraph( srs, maxObjects );
+
+    osg::Timer_t t0 = osg::Timer::instance()->tick();
+    for( GeoObjectVector::const_iterator i = refObjects.begin(); i != refObjects.end(); ++i )
+        refGraph->insertObject( i->get() );
+    double refTime = elapsed_ms( t0 );
+
+    t0 = osg::Timer::instance()->tick();
+    fastGraph->insertObjects( fastObjects );
+    double fastTime = elapsed_ms( t0 );
+
+    unsigned bad = 0;
+    for( unsigned i=0; i<numObjects; ++i )
+    {
+        GeoCell* refCell  = refObjects[i]->getGeoCell();
+        GeoCell* fastCell = fastObjects[i]->getGeoCell();
+        if ( !refCell || !fastCell || refCell->getExtent() != fastCell->getExtent() )
+            ++bad;
+    }
+
+    std::cout
+        << "insert: " << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " of " << numObjects << " objects in different cells"
+        << "; ref " << refTime << " ms, fast " << fastTime << " ms" << std::endl;
+
+    failures += bad == 0 ? 0 : 1;
+    failures += checkGraph( "insert", fastGraph.get(), numObjects );
+
+    // move: re-insert from the root vs. reindexObject, which only re-files
+    // objects that leave their cell. Half the moves are small nudges that
+    // usually stay in the cell; half are jumps. A few objects also change
+    // priority without moving.
+    std::vector<unsigned> moved( numMoves );
+    std::vector<osg::Vec3d> targets( numMoves );
+    std::vector<float> priorities( numMoves );
+    for( unsigned m=0; m<numMoves; ++m )
+    {
+        moved[m] = prng.next( numObjects );
+        const osg::Vec3d& from = static_cast<BenchObject*>(refObjects[moved[m]].get())->_location;
+        if ( m % 2 == 0 )
+            targets[m] = osg::Vec3d(
+                osg::clampBetween(from.x() + 0.01*(prng.next()-0.5), -180.0, 180.0),
+                osg::clampBetween(from.y() + 0.01*(prng.next()-0.5), -90.0, 90.0),
+                0.0 );
+        else
+            targets[m] = randomLocation( prng );
+        priorities[m] = m % 10 == 0 ? (float)prng.next(numPriorities) : static_cast<BenchObject*>(refObjects[moved[m]].get())->_rank;
+    }
+
+    t0 = osg::Timer::instance()->tick();
+    for( unsigned m=0; m<numMoves; ++m )
+    {
+        BenchObject* object = static_cast<BenchObject*>( refObjects[moved[m]].get() );
+        object->getGeoCell()->removeObject( object );
+        object->_location = targets[m];
+        object->_rank     = priorities[m];
+        refGraph->insertObject( object );
+    }
+    refTime = elapsed_ms( t0 );
+
+    t0 = osg::Timer::instance()->tick();
+    for( unsigned m=0; m<numMoves; ++m )
+    {
+        BenchObject* object = static_cast<BenchObject*>( fastObjects[moved[m]].get() );
+        object->_location = targets[m];
+        object->_rank     = priorities[m];
+        fastGraph->reindexObject( object );
+    }
+    fastTime = elapsed_ms( t0 );
+
+    unsigned moveFailures = checkGraph( "move, re-insert", refGraph.get(), numObjects ) + checkGraph( "move, reindex", fastGraph.get(), numObjects );
+    std::cout
+        << "move: " << (moveFailures == 0 ? "OK" : "INVALID") << ", " << numMoves << " moves"
+        << "; ref " << refTime << " ms, fast " << fastTime << " ms" << std::endl;
+    failures += moveFailures;
+
+    // query: a scan of every object vs. a descent that skips cells outside the region.
+    bad = 0;
+    refTime = fastTime = 0.0;
+    for( unsigned q=0; q<numQueries; ++q )
+    {
+        double w = 1.0 + 20.0*prng.next(), h = 1.0 + 20.0*prng.next();
+        double x = -180.0 + (360.0-w)*prng.next(), y = -90.0 + (180.0-h)*prng.next();
+        GeoExtent region( srs, x, y, x+w, y+h );
+
+        t0 = osg::Timer::instance()->tick();
+        std::set<const GeoObject*> expected;
+        for( GeoObjectVector::const_iterator i = fastObjects.begin(); i != fastObjects.end(); ++i )
+        {
+            osg::Vec3d location;
+            (*i)->getLocation( location );
+            if ( region.contains(location.x(), location.y()) )
+                expected.insert( i->get() );
+        }
+        refTime += elapsed_ms( t0 );
+
+        t0 = osg::Timer::instance()->tick();
+        GeoGraphQuery query( region );
+        fastGraph->accept( query );
+        fastTime += elapsed_ms( t0 );
+
+        if ( query._results != expected )
+            ++bad;
+    }
+
+    std::cout
+        << "query: " << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " of " << numQueries << " queries differ"
+        << "; ref " << refTime << " ms, fast " << fastTime << " ms" << std::endl;
+    failures += bad == 0 ? 0 : 1;
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    // Totals the vertices and the array and primitive set bytes under a node.
+    struct GeometryCounter : public osg::NodeVisitor
+    {
+        unsigned _drawables, _verts, _bytes;
+
+        GeometryCounter() : osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN), _drawables(0), _verts(0), _bytes(0) { }
+
+        void addArray( const osg::Array* array )
+        {
+            if ( array )
+                _bytes += array->getTotalDataSize();
+        }
+
+        void apply( osg::Geode& geode )
+        {
+            for( unsigned i=0; i<geode.getNumDrawables(); ++i )
+            {
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if ( !geom )
+                    continue;
+
+                ++_drawables;
+                if ( geom->getVertexArray() )
+                    _verts += geom->getVertexArray()->getNumElements();
+
+                addArray( geom->getVertexArray() );
+                addArray( geom->getNormalArray() );
+                addArray( geom->getColorArray() );
+                for( unsigned t=0; t<geom->getNumTexCoordArrays(); ++t )
+                    addArray( geom->getTexCoordArray(t) );
+                for( unsigned p=0; p<geom->getNumPrimitiveSets(); ++p )
+                    _bytes += geom->getPrimitiveSet(p)->getTotalDataSize();
+            }
+        }
+    };
+
+    osg::Node* runExtrusion( FeatureSource* source, Session* session, const Style& style, bool shared, unsigned threads, double& out_ms )
+    {
+        // the filter modifies its input, so every run gets its own copy.
+        FeatureList features;
+        osg::ref_ptr<FeatureCursor> cursor = source->createFeatureCursor();
+        while( cursor.valid() && cursor->hasMore() )
+            features.push_back( new Feature(*cursor->nextFeature()) );
+
+        FilterContext context( session, source->getFeatureProfile() );
+
+        ExtrudeGeometryFilter filter;
+        filter.setStyle( style );
+        filter.setUseSharedBuffers( shared );
+        filter.setNumThreads( threads );
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        osg::ref_ptr<osg::Node> node = filter.push( features, context );
+        out_ms = elapsed_ms( t0 );
+        return node.release();
+    }
+
+    void report( const std::string& name, const GeometryCounter& counts, double ms )
+    {
+        std::cout
+            << name << ": " << counts._drawables << " drawables, " << counts._verts << " verts, "
+            << counts._bytes << " bytes, " << ms << " ms" << std::endl;
+    }
+}
+
+int
+extrude( osg::ArgumentParser& args )
+{
+    unsigned numFeatures = 10000, threads = 4;
+    args.read( "--features", numFeatures );
+    args.read( "--threads", threads );
+
+    Random prng( 0, Random::METHOD_FAST );
+    osg::ref_ptr<FeatureListSource> source = makeFeatures( numFeatures, prng );
+
+    Style style;
+    style.getOrCreateSymbol<ExtrusionSymbol>()->height() = 50.0f;
+    style.getOrCreateSymbol<PolygonSymbol>()->fill()->color() = Color::White;
+
+    osg::ref_ptr<Map>     map     = new Map();
+    osg::ref_ptr<Session> session = new Session( map.get(), 0L, source.get() );
+
+    // before: a geometry per feature, merged afterwards by the MeshConsolidator.
+    double refTime;
+    osg::ref_ptr<osg::Node> ref = runExtrusion( source.get(), session.get(), style, false, 1, refTime );
+    GeometryCounter refCounts;
+    ref->accept( refCounts );
+    report( "per-feature", refCounts, refTime );
+
+    // after: features written straight into shared buffers, on one and on N threads.
+    double sharedTime;
+    osg::ref_ptr<osg::Node> shared = runExtrusion( source.get(), session.get(), style, true, 1, sharedTime );
+    GeometryCounter sharedCounts;
+    shared->accept( sharedCounts );
+    report( "shared", sharedCounts, sharedTime );
+
+    double threadedTime;
+    osg::ref_ptr<osg::Node> threaded = runExtrusion( source.get(), session.get(), style, true, threads, threadedTime );
+    GeometryCounter threadedCounts;
+    threaded->accept( threadedCounts );
+    report( "shared, threaded", threadedCounts, threadedTime );
+
+    // splitting the work across threads must not change what gets built.
+    bool ok =
+        threadedCounts._verts == sharedCounts._verts &&
+        threadedCounts._bytes == sharedCounts._bytes &&
+        sharedCounts._verts > 0;
+
+    std::cout
+        << "extrude: " << (ok ? "OK" : "MISMATCH")
+        << "; verts " << refCounts._verts << " -> " << sharedCounts._verts
+        << ", bytes " << refCounts._bytes << " -> " << sharedCounts._bytes << std::endl;
+
+    return ok ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    // Random RGB or RGBA8 tiles, the same every time for a given key.
+    class NoiseTileSource : public TileSource
+    {
+    public:
+        NoiseTileSource( unsigned seed, bool alpha, int size )
+            : _seed( seed ), _alpha( alpha ), _size( size ) { }
+
+        void initialize( const osgDB::Options* dbOptions, const Profile* overrideProfile )
+        {
+            setProfile( overrideProfile ? overrideProfile : Registry::instance()->getGlobalGeodeticProfile() );
+        }
+
+        osg::Image* createImage( const TileKey& key, ProgressCallback* progress )
+        {
+            Random prng( _seed*7919u + key.getLevelOfDetail()*104729u + key.getTileX()*1009u + key.getTileY(), Random::METHOD_FAST );
+
+            osg::Image* image = new osg::Image();
+            image->allocateImage( _size, _size, 1, _alpha ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE );
+            unsigned char* p = image->data();
+            for( unsigned i=0; i<image->getTotalSizeInBytes(); ++i )
+                p[i] = (unsigned char)(256.0*prng.next());
+            return image;
+        }
+
+    private:
+        unsigned _seed;
+        bool     _alpha;
+        int      _size;
+    };
+
+    ImageLayerOptions componentLayer( float opacity )
+    {
+        ImageLayerOptions options;
+        options.opacity() = opacity;
+        return options;
+    }
+
+    osg::Image* fetch( TileSource* source, const TileKey& key )
+    {
+        return source->createImage( key );
+    }
+
+    // the old blend: each layer mixed into the result in turn with ImageUtils::mix.
+    osg::Image* mixLayers( TileSource* bottom, const std::vector< std::pair<TileSource*, float> >& layers, const TileKey& key )
+    {
+        osg::ref_ptr<osg::Image> base = fetch( bottom, key );
+        osg::Image* result = new osg::Image( *base.get() );
+        for( unsigned i=0; i<layers.size(); ++i )
+        {
+            osg::ref_ptr<osg::Image> image = fetch( layers[i].first, key );
+            ImageUtils::mix( result, image.get(), layers[i].second );
+        }
+        return result;
+    }
+
+    struct CompositeCaller : public OpenThreads::Thread
+    {
+        CompositeCaller(
+            TileSource*                              source,
+            const std::vector<TileKey>&              keys,
+            std::vector< osg::ref_ptr<osg::Image> >& results,
+            unsigned                                 first,
+            unsigned                                 stride )
+            : _source( source ), _keys( keys ), _results( results ), _first( first ), _stride( stride ) { }
+
+        void run()
+        {
+            for( unsigned i=_first; i<_keys.size(); i += _stride )
+                _results[i] = fetch( _source, _keys[i] );
+        }
+
+        TileSource*                              _source;
+        const std::vector<TileKey>&              _keys;
+        std::vector< osg::ref_ptr<osg::Image> >& _results;
+        unsigned                                 _first, _stride;
+    };
+}
+
+int
+composite( osg::ArgumentParser& args )
+{
+    unsigned numLayers = 5, level = 3, numThreads = 4;
+    int size = 256;
+    args.read( "--layers", numLayers );
+    args.read( "--size", size );
+    args.read( "--level", level );
+    args.read( "--threads", numThreads );
+
+    if ( numLayers < 3 )
+        return usage( "--layers must be at least 3" );
+
+    // alternate RGBA and RGB layers so both the alpha and the opaque blends run.
+    std::vector< osg::ref_ptr<TileSource> > noise;
+    std::vector< float > opacity;
+    for( unsigned i=0; i<numLayers; ++i )
+    {
+        noise.push_back( new NoiseTileSource(i+1, i % 2 == 0, size) );
+        noise.back()->initialize( 0L, 0L );
+        opacity.push_back( 0.3f + 0.6f*(float)i/(float)numLayers );
+    }
+
+    // layers 1 and 2 go through a nested composite, which must not deadlock
+    // waiting on the pool of the composite that is running it.
+    CompositeTileSourceOptions nestedOptions;
+    nestedOptions.add( noise[1].get(), componentLayer(1.0f) );
+    nestedOptions.add( noise[2].get(), componentLayer(opacity[2]) );
+    osg::ref_ptr<TileSource> nested = new CompositeTileSource( nestedOptions );
+
+    CompositeTileSourceOptions topOptions;
+    topOptions.add( noise[0].get(), componentLayer(1.0f) );
+    topOptions.add( nested.get(), componentLayer(opacity[1]) );
+    for( unsigned i=3; i<numLayers; ++i )
+        topOptions.add( noise[i].get(), componentLayer(opacity[i]) );
+    osg::ref_ptr<TileSource> top = new CompositeTileSource( topOptions );
+    top->initialize( 0L, 0L );
+
+    const Profile* profile = top->getProfile();
+    std::vector<TileKey> keys;
+    unsigned tilesWide, tilesHigh;
+    profile->getNumTiles( level, tilesWide, tilesHigh );
+    for( unsigned x=0; x<tilesWide; ++x )
+        for( unsigned y=0; y<tilesHigh; ++y )
+            keys.push_back( TileKey(level, x, y, profile) );
+
+    // reference: the nested pair mixed first, then the rest on top, layer by layer.
+    std::vector< osg::ref_ptr<osg::Image> > expected( keys.size() );
+    osg::Timer_t t0 = osg::Timer::instance()->tick();
+    for( unsigned k=0; k<keys.size(); ++k )
+    {
+        std::vector< std::pair<TileSource*, float> > nestedLayers;
+        nestedLayers.push_back( std::make_pair(noise[2].get(), opacity[2]) );
+        osg::ref_ptr<osg::Image> middle = mixLayers( noise[1].get(), nestedLayers, keys[k] );
+
+        osg::ref_ptr<osg::Image> result = fetch( noise[0].get(), keys[k] );
+        result = new osg::Image( *result.get() );
+        ImageUtils::mix( result.get(), middle.get(), opacity[1] );
+        for( unsigned i=3; i<numLayers; ++i )
+        {
+            osg::ref_ptr<osg::Image> image = fetch( noise[i].get(), keys[k] );
+            ImageUtils::mix( result.get(), image.get(), opacity[i] );
+        }
+        expected[k] = result.get();
+    }
+    double refTime = elapsed_ms( t0 );
+
+    std::vector< osg::ref_ptr<osg::Image> > images;
+    double fastTime;
+    renderAll( top.get(), keys, images, fastTime );
+
+    // the single-pass blend rounds once instead of once per layer, so allow a
+    // step of rounding per blended layer.
+    unsigned bad = 0, maxDiff = 0;
+    for( unsigned k=0; k<keys.size(); ++k )
+    {
+        const osg::Image* a = expected[k].get();
+        const osg::Image* b = images[k].get();
+        if ( !b || a->getTotalSizeInBytes() != b->getTotalSizeInBytes() || a->getPixelFormat() != b->getPixelFormat() )
+        {
+            ++bad;
+            continue;
+        }
+
+        unsigned tileMax = 0;
+        for( unsigned i=0; i<a->getTotalSizeInBytes(); ++i )
+            tileMax = osg::maximum( tileMax, (unsigned)std::abs( (int)a->data()[i] - (int)b->data()[i] ) );
+        if ( tileMax > numLayers )
+            ++bad;
+        maxDiff = osg::maximum( maxDiff, tileMax );
+    }
+
+    std::cout
+        << "blend: " << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " of " << keys.size() << " tiles differ"
+        << " (max channel difference " << maxDiff << ")"
+        << "; ImageUtils::mix " << refTime << " ms, composite " << fastTime << " ms" << std::endl;
+
+    // several callers at once, like pager threads, must get the same tiles.
+    std::vector< osg::ref_ptr<osg::Image> > threaded( keys.size() );
+    std::vector<CompositeCaller*> callers;
+    t0 = osg::Timer::instance()->tick();
+    for( unsigned t=0; t<numThreads; ++t )
+    {
+        callers.push_back( new CompositeCaller(top.get(), keys, threaded, t, numThreads) );
+        callers.back()->start();
+    }
+    for( unsigned t=0; t<callers.size(); ++t )
+    {
+        callers[t]->join();
+        delete callers[t];
+    }
+    double threadedTime = elapsed_ms( t0 );
+
+    unsigned threadedBad = 0;
+    for( unsigned k=0; k<keys.size(); ++k )
+    {
+        if ( !sameImage(images[k].get(), threaded[k].get()) )
+            ++threadedBad;
+    }
+
+    std::cout
+        << "concurrent: " << (threadedBad == 0 ? "OK" : "MISMATCH") << ", " << threadedBad << " of " << keys.size() << " tiles differ"
+        << "; " << numThreads << " callers " << threadedTime << " ms" << std::endl;
+
+    return bad == 0 && threadedBad == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    // A unit box with vertex arrays only, which the instancing path accepts.
+    osg::Node* makeMarkerModel()
+    {
+        osg::Vec3Array* verts = new osg::Vec3Array();
+        osg::Vec3Array* normals = new osg::Vec3Array();
+        for( unsigned i=0; i<8; ++i )
+        {
+            osg::Vec3 v( i&1 ? 1.0f : -1.0f, i&2 ? 1.0f : -1.0f, i&4 ? 2.0f : 0.0f );
+            verts->push_back( v );
+            normals->push_back( osg::Vec3(v.x(), v.y(), v.z()-1.0f) / sqrt(3.0f) );
+        }
+
+        static const GLushort faces[36] = {
+            0,2,1, 1,2,3,  4,5,6, 5,7,6,  0,1,4, 1,5,4,
+            2,6,3, 3,6,7,  0,4,2, 2,4,6,  1,3,5, 3,7,5 };
+
+        osg::Geometry* geom = new osg::Geometry();
+        geom->setVertexArray( verts );
+        geom->setNormalArray( normals );
+        geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+        geom->addPrimitiveSet( new osg::DrawElementsUShort(GL_TRIANGLES, 36, faces) );
+
+        osg::Geode* geode = new osg::Geode();
+        geode->addDrawable( geom );
+        return geode;
+    }
+
+    // Counts what the cull traversal would visit, what is stored, and what is drawn.
+    struct SubstituteCounter : public osg::NodeVisitor
+    {
+        unsigned _nodes, _drawables, _chunks, _instances;
+        unsigned _drawnVerts;
+        std::set<const osg::Array*> _arrays;
+
+        SubstituteCounter()
+            : osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN),
+              _nodes(0), _drawables(0), _chunks(0), _instances(0), _drawnVerts(0) { }
+
+        unsigned storedVerts() const
+        {
+            unsigned n = 0;
+            for( std::set<const osg::Array*>::const_iterator i = _arrays.begin(); i != _arrays.end(); ++i )
+                n += (*i)->getNumElements();
+            return n;
+        }
+
+        void apply( osg::Node& node )
+        {
+            ++_nodes;
+
+            // an instanced chunk carries the width of its instance data texture.
+            osg::StateSet* ss = node.getStateSet();
+            osg::Uniform* width = ss ? ss->getUniform( "osgearth_InstanceDataWidth" ) : 0L;
+            float w;
+            if ( width && width->get(w) )
+            {
+                ++_chunks;
+                _instances += (unsigned)(w/3.0f + 0.5f);
+            }
+            traverse( node );
+        }
+
+        void apply( osg::Geode& geode )
+        {
+            apply( static_cast<osg::Node&>(geode) );
+
+            for( unsigned i=0; i<geode.getNumDrawables(); ++i )
+            {
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if ( !geom || !geom->getVertexArray() )
+                    continue;
+
+                ++_drawables;
+                _arrays.insert( geom->getVertexArray() );
+
+                unsigned copies = 1;
+#if OSG_MIN_VERSION_REQUIRED(3,0,0)
+                if ( geom->getNumPrimitiveSets() > 0 && geom->getPrimitiveSet(0)->getNumInstances() > 0 )
+                    copies = geom->getPrimitiveSet(0)->getNumInstances();
+#endif
+                _drawnVerts += copies * geom->getVertexArray()->getNumElements();
+            }
+        }
+    };
+
+    osg::Node* substitute( const FeatureList& points, Session* session, const FeatureProfile* profile, const Style& style, int mode, double& out_ms )
+    {
+        FeatureList features;
+        for( FeatureList::const_iterator i = points.begin(); i != points.end(); ++i )
+            features.push_back( new Feature(*i->get()) );
+
+        FilterContext context( session, profile );
+
+        SubstituteModelFilter filter( style );
+        filter.setClustering( mode == 1 );
+        filter.setInstancing( mode == 2 );
+        filter.setForceInstancing( true );
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        osg::ref_ptr<osg::Node> node = filter.push( features, context );
+        out_ms = elapsed_ms( t0 );
+        return node.release();
+    }
+}
+
+int
+instancing( osg::ArgumentParser& args )
+{
+    unsigned numPoints = 20000;
+    std::string modelPath = "osgearth_benchmark_marker.osg";
+    args.read( "--points", numPoints );
+    args.read( "--model", modelPath );
+
+    osg::ref_ptr<osg::Node> model = makeMarkerModel();
+    if ( !osgDB::writeNodeFile(*model.get(), modelPath) )
+    {
+        std::cout << "instancing: FAILED, could not write " << modelPath << std::endl;
+        return 1;
+    }
+
+    const unsigned modelVerts = 8;
+
+    Random prng( 0, Random::METHOD_FAST );
+    const SpatialReference* srs = SpatialReference::create( "epsg:4326" );
+    FeatureList points;
+    for( unsigned i=0; i<numPoints; ++i )
+    {
+        PointSet* point = new PointSet();
+        point->push_back( osg::Vec3d(-5.0 + 10.0*prng.next(), -5.0 + 10.0*prng.next(), 0.0) );
+        points.push_back( new Feature(point, srs, Style(), (FeatureID)(i+1)) );
+    }
+
+    Style style;
+    style.getOrCreateSymbol<MarkerSymbol>()->url() = StringExpression( modelPath );
+
+    osg::ref_ptr<FeatureProfile> profile = new FeatureProfile( GeoExtent(srs, -180, -90, 180, 90) );
+    osg::ref_ptr<Map>            map     = new Map();
+    osg::ref_ptr<Session>        session = new Session( map.get() );
+
+    const char* names[3] = { "transforms", "clustering", "instancing" };
+    SubstituteCounter counts[3];
+    double times[3];
+    unsigned failures = 0;
+
+    for( int mode=0; mode<3; ++mode )
+    {
+        osg::ref_ptr<osg::Node> node = substitute( points, session.get(), profile.get(), style, mode, times[mode] );
+        if ( node.valid() )
+            node->accept( counts[mode] );
+
+        // every path must draw every model exactly once.
+        bool ok = counts[mode]._drawnVerts == numPoints*modelVerts;
+        if ( mode == 2 )
+            ok = ok && counts[mode]._instances == numPoints && counts[mode]._chunks > 0;
+        if ( !ok )
+            ++failures;
+
+        std::cout
+            << names[mode] << ": " << (ok ? "OK" : "MISMATCH") << ", "
+            << counts[mode]._nodes << " nodes, " << counts[mode]._drawables << " drawables, "
+            << counts[mode]._chunks << " chunks, " << counts[mode].storedVerts() << " stored verts, "
+            << counts[mode]._drawnVerts << " drawn verts (expected " << numPoints*modelVerts << "); "
+            << times[mode] << " ms" << std::endl;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+#ifndef _WIN32
+
+namespace
+{
+    // the body the stub server returns for a path: the path, padded out to size.
+    std::string makeBody( const std::string& path, unsigned size )
+    {
+        std::string body = path;
+        body.reserve( size );
+        for( unsigned i=0; body.size() < size; ++i )
+            body.push_back( (char)('a' + (i + path.size()) % 26) );
+        return body;
+    }
+
+    /**
+     * A minimal HTTP/1.1 server on the loopback interface: keep-alive, GET only,
+     * one thread per connection. Paths under /slow/ take a second longer. Counts
+     * connections and requests in flight, so the client's limits can be checked.
+     */
+    struct StubServer : public OpenThreads::Thread
+    {
+        struct Connection : public OpenThreads::Thread
+        {
+            Connection( StubServer* server, int fd ) : _server(server), _fd(fd) { }
+
+            void run()
+            {
+                std::string buf;
+                char chunk[4096];
+                for( ;; )
+                {
+                    std::string::size_type end;
+                    while( (end = buf.find("\r\n\r\n")) == std::string::npos )
+                    {
+                        ssize_t n = ::recv( _fd, chunk, sizeof(chunk), 0 );
+                        if ( n <= 0 )
+                            return;
+                        buf.append( chunk, n );
+                    }
+
+                    std::string request = buf.substr( 0, end );
+                    buf.erase( 0, end + 4 );
+
+                    std::string::size_type p0 = request.find( ' ' );
+                    std::string::size_type p1 = request.find( ' ', p0+1 );
+                    std::string path = p0 != std::string::npos && p1 != std::string::npos ? request.substr( p0+1, p1-p0-1 ) : "/";
+
+                    _server->beginRequest();
+                    unsigned delay = _server->_delay_ms + (path.find("/slow/") == 0 ? 1000u : 0u);
+                    if ( delay > 0 )
+                        OpenThreads::Thread::microSleep( delay*1000 );
+                    std::string body, type;
+                    unsigned status = _server->respond( path, body, type );
+                    _server->endRequest();
+
+                    std::ostringstream out;
+                    out << "HTTP/1.1 " << status << (status == 200 ? " OK" : " Not Found") << "\r\n"
+                        << "Content-Type: " << type << "\r\n"
+                        << "Content-Length: " << body.size() << "\r\n"
+                        << "Connection: keep-alive\r\n\r\n"
+                        << body;
+                    std::string response = out.str();
+                    if ( ::send( _fd, response.data(), response.size(), 0 ) != (ssize_t)response.size() )
+                        return;
+                }
+            }
+
+            StubServer* _server;
+            int         _fd;
+        };
+
+        StubServer( unsigned delay_ms, unsigned size ) :
+            _delay_ms( delay_ms ), _size( size ), _listen( -1 ), _port( 0 ),
+            _connections( 0 ), _inFlight( 0 ), _maxInFlight( 0 ) { }
+
+        virtual ~StubServer() { }
+
+        // fills in the response to a path and returns its HTTP status.
+        virtual unsigned respond( const std::string& path, std::string& out_body, std::string& out_type )
+        {
+            out_body = makeBody( path, _size );
+            out_type = "text/plain";
+            return 200;
+        }
+
+        bool listen()
+        {
+            _listen = ::socket( AF_INET, SOCK_STREAM, 0 );
+            if ( _listen < 0 )
+                return false;
+
+            sockaddr_in addr;
+            ::memset( &addr, 0, sizeof(addr) );
+            addr.sin_family      = AF_INET;
+            addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+            addr.sin_port        = 0;
+
+            socklen_t len = sizeof(addr);
+            if (::bind( _listen, (sockaddr*)&addr, sizeof(addr) ) != 0 ||
+                ::listen( _listen, 64 ) != 0 ||
+                ::getsockname( _listen, (sockaddr*)&addr, &len ) != 0 )
+            {
+                return false;
+            }
+
+            _port = ntohs( addr.sin_port );
+            start();
+            return true;
+        }
+
+        void run()
+        {
+            for( ;; )
+            {
+                int fd = ::accept( _listen, 0L, 0L );
+                if ( fd < 0 )
+                    return;
+
+                Threading::ScopedMutexLock lock( _mutex );
+                ++_connections;
+                Connection* c = new Connection( this, fd );
+                _open.push_back( c );
+                c->start();
+            }
+        }
+
+        void stop()
+        {
+            ::shutdown( _listen, SHUT_RDWR );
+            ::close( _listen );
+            join();
+
+            Threading::ScopedMutexLock lock( _mutex );
+            for( std::vector<Connection*>::iterator i = _open.begin(); i != _open.end(); ++i )
+            {
+                ::shutdown( (*i)->_fd, SHUT_RDWR );
+                (*i)->join();
+                ::close( (*i)->_fd );
+                delete *i;
+            }
+            _open.clear();
+        }
+
+        void beginRequest()
+        {
+            Threading::ScopedMutexLock lock( _mutex );
+            _maxInFlight = osg::maximum( _maxInFlight, ++_inFlight );
+        }
+
+        void endRequest()
+        {
+            Threading::ScopedMutexLock lock( _mutex );
+            --_inFlight;
+        }
+
+        // connections opened and peak requests in flight since the last call.
+        void takeCounts( unsigned& out_connections, unsigned& out_maxInFlight )
+        {
+            Threading::ScopedMutexLock lock( _mutex );
+            out_connections = _connections;
+            out_maxInFlight = _maxInFlight;
+            _connections = 0;
+            _maxInFlight = _inFlight;
+        }
+
+        unsigned                 _delay_ms, _size;
+        int                      _listen;
+        unsigned short           _port;
+        Threading::Mutex         _mutex;
+        std::vector<Connection*> _open;
+        unsigned                 _connections, _inFlight, _maxInFlight;
+    };
+
+    std::string stubURL( const StubServer& server, const std::string& path )
+    {
+        std::ostringstream buf;
+        buf << "http://127.0.0.1:" << server._port << path;
+        return buf.str();
+    }
+
+    std::string tilePath( unsigned i )
+    {
+        std::ostringstream buf;
+        buf << "/tile/" << i;
+        return buf.str();
+    }
+
+    bool checkResponse( const HTTPResponse& response, const std::string& path, unsigned size )
+    {
+        return response.isOK() && response.getNumParts() > 0 && response.getPartAsString(0) == makeBody(path, size);
+    }
+
+    // blocking HTTPClient::get calls from several threads, like tile loaders.
+    struct BlockingCaller : public OpenThreads::Thread
+    {
+        BlockingCaller( const StubServer& server, unsigned numRequests, unsigned first, unsigned stride ) :
+            _server( server ), _numRequests( numRequests ), _first( first ), _stride( stride ), _bad( 0 ) { }
+
+        void run()
+        {
+            for( unsigned i=_first; i<_numRequests; i += _stride )
+            {
+                HTTPResponse response = HTTPClient::get( stubURL(_server, tilePath(i)) );
+                if ( !checkResponse(response, tilePath(i), _server._size) )
+                    ++_bad;
+            }
+        }
+
+        const StubServer& _server;
+        unsigned          _numRequests, _first, _stride, _bad;
+    };
+
+    unsigned runBlocking( const StubServer& server, unsigned numRequests, unsigned numThreads, double& out_ms )
+    {
+        std::vector<BlockingCaller*> callers;
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for( unsigned t=0; t<numThreads; ++t )
+        {
+            callers.push_back( new BlockingCaller(server, numRequests, t, numThreads) );
+            callers.back()->start();
+        }
+
+        unsigned bad = 0;
+        for( unsigned t=0; t<callers.size(); ++t )
+        {
+            callers[t]->join();
+            bad += callers[t]->_bad;
+            delete callers[t];
+        }
+        out_ms = elapsed_ms( t0 );
+        return bad;
+    }
+
+    unsigned runAsync( const StubServer& server, unsigned numRequests, double& out_ms )
+    {
+        std::vector< osg::ref_ptr<HTTPFuture> > futures( numRequests );
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for( unsigned i=0; i<numRequests; ++i )
+            futures[i] = HTTPClient::getAsync( HTTPRequest(stubURL(server, tilePath(i))) );
+
+        unsigned bad = 0;
+        for( unsigned i=0; i<numRequests; ++i )
+        {
+            if ( !checkResponse(futures[i]->getResponse(), tilePath(i), server._size) )
+                ++bad;
+        }
+        out_ms = elapsed_ms( t0 );
+        return bad;
+    }
+
+    struct DelayedCancel : public OpenThreads::Thread
+    {
+        DelayedCancel( ProgressCallback* progress, unsigned delay_ms ) : _progress( progress ), _delay_ms( delay_ms ) { }
+
+        void run()
+        {
+            OpenThreads::Thread::microSleep( _delay_ms*1000 );
+            _progress->cancel();
+        }
+
+        osg::ref_ptr<ProgressCallback> _progress;
+        unsigned                       _delay_ms;
+    };
+}
+
+int
+http( osg::ArgumentParser& args )
+{
+    unsigned numRequests = 500, numThreads = 8, delay = 5, size = 4096, perHost = 6;
+    args.read( "--requests", numRequests );
+    args.read( "--threads", numThreads );
+    args.read( "--delay", delay );
+    args.read( "--size", size );
+    args.read( "--per-host", perHost );
+
+    StubServer server( delay, size );
+    if ( !server.listen() )
+    {
+        std::cout << "http: FAILED, could not start the stub server" << std::endl;
+        return 1;
+    }
+
+    unsigned failures = 0, bad, connections, maxInFlight;
+    double ms;
+
+    // before: one blocking connection per calling thread.
+    HTTPClient::setAsyncEnabled( false );
+    bad = runBlocking( server, numRequests, numThreads, ms );
+    server.takeCounts( connections, maxInFlight );
+    std::cout
+        << "blocking, per-thread handles: " << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " of " << numRequests << " responses differ"
+        << "; " << connections << " connections, " << maxInFlight << " in flight; " << ms << " ms" << std::endl;
+    failures += bad > 0 ? 1 : 0;
+
+    // after: the same callers through the shared engine, within its limits.
+    HTTPClient::setAsyncEnabled( true );
+    HTTPClient::setMaxConnectionsPerHost( perHost );
+    bad = runBlocking( server, numRequests, numThreads, ms );
+    server.takeCounts( connections, maxInFlight );
+    bool ok = bad == 0 && maxInFlight <= perHost;
+    std::cout
+        << "blocking, engine: " << (ok ? "OK" : "MISMATCH") << ", " << bad << " of " << numRequests << " responses differ"
+        << "; " << connections << " connections, " << maxInFlight << " in flight (limit " << perHost << "); " << ms << " ms" << std::endl;
+    failures += ok ? 0 : 1;
+
+    bad = runAsync( server, numRequests, ms );
+    server.takeCounts( connections, maxInFlight );
+    ok = bad == 0 && maxInFlight <= perHost;
+    std::cout
+        << "getAsync: " << (ok ? "OK" : "MISMATCH") << ", " << bad << " of " << numRequests << " responses differ"
+        << "; " << connections << " connections, " << maxInFlight << " in flight (limit " << perHost << "); " << ms << " ms" << std::endl;
+    failures += ok ? 0 : 1;
+
+    // a lower limit must take effect on the running engine.
+    unsigned lowLimit = osg::maximum( 1u, perHost/2 );
+    HTTPClient::setMaxConnectionsPerHost( lowLimit );
+    bad = runAsync( server, numRequests, ms );
+    server.takeCounts( connections, maxInFlight );
+    ok = bad == 0 && maxInFlight <= lowLimit;
+    std::cout
+        << "getAsync, lowered limit: " << (ok ? "OK" : "MISMATCH") << ", " << bad << " of " << numRequests << " responses differ"
+        << "; " << maxInFlight << " in flight (limit " << lowLimit << "); " << ms << " ms" << std::endl;
+    failures += ok ? 0 : 1;
+
+    // a blocked caller must return once cancelled, even while its request is
+    // still queued behind a slow one on a saturated host.
+    HTTPClient::setMaxConnectionsPerHost( 1 );
+    osg::ref_ptr<HTTPFuture> slow = HTTPClient::getAsync( HTTPRequest(stubURL(server, "/slow/0")) );
+    OpenThreads::Thread::microSleep( 50000 );
+
+    osg::ref_ptr<ProgressCallback> progress = new ProgressCallback();
+    DelayedCancel canceller( progress.get(), 100 );
+    canceller.start();
+    osg::Timer_t t0 = osg::Timer::instance()->tick();
+    HTTPResponse response = HTTPClient::get( stubURL(server, tilePath(0)), 0L, progress.get() );
+    ms = elapsed_ms( t0 );
+    canceller.join();
+    ok = response.isCancelled() && ms < 900.0;
+    std::cout
+        << "cancel while queued: " << (ok ? "OK" : "FAILED") << ", returned " << (response.isCancelled() ? "cancelled" : "a response")
+        << " after " << ms << " ms (slow request takes 1000+ ms)" << std::endl;
+    failures += ok ? 0 : 1;
+
+    slow->getResponse();
+    HTTPClient::setMaxConnectionsPerHost( perHost );
+    server.stop();
+
+    return failures == 0 ? 0 : 1;
+}
+
+#else
+
+int
+http( osg::ArgumentParser& args )
+{
+    std::cout << "http: the stub server is not available on this platform" << std::endl;
+    return 1;
+}
+
+#endif
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    /** Reads random tiles and checks each one against the image that was stored. */
+    struct TileReader : public OpenThreads::Thread
+    {
+        TileReader(
+            TileSource*                     source,
+            const std::vector<TileKey>&     keys,
+            const std::vector<std::string>& expected,
+            unsigned                        reads,
+            unsigned                        seed )
+            : _source( source ), _keys( keys ), _expected( expected ), _reads( reads ), _prng( seed ), _bad( 0 ) { }
+
+        void run()
+        {
+            for( unsigned i=0; i<_reads; ++i )
+            {
+                unsigned k = _prng.next( _keys.size() );
+                osg::ref_ptr<osg::Image> image = _source->createImage( _keys[k] );
+                if ( !sameImageData(image.get(), _expected[k]) )
+                    ++_bad;
+            }
+        }
+
+        TileSource*                     _source;
+        const std::vector<TileKey>&     _keys;
+        const std::vector<std::string>& _expected;
+        unsigned                        _reads;
+        Random                          _prng;
+        unsigned                        _bad;
+    };
+
+    unsigned runTileReaders(
+        TileSource*                     source,
+        const std::vector<TileKey>&     keys,
+        const std::vector<std::string>& expected,
+        unsigned                        numThreads,
+        unsigned                        reads,
+        double&                         out_ms )
+    {
+        std::vector<TileReader*> readers;
+        for( unsigned t=0; t<numThreads; ++t )
+            readers.push_back( new TileReader(source, keys, expected, reads, t+1) );
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for( unsigned t=0; t<numThreads; ++t )
+            readers[t]->start();
+
+        unsigned bad = 0;
+        for( unsigned t=0; t<numThreads; ++t )
+        {
+            readers[t]->join();
+            bad += readers[t]->_bad;
+            delete readers[t];
+        }
+        out_ms = elapsed_ms( t0 );
+        return bad;
+    }
+
+    TileSource* openMBTiles( const std::string& file, bool writable )
+    {
+        MBTilesOptions options;
+        options.filename() = file;
+        options.format()   = "png";
+        options.writable() = writable;
+
+        osg::ref_ptr<TileSource> source = TileSourceFactory::create( options );
+        if ( !source.valid() )
+            return 0L;
+
+        source->initialize( 0L, 0L );
+        return source->getProfile() ? source.release() : 0L;
+    }
+}
+
+int
+mbtiles( osg::ArgumentParser& args )
+{
+    std::string file = "osgearth_benchmark.mbtiles";
+    while( args.read("--file", file) );
+
+    unsigned level = 4;
+    while( args.read("--level", level) );
+
+    unsigned size = 256;
+    while( args.read("--size", size) );
+
+    unsigned numThreads = 8;
+    while( args.read("--threads", numThreads) );
+
+    unsigned reads = 1000;
+    while( args.read("--reads", reads) );
+
+    if ( level > 10 || size < 1 || numThreads < 1 || reads < 1 )
+        return usage( "Level must be at most 10; size, threads and reads at least 1." );
+
+    const char* suffixes[] = { "", "-wal", "-shm" };
+    for( unsigned i=0; i<3; ++i )
+    {
+        std::string name = file + suffixes[i];
+        if ( osgDB::fileExists(name) )
+            ::remove( name.c_str() );
+    }
+
+    unsigned failures = 0;
+
+    // fill every tile of the level through a writable source; the stores are
+    // batched into transactions, the first read commits the open batch.
+    std::vector<TileKey>     keys;
+    std::vector<std::string> expected;
+    {
+        osg::ref_ptr<TileSource> writer = openMBTiles( file, true );
+        if ( !writer.valid() || !writer->isWritable() )
+            return usage( "Could not create " + file + " with the mbtiles driver." );
+
+        const Profile* profile = writer->getProfile();
+        unsigned cols, rows;
+        profile->getNumTiles( level, cols, rows );
+
+        Random prng( 0, Random::METHOD_FAST );
+        std::vector< osg::ref_ptr<osg::Image> > images;
+        for( unsigned y=0; y<rows; ++y )
+        {
+            for( unsigned x=0; x<cols; ++x )
+            {
+                unsigned i = keys.size();
+                osg::Image* image = new osg::Image();
+                image->allocateImage( size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+                for( unsigned b=0; b<image->getTotalSizeInBytes(); ++b )
+                    image->data()[b] = (unsigned char)( (b/4 + i) % 7 == 0 ? prng.next(256) : i );
+
+                keys.push_back( TileKey(level, x, y, profile) );
+                images.push_back( image );
+                expected.push_back( std::string((const char*)image->data(), image->getTotalSizeInBytes()) );
+            }
+        }
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        unsigned stored = 0;
+        for( unsigned i=0; i<keys.size(); ++i )
+        {
+            if ( writer->storeImage(keys[i], images[i].get(), 0L) )
+                ++stored;
+        }
+        double storeTime = elapsed_ms( t0 );
+
+        osg::ref_ptr<osg::Image> back = writer->createImage( keys.back() );
+        bool ok = stored == keys.size() && sameImageData( back.get(), expected.back() );
+        std::cout
+            << "store: " << (ok ? "OK" : "FAILED") << ", " << stored << " of " << keys.size() << " tiles stored, last one "
+            << (back.valid() ? "read back" : "missing") << "; "
+            << (storeTime > 0.0 ? 1000.0*(double)stored/storeTime : 0.0) << " stores/s"
+            << std::endl;
+        failures += ok ? 0 : 1;
+    }
+
+    // read back through a fresh read-only source, once on one thread for the
+    // check and then from the concurrent readers.
+    osg::ref_ptr<TileSource> reader = openMBTiles( file, false );
+    if ( !reader.valid() )
+        return usage( "Could not reopen " + file + " with the mbtiles driver." );
+
+    unsigned missing = 0;
+    for( unsigned i=0; i<keys.size(); ++i )
+    {
+        osg::ref_ptr<osg::Image> image = reader->createImage( keys[i] );
+        if ( !sameImageData(image.get(), expected[i]) )
+            ++missing;
+    }
+
+    double oneTime, manyTime;
+    unsigned bad = missing;
+    bad += runTileReaders( reader.get(), keys, expected, 1, reads, oneTime );
+    bad += runTileReaders( reader.get(), keys, expected, numThreads, reads, manyTime );
+    if ( bad > 0 )
+        ++failures;
+
+    std::cout
+        << "mbtiles: "
+        << (bad == 0 ? "OK" : "MISMATCH") << ", " << bad << " reads differ; "
+        << "1 reader " << (oneTime > 0.0 ? 1000.0*(double)reads/oneTime : 0.0) << " reads/s, "
+        << numThreads << " readers " << (manyTime > 0.0 ? 1000.0*(double)(reads*numThreads)/manyTime : 0.0) << " reads/s"
+        << std::endl;
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    /** Peak resident set size of the process so far, in KB; 0 where unknown. */
+    unsigned long peakRSSKB()
+    {
+#ifndef _WIN32
+        struct rusage usage;
+        if ( ::getrusage(RUSAGE_SELF, &usage) != 0 )
+            return 0;
+#  ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#  else
+        return usage.ru_maxrss;
+#  endif
+#else
+        return 0;
+#endif
+    }
+
+    struct NodeCounter : public osg::NodeVisitor
+    {
+        unsigned _nodes, _drawables;
+
+        NodeCounter() : osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN), _nodes(0), _drawables(0) { }
+
+        void apply( osg::Node& node )
+        {
+            ++_nodes;
+            traverse( node );
+        }
+
+        void apply( osg::Geode& geode )
+        {
+            ++_nodes;
+            _drawables += geode.getNumDrawables();
+        }
+    };
+
+    /** Writes a document of points and lines sharing a few styles; text runs carry extra whitespace. */
+    bool writeKML( const std::string& file, unsigned numPlacemarks )
+    {
+        std::ofstream out( file.c_str() );
+        if ( !out.is_open() )
+            return false;
+
+        Random prng( 0, Random::METHOD_FAST );
+
+        out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            << "<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n"
+            << "<Document>\n"
+            << "  <name>osgearth_benchmark</name>\n";
+
+        const char* colors[] = { "ff0000ff", "ff00ff00", "ffff0000", "ff00ffff" };
+        for( unsigned i=0; i<4; ++i )
+        {
+            out << "  <Style id=\"s" << i << "\">\n"
+                << "    <LineStyle><color>" << colors[i] << "</color><width>2</width></LineStyle>\n"
+                << "    <LabelStyle><color>" << colors[i] << "</color></LabelStyle>\n"
+                << "  </Style>\n";
+        }
+
+        out << "  <Folder>\n    <name>placemarks</name>\n";
+        for( unsigned i=0; i<numPlacemarks; ++i )
+        {
+            double lon = -180.0 + 360.0*prng.next();
+            double lat =  -80.0 + 160.0*prng.next();
+
+            out << "    <Placemark>\n"
+                << "      <name>  Placemark\n        " << i << "  </name>\n"
+                << "      <description><![CDATA[<b>feature</b> " << i << "]]></description>\n"
+                << "      <styleUrl>#s" << (i%4) << "</styleUrl>\n";
+
+            if ( i % 4 == 3 )
+            {
+                out << "      <LineString><tessellate>1</tessellate><coordinates>\n";
+                for( unsigned v=0; v<8; ++v )
+                    out << "        " << lon + 0.01*v << "," << lat + 0.01*(v%2) << ",0\n";
+                out << "      </coordinates></LineString>\n";
+            }
+            else
+            {
+                out << "      <Point><coordinates>" << lon << "," << lat << ",0</coordinates></Point>\n";
+            }
+
+            out << "    </Placemark>\n";
+        }
+        out << "  </Folder>\n</Document>\n</kml>\n";
+
+        return out.good();
+    }
+
+    osg::Node* loadKML( const std::string& file, MapNode* mapNode, unsigned numThreads, double& out_ms, unsigned long& out_peakKB )
+    {
+        KMLOptions options;
+        options.numThreads() = numThreads;
+
+        unsigned long before = peakRSSKB();
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        osg::Node* node = KML::load( URI(file), mapNode, options );
+        out_ms = elapsed_ms( t0 );
+        out_peakKB = peakRSSKB() - before;
+        return node;
+    }
+}
+
+int
+kml( osg::ArgumentParser& args )
+{
+    std::string file = "osgearth_benchmark.kml";
+    while( args.read("--file", file) );
+
+    unsigned numPlacemarks = 20000;
+    while( args.read("--placemarks", numPlacemarks) );
+
+    unsigned numThreads = 4;
+    while( args.read("--threads", numThreads) );
+
+    if ( numPlacemarks < 1 || numThreads < 1 )
+        return usage( "Placemarks and threads must be at least 1." );
+
+    if ( !writeKML(file, numPlacemarks) )
+        return usage( "Could not write " + file );
+
+    std::cout << "wrote " << numPlacemarks << " placemarks to " << file << std::endl;
+
+    osg::ref_ptr<MapNode> mapNode = new MapNode( new Map() );
+
+    // peak RSS only ever grows, so the passes run from the least to the most
+    // memory they are expected to need; each reports how far it raised the peak.
+    unsigned long baseKB = peakRSSKB();
+    unsigned failures = 0;
+
+    double oneTime, manyTime;
+    unsigned long onePeak, manyPeak;
+    NodeCounter one, many;
+    {
+        osg::ref_ptr<osg::Node> node = loadKML( file, mapNode.get(), 1, oneTime, onePeak );
+        if ( !node.valid() )
+            return usage( "Could not load " + file + " with the kml plugin." );
+        node->accept( one );
+    }
+    {
+        osg::ref_ptr<osg::Node> node = loadKML( file, mapNode.get(), numThreads, manyTime, manyPeak );
+        if ( node.valid() )
+            node->accept( many );
+    }
+
+    bool ok = one._nodes == many._nodes && one._drawables == many._drawables && one._nodes > numPlacemarks;
+    failures += ok ? 0 : 1;
+
+    std::cout
+        << "kml: " << (ok ? "OK" : "MISMATCH") << ", "
+        << one._nodes << "/" << many._nodes << " nodes, "
+        << one._drawables << "/" << many._drawables << " drawables; "
+        << "1 thread " << oneTime << " ms, +" << onePeak << " KB peak; "
+        << numThreads << " threads " << manyTime << " ms, +" << manyPeak << " KB peak"
+        << std::endl;
+
+    // for scale: the DOM the reader used to build before any placemark.
+    {
+        unsigned long before = peakRSSKB();
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        std::ifstream in( file.c_str() );
+        osg::ref_ptr<XmlDocument> doc = XmlDocument::load( in );
+        double domTime = elapsed_ms( t0 );
+        std::cout
+            << "xml dom: " << (doc.valid() ? "loaded" : "FAILED") << " in " << domTime << " ms, +"
+            << peakRSSKB() - before << " KB peak (process peak " << baseKB << " KB before the loads)"
+            << std::endl;
+        failures += doc.valid() ? 0 : 1;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    /** A stream buffer that cannot seek, like a socket or a pipe. */
+    struct ForwardOnlyBuf : public std::streambuf
+    {
+        ForwardOnlyBuf( const std::string& data )
+        {
+            char* p = const_cast<char*>( data.data() );
+            setg( p, p, p + data.size() );
+        }
+    };
+
+    /** A map document with the constructs an earth file uses: attributes, entities, comments, CDATA, ragged whitespace. */
+    std::string makeMapXML( unsigned numLayers )
+    {
+        std::stringstream buf;
+        buf << "<?xml version=\"1.0\"?>\n"
+            << "<!-- generated by osgearth_benchmark -->\n"
+            << "<map name=\"benchmark\" type=\"geocentric\" version=\"2\">\n"
+            << "  <options>\n"
+            << "    <cache type=\"filesystem\">\n      <path>  cache/\n        tiles  </path>\n    </cache>\n"
+            << "  </options>\n";
+
+        for( unsigned i=0; i<numLayers; ++i )
+        {
+            buf << "  <image name=\"layer " << i << "\" driver=\"tms\">\n"
+                << "    <url>http://server/tiles.php?layer=" << i << "&amp;format=png</url>\n"
+                << "    <!-- layer " << i << " -->\n"
+                << "    <profile>global-geodetic</profile>\n"
+                << "    <cache_policy usage=\"read_write\" max_age=\"" << 3600*i << "\"/>\n"
+                << "    <description><![CDATA[  <b>layer</b> " << i << "  ]]></description>\n"
+                << "    <opacity>   0." << (i%10) << "   </opacity>\n"
+                << "  </image>\n";
+        }
+
+        buf << "</map>\n";
+        return buf.str();
+    }
+
+    /** Parses a document through the DOM, the buffered fast path and the unbuffered fast path; false if they differ. */
+    bool checkConfig( const std::string& name, const std::string& xml, unsigned iterations )
+    {
+        std::string ref, fast, forward;
+        double refTime = 0.0, fastTime = 0.0, forwardTime = 0.0;
+
+        for( unsigned i=0; i<iterations; ++i )
+        {
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            std::istringstream in( xml );
+            osg::ref_ptr<XmlDocument> doc = XmlDocument::load( in );
+            Config conf = doc.valid() ? doc->getConfig() : Config();
+            refTime += elapsed_ms( t0 );
+            if ( i == 0 ) ref = conf.toJSON();
+        }
+
+        for( unsigned i=0; i<iterations; ++i )
+        {
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            std::istringstream in( xml );
+            Config conf;
+            XmlDocument::loadConfig( in, conf );
+            fastTime += elapsed_ms( t0 );
+            if ( i == 0 ) fast = conf.toJSON();
+        }
+
+        for( unsigned i=0; i<iterations; ++i )
+        {
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            ForwardOnlyBuf sb( xml );
+            std::istream in( &sb );
+            Config conf;
+            XmlDocument::loadConfig( in, conf );
+            forwardTime += elapsed_ms( t0 );
+            if ( i == 0 ) forward = conf.toJSON();
+        }
+
+        bool ok = !ref.empty() && ref == fast && ref == forward;
+        std::cout
+            << name << ": " << (ok ? "OK" : "MISMATCH") << ", " << xml.size()/1024 << " KB; "
+            << "ref " << refTime/(double)iterations << " ms, "
+            << "fast " << fastTime/(double)iterations << " ms, "
+            << "unseekable " << forwardTime/(double)iterations << " ms"
+            << std::endl;
+        return ok;
+    }
+}
+
+int
+config( osg::ArgumentParser& args )
+{
+    unsigned numLayers = 2000;
+    while( args.read("--layers", numLayers) );
+
+    unsigned iterations = 5;
+    while( args.read("--iterations", iterations) );
+
+    std::string earthFile;
+    while( args.read("--earth", earthFile) );
+
+    if ( numLayers < 1 || iterations < 1 )
+        return usage( "Layers and iterations must be at least 1." );
+
+    unsigned failures = 0;
+
+    if ( !checkConfig("config", makeMapXML(numLayers), iterations) )
+        ++failures;
+
+    if ( !earthFile.empty() )
+    {
+        std::ifstream in( earthFile.c_str() );
+        if ( !in.is_open() )
+            return usage( "Could not open " + earthFile );
+
+        std::stringstream buf;
+        buf << in.rdbuf();
+        if ( !checkConfig("earth", buf.str(), iterations) )
+            ++failures;
+
+        // the whole load, of which the parse is the first step.
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        osg::ref_ptr<osg::Node> node = osgDB::readNodeFile( earthFile );
+        double loadTime = elapsed_ms( t0 );
+        std::cout
+            << "earth load: " << (node.valid() ? "OK" : "FAILED") << ", " << loadTime << " ms"
+            << std::endl;
+        failures += node.valid() ? 0 : 1;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    /** Engine whose "code" is an attribute name; a run returns twice that attribute. */
+    class AttributeScriptEngine : public ScriptEngine
+    {
+    public:
+        bool supported( std::string lang ) { return lang == "attribute"; }
+        bool supported( Script* script ) { return script && supported(script->getLanguage()); }
+
+        ScriptResult run( Script* script, Feature const* feature, FilterContext const* context )
+        {
+            return script ? run(script->getCode(), feature, context) : ScriptResult("", false, "No script");
+        }
+
+        ScriptResult run( const std::string& code, Feature const* feature, FilterContext const* context )
+        {
+            if ( !feature )
+                return ScriptResult( "", false, "No feature" );
+
+            std::stringstream buf;
+            buf << 2.0 * feature->getDouble( code );
+            return ScriptResult( buf.str() );
+        }
+
+        ScriptResult call( const std::string& function, Feature const* feature, FilterContext const* context )
+        {
+            return run( function, feature, context );
+        }
+    };
+
+    /** Times a per-feature run() loop against runBatch(); false if their results differ. */
+    bool checkRunBatch( const std::string& name, ScriptEngine* engine, const std::string& code, const FeatureList& features, unsigned iterations )
+    {
+        std::vector<std::string> ref, batch;
+        double refTime = 0.0, batchTime = 0.0;
+        bool refOK = true, batchOK = true;
+
+        for( unsigned i=0; i<iterations; ++i )
+        {
+            std::vector<ScriptResult> results;
+            results.reserve( features.size() );
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            for( FeatureList::const_iterator f = features.begin(); f != features.end(); ++f )
+                results.push_back( engine->run(code, f->get()) );
+            refTime += elapsed_ms( t0 );
+
+            if ( i == 0 )
+            {
+                for( unsigned r=0; r<results.size(); ++r )
+                {
+                    refOK = refOK && results[r].success();
+                    ref.push_back( results[r].asString() );
+                }
+            }
+        }
+
+        for( unsigned i=0; i<iterations; ++i )
+        {
+            std::vector<ScriptResult> results;
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            batchOK = engine->runBatch( code, features, results ) && batchOK;
+            batchTime += elapsed_ms( t0 );
+
+            if ( i == 0 )
+            {
+                for( unsigned r=0; r<results.size(); ++r )
+                    batch.push_back( results[r].asString() );
+            }
+        }
+
+        bool ok = refOK && batchOK && ref == batch;
+        double n = (double)features.size() * (double)iterations;
+        std::cout
+            << name << ": " << (ok ? "OK" : "MISMATCH") << ", " << batch.size() << " results; "
+            << "ref " << (refTime > 0.0 ? 1000.0*n/refTime : 0.0) << " runs/s, "
+            << "batch " << (batchTime > 0.0 ? 1000.0*n/batchTime : 0.0) << " runs/s"
+            << std::endl;
+        return ok;
+    }
+}
+
+int
+script( osg::ArgumentParser& args )
+{
+    unsigned numFeatures = 100000;
+    while( args.read("--features", numFeatures) );
+
+    unsigned iterations = 5;
+    while( args.read("--iterations", iterations) );
+
+    std::string language;
+    while( args.read("--language", language) );
+
+    std::string code = "1+1";
+    while( args.read("--code", code) );
+
+    if ( numFeatures < 1 || iterations < 1 )
+        return usage( "Features and iterations must be at least 1." );
+
+    Random prng( 0, Random::METHOD_FAST );
+    FeatureList features;
+    for( unsigned i=0; i<numFeatures; ++i )
+    {
+        Feature* feature = new Feature( 0L, 0L, Style(), (FeatureID)(i+1) );
+        feature->set( "height", 10.0 + 100.0*prng.next() );
+        features.push_back( feature );
+    }
+
+    unsigned failures = 0;
+
+    // the default runBatch, which every engine without its own override gets.
+    osg::ref_ptr<ScriptEngine> engine = new AttributeScriptEngine();
+    if ( !checkRunBatch("runBatch", engine.get(), "height", features, iterations) )
+        ++failures;
+
+    if ( !language.empty() )
+    {
+        osg::ref_ptr<ScriptEngine> plugin = ScriptEngineFactory::create( language );
+        if ( !plugin.valid() )
+            return usage( "Could not load a script engine for " + language );
+
+        if ( !checkRunBatch(language, plugin.get(), code, features, iterations) )
+            ++failures;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
+
+//------------------------------------------------------------------------
+
+#ifndef _WIN32
+
+namespace
+{
+    /**
+     * Answers WMS GetMap requests with a small PNG per time step, filled with the
+     * step's index; anything else is a 404. Earlier steps answer later, so the
+     * responses arrive out of order.
+     */
+    struct WMSStubServer : public StubServer
+    {
+        WMSStubServer( const std::vector<std::string>& times, unsigned stepDelay_ms, osgDB::ReaderWriter* png ) :
+            StubServer( 0, 0 ), _times( times ), _stepDelay_ms( stepDelay_ms ), _png( png ) { }
+
+        unsigned respond( const std::string& path, std::string& out_body, std::string& out_type )
+        {
+            out_type = "text/plain";
+            std::string::size_type t = path.find( "TIME=" );
+            if ( path.find("REQUEST=GetMap") == std::string::npos || t == std::string::npos )
+                return 404;
+
+            std::string time = path.substr( t+5, path.find('&', t) - (t+5) );
+            std::vector<std::string>::const_iterator i = std::find( _times.begin(), _times.end(), time );
+            if ( i == _times.end() )
+                return 404;
+
+            unsigned index = i - _times.begin();
+            OpenThreads::Thread::microSleep( (_times.size() - index) * _stepDelay_ms * 1000 );
+
+            osg::ref_ptr<osg::Image> image = new osg::Image();
+            image->allocateImage( 8, 8, 1, GL_RGB, GL_UNSIGNED_BYTE );
+            ::memset( image->data(), (int)(index % 256), image->getTotalSizeInBytes() );
+
+            std::ostringstream buf;
+            if ( !_png->writeImage(*image.get(), buf).success() )
+                return 404;
+
+            out_body = buf.str();
+            out_type = "image/png";
+            return 200;
+        }
+
+        std::vector<std::string> _times;
+        unsigned                 _stepDelay_ms;
+        osgDB::ReaderWriter*     _png;
+    };
+
+    unsigned numFrames( osg::ImageSequence* seq )
+    {
+#if OSG_MIN_VERSION_REQUIRED(3,3,0)
+        return seq->getNumImageData();
+#else
+        return seq->getNumImages();
+#endif
+    }
+
+    /** Number of frames out of place or missing; a frame's pixels hold its time step. */
+    unsigned badFrames( osg::ImageSequence* seq, unsigned numTimes )
+    {
+        unsigned frames = numFrames( seq );
+        unsigned bad = numTimes > frames ? numTimes - frames : frames - numTimes;
+        for( unsigned i=0; i<osg::minimum(frames, numTimes); ++i )
+        {
+            osg::Image* image = seq->getImage( i );
+            if ( !image || image->data()[0] != (unsigned char)(i % 256) )
+                ++bad;
+        }
+        return bad;
+    }
+
+    TileSource* openWMST( const WMSStubServer& server, const std::vector<std::string>& times, unsigned window, bool progressive )
+    {
+        std::string joined;
+        for( unsigned i=0; i<times.size(); ++i )
+            joined += (i > 0 ? "," : "") + times[i];
+
+        WMSOptions options;
+        options.url()                = URI( stubURL(server, "/wms") );
+        options.layers()             = "steps";
+        options.format()             = "png";
+        options.srs()                = "EPSG:4326";
+        options.times()              = joined;
+        options.maxConcurrentTimes() = window;
+        options.progressive()        = progressive;
+
+        osg::ref_ptr<TileSource> source = TileSourceFactory::create( options );
+        if ( !source.valid() )
+            return 0L;
+
+        source->initialize( 0L, 0L );
+        return source->getProfile() ? source.release() : 0L;
+    }
+}
+
+int
+wmst( osg::ArgumentParser& args )
+{
+    unsigned numTimes = 24, window = 4, delay = 5;
+    args.read( "--times", numTimes );
+    args.read( "--window", window );
+    args.read( "--delay", delay );
+
+    if ( numTimes < 2 || window < 1 )
+        return usage( "Times must be at least 2 and the window at least 1." );
+
+    osgDB::ReaderWriter* png = osgDB::Registry::instance()->getReaderWriterForExtension( "png" );
+    if ( !png )
+        return usage( "Could not load the png plugin." );
+
+    std::vector<std::string> times;
+    for( unsigned i=0; i<numTimes; ++i )
+    {
+        std::ostringstream buf;
+        buf << "2012-01-01T" << std::setfill('0') << std::setw(2) << (i/60)%24 << ":" << std::setw(2) << i%60 << ":00Z";
+        times.push_back( buf.str() );
+    }
+
+    WMSStubServer server( times, delay, png );
+    if ( !server.listen() )
+    {
+        std::cout << "wmst: FAILED, could not start the stub server" << std::endl;
+        return 1;
+    }
+
+    unsigned failures = 0, connections, maxInFlight;
+
+    // blocking: the sequence comes back with every frame, in time order, and no
+    // more than the window of steps was ever requested at once.
+    osg::ref_ptr<TileSource> blocking = openWMST( server, times, window, false );
+    if ( !blocking.valid() )
+    {
+        server.stop();
+        return usage( "Could not load the wms driver." );
+    }
+
+    TileKey key( 1, 0, 0, blocking->getProfile() );
+
+    server.takeCounts( connections, maxInFlight );
+    osg::Timer_t t0 = osg::Timer::instance()->tick();
+    osg::ref_ptr<osg::ImageSequence> seq = dynamic_cast<osg::ImageSequence*>( blocking->createImage(key, 0L) );
+    double ms = elapsed_ms( t0 );
+    server.takeCounts( connections, maxInFlight );
+
+    unsigned bad = seq.valid() ? badFrames( seq.get(), numTimes ) : numTimes;
+    bool ok = bad == 0 && maxInFlight <= window;
+    std::cout
+        << "blocking: " << (ok ? "OK" : "MISMATCH") << ", " << (seq.valid() ? numFrames(seq.get()) : 0) << " of " << numTimes
+        << " frames, " << bad << " missing or out of order, " << maxInFlight << " steps in flight (window " << window << "); "
+        << ms << " ms" << std::endl;
+    failures += ok ? 0 : 1;
+
+    // progressive: the first frame comes back alone, and the loader appends the
+    // rest, in order, in the background.
+    osg::ref_ptr<TileSource> progressive = openWMST( server, times, window, true );
+    if ( progressive.valid() )
+    {
+        t0 = osg::Timer::instance()->tick();
+        seq = dynamic_cast<osg::ImageSequence*>( progressive->createImage(key, 0L) );
+        double firstMs = elapsed_ms( t0 );
+        unsigned first = seq.valid() ? numFrames( seq.get() ) : 0;
+
+        while( seq.valid() && numFrames(seq.get()) < numTimes && elapsed_ms(t0) < 10000.0 )
+            OpenThreads::Thread::microSleep( 1000 );
+        ms = elapsed_ms( t0 );
+
+        bad = seq.valid() ? badFrames( seq.get(), numTimes ) : numTimes;
+        ok = first == 1 && bad == 0;
+        std::cout
+            << "progressive: " << (ok ? "OK" : "MISMATCH") << ", " << first << " frame(s) after " << firstMs << " ms, "
+            << (seq.valid() ? numFrames(seq.get()) : 0) << " of " << numTimes << " after " << ms << " ms, "
+            << bad << " missing or out of order" << std::endl;
+        failures += ok ? 0 : 1;
+    }
+    else
+    {
+        std::cout << "progressive: FAILED, could not open the source" << std::endl;
+        ++failures;
+    }
+
+    seq = 0L;
+    server.stop();
+
+    return failures == 0 ? 0 : 1;
+}
+
+#else
+
+int
+wmst( osg::ArgumentParser& args )
+{
+    std::cout << "wmst: the stub server is not available on this platform" << std::endl;
+    return 1;
+}
+
+#endif
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    typedef std::set< std::pair<int, std::pair<int, int> > > TileIDSet;
+
+    osgTerrain::TileID randomTileID( Random& prng )
+    {
+        unsigned level = 1 + prng.next( 18 );
+        return osgTerrain::TileID( level, prng.next(1u << level), prng.next(1u << (level-1)) );
+    }
+
+    void insertID( TileIDSet& ids, const osgTerrain::TileID& id )
+    {
+        ids.insert( std::make_pair(id.level, std::make_pair(id.x, id.y)) );
+    }
+
+    // counts the reference IDs the blacklist disagrees with: ones it lost, and
+    // (from the probes) ones it claims but never had.
+    unsigned badContains( const TileBlacklist* list, const TileIDSet& ids, const std::vector<osgTerrain::TileID>& probes )
+    {
+        unsigned bad = 0;
+        for( TileIDSet::const_iterator i = ids.begin(); i != ids.end(); ++i )
+        {
+            if ( !list->contains(osgTerrain::TileID(i->first, i->second.first, i->second.second)) )
+                ++bad;
+        }
+        for( unsigned i=0; i<probes.size(); ++i )
+        {
+            bool expected = ids.find( std::make_pair(probes[i].level, std::make_pair(probes[i].x, probes[i].y)) ) != ids.end();
+            if ( list->contains(probes[i]) != expected )
+                ++bad;
+        }
+        return bad;
+    }
+}
+
+int
+blacklist( osg::ArgumentParser& args )
+{
+    unsigned numTiles = 100000;
+    while( args.read("--tiles", numTiles) );
+
+    unsigned numProbes = 1000000;
+    while( args.read("--probes", numProbes) );
+
+    if ( numTiles < 1 || numProbes < 1 )
+        return usage( "Tiles and probes must be at least 1." );
+
+    Random prng( 0, Random::METHOD_FAST );
+    unsigned failures = 0;
+
+    TileIDSet ids;
+    osg::ref_ptr<TileBlacklist> original = new TileBlacklist();
+    for( unsigned i=0; i<numTiles; ++i )
+    {
+        osgTerrain::TileID id = randomTileID( prng );
+        original->add( id );
+        insertID( ids, id );
+    }
+
+    // probes are mostly tiles that were never added, so they also exercise the
+    // Bloom filter's negative path.
+    std::vector<osgTerrain::TileID> probes;
+    probes.reserve( numProbes );
+    for( unsigned i=0; i<numProbes; ++i )
+        probes.push_back( randomTileID(prng) );
+
+    unsigned bad = badContains( original.get(), ids, probes );
+    bool ok = bad == 0 && original->size() == ids.size();
+    std::cout
+        << "contains: " << (ok ? "OK" : "MISMATCH") << ", " << original->size() << " of " << ids.size()
+        << " tiles, " << bad << " wrong answers" << std::endl;
+    failures += ok ? 0 : 1;
+
+    // round trip: write it out and read it back into a fresh blacklist.
+    std::stringstream buf;
+    original->write( buf );
+    osg::ref_ptr<TileBlacklist> restored = TileBlacklist::read( buf );
+
+    bad = badContains( restored.get(), ids, probes );
+    ok = bad == 0 && restored->size() == ids.size();
+    std::cout
+        << "round trip: " << (ok ? "OK" : "MISMATCH") << ", " << restored->size() << " of " << ids.size()
+        << " tiles, " << bad << " wrong answers" << std::endl;
+    failures += ok ? 0 : 1;
+
+    // a TTL written with the entries has to survive the trip as well.
+    std::stringstream ttlBuf;
+    original->write( ttlBuf, 3600.0 );
+    osg::ref_ptr<TileBlacklist> expiring = TileBlacklist::read( ttlBuf );
+
+    bad = badContains( expiring.get(), ids, probes );
+    ok = bad == 0 && expiring->size() == ids.size() && ttlBuf.str() != buf.str();
+    std::cout
+        << "round trip with TTL: " << (ok ? "OK" : "MISMATCH") << ", " << expiring->size() << " of " << ids.size()
+        << " tiles, " << bad << " wrong answers" << std::endl;
+    failures += ok ? 0 : 1;
+
+    // removals leave their Bloom filter bits behind; the shards still have to
+    // answer correctly, before and after another trip.
+    unsigned n = 0;
+    for( TileIDSet::iterator i = ids.begin(); i != ids.end(); ++n )
+    {
+        if ( n % 3 == 0 )
+        {
+            restored->remove( osgTerrain::TileID(i->first, i->second.first, i->second.second) );
+            ids.erase( i++ );
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    std::stringstream removedBuf;
+    restored->write( removedBuf );
+    osg::ref_ptr<TileBlacklist> removed = TileBlacklist::read( removedBuf );
+
+    bad = badContains( restored.get(), ids, probes ) + badContains( removed.get(), ids, probes );
+    ok = bad == 0 && restored->size() == ids.size() && removed->size() == ids.size();
+    std::cout
+        << "remove: " << (ok ? "OK" : "MISMATCH") << ", " << removed->size() << " of " << ids.size()
+        << " tiles after the trip, " << bad << " wrong answers" << std::endl;
+    failures += ok ? 0 : 1;
+
+    osg::Timer_t t0 = osg::Timer::instance()->tick();
+    unsigned hits = 0;
+    for( unsigned i=0; i<probes.size(); ++i )
+        hits += original->contains( probes[i] ) ? 1 : 0;
+    double ms = elapsed_ms( t0 );
+
+    std::cout
+        << "lookups: " << probes.size() << " in " << ms << " ms ("
+        << (ms > 0.0 ? (double)probes.size() / ms : 0.0) << " per ms), " << hits << " hits" << std::endl;
+
+    return failures == 0 ? 0 : 1;
+}
@@ -28,6 +28,7 @@
 #include <osgEarthUtil/AutoClipPlaneHandler>
 #include <osgEarthUtil/LineOfSight>
 #include <osg/io_utils>
+#include <cmath>
 
 using namespace osgEarth;
 using namespace osgEarth::Util;
@@ -86,6 +87,78 @@ osg::AnimationPath* createAnimationPath( MapNode* mapNode, const osg::Vec3& cent
     return animationPath;    
 }
 
+/**
+ * Compares a RadialLineOfSightNode's intersector results with a hidden twin
+ * that evaluates the same spokes against the map's heightfields, and prints
+ * how well they agree each time either one changes.
+ */
+struct CompareLOS : public ChangedCallback
+{
+    CompareLOS( RadialLineOfSightNode* node, RadialLineOfSightNode* twin ) : _node( node ), _twin( twin ) { }
+
+    void onChanged()
+    {
+        osg::ref_ptr<RadialLineOfSightNode> node, twin;
+        if ( !_node.lock(node) || !_twin.lock(twin) )
+            return;
+
+        // keep the twin on the same parameters; it recomputes in the background.
+        twin->setAltitudeMode( node->getAltitudeMode() );
+        twin->setCenter      ( node->getCenter() );
+        twin->setRadius      ( node->getRadius() );
+        twin->setNumSpokes   ( node->getNumSpokes() );
+
+        RadialLineOfSightNode::SpokeVector a, b;
+        node->getSpokes( a );
+        twin->getSpokes( b );
+        if ( a.empty() || a.size() != b.size() )
+            return;
+
+        unsigned agree = 0, bothBlocked = 0;
+        double   sumDiff = 0.0, maxDiff = 0.0, startOffset = 0.0;
+        for( unsigned i=0; i<a.size(); ++i )
+        {
+            startOffset = osg::maximum( startOffset, (a[i]._start - b[i]._start).length() );
+            if ( a[i]._hasLOS == b[i]._hasLOS )
+                ++agree;
+            if ( !a[i]._hasLOS && !b[i]._hasLOS )
+            {
+                double diff = fabs( (a[i]._hit - a[i]._start).length() - (b[i]._hit - b[i]._start).length() );
+                sumDiff += diff;
+                maxDiff = osg::maximum( maxDiff, diff );
+                ++bothBlocked;
+            }
+        }
+
+        OE_NOTICE
+            << "Radial LOS at " << node->getCenter() << ": "
+            << agree << " of " << a.size() << " spokes agree; hit distance diff mean "
+            << (bothBlocked > 0 ? sumDiff/(double)bothBlocked : 0.0) << " m, max " << maxDiff << " m"
+            << " (observers " << startOffset << " m apart)" << std::endl;
+    }
+
+    osg::observer_ptr<RadialLineOfSightNode> _node, _twin;
+};
+
+/** Cull callback that hides a node while it still gets update traversals. */
+struct HideCallback : public osg::NodeCallback
+{
+    void operator()( osg::Node* node, osg::NodeVisitor* nv ) { }
+};
+
+void addComparison( osg::Group* root, MapNode* mapNode, RadialLineOfSightNode* node )
+{
+    RadialLineOfSightNode* twin = new RadialLineOfSightNode( mapNode );
+    twin->setUseHeightfields( true );
+    twin->setCullCallback( new HideCallback() );
+    root->addChild( twin );
+
+    CompareLOS* compare = new CompareLOS( node, twin );
+    node->addChangedCallback( compare );
+    twin->addChangedCallback( compare );
+    compare->onChanged();
+}
+
 osg::Node* createPlane(osg::Node* node, MapNode* mapNode, const osg::Vec3d& center, double radius, double time)
 {
     osg::MatrixTransform* positioner = new osg::MatrixTransform;
@@ -99,6 +172,10 @@ int
 main(int argc, char** argv)
 {
     osg::ArgumentParser arguments(&argc,argv);
+
+    // compare the radial nodes' intersector results with the heightfield engine:
+    bool compare = arguments.read( "--compare" );
+
     osgViewer::Viewer viewer(arguments);
 
     // load the .earth file from the command line.
@@ -166,6 +243,12 @@ main(int argc, char** argv)
     RadialLineOfSightEditor* radialRelEditor = new RadialLineOfSightEditor( radialRelative );
     root->addChild( radialRelEditor );
 
+    if ( compare )
+    {
+        addComparison( root, mapNode, radial );
+        addComparison( root, mapNode, radialRelative );
+    }
+
 
     //Create an editor for the radial line of sight that allows you to drag it around.
 
@@ -28,8 +28,10 @@
 #include <osgEarth/Registry>
 #include <osgEarth/StringUtils>
 #include <osgEarth/HTTPClient>
+#include <osgEarth/ImageUtils>
 #include <osgEarthUtil/TMSPackager>
 #include <osgEarthDrivers/tms/TMSOptions>
+#include <osgEarthDrivers/mbtiles/MBTilesOptions>
 
 #include <iostream>
 #include <sstream>
@@ -63,6 +65,14 @@ usage( const std::string& msg = "" )
         << "            [--overwrite]                  : overwrite existing tiles\n"
         << "            [--out-earth <earthfile>]      : export an earth file referencing the new repo\n"
         << "            [--ext <extension>]            : overrides the image file extension (e.g. jpg)\n"
+        << std::endl
+        << "         --mbtiles                         : package one image layer into an MBTiles file\n"
+        << "            <earth_file>                   : earth file defining the layer to export (requied)\n"
+        << "            --out <file>                   : output MBTiles file (required)\n"
+        << "            [--layer <name>]               : image layer to export (default=first enabled image layer)\n"
+        << "            [--bounds xmin ymin xmax ymax] : bounds to package (in map coordinates; default=entire map)\n"
+        << "            [--max-level <num>]            : max LOD level for tiles (default=5)\n"
+        << "            [--ext <extension>]            : tile image format (default=png)\n"
 #if 0
         << std::endl
         << "         --tfs                   : make a TFS repo" << std::endl
@@ -305,6 +315,153 @@ makeTMS( osg::ArgumentParser& args )
     return 0;
 }
 
+/** Recursively stores the tiles of an image layer in a writable tile source. */
+bool
+packageMBTile(ImageLayer*                   layer,
+              const TileKey&                key,
+              TileSource*                   target,
+              const std::vector<GeoExtent>& extents,
+              unsigned                      maxLevel,
+              const std::string&            extension,
+              bool                          verbose,
+              unsigned&                     out_count )
+{
+    if ( extents.size() > 0 && key.getLevelOfDetail() > 1 )
+    {
+        bool intersects = false;
+        for( std::vector<GeoExtent>::const_iterator i = extents.begin(); i != extents.end() && !intersects; ++i )
+            intersects = i->intersects( key.getExtent() );
+        if ( !intersects )
+            return true;
+    }
+
+    unsigned minLevel = layer->getImageLayerOptions().minLevel().isSet() ?
+        *layer->getImageLayerOptions().minLevel() : 0;
+
+    GeoImage image = layer->createImage( key );
+    if ( image.valid() && key.getLevelOfDetail() >= minLevel )
+    {
+        osg::ref_ptr<osg::Image> final = image.getImage();
+        if ( extension == "jpg" && final->getPixelFormat() != GL_RGB )
+            final = ImageUtils::convertToRGB8( image.getImage() );
+
+        if ( !target->storeImage( key, final.get() ) )
+        {
+            OE_WARN << LC << "Aborting, write failed for tile " << key.str() << std::endl;
+            return false;
+        }
+
+        ++out_count;
+        if ( verbose )
+        {
+            OE_NOTICE << LC << "Wrote tile " << key.str() << " (" << key.getExtent().toString() << ")" << std::endl;
+        }
+    }
+
+    // stop subdividing once the layer runs out of data.
+    if ( key.getLevelOfDetail() < maxLevel && (image.valid() || key.getLevelOfDetail() < minLevel) )
+    {
+        for( unsigned q=0; q<4; ++q )
+        {
+            if ( !packageMBTile(layer, key.createChildKey(q), target, extents, maxLevel, extension, verbose, out_count) )
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+/** Packages an image layer into an MBTiles file through the writable MBTiles tile source. */
+int
+makeMBTiles( osg::ArgumentParser& args )
+{
+    std::string extension = "png";
+    args.read( "--ext", extension );
+
+    bool verbose = !args.read( "--quiet" );
+
+    std::string earthFile = findArgumentWithExtension(args, ".earth");
+    if ( earthFile.empty() )
+        return usage( "Missing required .earth file" );
+
+    std::string outFile;
+    if ( !args.read( "--out", outFile ) )
+        return usage( "Missing required --out file" );
+
+    std::string layerName;
+    args.read( "--layer", layerName );
+
+    std::vector< Bounds > bounds;
+    double xmin=DBL_MAX, ymin=DBL_MAX, xmax=DBL_MIN, ymax=DBL_MIN;
+    while (args.read("--bounds", xmin, ymin, xmax, ymax ))
+    {        
+        Bounds b;
+        b.xMin() = xmin, b.yMin() = ymin, b.xMax() = xmax, b.yMax() = ymax;
+        bounds.push_back( b );
+    }
+
+    unsigned maxLevel = 5;
+    args.read( "--max-level", maxLevel );
+
+    osg::ref_ptr<MapNode> mapNode = MapNode::load( args );
+    if ( !mapNode.valid() )
+        return usage( "Failed to load a valid .earth file" );
+
+    Map* map = mapNode->getMap();
+
+    // find the layer to export:
+    osg::ref_ptr<ImageLayer> layer;
+    ImageLayerVector imageLayers;
+    map->getImageLayers( imageLayers );
+    for( ImageLayerVector::iterator i = imageLayers.begin(); i != imageLayers.end() && !layer.valid(); ++i )
+    {
+        if ( layerName.empty() ? i->get()->getImageLayerOptions().enabled() == true : i->get()->getName() == layerName )
+            layer = i->get();
+    }
+    if ( !layer.valid() )
+        return usage( "No image layer to export" );
+
+    // open the output through the MBTiles driver in writer mode:
+    MBTilesOptions mbtiles;
+    mbtiles.filename() = outFile;
+    mbtiles.format()   = extension;
+    mbtiles.writable() = true;
+
+    osg::ref_ptr<TileSource> target = TileSourceFactory::create( mbtiles );
+    if ( target.valid() )
+        target->initialize( 0L, 0L );
+    if ( !target.valid() || !target->getProfile() || !target->isWritable() )
+        return usage( "Failed to open \"" + outFile + "\" for writing" );
+
+    // MBTiles tiles are always in the spherical mercator profile.
+    const Profile* profile = target->getProfile();
+
+    std::vector<GeoExtent> extents;
+    for (unsigned int i = 0; i < bounds.size(); ++i)
+    {
+        if ( bounds[i].isValid() )
+            extents.push_back( GeoExtent(map->getProfile()->getSRS(), bounds[i]).transform(profile->getSRS()) );
+    }
+
+    if ( verbose )
+    {
+        OE_NOTICE << LC << "Packaging image layer \"" << layer->getName() << "\" into " << outFile << std::endl;
+    }
+
+    std::vector<TileKey> rootKeys;
+    profile->getRootKeys( rootKeys );
+
+    unsigned count = 0;
+    for( unsigned i=0; i<rootKeys.size(); ++i )
+    {
+        if ( !packageMBTile(layer.get(), rootKeys[i], target.get(), extents, maxLevel, extension, verbose, count) )
+            return -1;
+    }
+
+    return message( Stringify() << "Wrote " << count << " tiles to " << outFile );
+}
+
 /**
  * Data packaging tool for osgEarth.
  */
@@ -318,6 +475,9 @@ main(int argc, char** argv)
     if ( args.read("--tms") )
         return makeTMS(args);
 
+    else if ( args.read("--mbtiles") )
+        return makeMBTiles(args);
+
     else
         return usage();
 }
@@ -28,18 +28,28 @@
 #include <osgEarth/CacheSeed>
 #include <osgEarth/MapNode>
 #include <osgEarth/Registry>
+#include <osgEarth/ImageUtils>
+#include <osgEarth/StringUtils>
+
+#include <osgEarthDrivers/cache_filesystem/FileSystemCache>
+
+#include <OpenThreads/Thread>
+#include <osg/Timer>
 
 #include <iostream>
 #include <sstream>
 #include <iterator>
 
 using namespace osgEarth;
+using namespace osgEarth::Drivers;
 
 #define LC "[osgearth_cache] "
 
 int list( osg::ArgumentParser& args );
 int seed( osg::ArgumentParser& args );
 int purge( osg::ArgumentParser& args );
+int migrate( osg::ArgumentParser& args );
+int bench( osg::ArgumentParser& args );
 int usage( const std::string& msg );
 int message( const std::string& msg );
 
@@ -55,6 +65,10 @@ main(int argc, char** argv)
         return list( args );
     else if ( args.read( "--purge" ) )
         return purge( args );
+    else if ( args.read( "--migrate" ) )
+        return migrate( args );
+    else if ( args.read( "--bench" ) )
+        return bench( args );
     else
         return usage("");
 }
@@ -81,6 +95,13 @@ usage( const std::string& msg )
         << "        [--cache-type type]             ; Overrides the cache type in the .earth file" << std::endl
         << std::endl
         << "    --purge file.earth                  ; Purges a layer cache in a .earth file (interactive)" << std::endl
+        << std::endl
+        << "    --migrate path                      ; Converts a filesystem cache to the packed format" << std::endl
+        << "        [--remove-migrated]             ; Deletes the original files once converted" << std::endl
+        << std::endl
+        << "    --bench path                        ; Compares filesystem cache formats in a scratch folder" << std::endl
+        << "        [--count n]                     ; Number of records to write (default=2000)" << std::endl
+        << "        [--threads n]                   ; Number of reader threads (default=4)" << std::endl
         << std::endl;
 
     return -1;
@@ -309,3 +330,132 @@ purge( osg::ArgumentParser& args )
 
     return 0;
 }
+
+
+int
+migrate( osg::ArgumentParser& args )
+{
+    bool removeMigrated = args.read( "--remove-migrated" );
+
+    if ( args.argc() < 2 )
+        return usage( "Missing cache path." );
+
+    std::string path = args[1];
+    if ( osgDB::fileType(path) != osgDB::DIRECTORY )
+        return usage( "Cache path is not a folder." );
+
+    FileSystemCacheOptions options;
+    options.rootPath()       = path;
+    options.format()         = "packed";
+    options.migrate()        = true;
+    options.removeMigrated() = removeMigrated;
+
+    osg::ref_ptr<Cache> cache = CacheFactory::create( options );
+    if ( !cache.valid() )
+        return message( "Failed to load the filesystem cache driver." );
+
+    // every folder in the cache root is a bin; opening it as a packed bin imports its records.
+    osgDB::DirectoryContents dc = osgDB::getDirectoryContents( path );
+    for( osgDB::DirectoryContents::const_iterator i = dc.begin(); i != dc.end(); ++i )
+    {
+        if ( *i == "." || *i == ".." || osgDB::fileType(osgDB::concatPaths(path, *i)) != osgDB::DIRECTORY )
+            continue;
+
+        std::cout << "Migrating bin \"" << *i << "\".." << std::flush;
+        cache->addBin( *i );
+        std::cout << "done." << std::endl;
+    }
+
+    return 0;
+}
+
+namespace
+{
+    struct BenchReader : public OpenThreads::Thread
+    {
+        BenchReader( CacheBin* bin, unsigned count, unsigned start ) 
+            : _bin(bin), _count(count), _start(start), _hits(0) { }
+
+        void run()
+        {
+            for( unsigned i=0; i<_count; ++i )
+            {
+                unsigned k = (_start + i*7) % _count;
+                if ( _bin->readImage( Stringify() << "bench/" << k ).succeeded() )
+                    ++_hits;
+            }
+        }
+
+        CacheBin* _bin;
+        unsigned  _count, _start, _hits;
+    };
+
+    void runBench( const std::string& path, const std::string& format, unsigned count, unsigned numThreads )
+    {
+        FileSystemCacheOptions options;
+        options.rootPath() = osgDB::concatPaths( path, format );
+        options.format()   = format;
+
+        osg::ref_ptr<Cache> cache = CacheFactory::create( options );
+        if ( !cache.valid() )
+            return;
+
+        CacheBin* bin = cache->addBin( "bench" );
+        bin->purge();
+
+        osg::ref_ptr<osg::Image> image = ImageUtils::createEmptyImage();
+        image->allocateImage( 256, 256, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+        for( unsigned i=0; i<image->getTotalSizeInBytes(); ++i )
+            image->data()[i] = (unsigned char)(i*31);
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for( unsigned i=0; i<count; ++i )
+            bin->write( Stringify() << "bench/" << i, image.get() );
+        double writeTime = osg::Timer::instance()->delta_s( t0, osg::Timer::instance()->tick() );
+
+        std::vector<BenchReader*> readers;
+        for( unsigned i=0; i<numThreads; ++i )
+            readers.push_back( new BenchReader(bin, count, i*(count/numThreads)) );
+
+        t0 = osg::Timer::instance()->tick();
+        for( unsigned i=0; i<numThreads; ++i )
+            readers[i]->start();
+
+        unsigned hits = 0;
+        for( unsigned i=0; i<numThreads; ++i )
+        {
+            readers[i]->join();
+            hits += readers[i]->_hits;
+            delete readers[i];
+        }
+        double readTime = osg::Timer::instance()->delta_s( t0, osg::Timer::instance()->tick() );
+
+        std::cout
+            << "Format \"" << format << "\": " << std::endl
+            << "    wrote " << count << " records in " << writeTime << "s (" << (count/writeTime) << "/s)" << std::endl
+            << "    read  " << hits << " records on " << numThreads << " threads in " << readTime << "s (" << (hits/readTime) << "/s)" << std::endl;
+    }
+}
+
+int
+bench( osg::ArgumentParser& args )
+{
+    unsigned count = 2000;
+    while( args.read("--count", count) );
+
+    unsigned numThreads = 4;
+    while( args.read("--threads", numThreads) );
+    if ( numThreads < 1 )
+        numThreads = 1;
+
+    if ( args.argc() < 2 )
+        return usage( "Missing scratch folder path." );
+
+    std::string path = args[1];
+    osgDB::makeDirectory( path );
+
+    runBench( path, "files",  count, numThreads );
+    runBench( path, "packed", count, numThreads );
+
+    return 0;
+}
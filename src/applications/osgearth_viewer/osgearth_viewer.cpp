@@ -18,16 +18,66 @@
 */
 
 #include <osg/Notify>
+#include <osg/Timer>
 #include <osgViewer/Viewer>
+#include <osgEarth/MapNode>
+#include <osgEarth/ShaderComposition>
 #include <osgEarthUtil/EarthManipulator>
 #include <osgEarthUtil/ExampleResources>
 
 #define LC "[viewer] "
 
+using namespace osgEarth;
 using namespace osgEarth::Util;
 
 //------------------------------------------------------------------------
 
+namespace
+{
+    double since( osg::Timer_t start )
+    {
+        return osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+    }
+
+    /** Prints the --profile-startup report. */
+    void reportStartup( osg::Node* node, double loadSeconds, double firstFrameSeconds, double readySeconds )
+    {
+        MapNode* mapNode = MapNode::findMapNode( node );
+        if ( !mapNode )
+            return;
+
+        const MapNode::StartupStats& stats = mapNode->getStartupStats();
+        double parseSeconds = osg::maximum( 0.0, loadSeconds - stats._layerInitSeconds - stats._profileSeconds );
+
+        OE_NOTICE << LC << "Startup profile:" << std::endl
+            << "    earth file parse   : " << parseSeconds << "s" << std::endl
+            << "    layer init         : " << stats._layerInitSeconds << "s" << std::endl;
+
+        for( MapNode::LayerInitTimes::const_iterator i = stats._layers.begin(); i != stats._layers.end(); ++i )
+        {
+            OE_NOTICE
+                << "        " << i->_name << " : " << i->_seconds << "s"
+                << (!i->_completed ? " (timed out)" : !i->_ok ? " (failed)" : "") << std::endl;
+        }
+
+        OE_NOTICE
+            << "    profile resolution : " << stats._profileSeconds << "s" << std::endl
+            << "    first frame        : " << firstFrameSeconds << "s" << std::endl;
+
+        if ( readySeconds >= 0.0 )
+            OE_NOTICE << "    pager idle         : " << readySeconds << "s" << std::endl;
+        else
+            OE_NOTICE << "    pager idle         : not reached" << std::endl;
+
+        VirtualProgram::ProgramCacheStats shaders = VirtualProgram::getProgramCacheStats();
+        OE_NOTICE
+            << "    shader programs    : " << shaders._misses << " built, " << shaders._hits << " shared, "
+            << shaders._linkSeconds << "s linking" << std::endl;
+    }
+}
+
+//------------------------------------------------------------------------
+
 int
 main(int argc, char** argv)
 {
@@ -35,6 +85,9 @@ main(int argc, char** argv)
     if ( arguments.read("--stencil") )
         osg::DisplaySettings::instance()->setMinimumNumStencilBits( 8 );
 
+    // report where the startup time goes (earth file, layers, profile, first frames)
+    bool profileStartup = arguments.read("--profile-startup");
+
     // create a viewer:
     osgViewer::Viewer viewer(arguments);
 
@@ -43,11 +96,16 @@ main(int argc, char** argv)
 
     // load an earth file, and support all or our example command-line options
     // and earth file <external> tags
+    osg::Timer_t loadStart = osg::Timer::instance()->tick();
     osg::Node* node = MapNodeHelper().load( arguments, &viewer );
+    double loadSeconds = since( loadStart );
     if ( node )
     {
         viewer.setSceneData( node );
 
+        // compose the scene's shader programs now, rather than during the first frames.
+        VirtualProgram::precompile( node );
+
         // configure the near/far so we don't clip things that are up close
         viewer.getCamera()->setNearFarRatio(0.00002);
 
@@ -55,12 +113,36 @@ main(int argc, char** argv)
         // OSG, this activates OSG's IncrementalCompileOpeartion in order to avoid frame breaks.
         viewer.getDatabasePager()->setDoPreCompile( true );
 
-        return viewer.run();
+        if ( !profileStartup )
+            return viewer.run();
+
+        // run the frame loop ourselves so we can time the first frames.
+        osg::Timer_t frameStart = osg::Timer::instance()->tick();
+        if ( !viewer.isRealized() )
+            viewer.realize();
+        viewer.frame();
+        double firstFrameSeconds = since( frameStart );
+
+        bool reported = false;
+        while( !viewer.done() )
+        {
+            viewer.frame();
+            if ( !reported && !viewer.getDatabasePager()->getRequestsInProgress() )
+            {
+                reportStartup( node, loadSeconds, firstFrameSeconds, since(frameStart) );
+                reported = true;
+            }
+        }
+
+        if ( !reported )
+            reportStartup( node, loadSeconds, firstFrameSeconds, -1.0 );
+
+        return 0;
     }
     else
     {
         OE_NOTICE 
-            << "\nUsage: " << argv[0] << " file.earth" << std::endl
+            << "\nUsage: " << argv[0] << " file.earth [--profile-startup]" << std::endl
             << MapNodeHelper().usage() << std::endl;
     }
 }
@@ -99,6 +99,7 @@ Capabilities::Capabilities() :
 _maxFFPTextureUnits     ( 1 ),
 _maxGPUTextureUnits     ( 1 ),
 _maxGPUTextureCoordSets ( 1 ),
+_maxGPUVertexTextureUnits( 0 ),
 _maxTextureSize         ( 256 ),
 _maxFastTextureSize     ( 256 ),
 _maxLights              ( 1 ),
@@ -111,7 +112,9 @@ _supportsStencilWrap    ( true ),
 _supportsTwoSidedStencil( false ),
 _supportsTexture2DLod   ( false ),
 _supportsMipmappedTextureUpdates( false ),
-_supportsDepthPackedStencilBuffer( false )
+_supportsDepthPackedStencilBuffer( false ),
+_supportsDrawInstanced  ( false ),
+_supportsTextureFloat   ( false )
 {
     // little hack to force the osgViewer library to link so we can create a graphics context
     osgViewerGetVersion();
@@ -150,6 +153,9 @@ _supportsDepthPackedStencilBuffer( false )
         glGetIntegerv( GL_MAX_TEXTURE_COORDS_ARB, &_maxGPUTextureCoordSets );
         OE_INFO << LC << "  Max GPU texture coordinate sets = " << _maxGPUTextureCoordSets << std::endl;
 
+        glGetIntegerv( GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &_maxGPUVertexTextureUnits );
+        OE_INFO << LC << "  Max GPU vertex texture units = " << _maxGPUVertexTextureUnits << std::endl;
+
         glGetIntegerv( GL_DEPTH_BITS, &_depthBits );
         OE_INFO << LC << "  Depth buffer bits = " << _depthBits << std::endl;
 
@@ -206,6 +212,19 @@ _supportsDepthPackedStencilBuffer( false )
         _supportsDepthPackedStencilBuffer = osg::isGLExtensionSupported( id, "GL_EXT_packed_depth_stencil" );
         OE_INFO << LC << "  depth-packed stencil = " << SAYBOOL(_supportsDepthPackedStencilBuffer) << std::endl;
 
+#if !(defined(OSG_GLES1_AVAILABLE) || defined(OSG_GLES2_AVAILABLE))
+        _supportsDrawInstanced = 
+            osg::getGLVersionNumber() >= 3.1 ||
+            osg::isGLExtensionSupported( id, "GL_ARB_draw_instanced" ) ||
+            osg::isGLExtensionSupported( id, "GL_EXT_draw_instanced" );
+
+        _supportsTextureFloat =
+            osg::getGLVersionNumber() >= 3.0 ||
+            osg::isGLExtensionSupported( id, "GL_ARB_texture_float" );
+#endif
+        OE_INFO << LC << "  Instanced draws = " << SAYBOOL(_supportsDrawInstanced) << std::endl;
+        OE_INFO << LC << "  Float textures = " << SAYBOOL(_supportsTextureFloat) << std::endl;
+
         //_supportsTexture2DLod = osg::isGLExtensionSupported( id, "GL_ARB_shader_texture_lod" );
         //OE_INFO << LC << "  texture2DLod = " << SAYBOOL(_supportsTexture2DLod) << std::endl;
 
@@ -18,6 +18,8 @@
  */
 #include <osgEarth/CompositeTileSource>
 #include <osgEarth/ImageUtils>
+#include <osgEarth/TaskService>
+#include <osgEarth/ThreadingUtils>
 #include <osgDB/FileNameUtils>
 
 #define LC "[CompositeTileSource] "
@@ -123,6 +125,101 @@ namespace
 
         ImageLayerTileProcessor _processor;
     };
+
+    // fetches one component's image on a worker thread.
+    struct FetchComponentImage
+    {
+        void init(TileSource*                 source,
+                  const TileKey&              key,
+                  TileSource::ImageOperation* op,
+                  ProgressCallback*           progress )
+        {
+            _source   = source;
+            _key      = key;
+            _op       = op;
+            _progress = progress;
+        }
+
+        void execute()
+        {
+            _result = _source->createImage( _key, _op.get(), _progress.get() );
+        }
+
+        osg::ref_ptr<TileSource>                 _source;
+        TileKey                                  _key;
+        osg::ref_ptr<TileSource::ImageOperation> _op;
+        osg::ref_ptr<ProgressCallback>           _progress;
+        osg::ref_ptr<osg::Image>                 _result;
+    };
+
+    // number of 8-bit channels if this is an RGB/RGBA8 image we can blend directly, else 0.
+    unsigned getUByteChannels( const osg::Image* image )
+    {
+        if ( image->getDataType() != GL_UNSIGNED_BYTE || image->r() != 1 )
+            return 0;
+        if ( image->getPixelFormat() == GL_RGBA )
+            return 4;
+        if ( image->getPixelFormat() == GL_RGB )
+            return 3;
+        return 0;
+    }
+
+    // Blends all the layers into "output" (which holds a copy of the bottom layer)
+    // in one pass. Same math as ImageUtils::mix applied layer by layer, but each
+    // pixel is carried in floating point through the whole stack and written once.
+    void blendUByte( const ImageMixVector& layers, osg::Image* output )
+    {
+        const float    toFloat = 1.0f/255.0f;
+        const unsigned outChannels = getUByteChannels( output );
+
+        std::vector<unsigned> layerChannels( layers.size() );
+        std::vector<float>    layerOpacity( layers.size() );
+        for( unsigned k=1; k<layers.size(); ++k )
+        {
+            layerChannels[k] = getUByteChannels( layers[k].first.get() );
+            layerOpacity[k]  = osg::clampBetween( layers[k].second, 0.0f, 1.0f );
+        }
+
+        // one read pointer per layer, stepped along each row with the output.
+        std::vector<const unsigned char*> src( layers.size() );
+
+        for( int t=0; t<output->t(); ++t )
+        {
+            unsigned char* out = output->data(0, t);
+            for( unsigned k=1; k<layers.size(); ++k )
+                src[k] = layers[k].first->data(0, t);
+
+            for( int s=0; s<output->s(); ++s, out += outChannels )
+            {
+                float r = out[0] * toFloat;
+                float g = out[1] * toFloat;
+                float b = out[2] * toFloat;
+                float a = outChannels == 4 ? out[3] * toFloat : 1.0f;
+
+                for( unsigned k=1; k<layers.size(); ++k )
+                {
+                    const unsigned       n = layerChannels[k];
+                    const unsigned char* p = src[k];
+
+                    float sa = n == 4 ? layerOpacity[k] * p[3] * toFloat : layerOpacity[k];
+                    float da = n == 4 ? a : 1.0f;
+
+                    r = r*(1.0f-sa) + p[0]*toFloat*sa;
+                    g = g*(1.0f-sa) + p[1]*toFloat*sa;
+                    b = b*(1.0f-sa) + p[2]*toFloat*sa;
+                    a = osg::maximum( sa, da );
+
+                    src[k] = p + n;
+                }
+
+                out[0] = (unsigned char)(r*255.0f + 0.5f);
+                out[1] = (unsigned char)(g*255.0f + 0.5f);
+                out[2] = (unsigned char)(b*255.0f + 0.5f);
+                if ( outChannels == 4 )
+                    out[3] = (unsigned char)(a*255.0f + 0.5f);
+            }
+        }
+    }
 }
 
 //-----------------------------------------------------------------------
@@ -132,6 +229,12 @@ _options    ( options ),
 _initialized( false ),
 _dynamic    ( false )
 {
+    // the converting copy only keeps what's in the Config, so take the components
+    // (including any TileSource instances) straight from composite options.
+    const CompositeTileSourceOptions* compositeOptions = dynamic_cast<const CompositeTileSourceOptions*>( &options );
+    if ( compositeOptions )
+        _options = *compositeOptions;
+
     for(CompositeTileSourceOptions::ComponentVector::iterator i = _options._components.begin(); 
         i != _options._components.end(); )
 
@@ -167,97 +270,99 @@ osg::Image*
 CompositeTileSource::createImage(const TileKey&        key,
                                  ProgressCallback*     progress )
 {
-    ImageMixVector images;
-    images.reserve( _options._components.size() );
+    // figure out which components can contribute to this tile:
+    std::vector<unsigned> candidates;
+    candidates.reserve( _info.size() );
 
-    for(CompositeTileSourceOptions::ComponentVector::const_iterator i = _options._components.begin();
-        i != _options._components.end();
-        ++i )
+    for( unsigned c=0; c<_info.size(); ++c )
     {
-        if ( progress && progress->isCanceled() )
-            return 0L;
+        TileSource* source = _options._components[c]._tileSourceInstance->get();
+        if ( !source )
+            continue;
 
-        TileSource* source = i->_tileSourceInstance->get();
-        if ( source )
+        const ComponentInfo& info = _info[c];
+
+        // check that this source is within the level bounds:
+        if (info._minLevel > (int)key.getLevelOfDetail() ||
+            info._maxLevel < (int)key.getLevelOfDetail() )
         {
+            continue;
+        }
 
-            //TODO:  This duplicates code in ImageLayer::isKeyValid.  Maybe should move that to TileSource::isKeyValid instead
-            int minLevel = 0;
-            int maxLevel = INT_MAX;
-            if (i->_imageLayerOptions->minLevel().isSet())
-            {
-                minLevel = i->_imageLayerOptions->minLevel().value();
-            }
-            else if (i->_imageLayerOptions->minLevelResolution().isSet())
-            {
-                minLevel = source->getProfile()->getLevelOfDetailForHorizResolution( i->_imageLayerOptions->minLevelResolution().value(), source->getPixelsPerTile());            
-            }
+        if ( source->getBlacklist()->contains( key.getTileId() ) )
+        {
+            OE_DEBUG << LC << "Tile " << key.str() << " is blacklisted, not checking" << std::endl;
+        }
+        //Only try to get data if the source actually has data
+        else if ( !source->hasData( key ) )
+        {
+            OE_DEBUG << LC << "Source has no data at " << key.str() << std::endl;
+        }
+        else
+        {
+            candidates.push_back( c );
+        }
+    }
 
-            if (i->_imageLayerOptions->maxLevel().isSet())
-            {
-                maxLevel = i->_imageLayerOptions->maxLevel().value();
-            }
-            else if (i->_imageLayerOptions->maxLevelResolution().isSet())
-            {
-                maxLevel = source->getProfile()->getLevelOfDetailForHorizResolution( i->_imageLayerOptions->maxLevelResolution().value(), source->getPixelsPerTile());            
-            }
+    if ( candidates.size() == 0 || (progress && progress->isCanceled()) )
+        return 0L;
 
-            // check that this source is within the level bounds:
-            if (minLevel > key.getLevelOfDetail() ||
-                maxLevel < key.getLevelOfDetail() )
-            {
-                continue;
-            }
+    // fetch the candidates; in parallel if there are several of them. The first
+    // one runs right here, the rest in this source's own pool.
+    std::vector< osg::ref_ptr<osg::Image> > fetched( candidates.size() );
 
-            if ( !source->getBlacklist()->contains( key.getTileId() ) )
-            {
-                //Only try to get data if the source actually has data
-                if ( source->hasData( key ) )
-                {
-                    osg::ref_ptr< ImageLayerPreCacheOperation > preCacheOp;
-                    if ( i->_imageLayerOptions.isSet() )
-                    {
-                        preCacheOp = new ImageLayerPreCacheOperation();
-                        preCacheOp->_processor.init( i->_imageLayerOptions.value(), _dbOptions.get(), true );                        
-                    }
-
-                    ImageOpacityPair imagePair(
-                        source->createImage( key, preCacheOp.get(), progress ),
-                        1.0f );
-
-                    //If the image is not valid and the progress was not cancelled, blacklist
-                    if (!imagePair.first.valid() && (!progress || !progress->isCanceled()))
-                    {
-                        //Add the tile to the blacklist
-                        OE_DEBUG << LC << "Adding tile " << key.str() << " to the blacklist" << std::endl;
-                        source->getBlacklist()->add( key.getTileId() );
-                    }
-
-                    if ( imagePair.first.valid() )
-                    {
-                        // check for opacity:
-                        imagePair.second = i->_imageLayerOptions.isSet() ? i->_imageLayerOptions->opacity().value() : 1.0f;
-
-                        images.push_back( imagePair );
-                    }
-                }
-                else
-                {
-                    OE_DEBUG << LC << "Source has no data at " << key.str() << std::endl;
-                }
-            }
-            else
-            {
-                OE_DEBUG << LC << "Tile " << key.str() << " is blacklisted, not checking" << std::endl;
-            }
+    if ( candidates.size() == 1 || !_fetchService.valid() )
+    {
+        for( unsigned j=0; j<candidates.size(); ++j )
+        {
+            unsigned c = candidates[j];
+            fetched[j] = _options._components[c]._tileSourceInstance->get()->createImage( key, _info[c]._preCacheOp.get(), progress );
         }
     }
+    else
+    {
+        Threading::MultiEvent semaphore( candidates.size()-1 );
+        std::vector< osg::ref_ptr< ParallelTask<FetchComponentImage> > > jobs( candidates.size() );
+
+        for( unsigned j=1; j<candidates.size(); ++j )
+        {
+            unsigned c = candidates[j];
+            jobs[j] = new ParallelTask<FetchComponentImage>( &semaphore );
+            jobs[j]->init( _options._components[c]._tileSourceInstance->get(), key, _info[c]._preCacheOp.get(), progress );
+            _fetchService->add( jobs[j].get() );
+        }
+
+        unsigned c = candidates[0];
+        fetched[0] = _options._components[c]._tileSourceInstance->get()->createImage( key, _info[c]._preCacheOp.get(), progress );
+
+        semaphore.wait();
+
+        for( unsigned j=1; j<jobs.size(); ++j )
+            fetched[j] = jobs[j]->_result.get();
+    }
 
     if ( progress && progress->isCanceled() )
-    {
         return 0L;
+
+    ImageMixVector images;
+    images.reserve( candidates.size() );
+
+    for( unsigned j=0; j<candidates.size(); ++j )
+    {
+        unsigned c = candidates[j];
+        if ( fetched[j].valid() )
+        {
+            images.push_back( ImageOpacityPair(fetched[j].get(), _info[c]._opacity) );
+        }
+        else
+        {
+            //Add the tile to the blacklist
+            OE_DEBUG << LC << "Adding tile " << key.str() << " to the blacklist" << std::endl;
+            _options._components[c]._tileSourceInstance->get()->getBlacklist()->add( key.getTileId() );
+        }
     }
-    else if ( images.size() == 0 )
+
+    if ( images.size() == 0 )
     {
         return 0L;
     }
@@ -265,19 +370,40 @@ CompositeTileSource::createImage(const TileKey&        key,
     {
         return images[0].first.release();
     }
+
+    // layers that can't be mixed into the bottom one (mismatched sizes) are skipped,
+    // same as ImageUtils::mix does.
+    const osg::Image* base = images[0].first.get();
+    ImageMixVector layers;
+    layers.reserve( images.size() );
+    layers.push_back( images[0] );
+    bool allUByte = getUByteChannels( base ) > 0;
+
+    for( unsigned i=1; i<images.size(); ++i )
+    {
+        const osg::Image* image = images[i].first.get();
+        if ( image->s() == base->s() && image->t() == base->t() )
+        {
+            layers.push_back( images[i] );
+            allUByte = allUByte && getUByteChannels( image ) > 0;
+        }
+    }
+
+    osg::Image* result = new osg::Image( *base );
+
+    if ( allUByte )
+    {
+        blendUByte( layers, result );
+    }
     else
     {
-        osg::Image* result = new osg::Image( *images[0].first.get() );
-        for( unsigned int i=1; i<images.size(); ++i )
+        for( unsigned int i=1; i<layers.size(); ++i )
         {
-            ImageOpacityPair& pair = images[i];
-            if ( pair.first.valid() )
-            {
-                ImageUtils::mix( result, pair.first.get(), pair.second );
-            }
+            ImageUtils::mix( result, layers[i].first.get(), layers[i].second );
         }
-        return result;
     }
+
+    return result;
 }
 
 void
@@ -287,6 +413,12 @@ CompositeTileSource::initialize(const osgDB::Options* dbOptions,
     _dbOptions = dbOptions;
     osg::ref_ptr<const Profile> profile = overrideProfile;
 
+    ComponentInfo defaultInfo;
+    defaultInfo._minLevel = 0;
+    defaultInfo._maxLevel = INT_MAX;
+    defaultInfo._opacity  = 1.0f;
+    _info.assign( _options._components.size(), defaultInfo );
+
     for(CompositeTileSourceOptions::ComponentVector::iterator i = _options._components.begin();
         i != _options._components.end();
         ++i)
@@ -317,6 +449,34 @@ CompositeTileSource::initialize(const osgDB::Options* dbOptions,
             
             _dynamic = _dynamic || source->isDynamic();
 
+            // resolve the component's level range and image processing up front
+            // so createImage doesn't redo it for every tile.
+            //TODO:  This duplicates code in ImageLayer::isKeyValid.  Maybe should move that to TileSource::isKeyValid instead
+            ComponentInfo info = defaultInfo;
+
+            if ( i->_imageLayerOptions.isSet() )
+            {
+                const ImageLayerOptions& layerOpt = i->_imageLayerOptions.value();
+
+                if ( layerOpt.minLevel().isSet() )
+                    info._minLevel = layerOpt.minLevel().value();
+                else if ( layerOpt.minLevelResolution().isSet() )
+                    info._minLevel = source->getProfile()->getLevelOfDetailForHorizResolution( layerOpt.minLevelResolution().value(), source->getPixelsPerTile() );
+
+                if ( layerOpt.maxLevel().isSet() )
+                    info._maxLevel = layerOpt.maxLevel().value();
+                else if ( layerOpt.maxLevelResolution().isSet() )
+                    info._maxLevel = source->getProfile()->getLevelOfDetailForHorizResolution( layerOpt.maxLevelResolution().value(), source->getPixelsPerTile() );
+
+                info._opacity = layerOpt.opacity().value();
+
+                ImageLayerPreCacheOperation* preCacheOp = new ImageLayerPreCacheOperation();
+                preCacheOp->_processor.init( layerOpt, _dbOptions.get(), true );
+                info._preCacheOp = preCacheOp;
+            }
+
+            _info[i - _options._components.begin()] = info;
+
             // gather extents
             const DataExtentList& extents = source->getDataExtents();
             for( DataExtentList::const_iterator j = extents.begin(); j != extents.end(); ++j )
@@ -328,6 +488,11 @@ CompositeTileSource::initialize(const osgDB::Options* dbOptions,
 
     setProfile( profile.get() );
 
+    if ( _options._components.size() > 1 && !_fetchService.valid() )
+    {
+        _fetchService = new TaskService( "CompositeTileSource", (int)_options._components.size()-1 );
+    }
+
     _initialized = true;
 }
 
@@ -22,12 +22,37 @@
 #include <osgDB/ReaderWriter>
 #include <osgDB/FileNameUtils>
 #include <osgDB/Registry>
+#include <algorithm>
 #include <sstream>
 #include <fstream>
 #include <iomanip>
 
 using namespace osgEarth;
 
+// Configs with at least this many children keep a sorted key index.
+#define INDEX_THRESHOLD 16
+
+namespace
+{
+    // orders child positions by key, then by position, so equal keys keep document order.
+    struct KeyLess
+    {
+        const ConfigSet& _children;
+        KeyLess( const ConfigSet& children ) : _children(children) { }
+
+        bool operator()( unsigned lhs, unsigned rhs ) const {
+            int c = _children[lhs].key().compare( _children[rhs].key() );
+            return c < 0 || (c == 0 && lhs < rhs);
+        }
+        bool operator()( unsigned lhs, const std::string& rhs ) const {
+            return _children[lhs].key() < rhs;
+        }
+        bool operator()( const std::string& lhs, unsigned rhs ) const {
+            return lhs < _children[rhs].key();
+        }
+    };
+}
+
 void
 Config::setReferrer( const std::string& referrer )
 {
@@ -41,19 +66,146 @@ Config::setReferrer( const std::string& referrer )
 bool
 Config::fromXML( std::istream& in )
 {
-    osg::ref_ptr<XmlDocument> xml = XmlDocument::load( in );
-    if ( xml.valid() )
-        *this = xml->getConfig();
-    return xml.valid();
+    Config result;
+    if ( !XmlDocument::loadConfig( in, result ) )
+        return false;
+    swap( result );
+    return true;
 }
 
-Config
-Config::child( const std::string& childName ) const
+void
+Config::swap( Config& rhs )
+{
+    _key.swap( rhs._key );
+    _defaultValue.swap( rhs._defaultValue );
+    _children.swap( rhs._children );
+    _referrer.swap( rhs._referrer );
+    _refMap.swap( rhs._refMap );
+    _index.swap( rhs._index );
+    std::swap( _indexable, rhs._indexable );
+}
+
+Config&
+Config::appendChild()
+{
+    // grow by hand: a plain push_back would deep-copy every existing child
+    // (and its subtree) when the vector reallocates.
+    if ( _children.size() == _children.capacity() )
+    {
+        ConfigSet larger;
+        larger.reserve( std::max( _children.size()*2, (ConfigSet::size_type)4 ) );
+        larger.resize( _children.size() );
+        for( unsigned i = 0; i < _children.size(); ++i )
+            larger[i].swap( _children[i] );
+        _children.swap( larger );
+    }
+    _children.push_back( Config() );
+    return _children.back();
+}
+
+Config&
+Config::addChild( const std::string& key )
+{
+    Config& child = appendChild();
+    child._key = key;
+    child.setReferrer( _referrer );
+    indexLastChild();
+    return child;
+}
+
+void
+Config::indexLastChild()
+{
+    if ( !_indexable )
+        return;
+
+    if ( !_index.empty() )
+    {
+        unsigned pos = _children.size()-1;
+        _index.insert( std::upper_bound(_index.begin(), _index.end(), pos, KeyLess(_children)), pos );
+    }
+    else if ( _children.size() >= INDEX_THRESHOLD )
+    {
+        rebuildIndex();
+    }
+}
+
+void
+Config::rebuildIndex()
+{
+    _index.clear();
+    if ( _indexable && _children.size() >= INDEX_THRESHOLD )
+    {
+        _index.resize( _children.size() );
+        for( unsigned i = 0; i < _index.size(); ++i )
+            _index[i] = i;
+        std::sort( _index.begin(), _index.end(), KeyLess(_children) );
+    }
+}
+
+const Config*
+Config::child_ptr( const std::string& childName ) const
+{
+    if ( !_index.empty() )
+    {
+        std::vector<unsigned>::const_iterator i = std::lower_bound( _index.begin(), _index.end(), childName, KeyLess(_children) );
+        if ( i != _index.end() && _children[*i].key() == childName )
+            return &_children[*i];
+        return 0L;
+    }
+
+    for( ConfigSet::const_iterator i = _children.begin(); i != _children.end(); ++i ) {
+        if ( i->key() == childName )
+            return &(*i);
+    }
+    return 0L;
+}
+
+void
+Config::children( const std::string& childName, std::vector<const Config*>& output ) const
 {
-    for( ConfigSet::const_iterator i = _children.begin(); i != _children.end(); i++ ) {
+    if ( !_index.empty() )
+    {
+        std::pair<std::vector<unsigned>::const_iterator, std::vector<unsigned>::const_iterator> range =
+            std::equal_range( _index.begin(), _index.end(), childName, KeyLess(_children) );
+        for( std::vector<unsigned>::const_iterator i = range.first; i != range.second; ++i )
+            output.push_back( &_children[*i] );
+        return;
+    }
+
+    for( ConfigSet::const_iterator i = _children.begin(); i != _children.end(); ++i ) {
         if ( i->key() == childName )
-            return *i;
+            output.push_back( &(*i) );
     }
+}
+
+void
+Config::remove( const std::string& childName )
+{
+    if ( !child_ptr(childName) )
+        return;
+
+    // compact in place, swapping rather than copying the survivors.
+    unsigned out = 0;
+    for( unsigned in = 0; in < _children.size(); ++in )
+    {
+        if ( _children[in].key() != childName )
+        {
+            if ( out != in )
+                _children[out].swap( _children[in] );
+            ++out;
+        }
+    }
+    _children.erase( _children.begin() + out, _children.end() );
+    rebuildIndex();
+}
+
+Config
+Config::child( const std::string& childName ) const
+{
+    const Config* c = child_ptr( childName );
+    if ( c )
+        return *c;
 
     Config emptyConf;
     emptyConf.setReferrer( _referrer );
@@ -64,8 +216,12 @@ Config*
 Config::mutable_child( const std::string& childName )
 {
     for( ConfigSet::iterator i = _children.begin(); i != _children.end(); i++ ) {
-        if ( i->key() == childName )
+        if ( i->key() == childName ) {
+            // the caller may rename it.
+            _indexable = false;
+            _index.clear();
             return &(*i);
+        }
     }
 
     return 0L;
@@ -74,8 +230,9 @@ Config::mutable_child( const std::string& childName )
 void
 Config::merge( const Config& rhs ) 
 {
-    for( ConfigSet::const_iterator c = rhs._children.begin(); c != rhs._children.end(); ++c )
-        add( *c );
+    // by position, since rhs may be this Config
+    for( unsigned i = 0, n = rhs._children.size(); i < n; ++i )
+        add( rhs._children[i] );
 }
 
 const Config*
@@ -104,8 +261,12 @@ Config::find( const std::string& key, bool checkMe )
         return this;
 
     for( ConfigSet::iterator c = _children.begin(); c != _children.end(); ++c )
-        if ( key == c->key() )
+        if ( key == c->key() ) {
+            // the caller may rename it.
+            _indexable = false;
+            _index.clear();
             return &(*c);
+        }
 
     for( ConfigSet::iterator c = _children.begin(); c != _children.end(); ++c )
     {
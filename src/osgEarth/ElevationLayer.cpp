@@ -228,6 +228,7 @@ ElevationLayer::createHeightFieldFromTileSource(const TileKey&    key,
         if ( !result && (!progress || !progress->isCanceled()))
         {
             source->getBlacklist()->add( key.getTileId() );
+            storeBlacklistIfDue();
         }
     }
 
@@ -1561,15 +1561,16 @@ GeoHeightField::createSubSample( const GeoExtent& destEx, ElevationInterpolation
     double xstep = div/double(w-1);
     double ystep = div/double(h-1);
 
+    // input pixel coordinates of each output column and row:
+    std::vector<double> cols( w ), rows( h );
+
     for( x = x0, col = 0; col < w; x += xstep, col++ )
-    {
-        for( y = y0, row = 0; row < h; y += ystep, row++ )
-        {
-            float height = HeightFieldUtils::getHeightAtNormalizedLocation(
-                _heightField.get(), x, y, interpolation );
-            dest->setHeight( col, row, height );
-        }
-    }
+        cols[col] = x * (double)(w-1);
+
+    for( y = y0, row = 0; row < h; y += ystep, row++ )
+        rows[row] = y * (double)(h-1);
+
+    HeightFieldUtils::resample( _heightField.get(), cols, rows, dest, interpolation );
 
 #if 0
     for( x = destEx.xMin(), col=0; col < w; x += dx, col++ )
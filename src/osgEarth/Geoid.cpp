@@ -19,6 +19,7 @@
 
 #include <osgEarth/Geoid>
 #include <osgEarth/HeightFieldUtils>
+#include <algorithm>
 
 #define LC "[Geoid] "
 
@@ -91,6 +92,59 @@ Geoid::getHeight(double lat_deg, double lon_deg, const ElevationInterpolation& i
     return result;
 }
 
+void
+Geoid::getHeights(double                        lat_min,
+                  double                        lon_min,
+                  double                        lat_interval,
+                  double                        lon_interval,
+                  osg::HeightField*             out_hf,
+                  const ElevationInterpolation& interp ) const
+{
+    osg::HeightField::HeightList& heights = out_hf->getHeightList();
+
+    if ( !_valid )
+    {
+        std::fill( heights.begin(), heights.end(), 0.0f );
+        return;
+    }
+
+    unsigned numCols = out_hf->getNumColumns();
+    unsigned numRows = out_hf->getNumRows();
+    double   maxCol  = (double)(_hf->getNumColumns()-1);
+    double   maxRow  = (double)(_hf->getNumRows()-1);
+
+    // geoid pixel coordinates of each lattice column/row (same mapping as getHeight):
+    std::vector<double> cols( numCols ), rows( numRows );
+    std::vector<bool>   colIn( numCols ), rowIn( numRows );
+
+    for( unsigned c=0; c<numCols; ++c )
+    {
+        double lon = lon_min + lon_interval*double(c);
+        colIn[c] = lon >= _bounds.xMin() && lon <= _bounds.xMax();
+        cols[c]  = osg::clampBetween( (lon-_bounds.xMin())/_bounds.width() * maxCol, 0.0, maxCol );
+    }
+
+    for( unsigned r=0; r<numRows; ++r )
+    {
+        double lat = lat_min + lat_interval*double(r);
+        rowIn[r] = lat >= _bounds.yMin() && lat <= _bounds.yMax();
+        rows[r]  = osg::clampBetween( (lat-_bounds.yMin())/_bounds.height() * maxRow, 0.0, maxRow );
+    }
+
+    HeightFieldUtils::resample( _hf.get(), cols, rows, out_hf, interp );
+
+    // zero out anything that fell outside the geoid:
+    for( unsigned r=0; r<numRows; ++r )
+    {
+        float* row = &heights[r*numCols];
+        for( unsigned c=0; c<numCols; ++c )
+        {
+            if ( !rowIn[r] || !colIn[c] )
+                row[c] = 0.0f;
+        }
+    }
+}
+
 bool
 Geoid::isEquivalentTo( const Geoid& rhs ) const
 {
@@ -23,7 +23,10 @@
 #include <osgDB/Registry>
 #include <osgDB/FileNameUtils>
 #include <osg/Notify>
+#include <osg/Math>
+#include <OpenThreads/Thread>
 #include <string.h>
+#include <stdlib.h>
 #include <sstream>
 #include <fstream>
 #include <iterator>
@@ -265,6 +268,17 @@ HTTPResponse::getHeadersAsConfig() const
 
 static optional<ProxySettings>     _proxySettings;
 static std::string                 _userAgent = USER_AGENT;
+static unsigned                    _maxConnectionsPerHost = 6;
+static unsigned                    _maxConnections = 32;
+
+static bool
+initAsyncEnabled()
+{
+    const char* env = getenv("OSGEARTH_HTTP_ASYNC");
+    return !env || std::string(env) != "0";
+}
+
+static bool                        _asyncEnabled = initAsyncEnabled();
 
 
 HTTPClient&
@@ -281,10 +295,19 @@ HTTPClient::getClient()
 
 HTTPClient::HTTPClient()
 {
-    _previousHttpAuthentication = 0;
     _curl_handle = curl_easy_init();
+    configureHandle( _curl_handle );
+}
 
+HTTPClient::~HTTPClient()
+{
+    if (_curl_handle) curl_easy_cleanup( _curl_handle );
+    _curl_handle = 0;
+}
 
+void
+HTTPClient::configureHandle( void* handle )
+{
 	//Get the user agent
 	std::string userAgent = _userAgent;
 	const char* userAgentEnv = getenv("OSGEARTH_USERAGENT");
@@ -295,19 +318,16 @@ HTTPClient::HTTPClient()
 
 	OE_DEBUG << LC << "HTTPClient setting userAgent=" << userAgent << std::endl;
 
-    curl_easy_setopt( _curl_handle, CURLOPT_USERAGENT, userAgent.c_str() );
-    curl_easy_setopt( _curl_handle, CURLOPT_WRITEFUNCTION, osgEarth::StreamObjectReadCallback );
-    curl_easy_setopt( _curl_handle, CURLOPT_FOLLOWLOCATION, (void*)1 );
-    curl_easy_setopt( _curl_handle, CURLOPT_MAXREDIRS, (void*)5 );
-    curl_easy_setopt( _curl_handle, CURLOPT_PROGRESSFUNCTION, &CurlProgressCallback);
-    curl_easy_setopt( _curl_handle, CURLOPT_NOPROGRESS, (void*)0 ); //FALSE);
-    //curl_easy_setopt( _curl_handle, CURLOPT_TIMEOUT, 1L );
-}
+    curl_easy_setopt( handle, CURLOPT_USERAGENT, userAgent.c_str() );
+    curl_easy_setopt( handle, CURLOPT_WRITEFUNCTION, osgEarth::StreamObjectReadCallback );
+    curl_easy_setopt( handle, CURLOPT_FOLLOWLOCATION, (void*)1 );
+    curl_easy_setopt( handle, CURLOPT_MAXREDIRS, (void*)5 );
+    curl_easy_setopt( handle, CURLOPT_PROGRESSFUNCTION, &CurlProgressCallback);
+    curl_easy_setopt( handle, CURLOPT_NOPROGRESS, (void*)0 ); //FALSE);
+    //curl_easy_setopt( handle, CURLOPT_TIMEOUT, 1L );
 
-HTTPClient::~HTTPClient()
-{
-    if (_curl_handle) curl_easy_cleanup( _curl_handle );
-    _curl_handle = 0;
+    //Disable peer certificate verification to allow us to access in https servers where the peer certificate cannot be verified.
+    curl_easy_setopt( handle, CURLOPT_SSL_VERIFYPEER, (void*)0 );
 }
 
 void
@@ -327,7 +347,19 @@ void  HTTPClient::setUserAgent(const std::string& userAgent)
 }
 
 void
-HTTPClient::readOptions(const osgDB::Options* options, std::string& proxy_host, std::string& proxy_port) const
+HTTPClient::setAsyncEnabled( bool value )
+{
+    _asyncEnabled = value;
+}
+
+bool
+HTTPClient::isAsyncEnabled()
+{
+    return _asyncEnabled;
+}
+
+void
+HTTPClient::readOptions(const osgDB::Options* options, std::string& proxy_host, std::string& proxy_port)
 {
     // try to set proxy host/port by reading the CURL proxy options
     if ( options )
@@ -375,11 +407,10 @@ tokenize_str(const std::string & str, const std::string & delims=", \t")
   return tokens;
 }
 
-
 void
 HTTPClient::decodeMultipartStream(const std::string&   boundary,
                                   HTTPResponse::Part*  input,
-                                  HTTPResponse::Parts& output) const
+                                  HTTPResponse::Parts& output)
 {
     std::string bstr = std::string("--") + boundary;
     std::string line;
@@ -516,11 +547,9 @@ HTTPClient::download(const std::string& uri,
     return getClient().doDownload( uri, localPath );
 }
 
-HTTPResponse
-HTTPClient::doGet( const HTTPRequest& request, const osgDB::Options* options, ProgressCallback* callback) const
+std::string
+HTTPClient::configureRequest( void* handle, const std::string& url, const osgDB::Options* options )
 {
-    OE_DEBUG << LC << "doGet " << request.getURL() << std::endl;
-
     const osgDB::AuthenticationMap* authenticationMap = (options && options->getAuthenticationMap()) ? 
             options->getAuthenticationMap() :
             osgDB::Registry::instance()->getAuthenticationMap();
@@ -530,9 +559,6 @@ HTTPClient::doGet( const HTTPRequest& request, const osgDB::Options* options, Pr
 
 	std::string proxy_auth;
 
-    //TODO: don't do all this proxy setup on every GET. Just do it once per client, or only when 
-    // the proxy information changes.
-
 	//Try to get the proxy settings from the global settings
 	if (_proxySettings.isSet())
 	{
@@ -582,89 +608,59 @@ HTTPClient::doGet( const HTTPRequest& request, const osgDB::Options* options, Pr
         proxy_addr = bufStr;
     
         OE_DEBUG << LC << "setting proxy: " << proxy_addr << std::endl;
-		//curl_easy_setopt( _curl_handle, CURLOPT_HTTPPROXYTUNNEL, 1 ); 
-        curl_easy_setopt( _curl_handle, CURLOPT_PROXY, proxy_addr.c_str() );
+		//curl_easy_setopt( handle, CURLOPT_HTTPPROXYTUNNEL, 1 ); 
+        curl_easy_setopt( handle, CURLOPT_PROXY, proxy_addr.c_str() );
 
 		//Setup the proxy authentication if setup
 		if (!proxy_auth.empty())
 		{
 			OE_DEBUG << LC << "Setting up proxy authentication " << proxy_auth << std::endl;
-			curl_easy_setopt( _curl_handle, CURLOPT_PROXYUSERPWD, proxy_auth.c_str());
+			curl_easy_setopt( handle, CURLOPT_PROXYUSERPWD, proxy_auth.c_str());
 		}
     }
 
     const osgDB::AuthenticationDetails* details = authenticationMap ?
-        authenticationMap->getAuthenticationDetails(request.getURL()) :
+        authenticationMap->getAuthenticationDetails(url) :
         0;
 
-        if (details)
-        {
-            const std::string colon(":");
-            std::string password(details->username + colon + details->password);
-            curl_easy_setopt(_curl_handle, CURLOPT_USERPWD, password.c_str());
-            const_cast<HTTPClient*>(this)->_previousPassword = password;
+    if (details)
+    {
+        const std::string colon(":");
+        std::string password(details->username + colon + details->password);
+        curl_easy_setopt(handle, CURLOPT_USERPWD, password.c_str());
 
-            // use for https.
-            // curl_easy_setopt(_curl, CURLOPT_KEYPASSWD, password.c_str());
+        // use for https.
+        // curl_easy_setopt(_curl, CURLOPT_KEYPASSWD, password.c_str());
 
 #if LIBCURL_VERSION_NUM >= 0x070a07
-            if (details->httpAuthentication != _previousHttpAuthentication)
-            { 
-                curl_easy_setopt(_curl_handle, CURLOPT_HTTPAUTH, details->httpAuthentication); 
-                const_cast<HTTPClient*>(this)->_previousHttpAuthentication = details->httpAuthentication;
-            }
+        curl_easy_setopt(handle, CURLOPT_HTTPAUTH, details->httpAuthentication); 
 #endif
     }
     else
     {
-        if (!_previousPassword.empty())
-        {
-            curl_easy_setopt(_curl_handle, CURLOPT_USERPWD, 0);
-            const_cast<HTTPClient*>(this)->_previousPassword.clear();
-        }
+        // handles are reused, so clear out any previous credentials.
+        curl_easy_setopt(handle, CURLOPT_USERPWD, (void*)0);
 
 #if LIBCURL_VERSION_NUM >= 0x070a07
-        // need to reset if previously set.
-        if (_previousHttpAuthentication!=0)
-        {
-            curl_easy_setopt(_curl_handle, CURLOPT_HTTPAUTH, 0); 
-            const_cast<HTTPClient*>(this)->_previousHttpAuthentication = 0;
-        }
+        curl_easy_setopt(handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC); 
 #endif
     }
 
-    osg::ref_ptr<HTTPResponse::Part> part = new HTTPResponse::Part();
-    StreamObject sp( &part->_stream );
-
-    //Take a temporary ref to the callback
-    osg::ref_ptr<ProgressCallback> progressCallback = callback;
-    curl_easy_setopt( _curl_handle, CURLOPT_URL, request.getURL().c_str() );
-    if (callback)
-    {
-        curl_easy_setopt(_curl_handle, CURLOPT_PROGRESSDATA, progressCallback.get());
-    }
-
-    char errorBuf[CURL_ERROR_SIZE];
-    errorBuf[0] = 0;
-    curl_easy_setopt( _curl_handle, CURLOPT_ERRORBUFFER, (void*)errorBuf );
-
-    curl_easy_setopt( _curl_handle, CURLOPT_WRITEDATA, (void*)&sp);
-    CURLcode res = curl_easy_perform( _curl_handle );
-    curl_easy_setopt( _curl_handle, CURLOPT_WRITEDATA, (void*)0 );
-    curl_easy_setopt( _curl_handle, CURLOPT_PROGRESSDATA, (void*)0);
-
-    //Disable peer certificate verification to allow us to access in https servers where the peer certificate cannot be verified.
-    curl_easy_setopt( _curl_handle, CURLOPT_SSL_VERIFYPEER, (void*)0 );
+    return proxy_addr;
+}
 
+HTTPResponse
+HTTPClient::buildResponse( void* handle, int res, HTTPResponse::Part* part, const std::string& url, bool proxied )
+{
     long response_code = 0L;
-	if (!proxy_addr.empty())
+	if (proxied)
 	{
 		long connect_code = 0L;
-        curl_easy_getinfo( _curl_handle, CURLINFO_HTTP_CONNECTCODE, &connect_code );
+        curl_easy_getinfo( handle, CURLINFO_HTTP_CONNECTCODE, &connect_code );
 		OE_DEBUG << LC << "proxy connect code " << connect_code << std::endl;
 	}
 	
-    curl_easy_getinfo( _curl_handle, CURLINFO_RESPONSE_CODE, &response_code );     
+    curl_easy_getinfo( handle, CURLINFO_RESPONSE_CODE, &response_code );     
 
 	//OE_DEBUG << LC << "got response, code = " << response_code << std::endl;
 
@@ -674,12 +670,12 @@ HTTPClient::doGet( const HTTPRequest& request, const osgDB::Options* options, Pr
     {
         // check for multipart content:
         char* content_type_cp;
-        curl_easy_getinfo( _curl_handle, CURLINFO_CONTENT_TYPE, &content_type_cp );
+        curl_easy_getinfo( handle, CURLINFO_CONTENT_TYPE, &content_type_cp );
         if ( content_type_cp == NULL )
         {
             OE_NOTICE << LC
                 << "NULL Content-Type (protocol violation) " 
-                << "URL=" << request.getURL() << std::endl;
+                << "URL=" << url << std::endl;
             return NULL;
         }
 
@@ -697,14 +693,14 @@ HTTPClient::doGet( const HTTPRequest& request, const osgDB::Options* options, Pr
             OE_DEBUG << LC << "detected multipart data; decoding..." << std::endl;
 
             //TODO: parse out the "wcs" -- this is WCS-specific
-            decodeMultipartStream( "wcs", part.get(), response._parts );
+            decodeMultipartStream( "wcs", part, response._parts );
         }
         else
         {
             // store headers that we care about
             part->_headers[IOMetadata::CONTENT_TYPE] = content_type;
 
-            response._parts.push_back( part.get() );
+            response._parts.push_back( part );
         }
     }
     else if (res == CURLE_ABORTED_BY_CALLBACK || res == CURLE_OPERATION_TIMEDOUT)
@@ -716,7 +712,7 @@ HTTPClient::doGet( const HTTPRequest& request, const osgDB::Options* options, Pr
     // Store the mime-type, if any. (Note: CURL manages the buffer returned by
     // this call.)
     char* ctbuf = NULL;
-    if ( curl_easy_getinfo(_curl_handle, CURLINFO_CONTENT_TYPE, &ctbuf) == 0 && ctbuf )
+    if ( curl_easy_getinfo(handle, CURLINFO_CONTENT_TYPE, &ctbuf) == 0 && ctbuf )
     {
         response._mimeType = ctbuf;
     }
@@ -724,6 +720,584 @@ HTTPClient::doGet( const HTTPRequest& request, const osgDB::Options* options, Pr
     return response;
 }
 
+/****************************************************************************/
+
+HTTPFuture::HTTPFuture() :
+_canceled( false )
+{
+    //nop
+}
+
+const HTTPResponse&
+HTTPFuture::getResponse() const
+{
+    while( !_ready.isSet() )
+        _ready.wait();
+    return _response;
+}
+
+bool
+HTTPFuture::wait( ProgressCallback* progress ) const
+{
+    // the I/O thread only notices a cancelled callback once the transfer is
+    // running, and a queued one can wait a long time behind a busy host; so
+    // wake up now and then to check it ourselves.
+    while( !_ready.isSet() )
+    {
+        if ( !progress )
+            _ready.wait();
+        else if ( progress->isCanceled() )
+            return false;
+        else
+            _ready.wait( 50ul );
+    }
+    return true;
+}
+
+void
+HTTPFuture::setResponse( const HTTPResponse& response )
+{
+    _response = response;
+    _ready.set();
+}
+
+/****************************************************************************/
+
+#undef  LC
+#define LC "[HTTPAsyncEngine] "
+
+namespace osgEarth
+{
+    /**
+     * Runs HTTP transfers on a single I/O thread using a curl "multi" handle.
+     * Connections live in the multi handle's cache, so they are kept alive and
+     * shared by every request (and multiplexed over HTTP/2 where supported).
+     */
+    class HTTPAsyncEngine : public OpenThreads::Thread
+    {
+    public:
+        struct Transfer : public osg::Referenced
+        {
+            Transfer( const HTTPRequest& request ) :
+                _request( request ),
+                _url    ( request.getURL() ),
+                _part   ( new HTTPResponse::Part() ),
+                _stream ( &_part->_stream ),
+                _proxied( false )
+            {
+                _errorBuf[0] = 0;
+            }
+
+            HTTPRequest                        _request;
+            std::string                        _url;
+            std::string                        _host;
+            osg::ref_ptr<const osgDB::Options> _options;
+            osg::ref_ptr<ProgressCallback>     _progress;
+            osg::ref_ptr<HTTPResponseCallback> _callback;
+            osg::ref_ptr<HTTPFuture>           _future;
+            int                                _priority;
+            unsigned                           _sequence;
+            osg::ref_ptr<HTTPResponse::Part>   _part;
+            StreamObject                       _stream;
+            bool                               _proxied;
+            char                               _errorBuf[CURL_ERROR_SIZE];
+        };
+
+        // orders the pending heap: highest priority first, then first-come first-served.
+        struct SortByPriority
+        {
+            bool operator()( const osg::ref_ptr<Transfer>& lhs, const osg::ref_ptr<Transfer>& rhs ) const
+            {
+                return
+                    lhs->_priority < rhs->_priority ? true :
+                    lhs->_priority > rhs->_priority ? false :
+                    lhs->_sequence > rhs->_sequence;
+            }
+        };
+
+        typedef std::vector< osg::ref_ptr<Transfer> > TransferVector;
+        typedef std::map< std::string, TransferVector > PendingMap; // one priority heap per host
+        typedef std::map< CURL*, osg::ref_ptr<Transfer> > ActiveMap;
+        typedef std::map< std::string, unsigned > HostCounts;
+
+    public:
+        /** The engine, started on first use. */
+        static HTTPAsyncEngine& instance();
+
+        /** The engine if it's been started, else NULL. */
+        static HTTPAsyncEngine* running();
+
+        HTTPAsyncEngine() :
+            _sequence         ( 0 ),
+            _dispatchNeeded   ( false ),
+            _maxPerHostApplied( 0 ),
+            _done             ( false )
+        {
+            _multi = curl_multi_init();
+
+#if LIBCURL_VERSION_NUM >= 0x072b00
+            curl_multi_setopt( _multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX );
+#endif
+            start();
+        }
+
+        ~HTTPAsyncEngine()
+        {
+            _done = true;
+            _wake.set();
+            join();
+
+            // anything still outstanding gets cancelled.
+            TransferVector leftovers;
+            for( ActiveMap::iterator i = _active.begin(); i != _active.end(); ++i )
+            {
+                curl_multi_remove_handle( _multi, i->first );
+                curl_easy_cleanup( i->first );
+                leftovers.push_back( i->second );
+            }
+            _active.clear();
+
+            {
+                Threading::ScopedMutexLock lock( _pendingMutex );
+                for( PendingMap::iterator i = _pending.begin(); i != _pending.end(); ++i )
+                    leftovers.insert( leftovers.end(), i->second.begin(), i->second.end() );
+                _pending.clear();
+            }
+
+            for( TransferVector::iterator i = leftovers.begin(); i != leftovers.end(); ++i )
+                cancel( i->get() );
+
+            for( std::vector<CURL*>::iterator i = _idleHandles.begin(); i != _idleHandles.end(); ++i )
+                curl_easy_cleanup( *i );
+
+            curl_multi_cleanup( _multi );
+        }
+
+        /** Queues a transfer and wakes up the I/O thread. */
+        void submit( Transfer* t )
+        {
+            t->_host = getHost( t->_url );
+            {
+                Threading::ScopedMutexLock lock( _pendingMutex );
+                t->_sequence = _sequence++;
+                TransferVector& heap = _pending[t->_host];
+                heap.push_back( t );
+                std::push_heap( heap.begin(), heap.end(), SortByPriority() );
+                _dispatchNeeded = true;
+            }
+            wake();
+        }
+
+        /** Asks the I/O thread to start whatever the (possibly changed) limits allow. */
+        void requestDispatch()
+        {
+            {
+                Threading::ScopedMutexLock lock( _pendingMutex );
+                _dispatchNeeded = true;
+            }
+            wake();
+        }
+
+        /** Whether the caller is running on the I/O thread */
+        bool isEngineThread() const
+        {
+            return OpenThreads::Thread::CurrentThread() == this;
+        }
+
+        void run()
+        {
+            while( !_done )
+            {
+                applyLimits();
+                dispatch();
+
+                if ( _active.empty() )
+                {
+                    _wake.waitAndReset();
+                    continue;
+                }
+
+                int running = 0;
+                curl_multi_perform( _multi, &running );
+                collect();
+
+                if ( running > 0 )
+                {
+#if LIBCURL_VERSION_NUM >= 0x074400
+                    // wake() interrupts the poll, so there's no need to spin.
+                    int numfds = 0;
+                    curl_multi_poll( _multi, 0L, 0, 1000, &numfds );
+#elif LIBCURL_VERSION_NUM >= 0x071c00
+                    // short timeout, so that newly queued requests are picked up promptly.
+                    int numfds = 0;
+                    curl_multi_wait( _multi, 0L, 0, 10, &numfds );
+#else
+                    OpenThreads::Thread::microSleep( 1000 );
+#endif
+                }
+            }
+        }
+
+    private:
+        void wake()
+        {
+            _wake.set();
+#if LIBCURL_VERSION_NUM >= 0x074400
+            curl_multi_wakeup( _multi );
+#endif
+        }
+
+        /** Pushes changed connection limits down to the multi handle. */
+        void applyLimits()
+        {
+#if LIBCURL_VERSION_NUM >= 0x071e00
+            unsigned maxPerHost = _maxConnectionsPerHost;
+            if ( maxPerHost != _maxPerHostApplied )
+            {
+                curl_multi_setopt( _multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)maxPerHost );
+                _maxPerHostApplied = maxPerHost;
+            }
+#endif
+        }
+
+        unsigned getActiveCount( const std::string& host ) const
+        {
+            HostCounts::const_iterator i = _hostCounts.find( host );
+            return i != _hostCounts.end() ? i->second : 0u;
+        }
+
+        static std::string getHost( const std::string& url )
+        {
+            std::string::size_type start = url.find( "://" );
+            start = start == std::string::npos ? 0 : start + 3;
+            std::string::size_type end = url.find( '/', start );
+            return url.substr( start, end == std::string::npos ? std::string::npos : end - start );
+        }
+
+        static int progressCallback( void* clientp, double dltotal, double dlnow, double ultotal, double ulnow )
+        {
+            Transfer* t = (Transfer*)clientp;
+            if ( t->_future->isCanceled() )
+                return 1;
+            return CurlProgressCallback( t->_progress.get(), dltotal, dlnow, ultotal, ulnow );
+        }
+
+        static bool isCanceled( const Transfer* t )
+        {
+            return t->_future->isCanceled() || (t->_progress.valid() && t->_progress->isCanceled());
+        }
+
+        /**
+         * Moves pending transfers into the multi handle, subject to the connection
+         * limits. Only does any work after something was queued, something finished
+         * or the limits changed; transfers for a busy host just stay in its heap.
+         */
+        void dispatch()
+        {
+            TransferVector toStart, toCancel;
+            {
+                Threading::ScopedMutexLock lock( _pendingMutex );
+
+                if ( !_dispatchNeeded )
+                    return;
+                _dispatchNeeded = false;
+
+                unsigned numActive = _active.size();
+                while( numActive < _maxConnections )
+                {
+                    // the best transfer among the hosts with a free connection.
+                    PendingMap::iterator best = _pending.end();
+                    for( PendingMap::iterator h = _pending.begin(); h != _pending.end(); ++h )
+                    {
+                        if ( getActiveCount(h->first) >= _maxConnectionsPerHost )
+                            continue;
+                        if ( best == _pending.end() || SortByPriority()(best->second.front(), h->second.front()) )
+                            best = h;
+                    }
+
+                    if ( best == _pending.end() )
+                        break;
+
+                    TransferVector& heap = best->second;
+                    std::pop_heap( heap.begin(), heap.end(), SortByPriority() );
+                    osg::ref_ptr<Transfer> t = heap.back();
+                    heap.pop_back();
+                    if ( heap.empty() )
+                        _pending.erase( best );
+
+                    if ( isCanceled(t.get()) )
+                    {
+                        toCancel.push_back( t );
+                    }
+                    else
+                    {
+                        _hostCounts[t->_host]++;
+                        toStart.push_back( t );
+                        ++numActive;
+                    }
+                }
+            }
+
+            for( TransferVector::iterator i = toStart.begin(); i != toStart.end(); ++i )
+                startTransfer( i->get() );
+
+            for( TransferVector::iterator i = toCancel.begin(); i != toCancel.end(); ++i )
+                cancel( i->get() );
+        }
+
+        void startTransfer( Transfer* t )
+        {
+            CURL* handle;
+            if ( !_idleHandles.empty() )
+            {
+                handle = _idleHandles.back();
+                _idleHandles.pop_back();
+                curl_easy_reset( handle );
+            }
+            else
+            {
+                handle = curl_easy_init();
+            }
+
+            HTTPClient::configureHandle( handle );
+            t->_proxied = !HTTPClient::configureRequest( handle, t->_url, t->_options.get() ).empty();
+
+            curl_easy_setopt( handle, CURLOPT_URL, t->_url.c_str() );
+            curl_easy_setopt( handle, CURLOPT_WRITEDATA, (void*)&t->_stream );
+            curl_easy_setopt( handle, CURLOPT_PROGRESSFUNCTION, &progressCallback );
+            curl_easy_setopt( handle, CURLOPT_PROGRESSDATA, (void*)t );
+            curl_easy_setopt( handle, CURLOPT_ERRORBUFFER, (void*)t->_errorBuf );
+
+#if LIBCURL_VERSION_NUM >= 0x071900
+            curl_easy_setopt( handle, CURLOPT_TCP_KEEPALIVE, 1L );
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+            // prefer waiting for a connection we can multiplex over opening a new one
+            curl_easy_setopt( handle, CURLOPT_PIPEWAIT, 1L );
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00
+            curl_easy_setopt( handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS );
+#endif
+
+            _active[handle] = t;
+            curl_multi_add_handle( _multi, handle );
+        }
+
+        /** Harvests completed transfers. */
+        void collect()
+        {
+            CURLMsg* msg;
+            int      numLeft;
+            bool     freed = false;
+            while( (msg = curl_multi_info_read(_multi, &numLeft)) != 0L )
+            {
+                if ( msg->msg != CURLMSG_DONE )
+                    continue;
+
+                CURL*    handle = msg->easy_handle;
+                CURLcode result = msg->data.result;
+                curl_multi_remove_handle( _multi, handle );
+
+                ActiveMap::iterator i = _active.find( handle );
+                if ( i == _active.end() )
+                {
+                    curl_easy_cleanup( handle );
+                    continue;
+                }
+
+                osg::ref_ptr<Transfer> t = i->second;
+                _active.erase( i );
+                freed = true;
+
+                HostCounts::iterator h = _hostCounts.find( t->_host );
+                if ( h != _hostCounts.end() && --h->second == 0 )
+                    _hostCounts.erase( h );
+
+                if ( result != CURLE_OK && result != CURLE_ABORTED_BY_CALLBACK )
+                {
+                    OE_DEBUG << LC << "Transfer failed (" << t->_errorBuf << "): " << t->_url << std::endl;
+                }
+
+                HTTPResponse response = HTTPClient::buildResponse( handle, result, t->_part.get(), t->_url, t->_proxied );
+
+                if ( _idleHandles.size() < _maxConnections )
+                    _idleHandles.push_back( handle );
+                else
+                    curl_easy_cleanup( handle );
+
+                complete( t.get(), response );
+            }
+
+            // connections freed up, so queued transfers may be able to start.
+            if ( freed )
+            {
+                Threading::ScopedMutexLock lock( _pendingMutex );
+                _dispatchNeeded = true;
+            }
+        }
+
+        void cancel( Transfer* t )
+        {
+            HTTPResponse response( 0L );
+            response._cancelled = true;
+            complete( t, response );
+        }
+
+        void complete( Transfer* t, const HTTPResponse& response )
+        {
+            t->_future->setResponse( response );
+            if ( t->_callback.valid() )
+                t->_callback->onResponse( t->_request, response );
+        }
+
+        CURLM*             _multi;
+        PendingMap         _pending;
+        Threading::Mutex   _pendingMutex;
+        unsigned           _sequence;
+        bool               _dispatchNeeded;
+        unsigned           _maxPerHostApplied;
+        ActiveMap          _active;
+        HostCounts         _hostCounts;
+        std::vector<CURL*> _idleHandles;
+        Threading::Event   _wake;
+        volatile bool      _done;
+    };
+
+    namespace
+    {
+        struct EngineHolder
+        {
+            ~EngineHolder() { delete _engine; }
+            HTTPAsyncEngine* _engine;
+        };
+
+        EngineHolder     s_engineHolder;
+        Threading::Mutex s_engineMutex;
+    }
+
+    // always locked: an unlocked first check could see the pointer before the
+    // engine it points to is fully constructed.
+    HTTPAsyncEngine&
+    HTTPAsyncEngine::instance()
+    {
+        Threading::ScopedMutexLock lock( s_engineMutex );
+        if ( !s_engineHolder._engine )
+            s_engineHolder._engine = new HTTPAsyncEngine();
+        return *s_engineHolder._engine;
+    }
+
+    HTTPAsyncEngine*
+    HTTPAsyncEngine::running()
+    {
+        Threading::ScopedMutexLock lock( s_engineMutex );
+        return s_engineHolder._engine;
+    }
+}
+
+#undef  LC
+#define LC "[HTTPClient] "
+
+void
+HTTPClient::setMaxConnectionsPerHost( unsigned value )
+{
+    _maxConnectionsPerHost = osg::maximum( value, 1u );
+
+    HTTPAsyncEngine* engine = HTTPAsyncEngine::running();
+    if ( engine )
+        engine->requestDispatch();
+}
+
+unsigned
+HTTPClient::getMaxConnectionsPerHost()
+{
+    return _maxConnectionsPerHost;
+}
+
+void
+HTTPClient::setMaxConnections( unsigned value )
+{
+    _maxConnections = osg::maximum( value, 1u );
+
+    HTTPAsyncEngine* engine = HTTPAsyncEngine::running();
+    if ( engine )
+        engine->requestDispatch();
+}
+
+unsigned
+HTTPClient::getMaxConnections()
+{
+    return _maxConnections;
+}
+
+osg::ref_ptr<HTTPFuture>
+HTTPClient::getAsync( const HTTPRequest&    request,
+                      const osgDB::Options* options,
+                      ProgressCallback*     progress,
+                      HTTPResponseCallback* callback,
+                      int                   priority )
+{
+    HTTPAsyncEngine::Transfer* t = new HTTPAsyncEngine::Transfer( request );
+    t->_options  = options;
+    t->_progress = progress;
+    t->_callback = callback;
+    t->_priority = priority;
+    t->_future   = new HTTPFuture();
+
+    // hold a reference across submit, since the transfer may complete right away.
+    osg::ref_ptr<HTTPFuture> future = t->_future.get();
+    HTTPAsyncEngine::instance().submit( t );
+    return future;
+}
+
+HTTPResponse
+HTTPClient::doGet( const HTTPRequest& request, const osgDB::Options* options, ProgressCallback* callback) const
+{
+    OE_DEBUG << LC << "doGet " << request.getURL() << std::endl;
+
+    // route through the shared I/O engine, unless we're already on it (e.g. a
+    // response callback making a nested request).
+    if ( _asyncEnabled && !HTTPAsyncEngine::instance().isEngineThread() )
+    {
+        osg::ref_ptr<HTTPFuture> future = getAsync( request, options, callback );
+
+        // a cancelled caller returns right away; the engine drops the transfer.
+        if ( !future->wait(callback) )
+        {
+            future->cancel();
+            HTTPResponse response( 0L );
+            response._cancelled = true;
+            return response;
+        }
+        return future->getResponse();
+    }
+
+    //TODO: don't do all this proxy setup on every GET. Just do it once per client, or only when 
+    // the proxy information changes.
+    std::string proxy_addr = configureRequest( _curl_handle, request.getURL(), options );
+
+    osg::ref_ptr<HTTPResponse::Part> part = new HTTPResponse::Part();
+    StreamObject sp( &part->_stream );
+
+    //Take a temporary ref to the callback
+    osg::ref_ptr<ProgressCallback> progressCallback = callback;
+    curl_easy_setopt( _curl_handle, CURLOPT_URL, request.getURL().c_str() );
+    if (callback)
+    {
+        curl_easy_setopt(_curl_handle, CURLOPT_PROGRESSDATA, progressCallback.get());
+    }
+
+    char errorBuf[CURL_ERROR_SIZE];
+    errorBuf[0] = 0;
+    curl_easy_setopt( _curl_handle, CURLOPT_ERRORBUFFER, (void*)errorBuf );
+
+    curl_easy_setopt( _curl_handle, CURLOPT_WRITEDATA, (void*)&sp);
+    CURLcode res = curl_easy_perform( _curl_handle );
+    curl_easy_setopt( _curl_handle, CURLOPT_WRITEDATA, (void*)0 );
+    curl_easy_setopt( _curl_handle, CURLOPT_PROGRESSDATA, (void*)0);
+
+    return buildResponse( _curl_handle, res, part.get(), request.getURL(), !proxy_addr.empty() );
+}
+
 
 HTTPResponse
 HTTPClient::doGet( const std::string& url, const osgDB::Options* options, ProgressCallback* callback) const
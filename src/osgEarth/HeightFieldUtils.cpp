@@ -21,9 +21,210 @@
 #include <osgEarth/GeoData>
 #include <osgEarth/Geoid>
 #include <osg/Notify>
+#include <algorithm>
 
 using namespace osgEarth;
 
+//------------------------------------------------------------------------
+
+namespace
+{
+    // One entry per output column (or row): the bracketing input posts along
+    // that axis and the interpolation weights for each. The rules mirror the
+    // ones in getHeightAtPixel exactly so that the separable kernels below
+    // produce the same values as per-post sampling.
+    struct AxisSample
+    {
+        int    lo, hi;
+        double w0, w1;  // weights for lo/hi; w1 is the fractional offset for INTERP_TRIANGULATE
+    };
+
+    typedef std::vector<AxisSample> AxisTable;
+
+    void buildAxisTable(const std::vector<double>& coords, int numPosts, ElevationInterpolation interp, AxisTable& table)
+    {
+        table.resize( coords.size() );
+
+        for( unsigned i=0; i<coords.size(); ++i )
+        {
+            double     p = coords[i];
+            AxisSample& s = table[i];
+
+            if ( interp == INTERP_NEAREST )
+            {
+                s.lo = s.hi = osg::clampBetween( (int)osg::round(p), 0, numPosts-1 );
+                s.w0 = 1.0;
+                s.w1 = 0.0;
+                continue;
+            }
+
+            s.lo = osg::maximum( (int)floor(p), 0 );
+            s.hi = osg::maximum( osg::minimum((int)ceil(p), numPosts-1), 0 );
+
+            if ( interp == INTERP_TRIANGULATE )
+            {
+                // triangulation always needs a full cell to pick a triangle from.
+                if ( s.lo == s.hi )
+                {
+                    if ( s.lo < numPosts-2 )
+                        s.hi = s.lo + 1;
+                    else
+                        s.lo = s.hi - 1;
+                }
+                if ( s.lo > s.hi ) s.lo = s.hi;
+                if ( s.lo < 0 )
+                {
+                    // two-post axis sampled exactly on post 0
+                    s.lo = 0;
+                    s.hi = osg::minimum( 1, numPosts-1 );
+                }
+                s.w0 = 0.0;
+                s.w1 = p - (double)s.lo;
+            }
+            else
+            {
+                if ( s.lo > s.hi ) s.lo = s.hi;
+
+                if ( interp == INTERP_AVERAGE )
+                {
+                    double rem = p - (int)p;
+                    s.w0 = 1.0 - rem;
+                    s.w1 = rem;
+                }
+                else if ( s.lo == s.hi ) // INTERP_BILINEAR, exactly on a post
+                {
+                    s.w0 = 1.0;
+                    s.w1 = 0.0;
+                }
+                else // INTERP_BILINEAR
+                {
+                    s.w0 = (double)s.hi - p;
+                    s.w1 = p - (double)s.lo;
+                }
+            }
+        }
+    }
+
+    // The kernels below all walk the output in row-major order. Each output row
+    // reads from (at most) two input rows, so the inner loop is a straight pass
+    // over the column table. The CHECK_NODATA variants are only used when the
+    // input actually contains NO_DATA_VALUE posts; otherwise the inner loops are
+    // branch-free and the compiler is free to vectorize them.
+
+    void resampleNearest(const float* in, int inCols, const AxisTable& ct, const AxisTable& rt, float* out)
+    {
+        unsigned outCols = ct.size();
+        for( unsigned r=0; r<rt.size(); ++r )
+        {
+            const float* row = in + rt[r].lo * inCols;
+            float*       dst = out + r * outCols;
+            for( unsigned c=0; c<outCols; ++c )
+                dst[c] = row[ct[c].lo];
+        }
+    }
+
+    template<bool CHECK_NODATA>
+    void resampleBilinear(const float* in, int inCols, const AxisTable& ct, const AxisTable& rt, float* out)
+    {
+        unsigned outCols = ct.size();
+        for( unsigned r=0; r<rt.size(); ++r )
+        {
+            const AxisSample& rs    = rt[r];
+            const float*      rowLo = in + rs.lo * inCols;
+            const float*      rowHi = in + rs.hi * inCols;
+            float*            dst   = out + r * outCols;
+
+            for( unsigned c=0; c<outCols; ++c )
+            {
+                const AxisSample& cs = ct[c];
+                float ll = rowLo[cs.lo], lr = rowLo[cs.hi];
+                float ul = rowHi[cs.lo], ur = rowHi[cs.hi];
+
+                if ( CHECK_NODATA && (ll == NO_DATA_VALUE || lr == NO_DATA_VALUE || ul == NO_DATA_VALUE || ur == NO_DATA_VALUE) )
+                {
+                    dst[c] = NO_DATA_VALUE;
+                    continue;
+                }
+
+                // same rounding steps as getHeightAtPixel: interpolate each row to
+                // float, then interpolate between the rows.
+                float r1 = cs.w0 * ll + cs.w1 * lr;
+                float r2 = cs.w0 * ul + cs.w1 * ur;
+                dst[c] = rs.w0 * r1 + rs.w1 * r2;
+            }
+        }
+    }
+
+    template<bool CHECK_NODATA>
+    void resampleAverage(const float* in, int inCols, const AxisTable& ct, const AxisTable& rt, float* out)
+    {
+        unsigned outCols = ct.size();
+        for( unsigned r=0; r<rt.size(); ++r )
+        {
+            const AxisSample& rs    = rt[r];
+            const float*      rowLo = in + rs.lo * inCols;
+            const float*      rowHi = in + rs.hi * inCols;
+            float*            dst   = out + r * outCols;
+
+            for( unsigned c=0; c<outCols; ++c )
+            {
+                const AxisSample& cs = ct[c];
+                float ll = rowLo[cs.lo], lr = rowLo[cs.hi];
+                float ul = rowHi[cs.lo], ur = rowHi[cs.hi];
+
+                if ( CHECK_NODATA && (ll == NO_DATA_VALUE || lr == NO_DATA_VALUE || ul == NO_DATA_VALUE || ur == NO_DATA_VALUE) )
+                {
+                    dst[c] = NO_DATA_VALUE;
+                    continue;
+                }
+
+                double w00 = rs.w0 * cs.w0 * (double)ll;
+                double w01 = rs.w0 * cs.w1 * (double)lr;
+                double w10 = rs.w1 * cs.w0 * (double)ul;
+                double w11 = rs.w1 * cs.w1 * (double)ur;
+                dst[c] = (float)(w00 + w01 + w10 + w11);
+            }
+        }
+    }
+
+    template<bool CHECK_NODATA>
+    void resampleTriangulate(const float* in, int inCols, const AxisTable& ct, const AxisTable& rt, float* out)
+    {
+        unsigned outCols = ct.size();
+        for( unsigned r=0; r<rt.size(); ++r )
+        {
+            const AxisSample& rs    = rt[r];
+            const float*      rowLo = in + rs.lo * inCols;
+            const float*      rowHi = in + rs.hi * inCols;
+            float*            dst   = out + r * outCols;
+            double            dy    = rs.w1;
+
+            for( unsigned c=0; c<outCols; ++c )
+            {
+                const AxisSample& cs = ct[c];
+                double ll = rowLo[cs.lo], lr = rowLo[cs.hi];
+                double ul = rowHi[cs.lo], ur = rowHi[cs.hi];
+
+                if ( CHECK_NODATA && (ll == NO_DATA_VALUE || lr == NO_DATA_VALUE || ul == NO_DATA_VALUE || ur == NO_DATA_VALUE) )
+                {
+                    dst[c] = NO_DATA_VALUE;
+                    continue;
+                }
+
+                // The plane equation from getHeightAtPixel, reduced for a unit cell:
+                // the "right" triangle is ll,lr,ur and the "left" one is ll,ur,ul.
+                double dx = cs.w1;
+                if ( dx > dy )
+                    dst[c] = ((lr - ll) * dx + (ur - lr) * dy) + ll;
+                else
+                    dst[c] = ((ur - ul) * dx + (ul - ll) * dy) + ll;
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------
+
 float
 HeightFieldUtils::getHeightAtPixel(const osg::HeightField* hf, double c, double r, ElevationInterpolation interpolation)
 {
@@ -200,6 +401,59 @@ HeightFieldUtils::getHeightAtNormalizedLocation(const osg::HeightField* input,
     return getHeightAtPixel( input, px, py, interp );
 }
 
+void
+HeightFieldUtils::resample(const osg::HeightField*    input,
+                           const std::vector<double>& cols,
+                           const std::vector<double>& rows,
+                           osg::HeightField*          output,
+                           ElevationInterpolation     interp)
+{
+    if ( !input || !output || cols.empty() || rows.empty() )
+        return;
+
+    if ( output->getNumColumns() != cols.size() || output->getNumRows() != rows.size() )
+    {
+        OE_WARN << "[osgEarth::HeightFieldUtils] resample: output heightfield size does not match the sample tables" << std::endl;
+        return;
+    }
+
+    int inCols = input->getNumColumns();
+    int inRows = input->getNumRows();
+
+    AxisTable colTable, rowTable;
+    buildAxisTable( cols, inCols, interp, colTable );
+    buildAxisTable( rows, inRows, interp, rowTable );
+
+    const osg::HeightField::HeightList& inList = input->getHeightList();
+    const float* in  = &inList[0];
+    float*       out = &output->getHeightList()[0];
+
+    // Only pay for the NO_DATA tests when there is something to find.
+    bool hasNoData = std::find( inList.begin(), inList.end(), (float)NO_DATA_VALUE ) != inList.end();
+
+    switch( interp )
+    {
+    case INTERP_NEAREST:
+        resampleNearest( in, inCols, colTable, rowTable, out );
+        break;
+
+    case INTERP_AVERAGE:
+        if ( hasNoData ) resampleAverage<true> ( in, inCols, colTable, rowTable, out );
+        else             resampleAverage<false>( in, inCols, colTable, rowTable, out );
+        break;
+
+    case INTERP_TRIANGULATE:
+        if ( hasNoData ) resampleTriangulate<true> ( in, inCols, colTable, rowTable, out );
+        else             resampleTriangulate<false>( in, inCols, colTable, rowTable, out );
+        break;
+
+    default:
+        if ( hasNoData ) resampleBilinear<true> ( in, inCols, colTable, rowTable, out );
+        else             resampleBilinear<false>( in, inCols, colTable, rowTable, out );
+        break;
+    }
+}
+
 
 void
 HeightFieldUtils::scaleHeightFieldToDegrees( osg::HeightField* hf )
@@ -250,17 +504,18 @@ HeightFieldUtils::createSubSample(osg::HeightField* input, const GeoExtent& inpu
     // copy over the skirt height, adjusting it for relative tile size.
     dest->setSkirtHeight( input->getSkirtHeight() * div );
 
+    // input pixel coordinates of each output column and row:
+    std::vector<double> cols( numCols ), rows( numRows );
     double x, y;
     int col, row;
 
     for( x = outputEx.xMin(), col=0; col < numCols; x += dx, col++ )
-    {
-        for( y = outputEx.yMin(), row=0; row < numRows; y += dy, row++ )
-        {
-            float height = HeightFieldUtils::getHeightAtLocation( input, x, y, inputEx.xMin(), inputEx.yMin(), xInterval, yInterval, interpolation);
-            dest->setHeight( col, row, height );
-        }
-    }
+        cols[col] = osg::clampBetween( (x - inputEx.xMin()) / xInterval, 0.0, (double)(numCols-1) );
+
+    for( y = outputEx.yMin(), row=0; row < numRows; y += dy, row++ )
+        rows[row] = osg::clampBetween( (y - inputEx.yMin()) / yInterval, 0.0, (double)(numRows-1) );
+
+    resample( input, cols, rows, dest, interpolation );
 
     osg::Vec3d orig( outputEx.xMin(), outputEx.yMin(), input->getOrigin().z() );
     dest->setOrigin( orig );
@@ -291,16 +546,15 @@ HeightFieldUtils::resizeHeightField(osg::HeightField* input, int newColumns, int
     output->setYInterval( stepY );
     output->setOrigin( origin );
     
+    std::vector<double> cols( newColumns ), rows( newRows );
+
+    for( int x = 0; x < newColumns; ++x )
+        cols[x] = ((double)x / (double)(newColumns-1)) * (double)(input->getNumColumns()-1);
+
     for( int y = 0; y < newRows; ++y )
-    {
-        for( int x = 0; x < newColumns; ++x )
-        {
-            double nx = (double)x / (double)(newColumns-1);
-            double ny = (double)y / (double)(newRows-1);
-            float h = getHeightAtNormalizedLocation( input, nx, ny );
-            output->setHeight( x, y, h );
-        }
-    }
+        rows[y] = ((double)y / (double)(newRows-1)) * (double)(input->getNumRows()-1);
+
+    resample( input, cols, rows, output, interp );
 
     return output;
 }
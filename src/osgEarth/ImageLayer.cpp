@@ -500,6 +500,7 @@ ImageLayer::createImageFromTileSource(const TileKey&    key,
     if ( result == 0L && (!progress || !progress->isCanceled()) )
     {
         source->getBlacklist()->add( key.getTileId() );
+        storeBlacklistIfDue();
     }
 
     //return result.release();
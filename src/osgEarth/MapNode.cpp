@@ -25,8 +25,10 @@
 #include <osgEarth/TextureCompositor>
 #include <osgEarth/URI>
 #include <osgEarth/DrapeableNode>
+#include <osgEarth/TaskService>
 #include <osg/ArgumentParser>
 #include <osg/PagedLOD>
+#include <osg/Timer>
 
 using namespace osgEarth;
 
@@ -75,6 +77,56 @@ namespace
 
         osg::observer_ptr<MapNode> _node;
     };
+
+    // shared by the layer init tasks; reference counted so that tasks still
+    // running after the startup deadline don't outlive it.
+    struct LayerInitSemaphore : public osg::Referenced
+    {
+        LayerInitSemaphore( int num ) : _event( num ) { }
+        Threading::MultiEvent _event;
+    };
+
+    // initializes one layer's tile source in the background and times it.
+    struct InitTileSourceTask : public TaskRequest
+    {
+        InitTileSourceTask( TerrainLayer* layer, LayerInitSemaphore* semaphore )
+            : _layer( layer ), _semaphore( semaphore ), _done( false ), _ok( false ), _hasTileSource( false ), _seconds( 0.0 ) { }
+
+        void operator()( ProgressCallback* progress )
+        {
+            osg::Timer_t start = osg::Timer::instance()->tick();
+            bool hasTileSource = _layer->getTileSource() != 0L;
+            bool ok = hasTileSource || _layer->isCacheOnly();
+            double seconds = osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+            {
+                Threading::ScopedMutexLock lock( _mutex );
+                _ok            = ok;
+                _hasTileSource = hasTileSource;
+                _seconds       = seconds;
+                _done          = true;
+            }
+            _semaphore->_event.notify();
+        }
+
+        // results are only valid if this returns true.
+        bool getResult( bool& ok, bool& hasTileSource, double& seconds )
+        {
+            Threading::ScopedMutexLock lock( _mutex );
+            ok            = _ok;
+            hasTileSource = _hasTileSource;
+            seconds       = _seconds;
+            return _done;
+        }
+
+        osg::ref_ptr<TerrainLayer>       _layer;
+        osg::ref_ptr<LayerInitSemaphore> _semaphore;
+        Threading::Mutex                 _mutex;
+        bool                             _done;
+        bool                             _ok;
+        bool                             _hasTileSource;
+        double                           _seconds;
+    };
+
 }
 
 //---------------------------------------------------------------------------
@@ -213,6 +265,10 @@ MapNode::init()
     // TODO: not sure why we call this here
     _map->setGlobalOptions( local_options.get() );
 
+    // bring up the layers' tile sources before the terrain engine asks for the
+    // map profile, which would otherwise initialize them one at a time.
+    initializeLayers();
+
     // load and attach the terrain engine, but don't initialize it until we need it
     const TerrainOptions& terrainOptions = _mapNodeOptions.getTerrainOptions();
 
@@ -298,6 +354,116 @@ MapNode::init()
     ADJUST_EVENT_TRAV_COUNT( this, 1 );
 }
 
+void
+MapNode::initializeLayers()
+{
+    _startupStats = StartupStats();
+
+    std::vector< osg::ref_ptr<TerrainLayer> > layers;
+    {
+        ImageLayerVector imageLayers;
+        _map->getImageLayers( imageLayers );
+        layers.insert( layers.end(), imageLayers.begin(), imageLayers.end() );
+
+        ElevationLayerVector elevationLayers;
+        _map->getElevationLayers( elevationLayers );
+        layers.insert( layers.end(), elevationLayers.begin(), elevationLayers.end() );
+    }
+
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    float timeout = _mapNodeOptions.layerInitTimeout().value();
+
+    // The map profile comes from the first layer (in this same order) that has a
+    // tile source, unless the map is geocentric or has an explicit profile. If that
+    // layer can't be determined without waiting on one that timed out, resolving the
+    // profile here would block, so leave it until something first asks for it.
+    bool profileNeedsLayers = !_map->isGeocentric() && !_map->getMapOptions().profile().isSet();
+    bool profileReady = true;
+
+    if ( layers.size() > 1 && timeout > 0.0f )
+    {
+        // tile source initialization mostly waits on the network or the disk, so
+        // it's fine to run more of them than we have cores.
+        unsigned numThreads = osg::minimum( (unsigned)layers.size(), 8u );
+        TaskService* service = TaskService::getShared( "MapNode layer init", (int)numThreads );
+
+        osg::ref_ptr<LayerInitSemaphore> semaphore = new LayerInitSemaphore( layers.size() );
+        std::vector< osg::ref_ptr<InitTileSourceTask> > tasks;
+        tasks.reserve( layers.size() );
+
+        for( unsigned i = 0; i < layers.size(); ++i )
+        {
+            InitTileSourceTask* task = new InitTileSourceTask( layers[i].get(), semaphore.get() );
+            tasks.push_back( task );
+            service->add( task );
+        }
+
+        if ( !semaphore->_event.wait( (unsigned)(timeout * 1000.0f) ) )
+        {
+            OE_WARN << LC << "Not all layers initialized within " << timeout
+                << "s; the rest will finish in the background" << std::endl;
+        }
+
+        bool foundProfileLayer = false;
+
+        for( unsigned i = 0; i < tasks.size(); ++i )
+        {
+            bool   ok, hasTileSource;
+            double seconds;
+
+            LayerInitTime t;
+            t._name      = layers[i]->getName();
+            t._completed = tasks[i]->getResult( ok, hasTileSource, seconds );
+            t._ok        = t._completed && ok;
+            t._seconds   = t._completed ? seconds : osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+            _startupStats._layers.push_back( t );
+
+            if ( profileNeedsLayers && !foundProfileLayer )
+            {
+                if ( !t._completed )
+                    profileReady = false;
+                else if ( hasTileSource )
+                    foundProfileLayer = true;
+            }
+        }
+    }
+    else
+    {
+        for( unsigned i = 0; i < layers.size(); ++i )
+        {
+            osg::Timer_t layerStart = osg::Timer::instance()->tick();
+
+            LayerInitTime t;
+            t._name      = layers[i]->getName();
+            t._ok        = layers[i]->getTileSource() != 0L || layers[i]->isCacheOnly();
+            t._completed = true;
+            t._seconds   = osg::Timer::instance()->delta_s( layerStart, osg::Timer::instance()->tick() );
+            _startupStats._layers.push_back( t );
+        }
+    }
+
+    _startupStats._layerInitSeconds = osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+
+    for( LayerInitTimes::const_iterator i = _startupStats._layers.begin(); i != _startupStats._layers.end(); ++i )
+    {
+        OE_INFO << LC << "Layer \"" << i->_name << "\" "
+            << (!i->_completed ? "still initializing after " : i->_ok ? "initialized in " : "failed to initialize after ")
+            << i->_seconds << "s" << std::endl;
+    }
+
+    // resolve the map profile now, while we're timing things.
+    if ( profileReady )
+    {
+        osg::Timer_t profileStart = osg::Timer::instance()->tick();
+        _map->getProfile();
+        _startupStats._profileSeconds = osg::Timer::instance()->delta_s( profileStart, osg::Timer::instance()->tick() );
+    }
+    else
+    {
+        OE_INFO << LC << "Map profile depends on a layer that is still initializing; resolving it later" << std::endl;
+    }
+}
+
 MapNode::~MapNode()
 {
     _map->removeMapCallback( _mapCallback.get() );
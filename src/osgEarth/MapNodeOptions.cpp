@@ -39,6 +39,7 @@ _overlayVertexWarping( false ),
 _overlayBlending     ( true ),
 _overlayMipMapping   ( false ),
 _overlayTextureSize  ( 4096 ),
+_layerInitTimeout    ( 30.0f ),
 _terrainOptions      ( 0L )
 {
     mergeConfig( conf );
@@ -52,6 +53,7 @@ _overlayVertexWarping( false ),
 _overlayBlending     ( true ),
 _overlayTextureSize  ( 4096 ),
 _overlayMipMapping   ( false ),
+_layerInitTimeout    ( 30.0f ),
 _terrainOptions      ( 0L )
 {
     setTerrainOptions( to );
@@ -65,6 +67,7 @@ _overlayVertexWarping( false ),
 _overlayBlending     ( true ),
 _overlayTextureSize  ( 4096 ),
 _overlayMipMapping   ( false ),
+_layerInitTimeout    ( 30.0f ),
 _terrainOptions      ( 0L )
 {
     mergeConfig( rhs.getConfig() );
@@ -94,6 +97,7 @@ MapNodeOptions::getConfig() const
     conf.updateIfSet   ( "overlay_blending",     _overlayBlending );
     conf.updateIfSet   ( "overlay_texture_size", _overlayTextureSize );
     conf.updateIfSet   ( "overlay_mipmapping",   _overlayMipMapping );
+    conf.updateIfSet   ( "layer_init_timeout",   _layerInitTimeout );
 
     return conf;
 }
@@ -110,6 +114,7 @@ MapNodeOptions::mergeConfig( const Config& conf )
     conf.getIfSet   ( "overlay_blending",     _overlayBlending );
     conf.getIfSet   ( "overlay_texture_size", _overlayTextureSize );
     conf.getIfSet   ( "overlay_mipmapping",   _overlayMipMapping );
+    conf.getIfSet   ( "layer_init_timeout",   _layerInitTimeout );
 
     if ( conf.hasChild( "terrain" ) )
     {
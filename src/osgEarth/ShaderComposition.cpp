@@ -19,10 +19,14 @@
 #include <osgEarth/ShaderComposition>
 
 #include <osgEarth/Registry>
+#include <osgEarth/StringUtils>
 #include <osg/Shader>
 #include <osg/Program>
+#include <osg/observer_ptr>
 #include <osg/State>
 #include <osg/Notify>
+#include <osg/NodeVisitor>
+#include <osg/Timer>
 #include <sstream>
 
 #define LC "[VirtualProgram] "
@@ -57,6 +61,82 @@ namespace
 
 //------------------------------------------------------------------------
 
+namespace
+{
+    /**
+     * A composed program in the process-wide cache. The cache only observes the
+     * program; the VirtualPrograms using it hold it, so it goes away with the
+     * last of them and its entry is pruned.
+     */
+    struct SharedProgram
+    {
+        std::string                     _key;      // full description of the composition
+        osg::observer_ptr<osg::Program> _program;
+        osg::ref_ptr<osg::Shader>       _vertMain;
+        osg::ref_ptr<osg::Shader>       _fragMain;
+    };
+
+    // keyed on a hash of the description; entries with the same hash are told apart by _key.
+    typedef std::multimap<unsigned, SharedProgram> SharedProgramMap;
+
+    Threading::Mutex                  s_sharedProgramsMutex;
+    SharedProgramMap                  s_sharedPrograms;
+    unsigned                          s_sharedProgramsPruneSize = 64;
+    VirtualProgram::ProgramCacheStats s_programCacheStats;
+
+    // finds a live entry for a composition, dropping dead ones with the same hash
+    // on the way. Call with s_sharedProgramsMutex held.
+    bool findSharedProgram( unsigned hash, const std::string& key, SharedProgram& out, osg::ref_ptr<osg::Program>& out_program )
+    {
+        std::pair<SharedProgramMap::iterator, SharedProgramMap::iterator> range = s_sharedPrograms.equal_range( hash );
+        for( SharedProgramMap::iterator i = range.first; i != range.second; )
+        {
+            osg::ref_ptr<osg::Program> program;
+            if ( !i->second._program.lock(program) )
+            {
+                s_sharedPrograms.erase( i++ );
+            }
+            else if ( i->second._key == key )
+            {
+                out = i->second;
+                out_program = program.get();
+                return true;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        return false;
+    }
+
+    // drops every dead entry once the cache has doubled since the last sweep, so
+    // compositions that are never looked up again don't pile up. Call with
+    // s_sharedProgramsMutex held.
+    void pruneSharedPrograms()
+    {
+        if ( s_sharedPrograms.size() < s_sharedProgramsPruneSize )
+            return;
+
+        for( SharedProgramMap::iterator i = s_sharedPrograms.begin(); i != s_sharedPrograms.end(); )
+        {
+            if ( !i->second._program.valid() )
+                s_sharedPrograms.erase( i++ );
+            else
+                ++i;
+        }
+
+        s_sharedProgramsPruneSize = osg::maximum( 64u, 2u * (unsigned)s_sharedPrograms.size() );
+    }
+
+    bool isMainShader( const std::string& semantic )
+    {
+        return semantic == "osgearth_vert_main" || semantic == "osgearth_frag_main";
+    }
+}
+
+//------------------------------------------------------------------------
+
 // If graphics board has program linking problems set MERGE_SHADERS to 1
 // Merge shaders can be used to merge shaders strings into one shader. 
 #define MERGE_SHADERS 0
@@ -138,28 +218,12 @@ VirtualProgram::apply( osg::State & state ) const
     if( _shaderMap.empty() ) // Virtual Program works as normal Program
         return Program::apply( state );
 
-    // first, find and collect all the VirtualProgram attributes:
-    ShaderMap shaderMap;
-    const StateHack::AttributeVec* av = StateHack::GetAttributeVec( state, this );
-    if ( av )
-    {
-        for( StateHack::AttributeVec::const_iterator i = av->begin(); i != av->end(); ++i )
-        {
-            const osg::StateAttribute* sa = i->first;
-            const VirtualProgram* vp = dynamic_cast< const VirtualProgram* >( sa );
-            if( vp && ( vp->_mask & _mask ) )
-            {
-                for( ShaderMap::const_iterator i = vp->_shaderMap.begin(); i != vp->_shaderMap.end(); ++i )
-                {
-                    shaderMap[ i->first ] = i->second;
-                }
-            }
-        }
-    }
+    // first, find and collect all the VirtualProgram attributes and their shaders:
+    VirtualProgramList stack;
+    getProgramStack( state, stack );
 
-    // next add the local shader components to the map:
-    for( ShaderMap::const_iterator i = _shaderMap.begin(); i != _shaderMap.end(); ++i )
-        shaderMap[ i->first ] = i->second;
+    ShaderMap shaderMap;
+    mergeShaders( stack, shaderMap );
 
     if( shaderMap.size() )
     {
@@ -169,83 +233,233 @@ VirtualProgram::apply( osg::State & state ) const
             sl.push_back( i->second );
 
         // see if there's already a program associated with this list:
-        osg::Program* program = 0L;
+        osg::ref_ptr<osg::Program> program;
         ProgramMap::iterator p = _programMap.find( sl );
         if ( p != _programMap.end() )
         {
-            program = p->second.get();
+            program = p->second;
         }
         else
         {
-            ShaderFactory* sf = osgEarth::Registry::instance()->getShaderFactory();
-
-            // build a new set of accumulated functions, to support the creation of main()
-            const_cast<VirtualProgram*>(this)->refreshAccumulatedFunctions( state );
-                
-            osg::Shader* vert_main = sf->createVertexShaderMain( _accumulatedFunctions );
-            const_cast<VirtualProgram*>(this)->setShader( "osgearth_vert_main", vert_main );
-            shaderMap[ ShaderSemantic("osgearth_vert_main", osg::Shader::VERTEX) ] = vert_main;
-
-            osg::Shader* frag_main = sf->createFragmentShaderMain( _accumulatedFunctions );
-            const_cast<VirtualProgram*>(this)->setShader( "osgearth_frag_main", frag_main );
-            shaderMap[ ShaderSemantic("osgearth_frag_main", osg::Shader::FRAGMENT) ] = frag_main;
+            // compose one, or find an identical composition in the shared cache:
+            bool created = false;
+            program = compose( stack, shaderMap, created );
             
             // rebuild the shader list now that we've changed the shader map.
             sl.clear();
             for( ShaderMap::iterator i = shaderMap.begin(); i != shaderMap.end(); ++i )
                 sl.push_back( i->second );
 
-            // Create a new program and add all our shaders.
-            program = new osg::Program();
+            // finally, cache the program so we only regenerate it when it changes.
+            _programMap[ sl ] = program;
 
-#if !MERGE_SHADERS
-            for( ShaderList::iterator i = sl.begin(); i != sl.end(); ++i )
-            {
-                program->addShader( i->get() );
-            }
-#else
-            std::string strFragment;
-            std::string strVertex;
-            std::string strGeometry;
-            
-            for( ShaderList::iterator i = sl.begin(); i != sl.end(); ++i )
+            if ( created )
             {
-                if( i->get()->getType() == osg::Shader::FRAGMENT )
-                    strFragment += i->get()->getShaderSource();
-                else if ( i->get()->getType() == osg::Shader::VERTEX )
-                    strVertex += i->get()->getShaderSource();
-                else if ( i->get()->getType() == osg::Shader::GEOMETRY )
-                    strGeometry += i->get()->getShaderSource();
+                // first use of a new program compiles and links it; count that time.
+                osg::Timer_t start = osg::Timer::instance()->tick();
+                program->apply( state );
+                double seconds = osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+
+                Threading::ScopedMutexLock lock( s_sharedProgramsMutex );
+                s_programCacheStats._linkSeconds += seconds;
+                return;
             }
+        }
 
-            if( strFragment.length() > 0 )
-            {
-                program->addShader( new osg::Shader( osg::Shader::FRAGMENT, strFragment ) );
-            }
+        // finally, apply the program attribute.
+        program->apply( state );
+    }
+    else
+    {
+        Program::apply( state );
+    }
+}
 
-            if( strVertex.length() > 0  )
-            {
-                program->addShader( new osg::Shader( osg::Shader::VERTEX, strVertex ) );
-            }
+void
+VirtualProgram::mergeShaders( const VirtualProgramList& stack, ShaderMap& out )
+{
+    for( VirtualProgramList::const_iterator vp = stack.begin(); vp != stack.end(); ++vp )
+    {
+        for( ShaderMap::const_iterator i = (*vp)->_shaderMap.begin(); i != (*vp)->_shaderMap.end(); ++i )
+        {
+            out[ i->first ] = i->second;
+        }
+    }
+}
 
-            if( strGeometry.length() > 0  )
+void
+VirtualProgram::getProgramStack( const osg::State& state, VirtualProgramList& out ) const
+{
+    const StateHack::AttributeVec* av = StateHack::GetAttributeVec( state, this );
+    if ( av )
+    {
+        for( StateHack::AttributeVec::const_iterator i = av->begin(); i != av->end(); ++i )
+        {
+            const osg::StateAttribute* sa = i->first;
+            const VirtualProgram* vp = dynamic_cast< const VirtualProgram* >( sa );
+            if( vp && vp != this && ( vp->_mask & _mask ) )
             {
-                program->addShader( new osg::Shader( osg::Shader::GEOMETRY, strGeometry ) );
+                out.push_back( vp );
             }
+        }
+    }
+
+    // the local shader components go last so they take precedence:
+    out.push_back( this );
+}
+
+osg::ref_ptr<osg::Program>
+VirtualProgram::compose( const VirtualProgramList& stack, ShaderMap& shaderMap, bool& out_created ) const
+{
+    out_created = false;
+
+    // build a new set of accumulated functions, to support the creation of main()
+    const_cast<VirtualProgram*>(this)->refreshAccumulatedFunctions( stack );
+
+    // describe the composition: the shaders (other than the generated main()s,
+    // which follow from the rest) and the accumulated functions.
+    std::stringstream buf;
+    for( ShaderMap::const_iterator i = shaderMap.begin(); i != shaderMap.end(); ++i )
+    {
+        if ( !isMainShader(i->first.first) )
+        {
+            const std::string& source = i->second->getShaderSource();
+            buf << i->first.first << " " << (int)i->first.second << " " << source.size() << "\n" << source << "\n";
+        }
+    }
+    for( FunctionLocationMap::const_iterator j = _accumulatedFunctions.begin(); j != _accumulatedFunctions.end(); ++j )
+    {
+        for( OrderedFunctionMap::const_iterator k = j->second.begin(); k != j->second.end(); ++k )
+        {
+            buf << (int)j->first << " " << k->first << " " << k->second << "\n";
+        }
+    }
+
+    std::string key;
+    key = buf.str();
+    unsigned hash = hashString( key );
+
+    SharedProgram              shared;
+    osg::ref_ptr<osg::Program> program;
+    {
+        Threading::ScopedMutexLock lock( s_sharedProgramsMutex );
+        if ( findSharedProgram(hash, key, shared, program) )
+            s_programCacheStats._hits++;
+    }
+
+    if ( !program.valid() )
+    {
+        ShaderFactory* sf = osgEarth::Registry::instance()->getShaderFactory();
+
+        shared._key      = key;
+        shared._vertMain = sf->createVertexShaderMain( _accumulatedFunctions );
+        shared._fragMain = sf->createFragmentShaderMain( _accumulatedFunctions );
+
+        shaderMap[ ShaderSemantic("osgearth_vert_main", osg::Shader::VERTEX) ] = shared._vertMain.get();
+        shaderMap[ ShaderSemantic("osgearth_frag_main", osg::Shader::FRAGMENT) ] = shared._fragMain.get();
+
+        // Create a new program and add all our shaders.
+        program = new osg::Program();
+        shared._program = program.get();
+
+#if !MERGE_SHADERS
+        for( ShaderMap::iterator i = shaderMap.begin(); i != shaderMap.end(); ++i )
+        {
+            program->addShader( i->second.get() );
+        }
+#else
+        std::string strFragment;
+        std::string strVertex;
+        std::string strGeometry;
+        
+        for( ShaderMap::iterator i = shaderMap.begin(); i != shaderMap.end(); ++i )
+        {
+            if( i->second->getType() == osg::Shader::FRAGMENT )
+                strFragment += i->second->getShaderSource();
+            else if ( i->second->getType() == osg::Shader::VERTEX )
+                strVertex += i->second->getShaderSource();
+            else if ( i->second->getType() == osg::Shader::GEOMETRY )
+                strGeometry += i->second->getShaderSource();
+        }
+
+        if( strFragment.length() > 0 )
+        {
+            program->addShader( new osg::Shader( osg::Shader::FRAGMENT, strFragment ) );
+        }
+
+        if( strVertex.length() > 0  )
+        {
+            program->addShader( new osg::Shader( osg::Shader::VERTEX, strVertex ) );
+        }
+
+        if( strGeometry.length() > 0  )
+        {
+            program->addShader( new osg::Shader( osg::Shader::GEOMETRY, strGeometry ) );
+        }
 #endif
-            // finally, cache the program so we only regenerate it when it changes.
-            _programMap[ sl ] = program;
+
+        Threading::ScopedMutexLock lock( s_sharedProgramsMutex );
+
+        // another thread may have composed the same program in the meantime; use theirs.
+        SharedProgram              theirs;
+        osg::ref_ptr<osg::Program> theirProgram;
+        if ( findSharedProgram(hash, key, theirs, theirProgram) )
+        {
+            shared  = theirs;
+            program = theirProgram.get();
+            s_programCacheStats._hits++;
+        }
+        else
+        {
+            pruneSharedPrograms();
+            s_sharedPrograms.insert( std::make_pair(hash, shared) );
+            s_programCacheStats._misses++;
+            out_created = true;
         }
+    }
 
-        // finally, apply the program attribute.
-        program->apply( state );
+    const_cast<VirtualProgram*>(this)->setShader( "osgearth_vert_main", shared._vertMain.get() );
+    shaderMap[ ShaderSemantic("osgearth_vert_main", osg::Shader::VERTEX) ] = shared._vertMain.get();
+
+    const_cast<VirtualProgram*>(this)->setShader( "osgearth_frag_main", shared._fragMain.get() );
+    shaderMap[ ShaderSemantic("osgearth_frag_main", osg::Shader::FRAGMENT) ] = shared._fragMain.get();
+
+    // the caller keeps the reference; the cache only observes it.
+    return program;
+}
+
+void
+VirtualProgram::releaseGLObjects( osg::State* state ) const
+{
+    osg::Program::releaseGLObjects( state );
+
+    // the composed programs are the ones that own GL objects.
+    for( ProgramMap::const_iterator i = _programMap.begin(); i != _programMap.end(); ++i )
+    {
+        if ( i->second.valid() )
+            i->second->releaseGLObjects( state );
     }
-    else
+}
+
+void
+VirtualProgram::resizeGLObjectBuffers( unsigned maxSize )
+{
+    osg::Program::resizeGLObjectBuffers( maxSize );
+
+    for( ProgramMap::const_iterator i = _programMap.begin(); i != _programMap.end(); ++i )
     {
-        Program::apply( state );
+        if ( i->second.valid() )
+            i->second->resizeGLObjectBuffers( maxSize );
     }
 }
 
+VirtualProgram::ProgramCacheStats
+VirtualProgram::getProgramCacheStats()
+{
+    Threading::ScopedMutexLock lock( s_sharedProgramsMutex );
+    return s_programCacheStats;
+}
+
 void
 VirtualProgram::getFunctions( FunctionLocationMap& out ) const
 {
@@ -254,21 +468,19 @@ VirtualProgram::getFunctions( FunctionLocationMap& out ) const
 }
 
 void
-VirtualProgram::refreshAccumulatedFunctions( const osg::State& state )
+VirtualProgram::refreshAccumulatedFunctions( const VirtualProgramList& stack )
 {
-    // This method searches the state's attribute stack and accumulates all 
-    // the user functions (including those in this program).
+    // This method accumulates all the user functions of the VirtualPrograms
+    // on the stack (including those in this program).
 
     Threading::ScopedMutexLock lock( _functionsMutex );
 
     _accumulatedFunctions.clear();
 
-    const StateHack::AttributeVec* av = StateHack::GetAttributeVec( state, this );
-    for( StateHack::AttributeVec::const_iterator i = av->begin(); i != av->end(); ++i )
+    for( VirtualProgramList::const_iterator i = stack.begin(); i != stack.end(); ++i )
     {
-        const osg::StateAttribute* sa = i->first;
-        const VirtualProgram* vp = dynamic_cast< const VirtualProgram* >( sa );
-        if( vp && vp != this && ( vp->_mask & _mask ) )
+        const VirtualProgram* vp = *i;
+        if( vp != this )
         {
             FunctionLocationMap rhs;
             vp->getFunctions( rhs );
@@ -297,6 +509,81 @@ VirtualProgram::refreshAccumulatedFunctions( const osg::State& state )
 
 //----------------------------------------------------------------------------
 
+/**
+ * Walks a scene graph, tracking the VirtualPrograms that nest along each path,
+ * and composes the program each one would apply with.
+ */
+class VirtualProgram::Precompiler : public osg::NodeVisitor
+{
+public:
+    Precompiler() : osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN ), _count( 0 ) { }
+
+    void apply( osg::Node& node )
+    {
+        const VirtualProgram* vp = node.getStateSet() ?
+            dynamic_cast<const VirtualProgram*>( node.getStateSet()->getAttribute(osg::StateAttribute::PROGRAM) ) : 0L;
+
+        if ( vp )
+        {
+            _path.push_back( vp );
+            precompile( vp );
+            traverse( node );
+            _path.pop_back();
+        }
+        else
+        {
+            traverse( node );
+        }
+    }
+
+    void precompile( const VirtualProgram* vp )
+    {
+        if ( vp->_shaderMap.empty() )
+            return;
+
+        VirtualProgramList stack;
+        for( unsigned i = 0; i+1 < _path.size(); ++i )
+        {
+            if ( _path[i] != vp && (_path[i]->_mask & vp->_mask) )
+                stack.push_back( _path[i] );
+        }
+        stack.push_back( vp );
+
+        ShaderMap shaderMap;
+        mergeShaders( stack, shaderMap );
+
+        bool created = false;
+        osg::ref_ptr<osg::Program> program = vp->compose( stack, shaderMap, created );
+
+        // seed the program's own cache so its first apply finds it.
+        ShaderList sl;
+        for( ShaderMap::iterator i = shaderMap.begin(); i != shaderMap.end(); ++i )
+            sl.push_back( i->second );
+        vp->_programMap[ sl ] = program;
+
+        if ( created )
+            ++_count;
+    }
+
+    VirtualProgramList _path;
+    unsigned           _count;
+};
+
+unsigned
+VirtualProgram::precompile( osg::Node* node )
+{
+    if ( !node )
+        return 0;
+
+    Precompiler precompiler;
+    node->accept( precompiler );
+
+    OE_INFO << LC << "Precompiled " << precompiler._count << " programs" << std::endl;
+    return precompiler._count;
+}
+
+//----------------------------------------------------------------------------
+
 osg::Shader*
 ShaderFactory::createVertexShaderMain( const FunctionLocationMap& functions ) const
 {
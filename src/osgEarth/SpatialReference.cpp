@@ -1035,28 +1035,9 @@ SpatialReference::transformZ(std::vector<osg::Vec3d>& points,
     if ( _vdatum.get() == outVDatum )
         return true;
 
-    Units inUnits = _vdatum.valid() ? _vdatum->getUnits() : Units::METERS;
-    Units outUnits = outVDatum ? outVDatum->getUnits() : inUnits;
-
     if ( isGeographic() || pointsAreLatLong )
     {
-        for( unsigned i=0; i<points.size(); ++i )
-        {
-            if ( _vdatum.valid() )
-            {
-                // to HAE:
-                points[i].z() = _vdatum->msl2hae( points[i].y(), points[i].x(), points[i].z() );
-            }
-
-            // do the units conversion:
-            points[i].z() = inUnits.convertTo(outUnits, points[i].z());
-
-            if ( outVDatum )
-            {
-                // to MSL:
-                points[i].z() = outVDatum->hae2msl( points[i].y(), points[i].x(), points[i].z() );
-            }
-        }
+        VerticalDatum::transform( _vdatum.get(), outVDatum, points );
     }
 
     else // need to xform input points
@@ -1066,22 +1047,12 @@ SpatialReference::transformZ(std::vector<osg::Vec3d>& points,
         transform( geopoints, getGeographicSRS() );
 
         for( unsigned i=0; i<geopoints.size(); ++i )
-        {
-            if ( _vdatum.valid() )
-            {
-                // to HAE:
-                points[i].z() = _vdatum->msl2hae( geopoints[i].y(), geopoints[i].x(), points[i].z() );
-            }
+            geopoints[i].z() = points[i].z();
 
-            // do the units conversion:
-            points[i].z() = inUnits.convertTo(outUnits, points[i].z());
+        VerticalDatum::transform( _vdatum.get(), outVDatum, geopoints );
 
-            if ( outVDatum )
-            {
-                // to MSL:
-                points[i].z() = outVDatum->hae2msl( geopoints[i].y(), geopoints[i].x(), points[i].z() );
-            }
-        }
+        for( unsigned i=0; i<geopoints.size(); ++i )
+            points[i].z() = geopoints[i].z();
     }
 
     return true;
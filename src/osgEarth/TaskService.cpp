@@ -278,6 +278,28 @@ TaskService::~TaskService()
     }
 }
 
+namespace
+{
+    typedef std::map< std::string, osg::ref_ptr<TaskService> > SharedTaskServices;
+
+    Threading::Mutex   s_sharedMutex;
+    SharedTaskServices s_shared;
+}
+
+TaskService*
+TaskService::getShared( const std::string& name, int numThreads )
+{
+    Threading::ScopedMutexLock lock( s_sharedMutex );
+
+    osg::ref_ptr<TaskService>& service = s_shared[name];
+    if ( !service.valid() )
+        service = new TaskService( name, numThreads );
+    else if ( service->getNumThreads() < numThreads )
+        service->setNumThreads( numThreads );
+
+    return service.get();
+}
+
 int
 TaskService::getStamp() const
 {
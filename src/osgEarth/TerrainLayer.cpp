@@ -21,16 +21,31 @@
 #include <osgEarth/Registry>
 #include <osgEarth/StringUtils>
 #include <osgEarth/URI>
+#include <osgEarth/IOTypes>
 #include <osgDB/WriteFile>
 #include <osg/Version>
 #include <OpenThreads/ScopedLock>
 #include <memory.h>
+#include <sstream>
 
 using namespace osgEarth;
 using namespace OpenThreads;
 
 #define LC "[TerrainLayer] "
 
+// cache bin key under which the tile source blacklist is stored
+#define BLACKLIST_KEY "_blacklist"
+
+// lifetime of a persisted blacklist entry when neither the blacklist nor the
+// cache policy sets one, so that a tile is never blacklisted forever on disk
+#define DEFAULT_BLACKLIST_PERSIST_TTL (7.0*86400.0)
+
+// a blacklist with unsaved changes is stored once this many tiles have been
+// blacklisted, or once it has been this many seconds since it was last stored,
+// so that a crash doesn't lose a whole session's worth
+#define BLACKLIST_STORE_CHANGES  256
+#define BLACKLIST_STORE_INTERVAL 60.0
+
 //------------------------------------------------------------------------
 
 TerrainLayerOptions::TerrainLayerOptions( const ConfigOptions& options ) :
@@ -166,6 +181,8 @@ TerrainLayer::~TerrainLayer()
 {
     if ( _cache.valid() )
     {
+        storeBlacklist();
+
         Threading::ScopedWriteLock exclusive( _cacheBinsMutex );
         for( CacheBinInfoMap::iterator i = _cacheBins.begin(); i != _cacheBins.end(); ++i )
         {
@@ -183,6 +200,81 @@ TerrainLayer::init()
 {
     _tileSourceInitialized = false;
     _tileSize              = 256;
+    _blacklistRevision     = 0;
+    _blacklistWriteable    = false;
+    _blacklistPersistTTL   = 0.0;
+    _blacklistStoredAt     = osg::Timer::instance()->tick();
+}
+
+double
+TerrainLayer::getBlacklistPersistTTL() const
+{
+    if ( _tileSource.valid() && _tileSource->getBlacklist() && _tileSource->getBlacklist()->getTTL() > 0.0 )
+        return _tileSource->getBlacklist()->getTTL();
+    else if ( _runtimeOptions->cachePolicy()->maxAge().isSet() && *_runtimeOptions->cachePolicy()->maxAge() > 0.0 )
+        return *_runtimeOptions->cachePolicy()->maxAge();
+    else
+        return DEFAULT_BLACKLIST_PERSIST_TTL;
+}
+
+void
+TerrainLayer::storeBlacklist()
+{
+    // note: called from the destructor, so only touch TerrainLayer's own members here.
+    Threading::ScopedMutexLock lock( _blacklistStoreMutex );
+    writeBlacklist();
+}
+
+void
+TerrainLayer::storeBlacklistIfDue()
+{
+    if ( !_blacklistWriteable || !_tileSource.valid() || !_tileSource->getBlacklist() )
+        return;
+
+    unsigned changes = _tileSource->getBlacklist()->getRevision() - _blacklistRevision;
+    if ( changes == 0 )
+        return;
+
+    double age = osg::Timer::instance()->delta_s( _blacklistStoredAt, osg::Timer::instance()->tick() );
+    if ( changes < BLACKLIST_STORE_CHANGES && age < BLACKLIST_STORE_INTERVAL )
+        return;
+
+    // a tile loader shouldn't wait on another one's cache write.
+    if ( _blacklistStoreMutex.trylock() != 0 )
+        return;
+
+    writeBlacklist();
+    _blacklistStoreMutex.unlock();
+}
+
+void
+TerrainLayer::writeBlacklist()
+{
+    // note: call with _blacklistStoreMutex held.
+    if ( _blacklistBinId.empty() || !_blacklistWriteable || !_tileSource.valid() )
+        return;
+
+    TileBlacklist* blacklist = _tileSource->getBlacklist();
+    if ( !blacklist || blacklist->getRevision() == _blacklistRevision )
+        return;
+
+    Threading::ScopedReadLock shared( _cacheBinsMutex );
+    CacheBinInfoMap::iterator i = _cacheBins.find( _blacklistBinId );
+    if ( i != _cacheBins.end() && i->second._bin.valid() )
+    {
+        blacklist->purgeExpired();
+
+        std::stringstream buf;
+        blacklist->write( buf, _blacklistPersistTTL );
+
+        osg::ref_ptr<StringObject> obj = new StringObject( buf.str() );
+        _blacklistStoredAt = osg::Timer::instance()->tick();
+        if ( i->second._bin->write( BLACKLIST_KEY, obj.get() ) )
+        {
+            _blacklistRevision = blacklist->getRevision();
+            OE_INFO << LC << "Stored " << blacklist->size() << " blacklisted tiles for layer \"" << getName() << "\"" << std::endl;
+        }
+    }
 }
 
 void
@@ -448,6 +540,27 @@ TerrainLayer::getCacheBin( const Profile* profile, const std::string& binId )
             CacheBinInfo& newInfo = _cacheBins[binId];
             newInfo._metadata = meta;
             newInfo._bin      = newBin.get();
+
+            // the bin in the tile source's own profile also keeps its blacklist,
+            // so that known-empty tiles aren't requested again after a restart.
+            if ( _blacklistBinId.empty() && getTileSource() && getProfile() && profile->isEquivalentTo(getProfile()) )
+            {
+                TileBlacklist* blacklist = getTileSource()->getBlacklist();
+
+                _blacklistPersistTTL = getBlacklistPersistTTL();
+
+                ReadResult r = newBin->readString( BLACKLIST_KEY );
+                if ( r.succeeded() )
+                {
+                    std::istringstream in( r.getString() );
+                    blacklist->merge( in, _blacklistPersistTTL );
+                    OE_INFO << LC << "Loaded " << blacklist->size() << " blacklisted tiles for layer \"" << getName() << "\"" << std::endl;
+                }
+
+                _blacklistBinId     = binId;
+                _blacklistRevision  = blacklist->getRevision();
+                _blacklistWriteable = _runtimeOptions->cachePolicy()->isCacheWriteable();
+            }
         }
         else
         {
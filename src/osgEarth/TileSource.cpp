@@ -38,54 +38,164 @@ using namespace osgEarth;
 
 //------------------------------------------------------------------------
 
-TileBlacklist::TileBlacklist()
+namespace
+{
+    inline unsigned mixBits( unsigned h )
+    {
+        h ^= h >> 16; h *= 0x85ebca6bu;
+        h ^= h >> 13; h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    inline unsigned hashTileID( const osgTerrain::TileID& tile, unsigned seed )
+    {
+        return mixBits( mixBits( mixBits( seed ^ (unsigned)tile.level ) ^ (unsigned)tile.x ) ^ (unsigned)tile.y );
+    }
+
+    // Bloom filter probes are derived from two base hashes (Kirsch-Mitzenmacher).
+    const unsigned NUM_BLOOM_PROBES = 3;
+}
+
+TileBlacklist::TileBlacklist() :
+_ttl( 0.0 )
 {
     //NOP
 }
 
+void
+TileBlacklist::insert(const osgTerrain::TileID& tile, time_t expires)
+{
+    unsigned h1 = hashTileID( tile, 0x9e3779b9u );
+    unsigned h2 = hashTileID( tile, 0x7f4a7c15u ) | 1u;
+
+    Shard& shard = _shards[h1 % NUM_SHARDS];
+    Threading::ScopedWriteLock lock(shard._mutex);
+    shard._tiles[tile] = expires;
+
+    // set the filter bits while holding the shard lock, so that clear() (which
+    // takes every shard lock) can't interleave with us.
+    for( unsigned i=0; i<NUM_BLOOM_PROBES; ++i )
+    {
+        unsigned bit = (h1 + i*h2) % (NUM_BLOOM_WORDS*32);
+        _bloom[bit >> 5].OR( 1u << (bit & 31) );
+    }
+
+    ++_revision;
+}
+
 void
 TileBlacklist::add(const osgTerrain::TileID &tile)
 {
-    Threading::ScopedWriteLock lock(_mutex);
-    _tiles.insert(tile);
+    time_t expires = _ttl > 0.0 ? ::time(0L) + (time_t)_ttl : 0;
+    insert( tile, expires );
     OE_DEBUG << "Added " << tile.level << " (" << tile.x << ", " << tile.y << ") to blacklist" << std::endl;
 }
 
 void
 TileBlacklist::remove(const osgTerrain::TileID &tile)
 {
-    Threading::ScopedWriteLock lock(_mutex);
-    _tiles.erase(tile);
+    // note: the Bloom filter bits stay set; that only costs a shard lookup later.
+    Shard& shard = _shards[hashTileID(tile, 0x9e3779b9u) % NUM_SHARDS];
+    Threading::ScopedWriteLock lock(shard._mutex);
+    if ( shard._tiles.erase(tile) > 0 )
+        ++_revision;
     OE_DEBUG << "Removed " << tile.level << " (" << tile.x << ", " << tile.y << ") from blacklist" << std::endl;
 }
 
 void
 TileBlacklist::clear()
 {
-    Threading::ScopedWriteLock lock(_mutex);
-    _tiles.clear();
+    for( unsigned s=0; s<NUM_SHARDS; ++s )
+        _shards[s]._mutex.writeLock();
+
+    for( unsigned s=0; s<NUM_SHARDS; ++s )
+        _shards[s]._tiles.clear();
+
+    for( unsigned w=0; w<NUM_BLOOM_WORDS; ++w )
+        _bloom[w].exchange( 0u );
+
+    ++_revision;
+
+    for( unsigned s=0; s<NUM_SHARDS; ++s )
+        _shards[s]._mutex.writeUnlock();
+
     OE_DEBUG << "Cleared blacklist" << std::endl;
 }
 
 bool
 TileBlacklist::contains(const osgTerrain::TileID &tile) const
 {
-    Threading::ScopedReadLock lock(const_cast<TileBlacklist*>(this)->_mutex);
-    return _tiles.find(tile) != _tiles.end();
+    unsigned h1 = hashTileID( tile, 0x9e3779b9u );
+    unsigned h2 = hashTileID( tile, 0x7f4a7c15u ) | 1u;
+
+    // lock-free negative check:
+    for( unsigned i=0; i<NUM_BLOOM_PROBES; ++i )
+    {
+        unsigned bit = (h1 + i*h2) % (NUM_BLOOM_WORDS*32);
+        if ( ((unsigned)_bloom[bit >> 5] & (1u << (bit & 31))) == 0u )
+            return false;
+    }
+
+    Shard& shard = _shards[h1 % NUM_SHARDS];
+    Threading::ScopedReadLock lock(shard._mutex);
+    BlacklistedTiles::const_iterator i = shard._tiles.find(tile);
+    return i != shard._tiles.end() && (i->second == 0 || ::time(0L) < i->second);
 }
 
 unsigned int
 TileBlacklist::size() const
 {
-    Threading::ScopedReadLock lock(const_cast<TileBlacklist*>(this)->_mutex);
-    return _tiles.size();
+    time_t now = ::time(0L);
+    unsigned int count = 0;
+    for( unsigned s=0; s<NUM_SHARDS; ++s )
+    {
+        Threading::ScopedReadLock lock(_shards[s]._mutex);
+        for( BlacklistedTiles::const_iterator i = _shards[s]._tiles.begin(); i != _shards[s]._tiles.end(); ++i )
+        {
+            if ( i->second == 0 || now < i->second )
+                ++count;
+        }
+    }
+    return count;
+}
+
+void
+TileBlacklist::purgeExpired()
+{
+    time_t now = ::time(0L);
+    for( unsigned s=0; s<NUM_SHARDS; ++s )
+    {
+        Threading::ScopedWriteLock lock(_shards[s]._mutex);
+        BlacklistedTiles& tiles = _shards[s]._tiles;
+        for( BlacklistedTiles::iterator i = tiles.begin(); i != tiles.end(); )
+        {
+            if ( i->second != 0 && now >= i->second )
+            {
+                tiles.erase( i++ );
+                ++_revision;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
 }
 
 TileBlacklist*
 TileBlacklist::read(std::istream &in)
 {
     osg::ref_ptr< TileBlacklist > result = new TileBlacklist();
+    result->merge( in );
+    return result.release();
+}
 
+void
+TileBlacklist::merge(std::istream &in, double defaultTTL)
+{
+    time_t now = ::time(0L);
+    time_t defaultExpires = defaultTTL > 0.0 ? now + (time_t)defaultTTL : 0;
 
     while (!in.eof())
     {
@@ -93,16 +203,16 @@ TileBlacklist::read(std::istream &in)
         std::getline(in, line);
         if (!line.empty())
         {
+            // "z x y", optionally followed by an expiration time
             int z, x, y;
-            if (sscanf(line.c_str(), "%d %d %d", &z, &x, &y) == 3)
+            long expires = 0;
+            int n = sscanf(line.c_str(), "%d %d %d %ld", &z, &x, &y, &expires);
+            if (n >= 3 && (n == 3 || expires == 0 || (time_t)expires > now))
             {
-                result->add(osgTerrain::TileID(z, x, y ));
+                insert(osgTerrain::TileID(z, x, y), n == 4 && expires != 0 ? (time_t)expires : defaultExpires);
             }
-
         }
     }
-
-    return result.release();
 }
 
 TileBlacklist*
@@ -130,12 +240,21 @@ TileBlacklist::write(const std::string &filename) const
 }
 
 void
-TileBlacklist::write(std::ostream &output) const
+TileBlacklist::write(std::ostream &output, double defaultTTL) const
 {
-    Threading::ScopedReadLock lock(const_cast<TileBlacklist*>(this)->_mutex);
-    for (BlacklistedTiles::const_iterator itr = _tiles.begin(); itr != _tiles.end(); ++itr)
+    time_t now = ::time(0L);
+    time_t defaultExpires = defaultTTL > 0.0 ? now + (time_t)defaultTTL : 0;
+    for( unsigned s=0; s<NUM_SHARDS; ++s )
     {
-        output << itr->level << " " << itr->x << " " << itr->y << std::endl;
+        Threading::ScopedReadLock lock(_shards[s]._mutex);
+        for (BlacklistedTiles::const_iterator itr = _shards[s]._tiles.begin(); itr != _shards[s]._tiles.end(); ++itr)
+        {
+            time_t expires = itr->second != 0 ? itr->second : defaultExpires;
+            if ( expires == 0 )
+                output << itr->first.level << " " << itr->first.x << " " << itr->first.y << std::endl;
+            else if ( now < expires )
+                output << itr->first.level << " " << itr->first.x << " " << itr->first.y << " " << (long)expires << std::endl;
+        }
     }
 }
 
@@ -164,6 +283,7 @@ TileSourceOptions::getConfig() const
     conf.updateIfSet( "nodata_min", _noDataMinValue );
     conf.updateIfSet( "nodata_max", _noDataMaxValue );
     conf.updateIfSet( "blacklist_filename", _blacklistFilename);
+    conf.updateIfSet( "blacklist_ttl", _blacklistTTL);
     conf.updateIfSet( "l2_cache_size", _L2CacheSize );
     conf.updateObjIfSet( "profile", _profileOptions );
     return conf;
@@ -186,6 +306,7 @@ TileSourceOptions::fromConfig( const Config& conf )
     conf.getIfSet( "nodata_min", _noDataMinValue );
     conf.getIfSet( "nodata_max", _noDataMaxValue );
     conf.getIfSet( "blacklist_filename", _blacklistFilename);
+    conf.getIfSet( "blacklist_ttl", _blacklistTTL);
     conf.getIfSet( "l2_cache_size", _L2CacheSize );
     conf.getObjIfSet( "profile", _profileOptions );
 
@@ -242,6 +363,11 @@ _options( options )
         //Initialize the blacklist if we couldn't read it.
         _blacklist = new TileBlacklist();
     }
+
+    if (_options.blacklistTTL().isSet())
+    {
+        _blacklist->setTTL( _options.blacklistTTL().value() );
+    }
 }
 
 TileSource::~TileSource()
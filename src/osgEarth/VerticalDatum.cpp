@@ -21,10 +21,13 @@
 #include <osgEarth/StringUtils>
 #include <osgEarth/ThreadingUtils>
 #include <osgEarth/GeoData>
+#include <osgEarth/Containers>
 
 #include <osgDB/ReadFile>
 #include <osgDB/ReaderWriter>
 
+#include <algorithm>
+
 using namespace osgEarth;
 
 #undef  LC
@@ -37,6 +40,83 @@ namespace
     typedef std::map<std::string, osg::ref_ptr<VerticalDatum> > VDatumCache;
     VDatumCache      _vdatumCache;
     Threading::Mutex _vdataCacheMutex;
+
+    // Identifies a datum by its definition rather than its address, so a grid
+    // is never served for a different datum allocated at a recycled address.
+    // An empty string means HAE (no datum).
+    std::string datumID( const VerticalDatum* datum )
+    {
+        if ( !datum )
+            return std::string();
+        return toLower( datum->getInitString().empty() ? datum->getName() : datum->getInitString() );
+    }
+
+    // Everything a heightfield offset grid depends on: the datum pair and the
+    // lat/long lattice of the tile.
+    struct OffsetGridKey
+    {
+        std::string          _from;
+        std::string          _to;
+        double               _latMin, _lonMin, _latInterval, _lonInterval;
+        unsigned             _cols, _rows;
+
+        bool operator < (const OffsetGridKey& rhs) const
+        {
+            if ( _from        != rhs._from )        return _from        < rhs._from;
+            if ( _to          != rhs._to )          return _to          < rhs._to;
+            if ( _latMin      != rhs._latMin )      return _latMin      < rhs._latMin;
+            if ( _lonMin      != rhs._lonMin )      return _lonMin      < rhs._lonMin;
+            if ( _latInterval != rhs._latInterval ) return _latInterval < rhs._latInterval;
+            if ( _lonInterval != rhs._lonInterval ) return _lonInterval < rhs._lonInterval;
+            if ( _cols        != rhs._cols )        return _cols        < rhs._cols;
+            return _rows < rhs._rows;
+        }
+    };
+
+    typedef LRUCache<OffsetGridKey, osg::ref_ptr<osg::HeightField> > OffsetGridCache;
+    OffsetGridCache  _offsetGridCache( 64 );
+    Threading::Mutex _offsetGridCacheMutex;
+
+    // Builds the grid of additive offsets that converts a (unit-scaled) height
+    // in "from" to a height in "to" at each post of the lattice.
+    osg::HeightField* createOffsetGrid(const OffsetGridKey& key,
+                                       const VerticalDatum* from,
+                                       const VerticalDatum* to,
+                                       double unitScale)
+    {
+        osg::HeightField* grid = new osg::HeightField();
+        grid->allocate( key._cols, key._rows );
+        osg::HeightField::HeightList& offsets = grid->getHeightList();
+        std::fill( offsets.begin(), offsets.end(), 0.0f );
+
+        const Geoid* fromGeoid = from ? from->getGeoid() : 0L;
+        const Geoid* toGeoid   = to   ? to->getGeoid()   : 0L;
+
+        if ( fromGeoid || toGeoid )
+        {
+            osg::ref_ptr<osg::HeightField> geoidGrid = new osg::HeightField();
+            geoidGrid->allocate( key._cols, key._rows );
+            const osg::HeightField::HeightList& geoidHeights = geoidGrid->getHeightList();
+
+            if ( fromGeoid )
+            {
+                // MSL -> HAE, then into the output units:
+                fromGeoid->getHeights( key._latMin, key._lonMin, key._latInterval, key._lonInterval, geoidGrid.get() );
+                for( unsigned i=0; i<offsets.size(); ++i )
+                    offsets[i] = unitScale * geoidHeights[i];
+            }
+
+            if ( toGeoid )
+            {
+                // HAE -> MSL:
+                toGeoid->getHeights( key._latMin, key._lonMin, key._latInterval, key._lonInterval, geoidGrid.get() );
+                for( unsigned i=0; i<offsets.size(); ++i )
+                    offsets[i] -= geoidHeights[i];
+            }
+        }
+
+        return grid;
+    }
 } 
 
 VerticalDatum*
@@ -98,7 +178,7 @@ VerticalDatum::transform(const VerticalDatum* from,
 
     if ( from )
     {
-        in_out_z = from->msl2hae( lat_deg, lon_deg, INTERP_BILINEAR );
+        in_out_z = from->msl2hae( lat_deg, lon_deg, in_out_z );
     }
 
     Units fromUnits = from ? from->getUnits() : Units::METERS;
@@ -108,7 +188,7 @@ VerticalDatum::transform(const VerticalDatum* from,
 
     if ( to )
     {
-        in_out_z = to->hae2msl( lat_deg, lon_deg, INTERP_BILINEAR );
+        in_out_z = to->hae2msl( lat_deg, lon_deg, in_out_z );
     }
 
     return true;
@@ -127,6 +207,39 @@ VerticalDatum::transform(const VerticalDatum* from,
     return ok;
 }
 
+bool
+VerticalDatum::transform(const VerticalDatum*     from,
+                         const VerticalDatum*     to,
+                         std::vector<osg::Vec3d>& points)
+{
+    if ( from == to )
+        return true;
+
+    const Geoid* fromGeoid = from ? from->getGeoid() : 0L;
+    const Geoid* toGeoid   = to   ? to->getGeoid()   : 0L;
+
+    Units fromUnits = from ? from->getUnits() : Units::METERS;
+    Units toUnits   = to   ? to->getUnits()   : fromUnits;
+
+    for( unsigned i=0; i<points.size(); ++i )
+    {
+        osg::Vec3d& p = points[i];
+        double z = p.z();
+
+        if ( fromGeoid )
+            z += fromGeoid->getHeight( p.y(), p.x(), INTERP_BILINEAR );
+
+        z = fromUnits.convertTo( toUnits, z );
+
+        if ( toGeoid )
+            z -= toGeoid->getHeight( p.y(), p.x(), INTERP_BILINEAR );
+
+        p.z() = z;
+    }
+
+    return true;
+}
+
 bool
 VerticalDatum::transform(const VerticalDatum* from,
                          const VerticalDatum* to,
@@ -138,30 +251,68 @@ VerticalDatum::transform(const VerticalDatum* from,
 
     unsigned cols = hf->getNumColumns();
     unsigned rows = hf->getNumRows();
-    osg::Vec3d sw = hf->getOrigin();
-    osg::Vec3d ne;
-    ne.x() = sw.x() + hf->getXInterval()*double(rows);
-    ne.y() = sw.y() + hf->getYInterval()*double(cols);
-    double xstep = hf->getXInterval();
-    double ystep = hf->getYInterval();
+    if ( cols < 2 || rows < 2 )
+        return false;
+
+    // establish the lat/long lattice of the heightfield posts:
+    osg::Vec3d sw( extent.xMin(), extent.yMin(), 0.0 );
+    osg::Vec3d ne( extent.xMax(), extent.yMax(), 0.0 );
 
     if ( !extent.getSRS()->isGeographic() )
     {
         const SpatialReference* geoSRS = extent.getSRS()->getGeographicSRS();
         extent.getSRS()->transform(sw, geoSRS, sw);
         extent.getSRS()->transform(ne, geoSRS, ne);
-        xstep = (ne.x()-sw.x()) / double(cols);
-        ystep = (ne.y()-sw.y()) / double(rows);
     }
 
-    for( unsigned c=0; c<cols; ++c)
+    OffsetGridKey key;
+    key._from        = datumID( from );
+    key._to          = datumID( to );
+    key._latMin      = sw.y();
+    key._lonMin      = sw.x();
+    key._latInterval = (ne.y()-sw.y()) / double(rows-1);
+    key._lonInterval = (ne.x()-sw.x()) / double(cols-1);
+    key._cols        = cols;
+    key._rows        = rows;
+
+    Units fromUnits = from ? from->getUnits() : Units::METERS;
+    Units toUnits   = to   ? to->getUnits()   : fromUnits;
+    double unitScale = fromUnits.convertTo( toUnits, 1.0 );
+
+    osg::ref_ptr<osg::HeightField> offsetGrid;
+    {
+        Threading::ScopedMutexLock lock( _offsetGridCacheMutex );
+        OffsetGridCache::Record rec = _offsetGridCache.get( key );
+        if ( rec.valid() )
+            offsetGrid = rec.value().get();
+    }
+
+    if ( !offsetGrid.valid() )
+    {
+        offsetGrid = createOffsetGrid( key, from, to, unitScale );
+
+        Threading::ScopedMutexLock lock( _offsetGridCacheMutex );
+        _offsetGridCache.insert( key, offsetGrid.get() );
+    }
+
+    // apply the offsets, leaving NO_DATA posts alone:
+    osg::HeightField::HeightList&       heights = hf->getHeightList();
+    const osg::HeightField::HeightList& offsets = offsetGrid->getHeightList();
+
+    if ( unitScale == 1.0 )
+    {
+        for( unsigned i=0; i<heights.size(); ++i )
+        {
+            if ( heights[i] != NO_DATA_VALUE )
+                heights[i] += offsets[i];
+        }
+    }
+    else
     {
-        double lon = sw.x() + xstep*double(c);
-        for( unsigned r=0; r<rows; ++r)
+        for( unsigned i=0; i<heights.size(); ++i )
         {
-            double lat = sw.y() + ystep*double(r);
-            float& h = hf->getHeight(r, c);
-            VerticalDatum::transform( from, to, lat, lon, h );
+            if ( heights[i] != NO_DATA_VALUE )
+                heights[i] = unitScale * heights[i] + offsets[i];
         }
     }
 
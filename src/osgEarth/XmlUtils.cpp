@@ -20,11 +20,14 @@
 #include <osgEarth/XmlUtils>
 #include <osgEarth/StringUtils>
 #include <osgEarth/HTTPClient>
+#include <osgEarth/IOTypes>
 #include <osg/Notify>
 #include "tinyxml.h"
 #include <algorithm>
 #include <sstream>
 #include <iomanip>
+#include <cstring>
+#include <cstdlib>
 
 
 using namespace osgEarth;
@@ -422,6 +425,133 @@ XmlDocument::load( std::istream& in, const URIContext& uriContext )
     return doc;    
 }
 
+void
+XmlStreamHandler::appendCondensed( const std::string& text, std::string& out )
+{
+    // a space is only written once a later character follows it.
+    bool pendingSpace = false;
+    for( std::string::const_iterator i = text.begin(); i != text.end(); ++i )
+    {
+        char c = *i;
+        if ( c == ' ' || c == '\t' || c == '\n' || c == '\r' )
+        {
+            pendingSpace = !out.empty();
+        }
+        else
+        {
+            if ( pendingSpace )
+                out += ' ';
+            out += c;
+            pendingSpace = false;
+        }
+    }
+}
+
+namespace
+{
+    // builds a Config in place from XmlStreamReader events.
+    struct ConfigBuilder : public XmlStreamHandler
+    {
+        Config                   _doc;
+        std::vector<Config*>     _stack;
+        std::vector<std::string> _text;
+        int                      _skip;
+
+        ConfigBuilder() : _doc("Document"), _skip(0)
+        {
+            _stack.push_back( &_doc );
+            _text.push_back( std::string() );
+        }
+
+        void startElement( const std::string& name, const XmlAttributes& attrs )
+        {
+            // like XmlDocument, keep only the first top-level element.
+            if ( _skip > 0 || (_stack.size() == 1 && !_doc.children().empty()) )
+            {
+                ++_skip;
+                return;
+            }
+
+            // safe to hold: a parent gets no new children until this one closes.
+            Config& conf = _stack.back()->addChild( name );
+            for( XmlAttributes::const_iterator a = attrs.begin(); a != attrs.end(); ++a )
+                conf.add( a->first, a->second );
+
+            _stack.push_back( &conf );
+            _text.push_back( std::string() );
+        }
+
+        void endElement( const std::string& name )
+        {
+            if ( _skip > 0 )
+            {
+                --_skip;
+                return;
+            }
+            _stack.back()->value() = trim( _text.back() );
+            _stack.pop_back();
+            _text.pop_back();
+        }
+
+        void characters( const std::string& text, bool cdata )
+        {
+            if ( _skip > 0 || _stack.size() == 1 )
+                return;
+            if ( cdata )
+                _text.back() += text;
+            else
+                appendCondensed( text, _text.back() );
+        }
+    };
+}
+
+bool
+XmlDocument::loadConfig( std::istream& in, Config& output, const URIContext& uriContext )
+{
+    // parse straight from the caller's stream if it can be rewound for the
+    // fallback below; otherwise read it once and parse from that buffer.
+    std::streampos start = in.tellg();
+    bool seekable = start != std::streampos(-1);
+
+    std::string xmlStr;
+    if ( !seekable )
+    {
+        std::vector<char> chunk( 65536 );
+        while( in.read(&chunk[0], chunk.size()) || in.gcount() > 0 )
+            xmlStr.append( &chunk[0], (size_t)in.gcount() );
+        start = 0;
+    }
+
+    MemoryStreamBuf buffered( xmlStr.data(), xmlStr.size() );
+    std::istream    bufferedStream( &buffered );
+    std::istream&   source = seekable ? in : bufferedStream;
+
+    XmlStreamReader reader( source );
+    ConfigBuilder builder;
+
+    if ( reader.parse(builder) && !builder._doc.children().empty() )
+    {
+        output.swap( builder._doc );
+        output.setReferrer( URI("", uriContext).full() );
+        return true;
+    }
+
+    // the stream reader is stricter than TinyXML in places; let TinyXML have a go.
+    // That parse is several times slower and builds the whole DOM, so say so.
+    OE_WARN << "XmlDocument::loadConfig: falling back to the TinyXML parse of "
+        << (uriContext.referrer().empty() ? "a stream" : uriContext.referrer())
+        << " (" << reader.getError() << ")" << std::endl;
+
+    source.clear();
+    source.seekg( start );
+    osg::ref_ptr<XmlDocument> doc = load( source, uriContext );
+    if ( !doc.valid() )
+        return false;
+
+    output = doc->getConfig();
+    return true;
+}
+
 Config
 XmlDocument::getConfig() const
 {
@@ -476,3 +606,334 @@ XmlDocument::store( std::ostream& out ) const
         storeNode( i->get(), 0, out );
     }*/
 }
+
+//------------------------------------------------------------------------
+
+#define XML_STREAM_BUFFER_SIZE 65536
+
+XmlStreamReader::XmlStreamReader( std::istream& in ) :
+_in       ( in ),
+_buf      ( XML_STREAM_BUFFER_SIZE ),
+_pos      ( 0 ),
+_len      ( 0 ),
+_bytesRead( 0 ),
+_line     ( 1 )
+{
+    //nop
+}
+
+bool
+XmlStreamReader::fill()
+{
+    if ( !_in.good() )
+        return false;
+    _in.read( &_buf[0], _buf.size() );
+    _len = (size_t)_in.gcount();
+    _pos = 0;
+    return _len > 0;
+}
+
+inline bool
+XmlStreamReader::get( char& c )
+{
+    if ( _pos >= _len && !fill() )
+        return false;
+    c = _buf[_pos++];
+    ++_bytesRead;
+    if ( c == '\n' )
+        ++_line;
+    return true;
+}
+
+bool
+XmlStreamReader::skipPast( const char* terminator )
+{
+    size_t len = ::strlen( terminator );
+
+    // KMP failure table, so that a mismatch falls back to the longest partial
+    // match still in play (e.g. "--->" must still end a comment).
+    std::vector<size_t> fallback( len, 0 );
+    for( size_t i=1, k=0; i<len; ++i )
+    {
+        while( k > 0 && terminator[i] != terminator[k] )
+            k = fallback[k-1];
+        if ( terminator[i] == terminator[k] )
+            ++k;
+        fallback[i] = k;
+    }
+
+    size_t matched = 0;
+    char c;
+    while( get(c) )
+    {
+        while( matched > 0 && c != terminator[matched] )
+            matched = fallback[matched-1];
+
+        if ( c == terminator[matched] && ++matched == len )
+            return true;
+    }
+    return fail( Stringify() << "unexpected end of input; expected \"" << terminator << "\"" );
+}
+
+bool
+XmlStreamReader::fail( const std::string& msg )
+{
+    _error = Stringify() << msg << " (line " << _line << ")";
+    return false;
+}
+
+namespace
+{
+    void appendUTF8( unsigned long cp, std::string& out )
+    {
+        if ( cp < 0x80 ) {
+            out += (char)cp;
+        }
+        else if ( cp < 0x800 ) {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+        else if ( cp < 0x10000 ) {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+        else {
+            out += (char)(0xF0 | (cp >> 18));
+            out += (char)(0x80 | ((cp >> 12) & 0x3F));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    inline bool isSpace( char c )
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    inline std::string lowerCase( const std::string& in )
+    {
+        std::string out( in );
+        std::transform( out.begin(), out.end(), out.begin(), tolower );
+        return out;
+    }
+}
+
+void
+XmlStreamReader::decode( const std::string& in, std::string& out ) const
+{
+    out.clear();
+    out.reserve( in.size() );
+
+    for( std::string::size_type i = 0; i < in.size(); ++i )
+    {
+        if ( in[i] != '&' )
+        {
+            out += in[i];
+            continue;
+        }
+
+        std::string::size_type end = in.find( ';', i );
+        if ( end == std::string::npos || end - i > 10 )
+        {
+            out += in[i];
+            continue;
+        }
+
+        std::string entity = in.substr( i+1, end-i-1 );
+        if      ( entity == "lt" )   out += '<';
+        else if ( entity == "gt" )   out += '>';
+        else if ( entity == "amp" )  out += '&';
+        else if ( entity == "quot" ) out += '"';
+        else if ( entity == "apos" ) out += '\'';
+        else if ( entity.size() > 1 && entity[0] == '#' )
+        {
+            bool hex = entity[1] == 'x' || entity[1] == 'X';
+            unsigned long cp = ::strtoul( entity.c_str() + (hex ? 2 : 1), 0L, hex ? 16 : 10 );
+            appendUTF8( cp, out );
+        }
+        else
+        {
+            // unknown entity; leave it as-is.
+            out += in.substr( i, end-i+1 );
+        }
+        i = end;
+    }
+}
+
+bool
+XmlStreamReader::readTag( XmlStreamHandler& handler )
+{
+    char c;
+    if ( !get(c) )
+        return fail( "unexpected end of input" );
+
+    // processing instruction, e.g. <?xml ... ?>
+    if ( c == '?' )
+        return skipPast( "?>" );
+
+    if ( c == '!' )
+    {
+        if ( !get(c) )
+            return fail( "unexpected end of input" );
+
+        // comment
+        if ( c == '-' )
+        {
+            if ( !get(c) || c != '-' )
+                return fail( "malformed comment" );
+            return skipPast( "-->" );
+        }
+
+        // CDATA section
+        if ( c == '[' )
+        {
+            const char* cdata = "CDATA[";
+            for( const char* p = cdata; *p; ++p )
+            {
+                if ( !get(c) || c != *p )
+                    return fail( "malformed CDATA section" );
+            }
+
+            std::string text;
+            while( get(c) )
+            {
+                text += c;
+                if ( text.size() >= 3 && text.compare(text.size()-3, 3, "]]>") == 0 )
+                {
+                    text.resize( text.size()-3 );
+                    handler.characters( text, true );
+                    return true;
+                }
+            }
+            return fail( "unexpected end of input in CDATA section" );
+        }
+
+        // declaration (e.g. DOCTYPE), possibly with an internal subset
+        int depth = 0;
+        do {
+            if      ( c == '[' ) ++depth;
+            else if ( c == ']' ) --depth;
+            else if ( c == '>' && depth <= 0 ) return true;
+        }
+        while( get(c) );
+        return fail( "unexpected end of input in declaration" );
+    }
+
+    // end tag
+    if ( c == '/' )
+    {
+        std::string name;
+        while( get(c) && c != '>' )
+        {
+            if ( !isSpace(c) )
+                name += c;
+        }
+        if ( c != '>' )
+            return fail( "unexpected end of input in end tag" );
+
+        name = lowerCase( name );
+        if ( _open.empty() || _open.back() != name )
+            return fail( Stringify() << "mismatched end tag </" << name << ">" );
+
+        _open.pop_back();
+        handler.endElement( name );
+        return true;
+    }
+
+    // start tag
+    std::string name( 1, c );
+    while( get(c) && !isSpace(c) && c != '/' && c != '>' )
+        name += c;
+
+    XmlAttributes attrs;
+    bool empty = false;
+
+    for( ;; )
+    {
+        while( isSpace(c) && get(c) );
+
+        if ( c == '>' )
+            break;
+
+        if ( c == '/' )
+        {
+            if ( !get(c) || c != '>' )
+                return fail( "malformed empty-element tag" );
+            empty = true;
+            break;
+        }
+
+        std::string attrName;
+        while( c != '=' && !isSpace(c) && c != '>' && c != '/' )
+        {
+            attrName += c;
+            if ( !get(c) )
+                return fail( "unexpected end of input in tag" );
+        }
+
+        while( isSpace(c) && get(c) );
+        if ( c != '=' )
+            return fail( Stringify() << "missing value for attribute \"" << attrName << "\"" );
+
+        while( get(c) && isSpace(c) );
+        if ( c != '"' && c != '\'' )
+            return fail( Stringify() << "unquoted value for attribute \"" << attrName << "\"" );
+
+        char quote = c;
+        std::string raw;
+        while( get(c) && c != quote )
+            raw += c;
+        if ( c != quote )
+            return fail( "unexpected end of input in attribute value" );
+
+        std::string value;
+        decode( raw, value );
+        attrs[lowerCase(attrName)] = value;
+
+        if ( !get(c) )
+            return fail( "unexpected end of input in tag" );
+    }
+
+    name = lowerCase( name );
+    handler.startElement( name, attrs );
+
+    if ( empty )
+        handler.endElement( name );
+    else
+        _open.push_back( name );
+
+    return true;
+}
+
+bool
+XmlStreamReader::parse( XmlStreamHandler& handler )
+{
+    std::string text, decoded;
+    char c;
+
+    while( get(c) )
+    {
+        if ( c == '<' )
+        {
+            if ( !text.empty() )
+            {
+                decode( text, decoded );
+                handler.characters( decoded, false );
+                text.clear();
+            }
+
+            if ( !readTag(handler) )
+                return false;
+        }
+        else
+        {
+            text += c;
+        }
+    }
+
+    if ( !_open.empty() )
+        return fail( Stringify() << "unexpected end of input; <" << _open.back() << "> is not closed" );
+
+    return true;
+}
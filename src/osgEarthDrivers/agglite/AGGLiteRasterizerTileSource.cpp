@@ -25,7 +25,10 @@
 //TODO: replace this with ImageRasterizer
 #include <osgEarthSymbology/AGG.h>
 #include <osgEarth/Registry>
+#include <osgEarth/Containers>
 #include <osgEarth/FileUtils>
+#include <osgEarth/TaskService>
+#include <osgEarth/ThreadingUtils>
 
 #include <osg/Notify>
 #include <osgDB/FileNameUtils>
@@ -38,6 +41,10 @@
 //#include "agg.h"
 
 #include <sstream>
+#include <map>
+#include <vector>
+#include <cmath>
+#include <cfloat>
 #include <OpenThreads/Mutex>
 #include <OpenThreads/ScopedLock>
 
@@ -51,11 +58,97 @@ using namespace OpenThreads;
 
 /********************************************************************/
 
+namespace
+{
+    /** One feature's geometry in image pixel coordinates, ready to rasterize. */
+    struct RasterShape
+    {
+        std::vector< std::vector<osg::Vec2d> > _parts;
+        agg::rgba8 _color;
+        int        _yMin, _yMax; // rows the shape may touch
+    };
+
+    typedef std::vector<RasterShape> RasterShapeList;
+
+    /**
+     * Rasterizes the shapes, in order, into the image rows [y0, y1). Shapes are
+     * fed to the rasterizer exactly as a full-image pass would feed them, and
+     * only the scanlines are shifted into the band, so each band's pixels come
+     * out the same as they would from one pass over the whole image.
+     */
+    void renderBand( const RasterShapeList& shapes, osg::Image* image, int y0, int y1 )
+    {
+        agg::rendering_buffer rbuf( image->data(0, y0), image->s(), y1-y0, image->s()*4 );
+        agg::renderer<agg::span_abgr32> ren(rbuf);
+        agg::rasterizer ras;
+
+        ras.gamma(1.3);
+        ras.filling_rule(agg::fill_even_odd);
+
+        for( RasterShapeList::const_iterator s = shapes.begin(); s != shapes.end(); ++s )
+        {
+            if ( s->_yMax < y0 || s->_yMin >= y1 )
+                continue;
+
+            for( unsigned p=0; p<s->_parts.size(); ++p )
+            {
+                const std::vector<osg::Vec2d>& part = s->_parts[p];
+                for( unsigned v=0; v<part.size(); ++v )
+                {
+                    if ( v == 0 )
+                        ras.move_to_d( part[v].x(), part[v].y() );
+                    else
+                        ras.line_to_d( part[v].x(), part[v].y() );
+                }
+            }
+            ras.render(ren, s->_color, 0, -y0);
+            ras.reset();
+        }
+    }
+
+    struct RenderBand
+    {
+        void init( const RasterShapeList* shapes, osg::Image* image, int y0, int y1 )
+        {
+            _shapes = shapes; _image = image; _y0 = y0; _y1 = y1;
+        }
+
+        void execute()
+        {
+            renderBand( *_shapes, _image, _y0, _y1 );
+        }
+
+        const RasterShapeList* _shapes;
+        osg::Image*            _image;
+        int                    _y0, _y1;
+    };
+
+    /** Identifies a feature's buffered line geometry. */
+    struct BufferKey
+    {
+        FeatureID _fid;
+        double    _distance;
+        double    _minLength;
+        int       _capStyle;
+
+        bool operator < ( const BufferKey& rhs ) const
+        {
+            if ( _fid != rhs._fid ) return _fid < rhs._fid;
+            if ( _distance != rhs._distance ) return _distance < rhs._distance;
+            if ( _minLength != rhs._minLength ) return _minLength < rhs._minLength;
+            return _capStyle < rhs._capStyle;
+        }
+    };
+}
+
+/********************************************************************/
+
 class AGGLiteRasterizerTileSource : public FeatureTileSource
 {
 public:
     AGGLiteRasterizerTileSource( const TileSourceOptions& options ) : FeatureTileSource( options ),
-        _options( options )
+        _options( options ),
+        _bufferCache( _options.lineBufferCacheSize().value() )
     {
         //nop
     }
@@ -184,14 +277,8 @@ public:
             // downsample the line data so that it is no higher resolution than to image to which
             // we intend to rasterize it. If you don't do this, you run the risk of the buffer 
             // operation taking forever on very high-res input data.
-            if ( _options.optimizeLineSampling() == true )
-            {
-                ResampleFilter resample;
-                resample.minLength() = osg::minimum( xres, yres );
-                context = resample.push( linesToBuffer, context );
-            }
+            double minLength = _options.optimizeLineSampling() == true ? osg::minimum( xres, yres ) : 0.0;
 
-            // now run the buffer operation on all lines:
             BufferFilter buffer;
             float lineWidth = 0.5;
             if ( masterLine )
@@ -209,7 +296,56 @@ public:
             else
                 buffer.distance() = lineWidth;
 
-            buffer.push( linesToBuffer, context );
+            // neighboring tiles at the same level buffer the same lines with the same
+            // parameters; reuse those results when the cache is enabled.
+            unsigned cacheSize = _options.lineBufferCacheSize().value();
+            BufferKey key;
+            key._distance  = buffer.distance().value();
+            key._minLength = minLength;
+            key._capStyle  = (int)buffer.capStyle();
+
+            if ( cacheSize > 0 )
+            {
+                Threading::ScopedMutexLock lock( _bufferCacheMutex );
+                for( FeatureList::iterator i = linesToBuffer.begin(); i != linesToBuffer.end(); )
+                {
+                    key._fid = i->get()->getFID();
+                    BufferCache::Record rec = _bufferCache.get( key );
+                    if ( rec.valid() )
+                    {
+                        i->get()->setGeometry( rec.value()->clone() );
+                        i = linesToBuffer.erase( i );
+                    }
+                    else ++i;
+                }
+            }
+
+            // downsample the line data so that it is no higher resolution than to image to which
+            // we intend to rasterize it. If you don't do this, you run the risk of the buffer 
+            // operation taking forever on very high-res input data.
+            if ( _options.optimizeLineSampling() == true && linesToBuffer.size() > 0 )
+            {
+                ResampleFilter resample;
+                resample.minLength() = minLength;
+                context = resample.push( linesToBuffer, context );
+            }
+
+            // now run the buffer operation on all lines:
+            if ( linesToBuffer.size() > 0 )
+            {
+                buffer.push( linesToBuffer, context );
+            }
+
+            if ( cacheSize > 0 && linesToBuffer.size() > 0 )
+            {
+                // the cache evicts its least-recently-used entries as it fills.
+                Threading::ScopedMutexLock lock( _bufferCacheMutex );
+                for( FeatureList::iterator i = linesToBuffer.begin(); i != linesToBuffer.end(); ++i )
+                {
+                    key._fid = i->get()->getFID();
+                    _bufferCache.insert( key, i->get()->getGeometry()->clone() );
+                }
+            }
         }
 
         // First, transform the features into the map's SRS:
@@ -217,17 +353,6 @@ public:
         xform.setLocalizeCoordinates( false );
         context = xform.push( features, context );
 
-        // set up the AGG renderer:
-        agg::rendering_buffer rbuf( image->data(), image->s(), image->t(), image->s()*4 );
-
-        // Create the renderer and the rasterizer
-        agg::renderer<agg::span_abgr32> ren(rbuf);
-        agg::rasterizer ras;
-
-        // Setup the rasterizer
-        ras.gamma(1.3);
-        ras.filling_rule(agg::fill_even_odd);
-
         GeoExtent cropExtent = GeoExtent(imageExtent);
         cropExtent.scale(1.1, 1.1);
 
@@ -245,7 +370,10 @@ public:
         if ( masterLine )
             color = masterLine->stroke()->color();
 
-        // render the features
+        // convert the features into pixel-space shapes:
+        RasterShapeList shapes;
+        shapes.reserve( features.size() );
+
         for(FeatureList::iterator i = features.begin(); i != features.end(); i++)
         {
             Feature* feature = i->get();
@@ -257,11 +385,16 @@ public:
             if ( ! geometry->crop( cropPoly.get(), croppedGeometry ) )
                 continue;
 
+            shapes.push_back( RasterShape() );
+            RasterShape& shape = shapes.back();
+
             // set up a default color:
             osg::Vec4 c = color;
             unsigned int a = (unsigned int)(127+(c.a()*255)/2); // scale alpha up
             agg::rgba8 fgColor( (unsigned int)(c.r()*255), (unsigned int)(c.g()*255), (unsigned int)(c.b()*255), a );
 
+            double yMin = DBL_MAX, yMax = -DBL_MAX;
+
             GeometryIterator gi( croppedGeometry.get() );
             while( gi.hasMore() )
             {
@@ -293,25 +426,54 @@ public:
                 a = (unsigned int)(127+(c.a()*255)/2); // scale alpha up
                 fgColor = agg::rgba8( (unsigned int)(c.r()*255), (unsigned int)(c.g()*255), (unsigned int)(c.b()*255), a );
 
-                ras.filling_rule( agg::fill_even_odd );
+                shape._parts.push_back( std::vector<osg::Vec2d>() );
+                std::vector<osg::Vec2d>& part = shape._parts.back();
+                part.reserve( g->size() );
+
                 for( Geometry::iterator p = g->begin(); p != g->end(); p++ )
                 {
                     const osg::Vec3d& p0 = *p;
                     double x0 = xf*(p0.x()-xmin);
                     double y0 = yf*(p0.y()-ymin);
+                    part.push_back( osg::Vec2d(x0, y0) );
 
-                    //const osg::Vec3d& p1 = p+1 != g->end()? *(p+1) : g->front();
-                    //double x1 = xf*(p1.x()-xmin);
-                    //double y1 = yf*(p1.y()-ymin);
-
-                    if ( p == g->begin() )
-                        ras.move_to_d( x0, y0 );
-                    else
-                        ras.line_to_d( x0, y0 );
+                    if ( y0 < yMin ) yMin = y0;
+                    if ( y0 > yMax ) yMax = y0;
                 }
             }
-            ras.render(ren, fgColor);
-            ras.reset();
+
+            // the color of the last part applies to the whole feature.
+            shape._color = fgColor;
+            shape._yMin  = yMin <= yMax ? (int)floor(yMin) - 1 : 0;
+            shape._yMax  = yMin <= yMax ? (int)ceil(yMax) + 1  : -1;
+        }
+
+        // rasterize, in parallel bands if so configured:
+        int numBands = osg::minimum( (int)_options.renderThreads().value(), image->t()/16 );
+
+        if ( numBands <= 1 || shapes.size() == 0 )
+        {
+            renderBand( shapes, image, 0, image->t() );
+        }
+        else
+        {
+            int rowsPerBand = (image->t() + numBands - 1) / numBands;
+            numBands = (image->t() + rowsPerBand - 1) / rowsPerBand;
+
+            TaskService* service = TaskService::getShared( "AGGLite rasterizer", (int)numBands );
+            Threading::MultiEvent semaphore( numBands );
+            std::vector< osg::ref_ptr< ParallelTask<RenderBand> > > jobs( numBands );
+
+            for( int b=0; b<numBands; ++b )
+            {
+                int y0 = b*rowsPerBand;
+                int y1 = osg::minimum( y0+rowsPerBand, image->t() );
+                jobs[b] = new ParallelTask<RenderBand>( &semaphore );
+                jobs[b]->init( &shapes, image, y0, y1 );
+                service->add( jobs[b].get() );
+            }
+
+            semaphore.wait();
         }
 
         bd->_pass++;
@@ -321,13 +483,15 @@ public:
     //override
     bool postProcess( osg::Image* image, osg::Referenced* data )
     {
-		//convert from ABGR to RGBA
-		unsigned char* pixel = image->data();
-		for(int i=0; i<image->s()*image->t()*4; i+=4, pixel+=4)
-		{
-			std::swap( pixel[0], pixel[3] );
-			std::swap( pixel[1], pixel[2] );
-		}
+        //convert from ABGR to RGBA by reversing the bytes of each pixel. Working on
+        //whole 32-bit words (independent of byte order) lets the compiler vectorize it.
+        unsigned int* pixel = reinterpret_cast<unsigned int*>( image->data() );
+        unsigned int* end   = pixel + image->s()*image->t();
+        for( ; pixel != end; ++pixel )
+        {
+            unsigned int v = *pixel;
+            *pixel = (v >> 24) | ((v >> 8) & 0x0000ff00u) | ((v << 8) & 0x00ff0000u) | (v << 24);
+        }
         return true;
     }
 
@@ -339,6 +503,10 @@ public:
 private:
     const AGGLiteOptions _options;
     std::string _configPath;
+
+    typedef LRUCache< BufferKey, osg::ref_ptr<Geometry> > BufferCache;
+    BufferCache      _bufferCache;
+    Threading::Mutex _bufferCacheMutex;
 };
 
 // Reads tiles from a TileCache disk cache.
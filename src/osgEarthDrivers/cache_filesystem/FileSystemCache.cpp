@@ -17,6 +17,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "FileSystemCache"
+#include "PackedCacheBin"
 #include <osgEarth/Cache>
 #include <osgEarth/StringUtils>
 #include <osgEarth/ThreadingUtils>
@@ -60,7 +61,11 @@ namespace
 
         void init();
 
+        CacheBin* createBin( const std::string& name );
+
         std::string            _rootPath;
+        FileSystemCacheOptions _fsOptions;
+        Threading::Mutex       _addBinMutex;
     };
 
     /** 
@@ -140,10 +145,10 @@ namespace
 namespace
 {
     FileSystemCache::FileSystemCache( const CacheOptions& options ) :
-    Cache( options )
+    Cache     ( options ),
+    _fsOptions( options )
     {
-        FileSystemCacheOptions fsco( options );
-        _rootPath = URI( *fsco.rootPath(), options.referrer() ).full();
+        _rootPath = URI( *_fsOptions.rootPath(), options.referrer() ).full();
         init();
     }
 
@@ -158,10 +163,22 @@ namespace
         }
     }
 
+    CacheBin*
+    FileSystemCache::createBin( const std::string& name )
+    {
+        if ( _fsOptions.format() == "packed" )
+            return new PackedCacheBin( name, _rootPath, _fsOptions );
+        else
+            return new FileSystemCacheBin( name, _rootPath );
+    }
+
     CacheBin*
     FileSystemCache::addBin( const std::string& name )
     {
-        return _bins.getOrCreate( name, new FileSystemCacheBin( name, _rootPath ) );
+        // A packed bin owns its index file, so never open one just to throw it away.
+        Threading::ScopedMutexLock lock( _addBinMutex );
+        CacheBin* bin = _bins.get( name );
+        return bin ? bin : _bins.getOrCreate( name, createBin( name ) );
     }
 
     CacheBin*
@@ -173,7 +190,7 @@ namespace
             Threading::ScopedMutexLock lock( s_defaultBinMutex );
             if ( !_defaultBin.valid() ) // double-check
             {
-                _defaultBin = new FileSystemCacheBin( "__default", _rootPath );
+                _defaultBin = createBin( "__default" );
             }
         }
         return _defaultBin.get();
@@ -0,0 +1,1202 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2010 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "PackedCacheBin"
+#include <osgEarth/StringUtils>
+#include <osgEarth/Registry>
+#include <osgEarth/URI>
+#include <osgDB/FileUtils>
+#include <osgDB/FileNameUtils>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#ifdef _WIN32
+#   include <io.h>
+#else
+#   include <unistd.h>
+#   include <sys/mman.h>
+#endif
+
+using namespace osgEarth;
+using namespace osgEarth::Drivers;
+using namespace osgEarth::Threading;
+
+#define LC "[PackedCacheBin] "
+
+#define INDEX_MAGIC      0x4f45504bu  // "OEPK"
+#define INDEX_VERSION    1u
+#define RECORD_MAGIC     0x4f455243u  // "OERC"
+#define INITIAL_CAPACITY 4096u
+#define SEGMENT_PREFIX   "segment."
+#define INDEX_FILENAME   "index.oepk"
+
+// fraction of dead space (and minimum cache size) that triggers compaction
+#define COMPACTION_RATIO     0.5
+#define COMPACTION_MIN_BYTES (64u*1024u*1024u)
+
+namespace
+{
+    struct RecordHeader
+    {
+        uint32_t _magic;
+        uint32_t _keyLength;
+        uint32_t _metaLength;
+        uint32_t _dataLength;
+        int64_t  _timestamp;
+        uint32_t _checksum;
+        uint32_t _reserved;
+    };
+
+    // secondary key hash (FNV-1a), paired with hashString to form a 64-bit key.
+    uint32_t hash2( const std::string& input )
+    {
+        uint32_t h = 2166136261u;
+        for( std::string::const_iterator i = input.begin(); i != input.end(); ++i )
+        {
+            h ^= (unsigned char)(*i);
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    uint32_t checksum( const char* data, size_t len )
+    {
+        uint32_t h = 2166136261u;
+        for( size_t i=0; i<len; ++i )
+        {
+            h ^= (unsigned char)data[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    // Compact binary encoding of a Config tree, used for inline record metadata.
+    void encodeString( const std::string& s, std::string& buf )
+    {
+        uint32_t len = s.size();
+        buf.append( (const char*)&len, sizeof(len) );
+        buf.append( s );
+    }
+
+    void encodeConfig( const Config& conf, std::string& buf )
+    {
+        encodeString( conf.key(), buf );
+        encodeString( conf.value(), buf );
+        uint32_t n = conf.children().size();
+        buf.append( (const char*)&n, sizeof(n) );
+        for( ConfigSet::const_iterator i = conf.children().begin(); i != conf.children().end(); ++i )
+            encodeConfig( *i, buf );
+    }
+
+    bool decodeString( const char*& p, const char* end, std::string& out )
+    {
+        uint32_t len;
+        if ( p + sizeof(len) > end ) return false;
+        memcpy( &len, p, sizeof(len) );
+        p += sizeof(len);
+        if ( p + len > end ) return false;
+        out.assign( p, len );
+        p += len;
+        return true;
+    }
+
+    bool decodeConfig( const char*& p, const char* end, Config& conf )
+    {
+        std::string key, value;
+        if ( !decodeString(p, end, key) || !decodeString(p, end, value) )
+            return false;
+
+        conf = Config( key, value );
+
+        uint32_t n;
+        if ( p + sizeof(n) > end ) return false;
+        memcpy( &n, p, sizeof(n) );
+        p += sizeof(n);
+
+        for( uint32_t i=0; i<n; ++i )
+        {
+            Config child;
+            if ( !decodeConfig(p, end, child) )
+                return false;
+            conf.add( child );
+        }
+        return true;
+    }
+
+    int64_t now()
+    {
+        return (int64_t)::time(0L);
+    }
+
+    uint64_t fileSize( const std::string& path )
+    {
+        struct stat buf;
+        return ::stat( path.c_str(), &buf ) == 0 ? (uint64_t)buf.st_size : 0u;
+    }
+
+    int64_t fileTime( const std::string& path )
+    {
+        struct stat buf;
+        return ::stat( path.c_str(), &buf ) == 0 ? (int64_t)buf.st_mtime : now();
+    }
+
+    bool readFile( const std::string& path, std::string& out )
+    {
+        std::ifstream in( path.c_str(), std::ios::binary );
+        if ( !in.is_open() )
+            return false;
+        std::stringstream buf;
+        buf << in.rdbuf();
+        out = buf.str();
+        return true;
+    }
+}
+
+//------------------------------------------------------------------------
+
+PackedCacheBin::PackedCacheBin(const std::string&            binID,
+                               const std::string&            rootPath,
+                               const FileSystemCacheOptions& options) :
+CacheBin         ( binID ),
+_ok              ( true ),
+_indexMem        ( 0L ),
+_indexMemSize    ( 0 ),
+_indexFD         ( -1 ),
+_header          ( 0L ),
+_entries         ( 0L ),
+_activeFile      ( 0L ),
+_activeSize      ( 0 ),
+_liveBytes       ( 0 ),
+_totalBytes      ( 0 ),
+_writesSinceCheck( 0 ),
+_compactor       ( 0L ),
+_compacting      ( false ),
+_shuttingDown    ( false )
+{
+    _binPath   = osgDB::concatPaths( rootPath, binID );
+    _metaPath  = osgDB::concatPaths( _binPath, "osgearth_cacheinfo.json" );
+    _indexPath = osgDB::concatPaths( _binPath, INDEX_FILENAME );
+    _maxSegmentSize = (uint64_t)(*options.maxSegmentSize()) * 1024u * 1024u;
+
+    OE_INFO << LC << "Initializing packed cache bin: " << _binPath << std::endl;
+
+    osgDB::makeDirectoryForFile( _metaPath );
+    if ( !osgDB::fileExists( _binPath ) )
+    {
+        OE_WARN << LC << "FAILED to create folder for cache bin at \"" << _binPath << "\"" << std::endl;
+        _ok = false;
+        return;
+    }
+
+    _rw = osgDB::Registry::instance()->getReaderWriterForExtension( "osgb" );
+#ifdef OSGEARTH_HAVE_ZLIB
+    _rwOptions = Registry::instance()->cloneOrCreateOptions();
+    _rwOptions->setOptionString( "Compressor=zlib" );
+#endif
+
+    // Use the existing index only if it was closed cleanly; otherwise it may
+    // not reflect what actually made it into the segments.
+    bool clean =
+        openIndex( 0, false ) &&
+        _header->_clean == 1;
+
+    if ( !clean )
+    {
+        if ( _header )
+        {
+            OE_WARN << LC << "Index for bin \"" << binID << "\" was not closed cleanly; rebuilding" << std::endl;
+        }
+        closeIndex( false );
+        ::unlink( _indexPath.c_str() );
+
+        if ( !openIndex(INITIAL_CAPACITY, true) )
+        {
+            OE_WARN << LC << "FAILED to create index at \"" << _indexPath << "\"" << std::endl;
+            _ok = false;
+            return;
+        }
+        rebuildIndex();
+    }
+
+    // tally up the live and total sizes so we know when to compact.
+    for( uint32_t i=0; i<_header->_capacity; ++i )
+        _liveBytes += _entries[i]._length;
+
+    std::vector<uint32_t> segments;
+    listSegments( segments );
+    for( std::vector<uint32_t>::iterator s = segments.begin(); s != segments.end(); ++s )
+        _totalBytes += fileSize( segmentPath(*s) );
+
+    // from here on the index is dirty until we close it.
+    _header->_clean = 0;
+
+    if ( !openActiveSegment(_header->_activeSegment) )
+    {
+        _ok = false;
+        return;
+    }
+
+    if ( options.migrate() == true )
+    {
+        unsigned num = importFiles( *options.removeMigrated() );
+        if ( num > 0 )
+        {
+            OE_INFO << LC << "Migrated " << num << " records into packed bin \"" << binID << "\"" << std::endl;
+        }
+    }
+}
+
+PackedCacheBin::~PackedCacheBin()
+{
+    ScopedMutexLock compactorLock( _compactorMutex );
+    stopCompactor();
+
+    ScopedWriteLock exclusive( _rwmutex );
+
+    closeReadHandles();
+
+    if ( _activeFile )
+    {
+        // the segment must be on disk before the index is marked clean.
+        syncActiveSegment();
+        ::fclose( _activeFile );
+        _activeFile = 0L;
+    }
+
+    closeIndex( true );
+}
+
+//------------------------------------------------------------------------
+// Index management
+
+bool
+PackedCacheBin::openIndex( uint32_t capacity, bool create )
+{
+    size_t size = 0;
+
+#ifndef _WIN32
+    _indexFD = ::open( _indexPath.c_str(), create ? (O_RDWR|O_CREAT|O_TRUNC) : O_RDWR, 0644 );
+    if ( _indexFD < 0 )
+        return false;
+
+    if ( create )
+    {
+        size = sizeof(IndexHeader) + capacity*sizeof(IndexEntry);
+        if ( ::ftruncate(_indexFD, size) != 0 )
+        {
+            ::close( _indexFD );
+            _indexFD = -1;
+            return false;
+        }
+    }
+    else
+    {
+        struct stat buf;
+        if ( ::fstat(_indexFD, &buf) != 0 || (size_t)buf.st_size < sizeof(IndexHeader) )
+        {
+            ::close( _indexFD );
+            _indexFD = -1;
+            return false;
+        }
+        size = buf.st_size;
+    }
+
+    void* mem = ::mmap( 0L, size, PROT_READ|PROT_WRITE, MAP_SHARED, _indexFD, 0 );
+    if ( mem == MAP_FAILED )
+    {
+        ::close( _indexFD );
+        _indexFD = -1;
+        return false;
+    }
+    _indexMem = mem;
+
+#else
+    // No mmap; keep the index on the heap and write it back when it closes.
+    std::string existing;
+    if ( create )
+    {
+        size = sizeof(IndexHeader) + capacity*sizeof(IndexEntry);
+        _indexMem = ::calloc( size, 1 );
+    }
+    else
+    {
+        if ( !readFile(_indexPath, existing) || existing.size() < sizeof(IndexHeader) )
+            return false;
+        size = existing.size();
+        _indexMem = ::malloc( size );
+        memcpy( _indexMem, existing.data(), size );
+    }
+#endif
+
+    _indexMemSize = size;
+    _header  = static_cast<IndexHeader*>( _indexMem );
+    _entries = reinterpret_cast<IndexEntry*>( static_cast<char*>(_indexMem) + sizeof(IndexHeader) );
+
+    if ( create )
+    {
+        _header->_magic         = INDEX_MAGIC;
+        _header->_version       = INDEX_VERSION;
+        _header->_capacity      = capacity;
+        _header->_count         = 0;
+        _header->_clean         = 0;
+        _header->_activeSegment = 0;
+    }
+    else if (
+        _header->_magic   != INDEX_MAGIC   ||
+        _header->_version != INDEX_VERSION ||
+        size != sizeof(IndexHeader) + _header->_capacity*sizeof(IndexEntry) )
+    {
+        OE_WARN << LC << "Index at \"" << _indexPath << "\" is invalid" << std::endl;
+        closeIndex( false );
+        return false;
+    }
+
+    return true;
+}
+
+void
+PackedCacheBin::closeIndex( bool clean )
+{
+    if ( !_indexMem )
+        return;
+
+    _header->_clean = clean ? 1 : 0;
+
+#ifndef _WIN32
+    ::msync( _indexMem, _indexMemSize, MS_SYNC );
+    ::munmap( _indexMem, _indexMemSize );
+    ::close( _indexFD );
+    _indexFD = -1;
+#else
+    std::ofstream out( _indexPath.c_str(), std::ios::binary | std::ios::trunc );
+    out.write( static_cast<const char*>(_indexMem), _indexMemSize );
+    out.close();
+    ::free( _indexMem );
+#endif
+
+    _indexMem     = 0L;
+    _indexMemSize = 0;
+    _header       = 0L;
+    _entries      = 0L;
+}
+
+bool
+PackedCacheBin::growIndex()
+{
+    std::vector<IndexEntry> live;
+    live.reserve( _header->_count );
+    for( uint32_t i=0; i<_header->_capacity; ++i )
+        if ( _entries[i]._length > 0 )
+            live.push_back( _entries[i] );
+
+    uint32_t newCapacity = _header->_capacity * 2;
+    uint32_t active      = _header->_activeSegment;
+
+    closeIndex( false );
+    if ( !openIndex(newCapacity, true) )
+    {
+        OE_WARN << LC << "FAILED to grow index at \"" << _indexPath << "\"" << std::endl;
+        _ok = false;
+        return false;
+    }
+
+    _header->_activeSegment = active;
+
+    for( std::vector<IndexEntry>::const_iterator i = live.begin(); i != live.end(); ++i )
+    {
+        IndexEntry* e = insert( i->_hash, i->_hash2 );
+        *e = *i;
+    }
+
+    return true;
+}
+
+PackedCacheBin::IndexEntry*
+PackedCacheBin::find( uint32_t h1, uint32_t h2 )
+{
+    uint32_t mask = _header->_capacity - 1;
+    for( uint32_t i = h1 & mask, n = 0; n < _header->_capacity; i = (i+1) & mask, ++n )
+    {
+        IndexEntry& e = _entries[i];
+        if ( e._length == 0 )
+            return 0L;
+        if ( e._hash == h1 && e._hash2 == h2 )
+            return &e;
+    }
+    return 0L;
+}
+
+PackedCacheBin::IndexEntry*
+PackedCacheBin::insert( uint32_t h1, uint32_t h2 )
+{
+    IndexEntry* e = find( h1, h2 );
+    if ( e )
+        return e;
+
+    // keep the load factor under 70%:
+    if ( (_header->_count+1) * 10 > _header->_capacity * 7 )
+    {
+        if ( !growIndex() )
+            return 0L;
+    }
+
+    uint32_t mask = _header->_capacity - 1;
+    uint32_t i = h1 & mask;
+    while( _entries[i]._length != 0 )
+        i = (i+1) & mask;
+
+    e = &_entries[i];
+    e->_hash   = h1;
+    e->_hash2  = h2;
+    e->_length = 0;
+    _header->_count++;
+    return e;
+}
+
+void
+PackedCacheBin::rebuildIndex()
+{
+    std::vector<uint32_t> segments;
+    listSegments( segments );
+
+    unsigned numRecords = 0;
+
+    for( std::vector<uint32_t>::iterator s = segments.begin(); s != segments.end(); ++s )
+    {
+        std::string path = segmentPath( *s );
+        uint64_t    size = fileSize( path );
+        uint64_t    offset = 0;
+
+        FILE* file = ::fopen( path.c_str(), "rb" );
+        if ( !file )
+            continue;
+
+        std::string payload;
+        while( offset + sizeof(RecordHeader) <= size )
+        {
+            RecordHeader h;
+            if ( ::fread(&h, sizeof(h), 1, file) != 1 )
+                break;
+
+            uint64_t payloadLength = (uint64_t)h._keyLength + h._metaLength + h._dataLength;
+            if ( h._magic != RECORD_MAGIC || offset + sizeof(h) + payloadLength > size )
+                break;
+
+            payload.resize( payloadLength );
+            if ( payloadLength > 0 && ::fread(&payload[0], payloadLength, 1, file) != 1 )
+                break;
+
+            if ( checksum(payload.data(), payload.size()) != h._checksum )
+                break;
+
+            std::string key = payload.substr( 0, h._keyLength );
+            IndexEntry* e = insert( hashString(key), hash2(key) );
+            if ( !e )
+                break;
+
+            e->_segment   = *s;
+            e->_offset    = offset;
+            e->_length    = sizeof(h) + payloadLength;
+            e->_timestamp = h._timestamp;
+
+            offset += e->_length;
+            ++numRecords;
+        }
+
+        ::fclose( file );
+
+        // discard anything after the last good record (e.g. a write torn by a crash)
+        if ( offset < size )
+        {
+            OE_WARN << LC << "Truncating damaged segment \"" << path << "\" at offset " << offset << std::endl;
+#ifndef _WIN32
+            if ( ::truncate(path.c_str(), offset) != 0 )
+                OE_WARN << LC << "FAILED to truncate \"" << path << "\"" << std::endl;
+#endif
+        }
+    }
+
+    _header->_activeSegment = segments.size() > 0 ? segments.back() : 0;
+
+    OE_INFO << LC << "Rebuilt index for bin \"" << getID() << "\" with " << numRecords << " records" << std::endl;
+}
+
+unsigned
+PackedCacheBin::getNumRecords() const
+{
+    return _header ? _header->_count : 0;
+}
+
+//------------------------------------------------------------------------
+// Segment management
+
+std::string
+PackedCacheBin::segmentPath( uint32_t segment ) const
+{
+    char buf[32];
+    sprintf( buf, SEGMENT_PREFIX "%06u", segment );
+    return osgDB::concatPaths( _binPath, buf );
+}
+
+void
+PackedCacheBin::listSegments( std::vector<uint32_t>& out ) const
+{
+    osgDB::DirectoryContents dc = osgDB::getDirectoryContents( _binPath );
+    for( osgDB::DirectoryContents::const_iterator i = dc.begin(); i != dc.end(); ++i )
+    {
+        if ( startsWith(*i, SEGMENT_PREFIX) )
+            out.push_back( as<uint32_t>( i->substr(strlen(SEGMENT_PREFIX)), 0u ) );
+    }
+    std::sort( out.begin(), out.end() );
+}
+
+bool
+PackedCacheBin::openActiveSegment( uint32_t segment )
+{
+    if ( _activeFile )
+    {
+        syncActiveSegment();
+        ::fclose( _activeFile );
+    }
+
+    std::string path = segmentPath( segment );
+    _activeFile = ::fopen( path.c_str(), "ab" );
+    if ( !_activeFile )
+    {
+        OE_WARN << LC << "FAILED to open segment \"" << path << "\" for writing" << std::endl;
+        return false;
+    }
+
+    _activeSize = fileSize( path );
+    _header->_activeSegment = segment;
+    return true;
+}
+
+void
+PackedCacheBin::syncActiveSegment()
+{
+    if ( !_activeFile )
+        return;
+
+    ::fflush( _activeFile );
+#ifdef _WIN32
+    ::_commit( ::_fileno(_activeFile) );
+#else
+    ::fsync( ::fileno(_activeFile) );
+#endif
+}
+
+int
+PackedCacheBin::getReadHandle( uint32_t segment )
+{
+    ScopedMutexLock lock( _handlesMutex );
+    SegmentHandles::iterator i = _readHandles.find( segment );
+    if ( i != _readHandles.end() )
+        return i->second;
+
+#ifdef _WIN32
+    int fd = ::_open( segmentPath(segment).c_str(), _O_RDONLY | _O_BINARY );
+#else
+    int fd = ::open( segmentPath(segment).c_str(), O_RDONLY );
+#endif
+    if ( fd >= 0 )
+        _readHandles[segment] = fd;
+    return fd;
+}
+
+void
+PackedCacheBin::closeReadHandles()
+{
+    ScopedMutexLock lock( _handlesMutex );
+    for( SegmentHandles::iterator i = _readHandles.begin(); i != _readHandles.end(); ++i )
+    {
+#ifdef _WIN32
+        ::_close( i->second );
+#else
+        ::close( i->second );
+#endif
+    }
+    _readHandles.clear();
+}
+
+bool
+PackedCacheBin::readRaw( uint32_t segment, uint64_t offset, uint32_t length, std::string& out )
+{
+    int fd = getReadHandle( segment );
+    if ( fd < 0 )
+        return false;
+
+    out.resize( length );
+
+#ifdef _WIN32
+    // no positional reads; serialize access to the shared handle.
+    ScopedMutexLock lock( _handlesMutex );
+    if ( ::_lseeki64(fd, offset, SEEK_SET) < 0 )
+        return false;
+    return ::_read( fd, &out[0], length ) == (int)length;
+#else
+    return ::pread( fd, &out[0], length, (off_t)offset ) == (ssize_t)length;
+#endif
+}
+
+bool
+PackedCacheBin::appendRaw( const std::string& record, uint32_t h1, uint32_t h2, int64_t timestamp )
+{
+    // roll over to a new segment if this one is full.
+    if ( _activeSize > 0 && _activeSize + record.size() > _maxSegmentSize )
+    {
+        if ( !openActiveSegment(_header->_activeSegment + 1) )
+            return false;
+    }
+
+    if ( ::fwrite(record.data(), record.size(), 1, _activeFile) != 1 )
+        return false;
+    ::fflush( _activeFile );
+
+    uint64_t offset = _activeSize;
+    _activeSize += record.size();
+    _totalBytes += record.size();
+
+    // the data is in place; now point the index at it.
+    IndexEntry* e = insert( h1, h2 );
+    if ( !e )
+        return false;
+
+    _liveBytes -= e->_length;
+    _liveBytes += record.size();
+
+    e->_segment   = _header->_activeSegment;
+    e->_offset    = offset;
+    e->_length    = record.size();
+    e->_timestamp = timestamp;
+    return true;
+}
+
+bool
+PackedCacheBin::append( const std::string& key, const std::string& data, const Config& meta, int64_t timestamp )
+{
+    std::string metaBuf;
+    if ( !meta.empty() )
+        encodeConfig( meta, metaBuf );
+
+    std::string record;
+    record.reserve( sizeof(RecordHeader) + key.size() + metaBuf.size() + data.size() );
+    record.resize( sizeof(RecordHeader) );
+    record.append( key );
+    record.append( metaBuf );
+    record.append( data );
+
+    RecordHeader h;
+    h._magic      = RECORD_MAGIC;
+    h._keyLength  = key.size();
+    h._metaLength = metaBuf.size();
+    h._dataLength = data.size();
+    h._timestamp  = timestamp;
+    h._checksum   = checksum( record.data() + sizeof(h), record.size() - sizeof(h) );
+    h._reserved   = 0;
+    memcpy( &record[0], &h, sizeof(h) );
+
+    return appendRaw( record, hashString(key), hash2(key), timestamp );
+}
+
+bool
+PackedCacheBin::readRecord( const IndexEntry& entry, const std::string& key, std::string& data, Config& meta )
+{
+    std::string record;
+    if ( !readRaw(entry._segment, entry._offset, entry._length, record) )
+        return false;
+
+    RecordHeader h;
+    memcpy( &h, record.data(), sizeof(h) );
+
+    if (h._magic != RECORD_MAGIC ||
+        sizeof(h) + h._keyLength + h._metaLength + h._dataLength != entry._length ||
+        record.compare(sizeof(h), h._keyLength, key) != 0 )
+    {
+        return false;
+    }
+
+    if ( h._metaLength > 0 )
+    {
+        const char* p   = record.data() + sizeof(h) + h._keyLength;
+        const char* end = p + h._metaLength;
+        decodeConfig( p, end, meta );
+    }
+
+    data = record.substr( sizeof(h) + h._keyLength + h._metaLength, h._dataLength );
+    return true;
+}
+
+//------------------------------------------------------------------------
+// CacheBin interface
+
+ReadResult
+PackedCacheBin::read( const std::string& key, double maxAge, RecordType type )
+{
+    if ( !_ok ) return ReadResult();
+
+    std::string mangled = toLegalFileName( key );
+    std::string data;
+    Config      meta;
+    {
+        ScopedReadLock sharedLock( _rwmutex );
+
+        IndexEntry* e = find( hashString(mangled), hash2(mangled) );
+        if ( !e )
+            return ReadResult();
+
+        if ( maxAge < DBL_MAX && (double)(now() - e->_timestamp) > maxAge )
+            return ReadResult();
+
+        if ( !readRecord(*e, mangled, data, meta) )
+            return ReadResult();
+    }
+
+    std::istringstream in( data );
+    osgDB::ReaderWriter::ReadResult r;
+
+    if ( type == TYPE_IMAGE )
+        r = _rw->readImage( in, _rwOptions.get() );
+    else if ( type == TYPE_NODE )
+        r = _rw->readNode( in, _rwOptions.get() );
+    else
+        r = _rw->readObject( in, _rwOptions.get() );
+
+    if ( !r.success() )
+        return ReadResult();
+
+    return ReadResult( r.getObject(), meta );
+}
+
+ReadResult
+PackedCacheBin::readImage( const std::string& key, double maxAge )
+{
+    return read( key, maxAge, TYPE_IMAGE );
+}
+
+ReadResult
+PackedCacheBin::readObject( const std::string& key, double maxAge )
+{
+    return read( key, maxAge, TYPE_OBJECT );
+}
+
+ReadResult
+PackedCacheBin::readNode( const std::string& key, double maxAge )
+{
+    return read( key, maxAge, TYPE_NODE );
+}
+
+ReadResult
+PackedCacheBin::readString( const std::string& key, double maxAge )
+{
+    ReadResult r = readObject( key, maxAge );
+    return r.succeeded() && r.get<StringObject>() ? r : ReadResult();
+}
+
+bool
+PackedCacheBin::write( const std::string& key, const osg::Object* object, const Config& meta )
+{
+    if ( !_ok || !object ) return false;
+
+    // serialize outside the lock:
+    std::stringstream out;
+    osgDB::ReaderWriter::WriteResult r;
+
+    if ( dynamic_cast<const osg::Image*>(object) )
+        r = _rw->writeImage( *static_cast<const osg::Image*>(object), out, _rwOptions.get() );
+    else if ( dynamic_cast<const osg::Node*>(object) )
+        r = _rw->writeNode( *static_cast<const osg::Node*>(object), out, _rwOptions.get() );
+    else
+        r = _rw->writeObject( *object, out );
+
+    bool ok = r.success();
+    if ( ok )
+    {
+        bool compact;
+        {
+            ScopedWriteLock exclusiveLock( _rwmutex );
+            ok = append( toLegalFileName(key), out.str(), meta, now() );
+            compact = checkCompaction();
+        }
+
+        // the compactor takes the write lock itself, so start it outside.
+        if ( compact )
+            startCompactor();
+    }
+
+    if ( ok )
+    {
+        OE_DEBUG << LC << "Wrote \"" << key << "\" to cache bin " << getID() << std::endl;
+    }
+    else
+    {
+        OE_WARN << LC << "FAILED to write \"" << key << "\" to cache bin " << getID() << std::endl;
+    }
+
+    return ok;
+}
+
+bool
+PackedCacheBin::isCached( const std::string& key, double maxAge )
+{
+    if ( !_ok ) return false;
+
+    std::string mangled = toLegalFileName( key );
+
+    ScopedReadLock sharedLock( _rwmutex );
+    IndexEntry* e = find( hashString(mangled), hash2(mangled) );
+    return e && (maxAge == DBL_MAX || (double)(now() - e->_timestamp) <= maxAge);
+}
+
+bool
+PackedCacheBin::purge()
+{
+    if ( !_ok ) return false;
+
+    // a running compactor holds its own list of segments; stop it before they vanish.
+    ScopedMutexLock compactorLock( _compactorMutex );
+    stopCompactor();
+
+    ScopedWriteLock exclusiveLock( _rwmutex );
+
+    _shuttingDown = false;
+    _compacting   = false;
+
+    closeReadHandles();
+
+    if ( _activeFile )
+    {
+        ::fclose( _activeFile );
+        _activeFile = 0L;
+    }
+
+    bool allOK = true;
+
+    std::vector<uint32_t> segments;
+    listSegments( segments );
+    for( std::vector<uint32_t>::iterator s = segments.begin(); s != segments.end(); ++s )
+    {
+        if ( ::unlink(segmentPath(*s).c_str()) != 0 )
+            allOK = false;
+    }
+
+    closeIndex( false );
+    ::unlink( _indexPath.c_str() );
+
+    if ( !openIndex(INITIAL_CAPACITY, true) || !openActiveSegment(0) )
+    {
+        _ok = false;
+        return false;
+    }
+
+    _liveBytes  = 0;
+    _totalBytes = 0;
+
+    return allOK;
+}
+
+Config
+PackedCacheBin::readMetadata()
+{
+    if ( !_ok ) return Config();
+
+    ScopedReadLock sharedLock( _rwmutex );
+
+    Config conf;
+    conf.fromJSON( URI(_metaPath).readString(0L,CachePolicy::NO_CACHE).getString() );
+    return conf;
+}
+
+bool
+PackedCacheBin::writeMetadata( const Config& conf )
+{
+    if ( !_ok ) return false;
+
+    ScopedWriteLock exclusiveLock( _rwmutex );
+
+    std::fstream output( _metaPath.c_str(), std::ios_base::out );
+    if ( output.is_open() )
+    {
+        output << conf.toJSON(true);
+        output.flush();
+        output.close();
+        return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------
+// Compaction
+
+// Call with the write lock held. Returns true if the caller should start the
+// compactor (after releasing the lock).
+bool
+PackedCacheBin::checkCompaction()
+{
+    if ( ++_writesSinceCheck < 256 || _compacting )
+        return false;
+
+    _writesSinceCheck = 0;
+
+    if ( _totalBytes < COMPACTION_MIN_BYTES )
+        return false;
+
+    double dead = (double)(_totalBytes - _liveBytes) / (double)_totalBytes;
+    if ( dead < COMPACTION_RATIO )
+        return false;
+
+    // start a fresh segment so that every existing segment becomes compactable.
+    if ( _activeSize > 0 )
+        openActiveSegment( _header->_activeSegment + 1 );
+
+    _compacting = true;
+    return true;
+}
+
+// Call without holding the write lock.
+void
+PackedCacheBin::startCompactor()
+{
+    ScopedMutexLock lock( _compactorMutex );
+
+    if ( _shuttingDown )
+    {
+        _compacting = false;
+        return;
+    }
+
+    // a previous run has already finished (_compacting was clear), so this won't block.
+    if ( _compactor )
+    {
+        _compactor->join();
+        delete _compactor;
+    }
+
+    _compactor = new Compactor( this );
+    _compactor->start();
+}
+
+// Call with _compactorMutex held and without the write lock. Leaves _shuttingDown set.
+void
+PackedCacheBin::stopCompactor()
+{
+    _shuttingDown = true;
+    if ( _compactor )
+    {
+        _compactor->join();
+        delete _compactor;
+        _compactor = 0L;
+    }
+}
+
+void
+PackedCacheBin::compact()
+{
+    struct Live
+    {
+        uint32_t _h1, _h2, _length;
+        uint64_t _offset;
+        int64_t  _timestamp;
+    };
+
+    std::vector<uint32_t> segments;
+    uint32_t active;
+    {
+        ScopedReadLock sharedLock( _rwmutex );
+        listSegments( segments );
+        active = _header->_activeSegment;
+    }
+
+    unsigned moved = 0;
+
+    for( std::vector<uint32_t>::iterator s = segments.begin(); s != segments.end() && !_shuttingDown; ++s )
+    {
+        if ( *s >= active )
+            continue;
+
+        // collect the live records in this segment:
+        std::vector<Live> live;
+        {
+            ScopedReadLock sharedLock( _rwmutex );
+            for( uint32_t i=0; i<_header->_capacity; ++i )
+            {
+                const IndexEntry& e = _entries[i];
+                if ( e._length > 0 && e._segment == *s )
+                {
+                    Live r = { e._hash, e._hash2, e._length, e._offset, e._timestamp };
+                    live.push_back( r );
+                }
+            }
+        }
+
+        // move them, a batch at a time so readers aren't starved:
+        const unsigned batch = 64;
+        for( unsigned i = 0; i < live.size() && !_shuttingDown; i += batch )
+        {
+            ScopedWriteLock exclusiveLock( _rwmutex );
+            for( unsigned j = i; j < live.size() && j < i+batch; ++j )
+            {
+                const Live& r = live[j];
+
+                // skip it if it was rewritten since we looked.
+                IndexEntry* e = find( r._h1, r._h2 );
+                if ( !e || e->_segment != *s || e->_offset != r._offset )
+                    continue;
+
+                std::string record;
+                if ( readRaw(*s, r._offset, r._length, record) && appendRaw(record, r._h1, r._h2, r._timestamp) )
+                    ++moved;
+            }
+        }
+
+        if ( _shuttingDown )
+            break;
+
+        // nothing refers to the segment any more; delete it.
+        {
+            ScopedWriteLock exclusiveLock( _rwmutex );
+
+            // the moved copies must be on disk before the originals go.
+            syncActiveSegment();
+
+            ScopedMutexLock lock( _handlesMutex );
+            SegmentHandles::iterator h = _readHandles.find( *s );
+            if ( h != _readHandles.end() )
+            {
+#ifdef _WIN32
+                ::_close( h->second );
+#else
+                ::close( h->second );
+#endif
+                _readHandles.erase( h );
+            }
+
+            std::string path = segmentPath( *s );
+            _totalBytes -= fileSize( path );
+            ::unlink( path.c_str() );
+        }
+    }
+
+    OE_INFO << LC << "Compacted bin \"" << getID() << "\"; moved " << moved << " records" << std::endl;
+
+    _compacting = false;
+}
+
+//------------------------------------------------------------------------
+// Migration
+
+namespace
+{
+    void findFiles( const std::string& dir, const std::string& relDir, std::vector<std::string>& out )
+    {
+        osgDB::DirectoryContents dc = osgDB::getDirectoryContents( dir );
+        for( osgDB::DirectoryContents::const_iterator i = dc.begin(); i != dc.end(); ++i )
+        {
+            if ( *i == "." || *i == ".." )
+                continue;
+
+            std::string full = osgDB::concatPaths( dir, *i );
+            std::string rel  = relDir.empty() ? *i : relDir + "/" + *i;
+
+            osgDB::FileType type = osgDB::fileType( full );
+            if ( type == osgDB::DIRECTORY )
+                findFiles( full, rel, out );
+            else if ( type == osgDB::REGULAR_FILE && endsWith(*i, ".osgb") )
+                out.push_back( rel );
+        }
+    }
+}
+
+unsigned
+PackedCacheBin::importFiles( bool removeImported )
+{
+    if ( !_ok ) return 0;
+
+    // In the one-file-per-record layout, a record lives at <bin>/<legal key>.osgb
+    // (with optional JSON metadata in <legal key>.meta), so the relative path
+    // minus the extension is exactly the key we index.
+    std::vector<std::string> files;
+    findFiles( _binPath, "", files );
+
+    unsigned count = 0;
+
+    for( std::vector<std::string>::const_iterator f = files.begin(); f != files.end(); ++f )
+    {
+        std::string key      = f->substr( 0, f->length() - 5 );
+        std::string dataPath = osgDB::concatPaths( _binPath, *f );
+        std::string metaPath = osgDB::concatPaths( _binPath, key + ".meta" );
+        bool        hasMeta  = osgDB::fileExists( metaPath );
+
+        // keep the file's own age, so max-age expiry still means what it did.
+        int64_t timestamp = fileTime( dataPath );
+
+        // a record already imported (on an earlier open, when the files were
+        // kept) is skipped unless the file has changed since.
+        bool current;
+        {
+            ScopedReadLock sharedLock( _rwmutex );
+            IndexEntry* e = find( hashString(key), hash2(key) );
+            current = e && e->_timestamp >= timestamp;
+        }
+
+        if ( current )
+        {
+            if ( removeImported )
+            {
+                ::unlink( dataPath.c_str() );
+                if ( hasMeta )
+                    ::unlink( metaPath.c_str() );
+            }
+            continue;
+        }
+
+        std::string data;
+        if ( !readFile(dataPath, data) )
+            continue;
+
+        Config meta;
+        std::string metaJSON;
+        if ( hasMeta && readFile(metaPath, metaJSON) )
+            meta.fromJSON( metaJSON );
+
+        bool ok;
+        {
+            ScopedWriteLock exclusiveLock( _rwmutex );
+            ok = append( key, data, meta, timestamp );
+        }
+
+        if ( ok )
+        {
+            ++count;
+            if ( removeImported )
+            {
+                ::unlink( dataPath.c_str() );
+                if ( hasMeta )
+                    ::unlink( metaPath.c_str() );
+            }
+        }
+    }
+
+    return count;
+}
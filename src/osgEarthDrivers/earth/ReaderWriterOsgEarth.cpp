@@ -141,18 +141,17 @@ class ReaderWriterEarth : public osgDB::ReaderWriter
             //if ( uriContext.empty() && options && options->getDatabasePathList().size() > 0 )
             //    uriContext = URIContext( options->getDatabasePathList().front() + "/" );
 
-            osg::ref_ptr<XmlDocument> doc = XmlDocument::load( in, uriContext );            
-            if ( !doc.valid() )
+            Config docConf;
+            if ( !XmlDocument::loadConfig( in, docConf, uriContext ) )
                 return ReadResult::ERROR_IN_READING_FILE;
 
-            Config docConf = doc->getConfig();
-
             // support both "map" and "earth" tag names at the top level
             Config conf;
-            if ( docConf.hasChild( "map" ) )
-                conf = docConf.child( "map" );
-            else if ( docConf.hasChild( "earth" ) )
-                conf = docConf.child( "earth" );
+            Config* top = docConf.mutable_child( "map" );
+            if ( !top )
+                top = docConf.mutable_child( "earth" );
+            if ( top )
+                conf.swap( *top );
 
             MapNode* mapNode =0L;
             if ( !conf.empty() )
@@ -21,6 +21,8 @@
 #include "GeodeticManifold"
 #include <osgEarth/Cube>
 #include <osgEarthDrivers/tms/TMSOptions>
+#include <osg/Camera>
+#include <osg/Stats>
 
 using namespace osgEarth::Drivers;
 
@@ -80,6 +82,25 @@ DRoamNode::cull( osg::NodeVisitor* nv )
     // data variance .. so hopefully this is safe.
     _mesh->_amrGeom->setDrawList( _mesh->_amrDrawList );
     _mesh->_amrGeode->dirtyBound();
+
+    // publish the mesh manager's queue/job counters to the camera stats so that
+    // benchmarks and the stats handler can track them per frame.
+    osg::Stats* stats = cv->getCurrentCamera() ? cv->getCurrentCamera()->getStats() : 0L;
+    if ( stats && stats->collectStats("droam") && cv->getFrameStamp() )
+    {
+        unsigned frame = cv->getFrameStamp()->getFrameNumber();
+        const MeshManagerStats& s = _mesh->getStats();
+        stats->setAttribute( frame, "DROAM split queue",       (double)s._splitQueueDepth );
+        stats->setAttribute( frame, "DROAM merge queue",       (double)s._mergeQueueDepth );
+        stats->setAttribute( frame, "DROAM image queue",       (double)s._imageQueueDepth );
+        stats->setAttribute( frame, "DROAM dirty queue",       (double)s._dirtyQueueDepth );
+        stats->setAttribute( frame, "DROAM splits",            (double)s._splits );
+        stats->setAttribute( frame, "DROAM merges",            (double)s._merges );
+        stats->setAttribute( frame, "DROAM refreshes",         (double)s._refreshes );
+        stats->setAttribute( frame, "DROAM images installed",  (double)s._imagesInstalled );
+        stats->setAttribute( frame, "DROAM images canceled",   (double)s._imagesCanceled );
+        stats->setAttribute( frame, "DROAM update time",       s._updateTime );
+    }
 }
 
 void 
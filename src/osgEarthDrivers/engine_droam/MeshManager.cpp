@@ -17,8 +17,40 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "MeshManager"
+#include <osgEarth/ThreadingUtils>
 #include <osg/CullFace>
 #include <osg/Texture2D>
+#include <osg/Timer>
+#include <OpenThreads/Thread>
+#include <algorithm>
+
+// --------------------------------------------------------------------------
+
+namespace
+{
+    // rebuilds the primitives for a range of dirty diamonds. Each diamond only writes
+    // its own drawable and reads the (unchanging) shared nodes, so ranges can run
+    // concurrently.
+    struct RefreshDiamonds
+    {
+        void init( std::vector< osg::ref_ptr<Diamond> >& batch, unsigned begin, unsigned end )
+        {
+            _batch = &batch;
+            _begin = begin;
+            _end   = end;
+        }
+
+        void execute()
+        {
+            for( unsigned i = _begin; i < _end; ++i )
+                (*_batch)[i]->refreshDrawable();
+        }
+
+        std::vector< osg::ref_ptr<Diamond> >* _batch;
+        unsigned _begin, _end;
+    };
+
+}
 
 // --------------------------------------------------------------------------
 
@@ -44,7 +76,11 @@ _map( map ),
 _minGeomLevel( 1 ),
 _minActiveLevel( 0 ),
 _maxActiveLevel( MAX_ACTIVE_LEVEL ),
-_maxJobsPerFrame( MAX_JOBS_PER_FRAME )
+_maxSplitsPerFrame( MAX_SPLITS_PER_FRAME ),
+_maxMergesPerFrame( MAX_MERGES_PER_FRAME ),
+_maxJobTimePerFrame( JOB_TIME_PER_FRAME_MS ),
+_maxImagesPerFrame( MAX_IMAGES_PER_FRAME ),
+_numRefreshThreads( std::max( 2, OpenThreads::GetNumberOfProcessors() ) )
 {
     // fire up a task service to load textures.
     _imageService = new TaskService( "Image Service", 16 );
@@ -154,80 +190,78 @@ outlineTexture( osg::Image* image )
 void
 MeshManager::update()
 {
-    int j;
+    const osg::Timer* timer = osg::Timer::instance();
+    osg::Timer_t start = timer->tick();
+
+    _stats._splits = 0;
+    _stats._merges = 0;
+    _stats._refreshes = 0;
+    _stats._imagesInstalled = 0;
+    _stats._imagesCanceled = 0;
 
     // process the split queue. these are diamonds that have requested to be split into
-    // all four children.
-    for( j=0; j<_maxJobsPerFrame && !_splitQueue.empty(); ++j )
-    //if( !_splitQueue.empty() )
+    // all four children. Stale entries (removed diamonds, or diamonds that were requeued
+    // for a merge) are discarded without counting against the budget; at least one real
+    // split happens each frame so the queue always drains.
+    while( !_splitQueue.empty() && (int)_stats._splits < _maxSplitsPerFrame )
     {
-        Diamond* d = _splitQueue.top()._d.get();
-        if ( d->_status == ACTIVE && d->referenceCount() > 1 )
-        {
-            if ( d->_queuedForSplit )
-            {
-                //OE_NOTICE << "split: " << d->_name << "\n";
-                d->split();
-                d->_queuedForSplit = false;
-                d->_queuedForMerge = false;
-            }
-            else
-            {
-                //OE_WARN << d->_name << " was in the split Q, but NOT marked for splitting!" << std::endl;
-            }
-        }
-        else
+        if ( _stats._splits > 0 && timer->delta_m(start, timer->tick()) > _maxJobTimePerFrame )
+            break;
+
+        osg::ref_ptr<Diamond> d = _splitQueue.top()._d.get();
+        _splitQueue.pop();
+
+        // referenceCount() > 1: someone other than us still holds the diamond.
+        if ( d->_status == ACTIVE && d->referenceCount() > 1 && d->_queuedForSplit )
         {
-            // the diamond was removed while in the queue. ignore it.
+            d->split();
+            d->_queuedForSplit = false;
+            d->_queuedForMerge = false;
+            ++_stats._splits;
         }
-        _splitQueue.pop();
     }
 
     // process the merge queue. these are diamonds that have requested that all their
-    // children be removed.
-    // FUTURE: process jobs until we reach some sort of time quota?
-
-    for( j=0; j<_maxJobsPerFrame && !_mergeQueue.empty(); ++j )
+    // children be removed. Shares the time quota with the split queue.
+    while( !_mergeQueue.empty() && (int)_stats._merges < _maxMergesPerFrame )
     {
-        Diamond* d = _mergeQueue.top()._d.get();
-        if ( d->_status == ACTIVE && d->referenceCount() > 1 )
+        if ( _stats._merges > 0 && timer->delta_m(start, timer->tick()) > _maxJobTimePerFrame )
+            break;
+
+        osg::ref_ptr<Diamond> d = _mergeQueue.top()._d.get();
+        _mergeQueue.pop();
+
+        // if not _queuedForMerge, the diamond passed cull again after it was queued.
+        if ( d->_status == ACTIVE && d->referenceCount() > 1 && d->_queuedForMerge )
         {
-            if ( d->_queuedForMerge )
-            {
-                //OE_NOTICE << "merge: " << d->_name << "\n";
-
-                //TODO: when you merge, children are recursively merged..thus the merge
-                //may take some time. rather it might be better to traverse and schedule
-                //child merges first.?
-                d->merge();
-                d->_queuedForMerge = false;
-                d->_queuedForSplit = false;
-            }
-            else
-            {
-                //this means that the diamond was once queued for a merge, but then
-                // passed cull again.
-                //OE_WARN << d->_name << " was in the merge Q, but NOT marked for merging!" << std::endl;
-            }
+            //TODO: when you merge, children are recursively merged..thus the merge
+            //may take some time. rather it might be better to traverse and schedule
+            //child merges first.?
+            d->merge();
+            d->_queuedForMerge = false;
+            d->_queuedForSplit = false;
+            ++_stats._merges;
         }
-        _mergeQueue.pop();
     }
 
-    // process the texture image request queue.
-    j=0;
-    for( DiamondJobList::iterator i = _imageQueue.begin(); i != _imageQueue.end() && j < _maxJobsPerFrame; ++j )
-    //if( _imageQueue.size() > 0 )
+    // process the texture image request queue. The loads themselves run in the image
+    // TaskService; here we scan every outstanding request (so a slow load can't hold up
+    // the ones behind it), install up to the per-frame limit of finished textures, and
+    // cancel loads for diamonds that have gone away.
+    for( DiamondJobList::iterator i = _imageQueue.begin(); i != _imageQueue.end(); )
     {
-        bool increment = true;
         bool remove = true;
 
         Diamond* d = i->_d.get();
 
         if ( d->_status == ACTIVE && d->referenceCount() > 1 && d->_imageRequest.valid() )
         {
-            if ( d->_imageRequest->isCompleted() )
+            if ( !d->_imageRequest->isCompleted() || (int)_stats._imagesInstalled >= _maxImagesPerFrame )
+            {
+                remove = false;
+            }
+            else
             {
-                //OE_NOTICE << "REQ: " << d->_key->str() << " completed" << std::endl;
                 osg::Texture2D* tex = 0L;
                 
 #ifdef USE_DEBUG_TEXTURES
@@ -262,15 +296,16 @@ MeshManager::update()
 #endif
                 }
 
-                remove = true;
-            }
-
-            else
-            {
-                remove = false;
+                ++_stats._imagesInstalled;
             }
         }
 
+        else if ( d->_imageRequest.valid() && d->_imageRequest->isRunning() )
+        {
+            // nobody needs this texture any more; don't waste a loader thread on it.
+            d->_imageRequest->cancel();
+            ++_stats._imagesCanceled;
+        }
 
         if ( remove )
         {
@@ -286,9 +321,28 @@ MeshManager::update()
 
 #ifdef USE_DIRTY_QUEUE
 
+    refreshDirtyDiamonds();
+
+#endif
+
+    _stats._splitQueueDepth = _splitQueue.size();
+    _stats._mergeQueueDepth = _mergeQueue.size();
+    _stats._imageQueueDepth = _imageQueue.size();
+    _stats._dirtyQueueDepth = _dirtyQueue.size();
+    _stats._maxSplitQueueDepth = std::max( _stats._maxSplitQueueDepth, _stats._splitQueueDepth );
+    _stats._maxMergeQueueDepth = std::max( _stats._maxMergeQueueDepth, _stats._mergeQueueDepth );
+    _stats._maxImageQueueDepth = std::max( _stats._maxImageQueueDepth, _stats._imageQueueDepth );
+    _stats._updateTime = timer->delta_m( start, timer->tick() );
+}
+
+void
+MeshManager::refreshDirtyDiamonds()
+{
     // process the dirty diamond queue. these are diamonds that have been changed and
     // need a new primitive set.
     // NOTE: we need to process the entire dirty queue each frame.
+    _refreshBatch.clear();
+
     while( _dirtyQueue.size() > 0 )
     {
         Diamond* d = _dirtyQueue.front().get();
@@ -296,7 +350,8 @@ MeshManager::update()
         if ( d->_status == ACTIVE && d->referenceCount() > 1 )
         {
             // first, check to see whether the diamond's target stateset is ready. if so,
-            // install it and mark it up to date.
+            // install it and mark it up to date. (Stays on this thread: the stateset
+            // owners are shared between diamonds.)
             if ( d->_targetStateSetOwner->_stateSet->outOfSyncWith( d->_targetStateSetRevision ) )
             {            
                 d->_amrDrawable->_stateSet = d->_targetStateSetOwner->_stateSet.get();
@@ -305,13 +360,40 @@ MeshManager::update()
                 d->_targetStateSetOwner->_stateSet->sync( d->_targetStateSetRevision );
             }
 
-            // rebuild the primitives now.
-            d->refreshDrawable();
+            _refreshBatch.push_back( d );
         }
         _dirtyQueue.pop();
     }
 
-#endif
+    _stats._refreshes = _refreshBatch.size();
+
+    // rebuild the primitives now. Each rebuild allocates a stateset and a full set of
+    // uniforms per triangle, so large batches are spread across threads.
+    unsigned numJobs = std::min( (unsigned)std::max(_numRefreshThreads, 1), (unsigned)_refreshBatch.size() );
+    if ( _refreshBatch.size() < MIN_PARALLEL_REFRESH || numJobs <= 1 )
+    {
+        RefreshDiamonds job;
+        job.init( _refreshBatch, 0, _refreshBatch.size() );
+        job.execute();
+    }
+    else
+    {
+        TaskService* service = TaskService::getShared( "DROAM Refresh", (int)numJobs );
+        Threading::MultiEvent semaphore( numJobs );
+        unsigned perJob = _refreshBatch.size() / numJobs;
+
+        for( unsigned j=0; j<numJobs; ++j )
+        {
+            unsigned begin = j*perJob;
+            unsigned end   = j+1 == numJobs ? _refreshBatch.size() : begin+perJob;
+
+            ParallelTask<RefreshDiamonds>* job = new ParallelTask<RefreshDiamonds>( &semaphore );
+            job->init( _refreshBatch, begin, end );
+            service->add( job );
+        }
+
+        semaphore.wait();
+    }
 
-    //OE_NOTICE << "dq size = " << _dirtyQueue.size() << "; splits = " << _splitQueue.size() << "; merges = " << _mergeQueue.size() << std::endl;
+    _refreshBatch.clear();
 }
@@ -12,6 +12,9 @@
 #include <osg/NodeVisitor>
 #include <osg/Texture2D>
 
+#include <OpenThreads/ScopedLock>
+
+#include <osgEarth/HeightFieldUtils>
 #include <osgEarth/ImageUtils>
 #include <osgEarth/Notify>
 #include <osgEarth/VerticalSpatialReference>
@@ -31,7 +34,7 @@ typedef multi_array_ref<Vec3f, Vec3Array, 2> PatchArray;
 Geographic::Geographic(const Map* map,
                        const osgEarth::Drivers::SeamlessOptions& options)
     : PatchSet(options, new PatchOptions), _profile(new EulerProfile),
-      _eModel(new EllipsoidModel)
+      _eModel(new EllipsoidModel), _latticeCache(128)
 {
     setPrecisionFactor(8);
     setMap(map);
@@ -62,7 +65,8 @@ Geographic::Geographic(const Geographic& rhs, const osg::CopyOp& copyop)
     : PatchSet(rhs, copyop),
       _profile(static_cast<EulerProfile*>(copyop(rhs._profile.get()))),
       _eModel(static_cast<EllipsoidModel*>(copyop(rhs._eModel.get()))),
-      _hfService(rhs._hfService), _imageService(rhs._imageService)
+      _hfService(rhs._hfService), _imageService(rhs._imageService),
+      _latticeCache(128)
 {
 }
 
@@ -170,45 +174,53 @@ void expandHeights(Geographic* gpatchset, const TileKey& key,
 {
     int resolution = gpatchset->getResolution();
     const GeoExtent& patchExtent = key.getExtent();
-    double centx, centy;
-    patchExtent.getCentroid(centx, centy);
-    Vec3d patchCenter = gpatchset->toModel(centx, centy, 0);
-    const SpatialReference* srs = key.getProfile()->getSRS();
-    const SpatialReference* geoSrs = srs->getGeographicSRS();
-    // Populate cell
-    ref_ptr<Patch::Data> data = new Patch::Data;
+    ref_ptr<PatchLattice> lattice = gpatchset->getLattice(key);
     int patchDim = resolution + 1;
     double xInc = (patchExtent.xMax() - patchExtent.xMin()) / resolution;
     double yInc = (patchExtent.yMax() - patchExtent.yMin()) / resolution;
-    const EllipsoidModel* eModel = gpatchset->getEllipsoidModel();
     const float verticalScale = gpatchset->getVerticalScale();
+    // Height fields are normally fetched for exactly this key and grid,
+    // in which case the samples are read directly. Otherwise they are
+    // interpolated in the height field's own coordinates.
+    const HeightField* field = hf.getHeightField();
+    const GeoExtent& hfExtent = hf.getExtent();
+    bool direct = hfExtent == patchExtent
+        && field->getNumColumns() == (unsigned)patchDim
+        && field->getNumRows() == (unsigned)patchDim;
+    double hfXInterval
+        = hfExtent.width() / (double)(field->getNumColumns() - 1);
+    double hfYInterval
+        = hfExtent.height() / (double)(field->getNumRows() - 1);
     PatchArray mverts(*verts, patchDim);
     for (int j = 0; j < patchDim; ++j)
     {
         for (int i = 0; i < patchDim; i++)
         {
-            Vec2d cubeCoord(patchExtent.xMin() + i * xInc,
-                            patchExtent.yMin() + j * yInc);
-            double lon, lat;
-            srs->transform(cubeCoord.x(), cubeCoord.y(), geoSrs, lon, lat);
             float elevation;
-
-            bool found = hf.getElevation(srs, cubeCoord.x(), cubeCoord.y(),
-                                         INTERP_BILINEAR, 0, elevation);
-            // Into ec coordinates
-            if (!found)
+            if (direct)
             {
-                OE_WARN << "Couldn't find height sample for cube coordinates "
-                        << cubeCoord.x() << ", " << cubeCoord.y()
-                        << " (lon lat " << lon << ", " << lat << ")\n";
-                continue;
+                elevation = field->getHeight(i, j);
             }
+            else
+            {
+                Vec2d cubeCoord(patchExtent.xMin() + i * xInc,
+                                patchExtent.yMin() + j * yInc);
+                if (!hfExtent.contains(cubeCoord.x(), cubeCoord.y()))
+                {
+                    OE_WARN << "Couldn't find height sample for cube coordinates "
+                            << cubeCoord.x() << ", " << cubeCoord.y() << "\n";
+                    continue;
+                }
+                elevation = HeightFieldUtils::getHeightAtLocation(
+                    field, cubeCoord.x(), cubeCoord.y(),
+                    hfExtent.xMin(), hfExtent.yMin(),
+                    hfXInterval, hfYInterval, INTERP_BILINEAR);
+            }
+            // Into ec coordinates
             elevation *= verticalScale;
-            Vec3d coord;
-            eModel->convertLatLongHeightToXYZ(
-                DegreesToRadians(lat), DegreesToRadians(lon), elevation,
-                coord.x(), coord.y(), coord.z());
-            mverts[j][i] = coord - patchCenter;
+            int index = j * patchDim + i;
+            mverts[j][i] = lattice->surface[index]
+                + lattice->up[index] * elevation;
             if (fabs(mverts[j][i].z()) > 6000000)
                 OE_WARN << "found huge coordinate.\n";
         }
@@ -360,6 +372,9 @@ struct HeightFieldRequest : public TaskRequest
         {
             hf = getGeoHeightField(_mapf, _key, resolution);
         }
+        // The patch may have been paged out while the data was loading.
+        if (progress && progress->isCanceled())
+            return;
         int patchDim = resolution + 1;
         Vec3Array* verts = new Vec3Array(patchDim * patchDim);
         _result = verts;
@@ -404,6 +419,8 @@ struct ImageRequest : public TaskRequest
             if (!layers.empty())
                 gimage = layers[0]->createImage(_key);
         }
+        if (progress && progress->isCanceled())
+            return;
         _result = gimage.getImage();
     }
     ref_ptr<Geographic> _gpatchset;
@@ -431,6 +448,15 @@ public:
 
     META_Object(seamless, GeoPatchUpdateCallback);
 
+    // If the patch goes away before its data arrives, stop the work.
+    virtual ~GeoPatchUpdateCallback()
+    {
+        if (_hfRequest.valid() && _hfRequest->isRunning())
+            _hfRequest->cancel();
+        if (_imageRequest.valid() && _imageRequest->isRunning())
+            _imageRequest->cancel();
+    }
+
     virtual void operator()(Node* node, NodeVisitor* nv);
     
     ref_ptr<HeightFieldRequest> _hfRequest;
@@ -556,6 +582,68 @@ Vec3d Geographic::toModel(double cubeX, double cubeY, double elevation)
     return result;
 }
 
+ref_ptr<PatchLattice> Geographic::getLattice(const TileKey& key)
+{
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_latticeMutex);
+        LatticeCache::Record rec = _latticeCache.get(key);
+        if (rec.valid())
+            return rec.value();
+    }
+    // Build outside the lock; if two threads race, both results are
+    // identical and the second insert just replaces the first.
+    ref_ptr<PatchLattice> lattice = createLattice(key);
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_latticeMutex);
+    _latticeCache.insert(key, lattice);
+    return lattice;
+}
+
+PatchLattice* Geographic::createLattice(const TileKey& key)
+{
+    PatchLattice* lattice = new PatchLattice;
+    int patchDim = _resolution + 1;
+    const GeoExtent& patchExtent = key.getExtent();
+    double centx, centy;
+    patchExtent.getCentroid(centx, centy);
+    lattice->center = toModel(centx, centy, 0);
+    lattice->surface.resize(patchDim * patchDim);
+    lattice->up.resize(patchDim * patchDim);
+    double xInc = (patchExtent.xMax() - patchExtent.xMin()) / _resolution;
+    double yInc = (patchExtent.yMax() - patchExtent.yMin()) / _resolution;
+    // Patches never span faces, so the face is found once and the grid
+    // is converted straight from face coordinates, skipping the
+    // per-vertex SpatialReference::transform() calls.
+    double fxmin = patchExtent.xMin(), fymin = patchExtent.yMin();
+    double fxmax = patchExtent.xMax(), fymax = patchExtent.yMax();
+    int face;
+    bool onFace = euler::cubeToFace(fxmin, fymin, fxmax, fymax, face);
+    double fxInc = (fxmax - fxmin) / _resolution;
+    double fyInc = (fymax - fymin) / _resolution;
+    const SpatialReference* srs = key.getProfile()->getSRS();
+    const SpatialReference* geoSrs = srs->getGeographicSRS();
+    for (int j = 0; j < patchDim; ++j)
+    {
+        for (int i = 0; i < patchDim; i++)
+        {
+            double lon, lat;
+            if (onFace)
+                euler::faceCoordsToLatLon(fxmin + i * fxInc, fymin + j * fyInc,
+                                          face, lat, lon);
+            else
+                srs->transform(patchExtent.xMin() + i * xInc,
+                               patchExtent.yMin() + j * yInc, geoSrs, lon, lat);
+            double latr = DegreesToRadians(lat), lonr = DegreesToRadians(lon);
+            Vec3d coord;
+            _eModel->convertLatLongHeightToXYZ(latr, lonr, 0.0,
+                                               coord.x(), coord.y(), coord.z());
+            lattice->surface[j * patchDim + i] = coord - lattice->center;
+            lattice->up[j * patchDim + i]
+                = Vec3d(cos(latr) * cos(lonr), cos(latr) * sin(lonr), sin(latr));
+        }
+    }
+    return lattice;
+}
+
 Node* Geographic::createChild(const PatchOptions* parentOptions, int childNum)
 {
     PatchOptions* poptions = static_cast<PatchOptions*>(
@@ -20,6 +20,8 @@
 
 #include <osgEarth/Registry>
 #include <osgEarth/FileUtils>
+#include <osgEarth/TaskService>
+#include <osgEarth/ThreadingUtils>
 #include <osgEarthFeatures/FeatureSource>
 #include <osgEarthFeatures/Filter>
 #include <osgEarthFeatures/BufferFilter>
@@ -30,6 +32,8 @@
 #include <osgDB/FileNameUtils>
 #include <osgDB/FileUtils>
 #include <list>
+#include <set>
+#include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -49,6 +53,276 @@ using namespace osgEarth::Drivers;
 
 #define OGR_SCOPED_LOCK GDAL_SCOPED_LOCK
 
+namespace
+{
+    /**
+     * Compact binary encoding of a page of parsed features, for storing in
+     * the cache bin. Values are in host byte order. The request URL is stored
+     * with the page so that a cache key collision reads as a miss.
+     */
+    const std::string FEATURE_CACHE_MAGIC = "OEWFS2";
+
+    template<typename T>
+    void put( std::string& out, const T& value )
+    {
+        out.append( reinterpret_cast<const char*>(&value), sizeof(T) );
+    }
+
+    void putString( std::string& out, const std::string& value )
+    {
+        put( out, (unsigned)value.size() );
+        out.append( value );
+    }
+
+    void putGeometry( std::string& out, const Geometry* geom )
+    {
+        put( out, (unsigned char)geom->getType() );
+
+        if ( geom->getType() == Geometry::TYPE_MULTI )
+        {
+            const GeometryCollection& parts = static_cast<const MultiGeometry*>(geom)->getComponents();
+            put( out, (unsigned)parts.size() );
+            for( GeometryCollection::const_iterator i = parts.begin(); i != parts.end(); ++i )
+                putGeometry( out, i->get() );
+        }
+        else
+        {
+            put( out, (unsigned)geom->size() );
+            if ( geom->size() > 0 )
+                out.append( reinterpret_cast<const char*>(&geom->front()), geom->size()*sizeof(osg::Vec3d) );
+
+            if ( geom->getType() == Geometry::TYPE_POLYGON )
+            {
+                const RingCollection& holes = static_cast<const Symbology::Polygon*>(geom)->getHoles();
+                put( out, (unsigned)holes.size() );
+                for( RingCollection::const_iterator i = holes.begin(); i != holes.end(); ++i )
+                    putGeometry( out, i->get() );
+            }
+        }
+    }
+
+    struct BufferReader
+    {
+        BufferReader( const std::string& buf ) : _p( buf.data() ), _end( buf.data() + buf.size() ) { }
+
+        template<typename T>
+        bool get( T& value )
+        {
+            if ( _end - _p < (int)sizeof(T) ) return false;
+            memcpy( &value, _p, sizeof(T) );
+            _p += sizeof(T);
+            return true;
+        }
+
+        bool getBytes( void* dest, unsigned len )
+        {
+            if ( (unsigned)(_end - _p) < len ) return false;
+            memcpy( dest, _p, len );
+            _p += len;
+            return true;
+        }
+
+        bool getString( std::string& value )
+        {
+            unsigned len;
+            if ( !get(len) || (unsigned)(_end - _p) < len ) return false;
+            value.assign( _p, len );
+            _p += len;
+            return true;
+        }
+
+        const char* _p;
+        const char* _end;
+    };
+
+    Geometry* getGeometry( BufferReader& in )
+    {
+        unsigned char type;
+        unsigned      count;
+        if ( !in.get(type) || !in.get(count) )
+            return 0L;
+
+        if ( type == Geometry::TYPE_MULTI )
+        {
+            osg::ref_ptr<MultiGeometry> multi = new MultiGeometry();
+            for( unsigned i=0; i<count; ++i )
+            {
+                Geometry* part = getGeometry( in );
+                if ( !part ) return 0L;
+                multi->getComponents().push_back( part );
+            }
+            return multi.release();
+        }
+
+        Vec3dVector points( count );
+        if ( count > 0 && !in.getBytes( &points.front(), count*sizeof(osg::Vec3d) ) )
+            return 0L;
+
+        osg::ref_ptr<Geometry> geom = Geometry::create( (Geometry::Type)type, &points );
+        if ( !geom.valid() )
+            return 0L;
+
+        if ( type == Geometry::TYPE_POLYGON )
+        {
+            unsigned numHoles;
+            if ( !in.get(numHoles) )
+                return 0L;
+            for( unsigned i=0; i<numHoles; ++i )
+            {
+                osg::ref_ptr<Geometry> hole = getGeometry( in );
+                if ( !hole.valid() || hole->getType() != Geometry::TYPE_RING ) return 0L;
+                static_cast<Symbology::Polygon*>(geom.get())->getHoles().push_back( static_cast<Ring*>(hole.get()) );
+            }
+        }
+        return geom.release();
+    }
+
+    void encodeFeatures( const std::string& url, const FeatureList& features, std::string& out )
+    {
+        out = FEATURE_CACHE_MAGIC;
+        putString( out, url );
+        put( out, (unsigned char)sizeof(FeatureID) );
+        put( out, (unsigned)features.size() );
+
+        for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+        {
+            const Feature* f = i->get();
+            put( out, f->getFID() );
+
+            const Geometry* geom = f->getGeometry();
+            put( out, (unsigned char)(geom ? 1 : 0) );
+            if ( geom )
+                putGeometry( out, geom );
+
+            const AttributeTable& attrs = f->getAttrs();
+            put( out, (unsigned)attrs.size() );
+            for( AttributeTable::const_iterator a = attrs.begin(); a != attrs.end(); ++a )
+            {
+                putString( out, a->first );
+                put( out, (unsigned char)a->second.first );
+                switch( a->second.first )
+                {
+                case ATTRTYPE_INT:    put( out, a->second.second.intValue ); break;
+                case ATTRTYPE_DOUBLE: put( out, a->second.second.doubleValue ); break;
+                case ATTRTYPE_BOOL:   put( out, (unsigned char)(a->second.second.boolValue ? 1 : 0) ); break;
+                default:              putString( out, a->second.getString() ); break;
+                }
+            }
+        }
+    }
+
+    bool decodeFeatures( const std::string& buf, const std::string& url, const SpatialReference* srs, FeatureList& out )
+    {
+        if ( buf.compare( 0, FEATURE_CACHE_MAGIC.size(), FEATURE_CACHE_MAGIC ) != 0 )
+            return false;
+
+        BufferReader in( buf );
+        in._p += FEATURE_CACHE_MAGIC.size();
+
+        std::string   storedURL;
+        unsigned char fidSize;
+        unsigned      count;
+        if ( !in.getString(storedURL) || storedURL != url )
+            return false;
+        if ( !in.get(fidSize) || fidSize != sizeof(FeatureID) || !in.get(count) )
+            return false;
+
+        FeatureList features;
+        for( unsigned i=0; i<count; ++i )
+        {
+            FeatureID     fid;
+            unsigned char hasGeom;
+            if ( !in.get(fid) || !in.get(hasGeom) )
+                return false;
+
+            osg::ref_ptr<Geometry> geom;
+            if ( hasGeom )
+            {
+                geom = getGeometry( in );
+                if ( !geom.valid() )
+                    return false;
+            }
+
+            osg::ref_ptr<Feature> f = new Feature( geom.get(), srs, Style(), fid );
+
+            unsigned numAttrs;
+            if ( !in.get(numAttrs) )
+                return false;
+            for( unsigned a=0; a<numAttrs; ++a )
+            {
+                std::string   name;
+                unsigned char type;
+                if ( !in.getString(name) || !in.get(type) )
+                    return false;
+
+                if ( type == ATTRTYPE_INT )
+                {
+                    int value;
+                    if ( !in.get(value) ) return false;
+                    f->set( name, value );
+                }
+                else if ( type == ATTRTYPE_DOUBLE )
+                {
+                    double value;
+                    if ( !in.get(value) ) return false;
+                    f->set( name, value );
+                }
+                else if ( type == ATTRTYPE_BOOL )
+                {
+                    unsigned char value;
+                    if ( !in.get(value) ) return false;
+                    f->set( name, value != 0 );
+                }
+                else
+                {
+                    std::string value;
+                    if ( !in.getString(value) ) return false;
+                    f->set( name, value );
+                }
+            }
+
+            features.push_back( f.get() );
+        }
+
+        out.swap( features );
+        return true;
+    }
+}
+
+class WFSFeatureSource;
+
+/**
+ * Cursor that reads a WFS query one page at a time, requesting the next
+ * page only once the current one has been consumed.
+ */
+class WFSFeatureCursor : public FeatureCursor
+{
+public:
+    WFSFeatureCursor( WFSFeatureSource* source, const Symbology::Query& query, unsigned pageSize, unsigned maxFeatures );
+
+    virtual ~WFSFeatureCursor();
+
+    /** Fetches the first page; returns false if the request failed. */
+    bool fetchFirstPage();
+
+    bool hasMore() const;
+    Feature* nextFeature();
+
+protected:
+    bool fetchNextPage() const;
+
+    osg::ref_ptr<WFSFeatureSource> _source;
+    Symbology::Query               _query;
+    unsigned                       _pageSize;
+
+    // the pages are fetched lazily from hasMore():
+    mutable FeatureList            _page;
+    mutable unsigned               _startIndex;
+    mutable unsigned               _remaining;
+    mutable bool                   _done;
+    osg::ref_ptr<Feature>          _lastFeature;
+};
+
 /**
  * A FeatureSource that reads features from a WFS layer
  *
@@ -75,13 +349,22 @@ public:
     void initialize( const osgDB::Options* dbOptions )
     {
         _dbOptions = dbOptions ? osg::clone(dbOptions) : 0L;
-        if ( _dbOptions.valid() )
+
+        // establish our caching policy:
+        _cachePolicy = _options.cachePolicy().isSet() && !_options.cachePolicy()->empty() ?
+            _options.cachePolicy().value() :
+            Registry::instance()->defaultCachePolicy();
+
+        if ( _dbOptions.valid() && _cachePolicy.usage() != CachePolicy::USAGE_NO_CACHE )
         {
             // Set up a Custom caching bin for this source:
             Cache* cache = Cache::get( _dbOptions.get() );
             if ( cache )
             {
+                // the policy governs how the bin is used, not what's in it, so leave
+                // it out of the bin ID:
                 Config optionsConf = _options.getConfig();
+                optionsConf.remove( "cache_policy" );
 
                 std::string binId = Stringify() << std::hex << hashString(optionsConf.toJSON()) << "_wfs";
                 _cacheBin = cache->addBin( binId );
@@ -218,7 +501,7 @@ public:
                 if ( feat_handle )
                 {
                     osg::ref_ptr<Feature> f = OgrUtils::createFeature( feat_handle, srs );
-                    if ( f.valid() && !isBlacklisted(f->getFID()) )
+                    if ( f.valid() )
                     {
                         features.push_back( f.release() );
                     }
@@ -278,7 +561,7 @@ public:
             (mime.compare("text/x-json") == 0);
     }
 
-    std::string createURL(const Symbology::Query& query)
+    std::string createURL(const Symbology::Query& query, unsigned startIndex =0, unsigned count =0)
     {
         std::stringstream buf;
         buf << _options.url()->full() << "?SERVICE=WFS&VERSION=1.0.0&REQUEST=getfeature";
@@ -288,7 +571,12 @@ public:
         if (_options.outputFormat().isSet()) outputFormat = _options.outputFormat().get();
         buf << "&OUTPUTFORMAT=" << outputFormat;
 
-        if (_options.maxFeatures().isSet())
+        if (_options.pageSize().value() > 0)
+        {
+            // MAXFEATURES too, for servers that only know the 1.0 parameter name.
+            buf << "&STARTINDEX=" << startIndex << "&COUNT=" << count << "&MAXFEATURES=" << count;
+        }
+        else if (_options.maxFeatures().isSet())
         {
             buf << "&MAXFEATURES=" << _options.maxFeatures().get();
         }
@@ -309,47 +597,121 @@ public:
         return str;
     }
 
-    FeatureCursor* createFeatureCursor( const Symbology::Query& query )
+    /**
+     * Reads one page of a query: from the cache bin if the page is there, otherwise
+     * from the server (storing the parsed page in the cache bin), as the cache
+     * policy allows. Blacklisted features
+     * are dropped from the output; out_numRead counts them anyway, so the caller can
+     * tell a short (last) page from a filtered one.
+     */
+    bool fetchPage( const Symbology::Query& query, unsigned startIndex, unsigned count, FeatureList& output, unsigned& out_numRead )
     {
-        FeatureCursor* result = 0L;
-
-        std::string url = createURL( query );
+        std::string url = createURL( query, startIndex, count );
 
         // check the blacklist:
         if ( Registry::instance()->isBlacklisted(url) )
-            return 0L;
-
-        OE_DEBUG << LC << url << std::endl;
-        URI uri(url);
-
-        // read the data:
-        ReadResult r = uri.readString( _dbOptions.get() );
+            return false;
 
-        const std::string& buffer = r.getString();
-        const Config&      meta   = r.metadata();
+        FeatureProfile* fp = getFeatureProfile();
+        const SpatialReference* srs = fp ? fp->getSRS() : 0L;
 
+        FeatureList features;
         bool dataOK = false;
 
-        FeatureList features;
-        if ( !buffer.empty() )
+        std::string cacheKey = getCacheKey( url );
+        if ( _cacheBin.valid() && _cachePolicy.isCacheReadable() )
         {
-            // Get the mime-type from the metadata record if possible
-            const std::string& mimeType = r.metadata().value( IOMetadata::CONTENT_TYPE );
-            dataOK = getFeatures( buffer, mimeType, features );
+            ReadResult r = _cacheBin->readString( cacheKey, *_cachePolicy.maxAge() );
+            if ( r.succeeded() )
+            {
+                dataOK = decodeFeatures( r.getString(), url, srs, features );
+            }
         }
 
-        if ( dataOK )
+        if ( !dataOK )
         {
+            // a cache miss is not a server failure, so don't blacklist it.
+            if ( _cacheBin.valid() && _cachePolicy.usage() == CachePolicy::USAGE_CACHE_ONLY )
+                return false;
+
+            OE_DEBUG << LC << url << std::endl;
+            URI uri(url);
+
+            // read the data. Our cache bin stores the parsed features (below), so 
+            // when we have one there's no need to cache the raw response as well.
+            ReadResult r = uri.readString( 
+                _dbOptions.get(),
+                _cacheBin.valid() ? CachePolicy::NO_CACHE : _cachePolicy );
+
+            const std::string& buffer = r.getString();
+            if ( !buffer.empty() )
+            {
+                // Get the mime-type from the metadata record if possible
+                const std::string& mimeType = r.metadata().value( IOMetadata::CONTENT_TYPE );
+                dataOK = getFeatures( buffer, mimeType, features );
+            }
+
+            if ( !dataOK )
+            {
+                Registry::instance()->blacklist( url );
+                return false;
+            }
+
             OE_DEBUG << LC << "Read " << features.size() << " features" << std::endl;
+
+            if ( _cacheBin.valid() && _cachePolicy.isCacheWriteable() )
+            {
+                std::string encoded;
+                encodeFeatures( url, features, encoded );
+                osg::ref_ptr<StringObject> obj = new StringObject( encoded );
+                _cacheBin->write( cacheKey, obj.get() );
+            }
         }
 
-        //result = new FeatureListCursor(features);
-        result = dataOK ? new FeatureListCursor( features ) : 0L;
+        out_numRead = features.size();
+        for( FeatureList::iterator i = features.begin(); i != features.end(); ++i )
+        {
+            if ( !isBlacklisted(i->get()->getFID()) )
+                output.push_back( i->get() );
+        }
+        return true;
+    }
 
-        if ( !result )
-            Registry::instance()->blacklist( url );
+    FeatureCursor* createFeatureCursor( const Symbology::Query& query )
+    {
+        unsigned maxFeatures = _options.maxFeatures().isSet() ? _options.maxFeatures().value() : 0u;
+
+        osg::ref_ptr<WFSFeatureCursor> cursor = new WFSFeatureCursor( 
+            this, query, _options.pageSize().value(), maxFeatures );
+
+        if ( !cursor->fetchFirstPage() )
+            return 0L;
+
+        if ( _options.prefetchNeighbors() == true && _cacheBin.valid() && _cachePolicy.isCacheWriteable() && query.tileKey().isSet() )
+        {
+            prefetchNeighbors( query.tileKey().value() );
+        }
 
-        return result;
+        return cursor.release();
+    }
+
+    /** Queues background fetches of the first page of each neighbor of a tile. */
+    void prefetchNeighbors( const TileKey& key );
+
+    /**
+     * Cache bin key for a page request. The page record stores its URL too,
+     * so a hash collision reads as a miss rather than as the wrong page.
+     */
+    static std::string getCacheKey( const std::string& url )
+    {
+        return Stringify() << std::hex << hashString(url) << "_" << url.size();
+    }
+
+    /** Called by the prefetch task when a fetch completes. */
+    void prefetchDone( const std::string& url )
+    {
+        Threading::ScopedMutexLock lock( _prefetchMutex );
+        _prefetching.erase( url );
     }
 
     /**
@@ -386,10 +748,140 @@ private:
     osg::ref_ptr< FeatureProfile >  _featureProfile;
     FeatureSchema                   _schema;
     osg::ref_ptr<CacheBin>          _cacheBin;
+    CachePolicy                     _cachePolicy;
     osg::ref_ptr<osgDB::Options>    _dbOptions;
     OGRSFDriverH                    _geojsonDriver, _gmlDriver;
+    std::set<std::string>           _prefetching;
+    Threading::Mutex                _prefetchMutex;
 };
 
+//------------------------------------------------------------------------
+
+WFSFeatureCursor::WFSFeatureCursor( WFSFeatureSource* source, const Symbology::Query& query, unsigned pageSize, unsigned maxFeatures ) :
+_source    ( source ),
+_query     ( query ),
+_pageSize  ( pageSize ),
+_startIndex( 0 ),
+_remaining ( maxFeatures > 0 ? maxFeatures : ~0u ),
+_done      ( false )
+{
+    //nop
+}
+
+WFSFeatureCursor::~WFSFeatureCursor()
+{
+    //nop
+}
+
+bool
+WFSFeatureCursor::fetchFirstPage()
+{
+    return fetchNextPage();
+}
+
+bool
+WFSFeatureCursor::fetchNextPage() const
+{
+    unsigned count = _pageSize > 0 ? osg::minimum( _pageSize, _remaining ) : 0u;
+    unsigned numRead = 0;
+
+    if ( !_source->fetchPage( _query, _startIndex, count, _page, numRead ) )
+    {
+        _done = true;
+        return false;
+    }
+
+    _startIndex += numRead;
+    _remaining  -= osg::minimum( numRead, _remaining );
+    _done = _pageSize == 0 || numRead < count || _remaining == 0;
+    return true;
+}
+
+bool
+WFSFeatureCursor::hasMore() const
+{
+    // a page can come back empty if all of its features are blacklisted.
+    while ( _page.empty() && !_done )
+    {
+        fetchNextPage();
+    }
+    return !_page.empty();
+}
+
+Feature*
+WFSFeatureCursor::nextFeature()
+{
+    if ( !hasMore() )
+        return 0L;
+
+    // hold a reference to the returned feature until the next call:
+    _lastFeature = _page.front().get();
+    _page.pop_front();
+    return _lastFeature.get();
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    struct PrefetchTask : public TaskRequest
+    {
+        PrefetchTask( WFSFeatureSource* source, const Symbology::Query& query, unsigned count, const std::string& url )
+            : _source( source ), _query( query ), _count( count ), _url( url ) { }
+
+        void operator()( ProgressCallback* progress )
+        {
+            osg::ref_ptr<WFSFeatureSource> source;
+            if ( _source.lock(source) )
+            {
+                // fetching the page is enough to put it in the cache.
+                FeatureList features;
+                unsigned numRead;
+                source->fetchPage( _query, 0, _count, features, numRead );
+                source->prefetchDone( _url );
+            }
+        }
+
+        osg::observer_ptr<WFSFeatureSource> _source;
+        Symbology::Query                    _query;
+        unsigned                            _count;
+        std::string                         _url;
+    };
+
+}
+
+void
+WFSFeatureSource::prefetchNeighbors( const TileKey& key )
+{
+    const TileKey::Direction dirs[4] = { TileKey::NORTH, TileKey::SOUTH, TileKey::EAST, TileKey::WEST };
+
+    unsigned count = _options.pageSize().value();
+    if ( count > 0 && _options.maxFeatures().isSet() )
+        count = osg::minimum( count, _options.maxFeatures().value() );
+
+    for( unsigned d=0; d<4; ++d )
+    {
+        Symbology::Query query;
+        query.tileKey() = key.createNeighborKey( dirs[d] );
+
+        std::string url = createURL( query, 0, count );
+        if ( Registry::instance()->isBlacklisted(url) )
+            continue;
+
+        // skip neighbors that are already cached or on their way:
+        if ( _cacheBin->isCached(getCacheKey(url), *_cachePolicy.maxAge()) )
+            continue;
+
+        {
+            Threading::ScopedMutexLock lock( _prefetchMutex );
+            if ( !_prefetching.insert(url).second )
+                continue;
+        }
+
+        TaskService::getShared( "WFS prefetch", 2 )->add( new PrefetchTask(this, query, count, url) );
+    }
+}
+
 
 class WFSFeatureSourceFactory : public FeatureSourceDriver
 {
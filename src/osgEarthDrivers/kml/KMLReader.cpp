@@ -18,9 +18,23 @@
  */
 #include "KMLReader"
 #include "KML_Root"
+#include "KML_Container"
+#include "KML_Placemark"
+#include "KML_Style"
+#include "KML_StyleMap"
+#include "KML_Schema"
+#include "KML_PhotoOverlay"
+#include "KML_ScreenOverlay"
+#include "KML_GroundOverlay"
+#include "KML_NetworkLink"
+#include "KML_NetworkLinkControl"
 #include <osgEarth/XmlUtils>
+#include <osgEarth/TaskService>
 #include <osgEarthAnnotation/Decluttering>
+#include <osg/Timer>
+#include <osg/Math>
 #include <stack>
+#include <list>
 #include <iterator>
 
 using namespace osgEarth;
@@ -32,43 +46,475 @@ _options( options )
     //nop
 }
 
+osg::Group*
+KMLReader::createRoot( KMLContext& cx ) const
+{
+    osg::Group* root = new osg::Group();
+
+    cx._mapNode = _mapNode;
+    cx._sheet = new StyleSheet();
+    cx._groupStack.push( root );
+    cx._options = _options;
+    cx._srs = SpatialReference::create( "wgs84", "egm96" );
+
+    if ( cx._options->iconAndLabelGroup().valid() && cx._options->declutter() == true )
+    {
+        Decluttering::setEnabled( cx._options->iconAndLabelGroup()->getOrCreateStateSet(), true );
+    }
+
+    return root;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    // A placemark waiting to be built, along with its resolved style.
+    struct PendingPlacemark
+    {
+        Config _conf;
+        Style  _style;
+    };
+    typedef std::vector<PendingPlacemark> PendingPlacemarks;
+
+    // Builds a range of placemarks into a private group, so that several
+    // ranges can be built at once and then merged in document order.
+    struct BuildJob
+    {
+        void init( PendingPlacemarks::const_iterator begin,
+                   PendingPlacemarks::const_iterator end,
+                   const KMLContext&                 cx )
+        {
+            _begin = begin;
+            _end   = end;
+            _group = new osg::Group();
+
+            _options = *cx._options;
+            if ( _options.iconAndLabelGroup().valid() )
+            {
+                _iconGroup = new osg::Group();
+                _options.setIconAndLabelGroup( _iconGroup.get() );
+            }
+
+            _cx = cx;
+            _cx._options = &_options;
+            _cx._groupStack = std::stack<osg::ref_ptr<osg::Group> >();
+            _cx._groupStack.push( _group.get() );
+        }
+
+        void execute()
+        {
+            for( PendingPlacemarks::const_iterator i = _begin; i != _end; ++i )
+            {
+                KML_Placemark placemark;
+                placemark.buildWithStyle( i->_conf, _cx, i->_style );
+            }
+        }
+
+        PendingPlacemarks::const_iterator _begin, _end;
+        KMLContext                        _cx;
+        KMLOptions                        _options;
+        osg::ref_ptr<osg::Group>          _group;
+        osg::ref_ptr<osg::Group>          _iconGroup;
+    };
+
+    void moveChildren( osg::Group* from, osg::Group* to )
+    {
+        for( unsigned i=0; i<from->getNumChildren(); ++i )
+            to->addChild( from->getChild(i) );
+        from->removeChildren( 0, from->getNumChildren() );
+    }
+
+    /**
+     * Builds the KML scene graph from a stream of XML events.
+     *
+     * Containers (Document, Folder) become groups as soon as they open. Every
+     * other feature, style and schema element is collected into a small Config
+     * and processed when it closes, so only one of them is in memory at a time
+     * (plus a bounded batch of placemarks waiting to be built).
+     *
+     * The DOM reader makes three passes so that style references resolve no
+     * matter where the styles appear. Here, styles are registered as they are
+     * read; a StyleMap or Placemark that refers to a document style we haven't
+     * seen yet is deferred until the end of the document. A deferred placemark
+     * leaves an empty placeholder group behind so it still lands in document
+     * order.
+     */
+    class KMLStreamHandler : public XmlStreamHandler
+    {
+    public:
+        KMLStreamHandler( KMLContext& cx, const std::string& referrer ) :
+            _cx           ( cx ),
+            _referrer     ( referrer ),
+            _inKML        ( false ),
+            _numPlacemarks( 0 ),
+            _numDeferred  ( 0 )
+        {
+            _numThreads = osg::maximum( *cx._options->numThreads(), 1u );
+            _batchSize  = osg::maximum( *cx._options->batchSize(),  1u );
+        }
+
+        unsigned getNumPlacemarks() const { return _numPlacemarks; }
+        unsigned getNumDeferred() const { return _numDeferred; }
+
+    public: // XmlStreamHandler
+
+        void startElement( const std::string& name, const XmlAttributes& attrs )
+        {
+            if ( !_capture.empty() )
+            {
+                beginCapture( name, attrs );
+            }
+
+            else if ( name == "kml" )
+            {
+                _inKML = true;
+            }
+
+            else if ( !_inKML )
+            {
+                // not KML; ignore it.
+            }
+
+            else if ( isContainer(name) )
+            {
+                flush();
+
+                osg::Group* group = new osg::Group();
+                _cx._groupStack.top()->addChild( group );
+                _cx._groupStack.push( group );
+
+                _containers.push( Config(name) );
+                _containers.top().setReferrer( _referrer );
+                setAttrs( _containers.top(), attrs );
+            }
+
+            else
+            {
+                beginCapture( name, attrs );
+            }
+        }
+
+        void characters( const std::string& text, bool cdata )
+        {
+            if ( !_capture.empty() )
+            {
+                if ( cdata )
+                    _capture.back().value() += text;
+                else
+                    appendCondensed( text, _capture.back().value() );
+            }
+        }
+
+        void endElement( const std::string& name )
+        {
+            if ( !_capture.empty() )
+            {
+                if ( _capture.size() > 1 )
+                {
+                    _capture[_capture.size()-2].add( _capture.back() );
+                    _capture.pop_back();
+                }
+                else
+                {
+                    Config conf = _capture.back();
+                    _capture.pop_back();
+                    process( conf );
+                }
+            }
+
+            else if ( name == "kml" )
+            {
+                _inKML = false;
+            }
+
+            else if ( _inKML && isContainer(name) && !_containers.empty() )
+            {
+                flush();
+
+                // container-level data (name, visibility, LookAt, etc.)
+                KML_Container container;
+                container.build( _containers.top(), _cx, _cx._groupStack.top().get() );
+
+                _containers.pop();
+                _cx._groupStack.pop();
+            }
+        }
+
+    public:
+        /** Builds everything that was waiting on forward references. */
+        void finish()
+        {
+            flush();
+
+            // resolve style maps that referred to styles further down the document.
+            for( bool progress = true; progress && !_deferredStyleMaps.empty(); )
+            {
+                progress = false;
+                for( std::list<Config>::iterator i = _deferredStyleMaps.begin(); i != _deferredStyleMaps.end(); )
+                {
+                    if ( canResolveStyleMap(*i) )
+                    {
+                        KML_StyleMap styleMap;
+                        styleMap.scan2( *i, _cx );
+                        i = _deferredStyleMaps.erase( i );
+                        progress = true;
+                    }
+                    else ++i;
+                }
+            }
+
+            // build the placemarks whose styles weren't available when we read them,
+            // then swap each placeholder for what it built.
+            for( DeferredPlacemarks::iterator i = _deferredPlacemarks.begin(); i != _deferredPlacemarks.end(); ++i )
+            {
+                osg::ref_ptr<osg::Group> placeholder = i->second.get();
+                _cx._groupStack.push( placeholder.get() );
+                KML_Placemark placemark;
+                placemark.build( i->first, _cx );
+                _cx._groupStack.pop();
+
+                while( placeholder->getNumParents() > 0 )
+                {
+                    osg::Group* parent = placeholder->getParent(0);
+                    unsigned index = parent->getChildIndex( placeholder.get() );
+                    parent->removeChild( index );
+                    for( unsigned c=0; c<placeholder->getNumChildren(); ++c )
+                        parent->insertChild( index+c, placeholder->getChild(c) );
+                }
+            }
+            _deferredPlacemarks.clear();
+        }
+
+    private:
+        static bool isContainer( const std::string& name )
+        {
+            return name == "document" || name == "folder";
+        }
+
+        static void setAttrs( Config& conf, const XmlAttributes& attrs )
+        {
+            for( XmlAttributes::const_iterator a = attrs.begin(); a != attrs.end(); ++a )
+                conf.set( a->first, a->second );
+        }
+
+        void beginCapture( const std::string& name, const XmlAttributes& attrs )
+        {
+            _capture.push_back( Config(name) );
+            _capture.back().setReferrer( _referrer );
+            setAttrs( _capture.back(), attrs );
+        }
+
+        bool canResolveStyleMap( const Config& conf ) const
+        {
+            const Config& pair = conf.child("pair");
+            const std::string& url = pair.value("styleurl");
+            return url.empty() || _cx._sheet->getStyle( url, false ) != 0L;
+        }
+
+        template<typename T>
+        void buildFeature( const Config& conf )
+        {
+            flush();
+            T feature;
+            feature.scan ( conf, _cx );
+            feature.scan2( conf, _cx );
+            feature.build( conf, _cx );
+        }
+
+        /** Handles one complete element. */
+        void process( const Config& conf )
+        {
+            const std::string& name = conf.key();
+
+            if ( name == "placemark" )
+            {
+                addPlacemark( conf );
+            }
+            else if ( name == "style" )
+            {
+                KML_Style style;
+                style.scan( conf, _cx );
+            }
+            else if ( name == "stylemap" )
+            {
+                if ( canResolveStyleMap(conf) )
+                {
+                    KML_StyleMap styleMap;
+                    styleMap.scan2( conf, _cx );
+                }
+                else
+                {
+                    _deferredStyleMaps.push_back( conf );
+                }
+            }
+            else if ( name == "schema" )
+            {
+                KML_Schema schema;
+                schema.scan ( conf, _cx );
+                schema.scan2( conf, _cx );
+            }
+            else if ( name == "networklinkcontrol" )
+            {
+                KML_NetworkLinkControl nlc;
+                nlc.scan ( conf, _cx );
+                nlc.scan2( conf, _cx );
+            }
+            else if ( name == "networklink" )   buildFeature<KML_NetworkLink>  ( conf );
+            else if ( name == "groundoverlay" ) buildFeature<KML_GroundOverlay>( conf );
+            else if ( name == "screenoverlay" ) buildFeature<KML_ScreenOverlay>( conf );
+            else if ( name == "photooverlay" )  buildFeature<KML_PhotoOverlay> ( conf );
+            else if ( !_containers.empty() )
+            {
+                // a property of the enclosing container.
+                _containers.top().add( conf );
+            }
+        }
+
+        void addPlacemark( const Config& conf )
+        {
+            ++_numPlacemarks;
+
+            // registers any inline styles.
+            KML_Placemark placemark;
+            placemark.scan ( conf, _cx );
+            placemark.scan2( conf, _cx );
+
+            // only references into this document ("#id") can be resolved later;
+            // anything else won't improve by waiting.
+            const std::string& styleUrl = conf.value("styleurl");
+            if ( !styleUrl.empty() && styleUrl[0] == '#' && !_cx._sheet->getStyle(styleUrl, false) )
+            {
+                // forward reference (or a missing style); try again at the end,
+                // holding this placemark's position with a placeholder.
+                flush();
+                osg::Group* placeholder = new osg::Group();
+                _cx._groupStack.top()->addChild( placeholder );
+                _deferredPlacemarks.push_back( std::make_pair(conf, osg::ref_ptr<osg::Group>(placeholder)) );
+                ++_numDeferred;
+                return;
+            }
+
+            _batch.push_back( PendingPlacemark() );
+            _batch.back()._conf  = conf;
+            _batch.back()._style = placemark.resolveStyle( conf, _cx );
+
+            if ( _batch.size() >= _batchSize )
+                flush();
+        }
+
+        /** Builds the batched placemarks into the current group. */
+        void flush()
+        {
+            if ( _batch.empty() )
+                return;
+
+            unsigned numJobs = osg::minimum( _numThreads, (unsigned)_batch.size() );
+
+            if ( numJobs <= 1 )
+            {
+                for( PendingPlacemarks::const_iterator i = _batch.begin(); i != _batch.end(); ++i )
+                {
+                    KML_Placemark placemark;
+                    placemark.buildWithStyle( i->_conf, _cx, i->_style );
+                }
+            }
+            else
+            {
+                TaskService* service = TaskService::getShared( "KMLReader", (int)numJobs );
+
+                Threading::MultiEvent semaphore( numJobs );
+                std::vector< osg::ref_ptr< ParallelTask<BuildJob> > > jobs;
+                jobs.reserve( numJobs );
+
+                unsigned perJob = _batch.size() / numJobs;
+                PendingPlacemarks::const_iterator begin = _batch.begin();
+                for( unsigned j=0; j<numJobs; ++j )
+                {
+                    PendingPlacemarks::const_iterator end = j+1 < numJobs ? begin + perJob : _batch.end();
+                    ParallelTask<BuildJob>* job = new ParallelTask<BuildJob>( &semaphore );
+                    job->init( begin, end, _cx );
+                    jobs.push_back( job );
+                    begin = end;
+                }
+
+                for( unsigned j=0; j<numJobs; ++j )
+                    service->add( jobs[j].get() );
+
+                semaphore.wait();
+
+                // merge the results in document order.
+                osg::Group* parent = _cx._groupStack.top().get();
+                for( unsigned j=0; j<numJobs; ++j )
+                {
+                    moveChildren( jobs[j]->_group.get(), parent );
+                    if ( jobs[j]->_iconGroup.valid() )
+                        moveChildren( jobs[j]->_iconGroup.get(), _cx._options->iconAndLabelGroup().get() );
+                }
+            }
+
+            _batch.clear();
+        }
+
+        typedef std::list< std::pair< Config, osg::ref_ptr<osg::Group> > > DeferredPlacemarks;
+
+        KMLContext&         _cx;
+        std::string         _referrer;
+        bool                _inKML;
+        unsigned            _numThreads;
+        unsigned            _batchSize;
+        std::vector<Config> _capture;
+        std::stack<Config>  _containers;
+        PendingPlacemarks   _batch;
+        std::list<Config>   _deferredStyleMaps;
+        DeferredPlacemarks  _deferredPlacemarks;
+        unsigned            _numPlacemarks;
+        unsigned            _numDeferred;
+    };
+}
+
+//------------------------------------------------------------------------
+
 osg::Node*
 KMLReader::read( std::istream& in, const URIContext& context )
 {
-    // read the KML from an XML stream:
-    osg::ref_ptr<XmlDocument> xml = XmlDocument::load( in, context );
-    if ( !xml.valid() )
+    osg::Timer_t start = osg::Timer::instance()->tick();
+
+    KMLContext cx;
+    osg::ref_ptr<osg::Group> root = createRoot( cx );
+    root->setName( context.referrer() );
+
+    KMLStreamHandler handler( cx, context.referrer() );
+    XmlStreamReader  reader( in );
+
+    if ( !reader.parse(handler) )
+    {
+        OE_WARN << LC << "Error in KML document: " << reader.getError() << std::endl;
+        if ( !context.referrer().empty() )
+            OE_WARN << LC << context.referrer() << std::endl;
         return 0L;
+    }
 
-    // convert to a config:
-    Config config = xml->getConfig();
+    handler.finish();
 
-    osg::Node* node = read( config );
-    node->setName( context.referrer() );
+    OE_INFO << LC << "Read " << handler.getNumPlacemarks() << " placemarks ("
+        << handler.getNumDeferred() << " with forward style references) from "
+        << (reader.getBytesRead() / 1048576.0) << " MB in "
+        << osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() ) << " s"
+        << std::endl;
 
-    return node;
+    return root.release();
 }
 
 osg::Node*
 KMLReader::read( const Config& conf )
 {
-    osg::Group* root = new osg::Group();
+    KMLContext cx;
+    osg::Group* root = createRoot( cx );
     root->ref();
 
     root->setName( conf.referrer() );
 
-    KMLContext cx;
-    cx._mapNode = _mapNode;
-    cx._sheet = new StyleSheet();
-    cx._groupStack.push( root );
-    cx._options = _options;
-    cx._srs = SpatialReference::create( "wgs84", "egm96" );
-
-    if ( cx._options->iconAndLabelGroup().valid() && cx._options->declutter() == true )
-    {
-        Decluttering::setEnabled( cx._options->iconAndLabelGroup()->getOrCreateStateSet(), true );
-    }
-
     const Config& kml = conf.child("kml");
     if ( !kml.empty() )
     {
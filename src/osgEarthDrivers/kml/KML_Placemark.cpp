@@ -34,6 +34,12 @@ using namespace osgEarth::Annotation;
 
 void 
 KML_Placemark::build( const Config& conf, KMLContext& cx )
+{
+    buildWithStyle( conf, cx, resolveStyle(conf, cx) );
+}
+
+Style
+KML_Placemark::resolveStyle( const Config& conf, KMLContext& cx )
 {
     Style style;
     if ( conf.hasValue("styleurl") )
@@ -50,6 +56,13 @@ KML_Placemark::build( const Config& conf, KMLContext& cx )
         kmlStyle.scan( conf.child("style"), cx );
         style = cx._activeStyle;
     }
+    return style;
+}
+
+void
+KML_Placemark::buildWithStyle( const Config& conf, KMLContext& cx, const Style& resolvedStyle )
+{
+    Style style = resolvedStyle;
 
     // KML's default altitude mode is clampToGround.
     AltitudeModeEnum altMode = AltitudeMode::RELATIVE_TO_TERRAIN;
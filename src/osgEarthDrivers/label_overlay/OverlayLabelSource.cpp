@@ -105,7 +105,13 @@ public:
             makeECEF = context.getSession()->getMapInfo().isGeocentric();
         }
 
-        for( FeatureList::const_iterator i = input.begin(); i != input.end(); ++i )
+        // evaluate the label text for all features at once, so that scripted
+        // content runs through the script engine in a single batch.
+        std::vector<std::string> values;
+        Feature::eval( contentExpr, input, values, &context );
+
+        unsigned index = 0;
+        for( FeatureList::const_iterator i = input.begin(); i != input.end(); ++i, ++index )
         {
             const Feature* feature = i->get();
             if ( !feature )
@@ -122,7 +128,7 @@ public:
                 context.profile()->getSRS()->transformToECEF( centroid, centroid );
             }
 
-            const std::string& value = feature->eval( contentExpr, &context );
+            const std::string& value = values[index];
 
             if ( !value.empty() && (!skipDupes || used.find(value) == used.end()) )
             {
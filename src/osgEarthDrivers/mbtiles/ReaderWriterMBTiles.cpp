@@ -23,7 +23,10 @@
 #include <osgEarth/Registry>
 #include <osgEarth/FileUtils>
 #include <osgEarth/ImageUtils>
+#include <osgEarth/ThreadingUtils>
+#include <osgEarth/IOTypes>
 #include <osg/Notify>
+#include <osg/Timer>
 #include <osgDB/FileNameUtils>
 #include <osgDB/FileUtils>
 #include <osgDB/Registry>
@@ -33,6 +36,7 @@
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
+#include <vector>
 
 using namespace osgEarth;
 using namespace osgEarth::Drivers;
@@ -42,18 +46,73 @@ using namespace osgEarth::Drivers;
 
 #define LC "[MBTilesSource] "
 
+namespace
+{
+    /** A database connection along with its prepared statements. */
+    struct Connection
+    {
+        Connection() : _db( 0L ), _selectTile( 0L ), _insertTile( 0L ) { }
+
+        ~Connection()
+        {
+            if ( _selectTile ) sqlite3_finalize( _selectTile );
+            if ( _insertTile ) sqlite3_finalize( _insertTile );
+            if ( _db )         sqlite3_close( _db );
+        }
+
+        sqlite3*      _db;
+        sqlite3_stmt* _selectTile;
+        sqlite3_stmt* _insertTile;
+    };
+
+    bool execute( sqlite3* db, const char* sql )
+    {
+        char* errmsg = 0L;
+        int rc = sqlite3_exec( db, sql, 0L, 0L, &errmsg );
+        if ( rc != SQLITE_OK )
+        {
+            OE_WARN << LC << "SQL failed: " << sql << "; " << (errmsg ? errmsg : "") << std::endl;
+            sqlite3_free( errmsg );
+            return false;
+        }
+        return true;
+    }
+}
+
 class MBTilesSource : public TileSource
 {
 public:
     MBTilesSource( const TileSourceOptions& options ) :
       TileSource( options ),
       _options( options ),      
-      _database( NULL ),
+      _writer( 0L ),
+      _pendingInserts( 0 ),
+      _readFailed( false ),
+      _retryReadsAt( 0 ),
+      _retryDelay( 1.0 ),
       _minLevel( 0 ),
-      _maxLevel( 20 )
+      _maxLevel( 20 ),
+      _empty( false )
     {
     }
 
+    virtual ~MBTilesSource()
+    {
+        Threading::ScopedMutexLock lock( _connectionsMutex );
+        for( ConnectionVector::iterator i = _idleConnections.begin(); i != _idleConnections.end(); ++i )
+            delete *i;
+        _idleConnections.clear();
+
+        if ( _writer )
+        {
+            Threading::ScopedMutexLock writerLock( _writerMutex );
+            commitInserts();
+        }
+
+        delete _writer;
+        _writer = 0L;
+    }
+
     // override
       void initialize( const osgDB::Options* dbOptions, const Profile* overrideProfile)
     {
@@ -71,21 +130,35 @@ public:
         }
 #endif
 
-        int flags = SQLITE_OPEN_READONLY;
-        int rc = sqlite3_open_v2( _options.filename()->c_str(), &_database, flags, 0L );
-        if ( rc != 0 )
+        // in writer mode, open (or create) the database and its schema up front so
+        // that the reader connections can find the tables.
+        if ( _options.writable() == true )
+        {
+            _writer = openConnection( SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX );
+            if ( !_writer || !createTables() )
+            {
+                delete _writer;
+                _writer = 0L;
+                setProfile( 0L );
+                return;
+            }
+        }
+
+        ScopedConnection scoped( this );
+        Connection* conn = scoped._conn;
+        if ( !conn )
         {
-            OE_WARN << LC << "Failed to open database \"" << *_options.filename() << "\": " << sqlite3_errmsg(_database) << std::endl;
+            setProfile( 0L );
             return;
         }
 
         //Print out some metadata
         std::string name, type, version, description, format;
-        getMetaData( "name", name );
-        getMetaData( "type", type);
-        getMetaData( "version", version );
-        getMetaData( "description", description );
-        getMetaData( "format", format );
+        getMetaData( conn, "name", name );
+        getMetaData( conn, "type", type);
+        getMetaData( conn, "version", version );
+        getMetaData( conn, "description", description );
+        getMetaData( conn, "format", format );
         OE_NOTICE << "name=" << name << std::endl
                   << "type=" << type << std::endl
                   << "version=" << version << std::endl
@@ -111,10 +184,19 @@ public:
 
         OE_DEBUG << LC <<  "_tileFormat = " << _tileFormat << std::endl;
 
+        //Record the format in a new database
+        if ( _writer && format.empty() )
+        {
+            putMetaData( "name", osgDB::getStrippedName(*_options.filename()) );
+            putMetaData( "type", "baselayer" );
+            putMetaData( "version", "1.0" );
+            putMetaData( "format", _tileFormat );
+        }
+
         //Get the ReaderWriter
         _rw = osgDB::Registry::instance()->getReaderWriterForExtension( _tileFormat );
 
-        computeLevels();
+        computeLevels( conn );
     }    
 
     // override
@@ -125,75 +207,170 @@ public:
         int x = key.getTileX();
         int y = key.getTileY();
 
-        if (z < _minLevel)
+        // the level range grows as tiles are written, so read it under the lock.
+        unsigned minLevel, maxLevel;
+        bool     empty;
+        {
+            Threading::ScopedMutexLock lock( _levelsMutex );
+            minLevel = _minLevel;
+            maxLevel = _maxLevel;
+            empty    = _empty;
+        }
+
+        if ( empty )
+        {
+            // nothing has been written to the database yet
+            return NULL;
+        }
+
+        if (z < (int)minLevel)
         {
             //Return an empty image to make it continue subdividing
             return ImageUtils::createEmptyImage();
         }
 
-        if (z > _maxLevel)
+        if (z > (int)maxLevel)
         {
             //If we're at the max level, just return NULL
             return NULL;
         }
 
+        if ( !_rw.valid() )
+            return NULL;
+
         unsigned int numRows, numCols;
         key.getProfile()->getNumTiles(key.getLevelOfDetail(), numCols, numRows);
         y  = numRows - y - 1;
 
-        //Get the image
-        sqlite3_stmt* select = NULL;
-        std::string query = "SELECT tile_data from tiles where zoom_level = ? AND tile_column = ? AND tile_row = ?";
-        int rc = sqlite3_prepare_v2( _database, query.c_str(), -1, &select, 0L );
-        if ( rc != SQLITE_OK )
+        // readers only see committed tiles, so finish the open batch first.
+        if ( _pendingInserts > 0 )
         {
-            OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(_database) << std::endl;
-            return NULL;
+            Threading::ScopedMutexLock writerLock( _writerMutex );
+            commitInserts();
         }
 
-        bool valid = true;        
+        ScopedConnection scoped( this );
+        Connection* conn = scoped._conn;
+        if ( !conn )
+            return NULL;
+
+        //Get the image, using the connection's prepared statement
+        sqlite3_stmt* select = conn->_selectTile;
         sqlite3_bind_int( select, 1, z );
         sqlite3_bind_int( select, 2, x );
         sqlite3_bind_int( select, 3, y );
 
-
         osg::Image* result = NULL;
-        rc = sqlite3_step( select );
+        int rc = sqlite3_step( select );
         if ( rc == SQLITE_ROW)
         {                     
-            // the pointer returned from _blob gets freed internally by sqlite, supposedly
+            // the blob stays valid until the statement is reset, so decode it in place.
             const char* data = (const char*)sqlite3_column_blob( select, 0 );
             int imageBufLen = sqlite3_column_bytes( select, 0 );
 
-            // deserialize the image from the buffer:
-            std::string imageString( data, imageBufLen );
-            std::stringstream imageBufStream( imageString );
-            osgDB::ReaderWriter::ReadResult rr = _rw->readImage( imageBufStream );
-            if (rr.validImage())
+            if ( data && imageBufLen > 0 )
             {
-                result = rr.takeImage();            
+                MemoryStreamBuf buf( data, imageBufLen );
+                std::istream imageBufStream( &buf );
+                osgDB::ReaderWriter::ReadResult rr = _rw->readImage( imageBufStream );
+                if (rr.validImage())
+                {
+                    result = rr.takeImage();            
+                }
             }
         }
-        else
+        else if ( rc != SQLITE_DONE )
         {
-            OE_DEBUG << LC << "SQL QUERY failed for " << query << ": " << std::endl;
-            valid = false;
+            OE_DEBUG << LC << "SQL QUERY failed for tile " << key.str() << ": " << sqlite3_errmsg(conn->_db) << std::endl;
         }
 
-        sqlite3_finalize( select );
+        sqlite3_reset( select );
         return result;
+    }
+
+    // override
+    bool isWritable() const
+    {
+        return _writer != 0L;
+    }
+
+    // override
+    bool storeImage( const TileKey& key, osg::Image* image, ProgressCallback* progress )
+    {
+        if ( !_writer || !image || !_rw.valid() )
+            return false;
+
+        int z = key.getLevelOfDetail();
+        int x = key.getTileX();
+        int y = key.getTileY();
+
+        unsigned int numRows, numCols;
+        key.getProfile()->getNumTiles(key.getLevelOfDetail(), numCols, numRows);
+        y  = numRows - y - 1;
+
+        // encode the image:
+        std::stringstream buf;
+        osgDB::ReaderWriter::WriteResult wr = _rw->writeImage( *image, buf );
+        if ( !wr.success() )
+        {
+            OE_WARN << LC << "Failed to encode tile " << key.str() << " as " << _tileFormat << std::endl;
+            return false;
+        }
+        std::string data = buf.str();
+
+        Threading::ScopedMutexLock lock( _writerMutex );
+
+        // inserts are batched into transactions; one commit per tile would
+        // sync the database on every write.
+        if ( _pendingInserts == 0 && !execute(_writer->_db, "BEGIN") )
+            return false;
+
+        sqlite3_stmt* insert = _writer->_insertTile;
+        sqlite3_bind_int ( insert, 1, z );
+        sqlite3_bind_int ( insert, 2, x );
+        sqlite3_bind_int ( insert, 3, y );
+        sqlite3_bind_blob( insert, 4, data.c_str(), data.length(), SQLITE_STATIC );
+
+        int rc = sqlite3_step( insert );
+        sqlite3_reset( insert );
+        sqlite3_clear_bindings( insert );
+
+        if ( rc != SQLITE_DONE )
+        {
+            OE_WARN << LC << "Failed to store tile " << key.str() << ": " << sqlite3_errmsg(_writer->_db) << std::endl;
+            if ( _pendingInserts == 0 )
+                execute( _writer->_db, "COMMIT" );
+            return false;
+        }
+
+        if ( ++_pendingInserts >= MAX_INSERTS_PER_TRANSACTION )
+            commitInserts();
+
+        // widen the advertised level range to cover the new tile:
+        Threading::ScopedMutexLock levelsLock( _levelsMutex );
+        if ( _empty )
+        {
+            _minLevel = _maxLevel = z;
+            _empty = false;
+        }
+        else
+        {
+            _minLevel = osg::minimum( _minLevel, (unsigned)z );
+            _maxLevel = osg::maximum( _maxLevel, (unsigned)z );
+        }
 
+        return true;
     }
 
-    bool getMetaData( const std::string& key, std::string& value )
+    bool getMetaData( Connection* conn, const std::string& key, std::string& value )
     {
         //get the metadata
         sqlite3_stmt* select = NULL;
         std::string query = "SELECT value from metadata where name = ?";
-        int rc = sqlite3_prepare_v2( _database, query.c_str(), -1, &select, 0L );
+        int rc = sqlite3_prepare_v2( conn->_db, query.c_str(), -1, &select, 0L );
         if ( rc != SQLITE_OK )
         {
-            OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(_database) << std::endl;
+            OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(conn->_db) << std::endl;
             return false;
         }
 
@@ -203,7 +380,8 @@ public:
         rc = sqlite3_bind_text( select, 1, keyStr.c_str(), keyStr.length(), SQLITE_STATIC );
         if (rc != SQLITE_OK )
         {
-            OE_WARN << LC << "Failed to bind text: " << query << "; " << sqlite3_errmsg(_database) << std::endl;
+            OE_WARN << LC << "Failed to bind text: " << query << "; " << sqlite3_errmsg(conn->_db) << std::endl;
+            sqlite3_finalize( select );
             return false;
         }
 
@@ -222,19 +400,44 @@ public:
         return valid;
     }
 
-    void computeLevels()
+    bool putMetaData( const std::string& key, const std::string& value )
+    {
+        Threading::ScopedMutexLock lock( _writerMutex );
+
+        sqlite3_stmt* insert = NULL;
+        std::string query = "INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?)";
+        int rc = sqlite3_prepare_v2( _writer->_db, query.c_str(), -1, &insert, 0L );
+        if ( rc != SQLITE_OK )
+        {
+            OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(_writer->_db) << std::endl;
+            return false;
+        }
+
+        sqlite3_bind_text( insert, 1, key.c_str(), key.length(), SQLITE_STATIC );
+        sqlite3_bind_text( insert, 2, value.c_str(), value.length(), SQLITE_STATIC );
+
+        rc = sqlite3_step( insert );
+        sqlite3_finalize( insert );
+        return rc == SQLITE_DONE;
+    }
+
+    void computeLevels( Connection* conn )
     {        
         sqlite3_stmt* select = NULL;
         std::string query = "SELECT min(zoom_level), max(zoom_level) from tiles";
-        int rc = sqlite3_prepare_v2( _database, query.c_str(), -1, &select, 0L );
+        int rc = sqlite3_prepare_v2( conn->_db, query.c_str(), -1, &select, 0L );
         if ( rc != SQLITE_OK )
         {
-            OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(_database) << std::endl;
+            OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(conn->_db) << std::endl;
+            return;
         }
 
         rc = sqlite3_step( select );
         if ( rc == SQLITE_ROW)
         {                     
+            // min() is NULL when there are no tiles yet (e.g. a new writable database)
+            Threading::ScopedMutexLock lock( _levelsMutex );
+            _empty    = sqlite3_column_type( select, 0 ) == SQLITE_NULL;
             _minLevel = sqlite3_column_int( select, 0 );
             _maxLevel = sqlite3_column_int( select, 1 );
             //OE_NOTICE << "Min=" << _minLevel << " Max=" << _maxLevel << std::endl;
@@ -254,10 +457,159 @@ public:
     }
 
 private:
+    // number of tiles written in one transaction before it commits.
+    enum { MAX_INSERTS_PER_TRANSACTION = 256 };
+
+    /** Commits the open batch of inserts, if any. Call with the writer mutex held. */
+    void commitInserts()
+    {
+        if ( _pendingInserts > 0 )
+        {
+            execute( _writer->_db, "COMMIT" );
+            _pendingInserts = 0;
+        }
+    }
+
+    /** Opens a new connection and prepares its statements. */
+    Connection* openConnection( int flags )
+    {
+        Connection* conn = new Connection();
+
+        int rc = sqlite3_open_v2( _options.filename()->c_str(), &conn->_db, flags, 0L );
+        if ( rc != SQLITE_OK )
+        {
+            OE_WARN << LC << "Failed to open database \"" << *_options.filename() << "\": " << sqlite3_errmsg(conn->_db) << std::endl;
+            delete conn;
+            return 0L;
+        }
+
+        if ( flags & SQLITE_OPEN_READWRITE )
+        {
+            // WAL lets the reader connections keep going while tiles are written.
+            execute( conn->_db, "PRAGMA journal_mode=WAL" );
+        }
+        else if ( _options.mmapSizeMB().value() > 0 )
+        {
+            // Read tile pages straight out of the OS page cache (SQLite 3.7.17+;
+            // older versions ignore the pragma).
+            std::stringstream pragma;
+            pragma << "PRAGMA mmap_size=" << (sqlite3_int64)_options.mmapSizeMB().value() * 1048576;
+            std::string pragmaStr = pragma.str();
+            sqlite3_exec( conn->_db, pragmaStr.c_str(), 0L, 0L, 0L );
+        }
+
+        return conn;
+    }
+
+    /**
+     * Takes an idle read connection from the pool, opening a new one if they are all
+     * in use. Connections are shared by all threads, one at a time, so there are never
+     * more of them than concurrent readers and none are left behind by exited threads.
+     */
+    Connection* acquireConnection()
+    {
+        {
+            Threading::ScopedMutexLock lock( _connectionsMutex );
+            if ( !_idleConnections.empty() )
+            {
+                Connection* conn = _idleConnections.back();
+                _idleConnections.pop_back();
+                return conn;
+            }
+
+            // don't retry a failed open on every tile; back off instead.
+            if ( _readFailed && osg::Timer::instance()->tick() < _retryReadsAt )
+                return 0L;
+        }
+
+        // a connection is only used by one thread at a time, so skip SQLite's mutexing.
+        Connection* conn = openConnection( SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX );
+        if ( conn )
+        {
+            std::string query = "SELECT tile_data from tiles where zoom_level = ? AND tile_column = ? AND tile_row = ?";
+            int rc = sqlite3_prepare_v2( conn->_db, query.c_str(), -1, &conn->_selectTile, 0L );
+            if ( rc != SQLITE_OK )
+            {
+                OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(conn->_db) << std::endl;
+                delete conn;
+                conn = 0L;
+            }
+        }
+
+        {
+            Threading::ScopedMutexLock lock( _connectionsMutex );
+            if ( conn )
+            {
+                _readFailed = false;
+                _retryDelay = 1.0;
+            }
+            else
+            {
+                // e.g. the file is still being copied in; try again later, less and less often.
+                _readFailed   = true;
+                _retryReadsAt = osg::Timer::instance()->tick() + (osg::Timer_t)(_retryDelay / osg::Timer::instance()->getSecondsPerTick());
+                _retryDelay   = osg::minimum( _retryDelay * 2.0, 60.0 );
+            }
+        }
+        return conn;
+    }
+
+    /** Returns a read connection to the pool. */
+    void releaseConnection( Connection* conn )
+    {
+        if ( conn )
+        {
+            Threading::ScopedMutexLock lock( _connectionsMutex );
+            _idleConnections.push_back( conn );
+        }
+    }
+
+    /** Holds a pooled read connection for the lifetime of the object. */
+    struct ScopedConnection
+    {
+        ScopedConnection( MBTilesSource* source ) : _source( source ), _conn( source->acquireConnection() ) { }
+        ~ScopedConnection() { _source->releaseConnection( _conn ); }
+        MBTilesSource* _source;
+        Connection*    _conn;
+    };
+    friend struct ScopedConnection;
+
+    /** Creates the MBTiles schema in the writer's database if it does not exist. */
+    bool createTables()
+    {
+        if ( !execute(_writer->_db, "CREATE TABLE IF NOT EXISTS metadata (name text, value text)") ||
+             !execute(_writer->_db, "CREATE UNIQUE INDEX IF NOT EXISTS name ON metadata (name)") ||
+             !execute(_writer->_db, "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob)") ||
+             !execute(_writer->_db, "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row)") )
+        {
+            return false;
+        }
+
+        std::string query = "INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)";
+        int rc = sqlite3_prepare_v2( _writer->_db, query.c_str(), -1, &_writer->_insertTile, 0L );
+        if ( rc != SQLITE_OK )
+        {
+            OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(_writer->_db) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    typedef std::vector<Connection*> ConnectionVector;
+
     const MBTilesOptions _options;    
-    sqlite3* _database;
+    ConnectionVector     _idleConnections;
+    Threading::Mutex     _connectionsMutex;
+    Connection*          _writer;
+    Threading::Mutex     _writerMutex;
+    volatile unsigned    _pendingInserts;
+    bool                 _readFailed;
+    osg::Timer_t         _retryReadsAt;
+    double               _retryDelay;
+    Threading::Mutex     _levelsMutex;
     unsigned int _minLevel;
     unsigned int _maxLevel;
+    bool         _empty;
 
     osg::ref_ptr<osgDB::ReaderWriter> _rw;
     std::string _tileFormat;
@@ -49,7 +49,7 @@ JSFeature::GetObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> feat_instance;
+  v8::Persistent<v8::ObjectTemplate>& feat_instance = V8Util::GetObjectTemplateSlot(GetObjectType());
 
   if (feat_instance.IsEmpty())
   {
@@ -67,7 +67,7 @@ JSFeature::GetAttributesObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> attr_instance;
+  v8::Persistent<v8::ObjectTemplate>& attr_instance = V8Util::GetObjectTemplateSlot(GetObjectType() + "Attributes");
 
   if (attr_instance.IsEmpty())
   {
@@ -176,7 +176,7 @@ JSSymbologyGeometry::GetObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> template_instance;
+  v8::Persistent<v8::ObjectTemplate>& template_instance = V8Util::GetObjectTemplateSlot(GetObjectType());
 
   if (template_instance.IsEmpty())
   {
@@ -266,7 +266,7 @@ JSBounds::GetObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> template_instance;
+  v8::Persistent<v8::ObjectTemplate>& template_instance = V8Util::GetObjectTemplateSlot(GetObjectType());
   
   if (template_instance.IsEmpty())
   {
@@ -432,7 +432,7 @@ JSVec3d::GetObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> template_instance;
+  v8::Persistent<v8::ObjectTemplate>& template_instance = V8Util::GetObjectTemplateSlot(GetObjectType());
 
   if (template_instance.IsEmpty())
   {
@@ -513,7 +513,7 @@ JSFilterContext::GetObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> template_instance;
+  v8::Persistent<v8::ObjectTemplate>& template_instance = V8Util::GetObjectTemplateSlot(GetObjectType());
 
   if (template_instance.IsEmpty())
   {
@@ -685,7 +685,7 @@ JSSession::GetObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> template_instance;
+  v8::Persistent<v8::ObjectTemplate>& template_instance = V8Util::GetObjectTemplateSlot(GetObjectType());
 
   if (template_instance.IsEmpty())
   {
@@ -771,7 +771,7 @@ JSMapInfo::GetObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> template_instance;
+  v8::Persistent<v8::ObjectTemplate>& template_instance = V8Util::GetObjectTemplateSlot(GetObjectType());
 
   if (template_instance.IsEmpty())
   {
@@ -924,7 +924,7 @@ JSFeatureProfile::GetObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> template_instance;
+  v8::Persistent<v8::ObjectTemplate>& template_instance = V8Util::GetObjectTemplateSlot(GetObjectType());
 
   if (template_instance.IsEmpty())
   {
@@ -993,7 +993,7 @@ JSGeoExtent::GetObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> template_instance;
+  v8::Persistent<v8::ObjectTemplate>& template_instance = V8Util::GetObjectTemplateSlot(GetObjectType());
 
   if (template_instance.IsEmpty())
   {
@@ -1141,7 +1141,7 @@ JSSpatialReference::GetObjectTemplate()
 {
   v8::HandleScope handle_scope;
 
-  static v8::Persistent<v8::ObjectTemplate> template_instance;
+  v8::Persistent<v8::ObjectTemplate>& template_instance = V8Util::GetObjectTemplateSlot(GetObjectType());
 
   if (template_instance.IsEmpty())
   {
@@ -39,32 +39,100 @@ using namespace osgEarth::Features;
 JavascriptEngineV8::JavascriptEngineV8(const ScriptEngineOptions& options)
 : ScriptEngine(options)
 {
-  v8:: HandleScope handle_scope;
+  // set up the first context right away so that errors in the
+  // script are reported when the engine loads.
+  releaseContext(createContext());
+}
+
+JavascriptEngineV8::~JavascriptEngineV8()
+{
+  Threading::ScopedMutexLock lock(_idleContextsMutex);
+
+  for (std::vector<IsolateContext*>::iterator i = _idleContexts.begin(); i != _idleContexts.end(); ++i)
+    destroyContext(*i);
+
+  _idleContexts.clear();
+}
+
+JavascriptEngineV8::IsolateContext*
+JavascriptEngineV8::acquireContext()
+{
+  {
+    Threading::ScopedMutexLock lock(_idleContextsMutex);
+    if (!_idleContexts.empty())
+    {
+      IsolateContext* ic = _idleContexts.back();
+      _idleContexts.pop_back();
+      return ic;
+    }
+  }
+
+  // every context is busy; build another one outside the lock.
+  return createContext();
+}
 
-  v8::Handle<v8::ObjectTemplate> global = createGlobalObjectTemplate();
-  _globalContext = v8::Context::New(NULL, global);
+void
+JavascriptEngineV8::releaseContext(IsolateContext* ic)
+{
+  Threading::ScopedMutexLock lock(_idleContextsMutex);
+  _idleContexts.push_back(ic);
+}
 
-  if (options.script().isSet() && !options.script()->getCode().empty())
+JavascriptEngineV8::IsolateContext*
+JavascriptEngineV8::createContext()
+{
+  IsolateContext* ic = new IsolateContext();
+  ic->_isolate = v8::Isolate::New();
   {
-    // Create a nested handle scope
-    v8::HandleScope local_handle_scope;
+    v8::Locker locker(ic->_isolate);
+    v8::Isolate::Scope isolate_scope(ic->_isolate);
+    v8::HandleScope handle_scope;
+
+    v8::Handle<v8::ObjectTemplate> global = createGlobalObjectTemplate();
+    ic->_context = v8::Context::New(NULL, global);
 
-    // Enter the global context
-    v8::Context::Scope context_scope(_globalContext);
+    if (_script.isSet() && !_script->getCode().empty())
+    {
+      // Enter the new context
+      v8::Context::Scope context_scope(ic->_context);
 
-    // Compile and run the script
-    ScriptResult result = executeScript(v8::String::New(options.script()->getCode().c_str(), options.script()->getCode().length()));
-    if (!result.success())
-      OE_WARN << LC << "Error reading javascript: " << result.message() << std::endl;
+      // Compile and run the script (once per context, so don't cache it)
+      ScriptResult result = executeScript(ic, _script->getCode(), false);
+      if (!result.success())
+        OE_WARN << LC << "Error reading javascript: " << result.message() << std::endl;
+    }
   }
 
-  _globalTemplate = v8::Persistent<v8::ObjectTemplate>::New(global);
+  return ic;
 }
 
-JavascriptEngineV8::~JavascriptEngineV8()
+void
+JavascriptEngineV8::destroyContext(IsolateContext* ic)
+{
+  {
+    v8::Locker locker(ic->_isolate);
+    v8::Isolate::Scope isolate_scope(ic->_isolate);
+
+    for (IsolateContext::ScriptCache::iterator i = ic->_scripts.begin(); i != ic->_scripts.end(); ++i)
+      i->second.Dispose();
+    ic->_scripts.clear();
+
+    ic->_context.Dispose();
+    V8Util::DisposeIsolateData(ic->_isolate);
+  }
+
+  ic->_isolate->Dispose();
+  delete ic;
+}
+
+void
+JavascriptEngineV8::setGlobals(IsolateContext* ic, osgEarth::Features::Feature const* feature, osgEarth::Features::FilterContext const* context)
 {
-  _globalTemplate.Dispose();
-  _globalContext.Dispose();
+  v8::Handle<v8::Object> fObj = JSFeature::WrapFeature(const_cast<Feature*>(feature));
+  ic->_context->Global()->Set(v8::String::New("feature"), fObj);
+
+  v8::Handle<v8::Object> cObj = JSFilterContext::WrapFilterContext(const_cast<FilterContext*>(context));
+  ic->_context->Global()->Set(v8::String::New("context"), cObj);
 }
 
 v8::Local<v8::ObjectTemplate>
@@ -101,8 +169,11 @@ JavascriptEngineV8::logCallback(const v8::Arguments& args)
   return v8::Undefined();
 }
 
+// upper limit on the number of compiled scripts kept per pooled isolate
+#define MAX_CACHED_SCRIPTS 256
+
 ScriptResult
-JavascriptEngineV8::executeScript(v8::Handle<v8::String> script)
+JavascriptEngineV8::executeScript(IsolateContext* ic, const std::string& code, bool cache)
 {
   // Handle scope for temporary handles.
   v8::HandleScope handle_scope;
@@ -110,12 +181,36 @@ JavascriptEngineV8::executeScript(v8::Handle<v8::String> script)
   // TryCatch for any script errors
   v8::TryCatch try_catch;
 
-  // Compile the script
-  v8::Handle<v8::Script> compiled_script = v8::Script::Compile(script);
-  if (compiled_script.IsEmpty())
+  // Look for a previously compiled copy of the code
+  v8::Handle<v8::Script> compiled_script;
+  IsolateContext::ScriptCache::iterator i = ic->_scripts.find(code);
+  if (i != ic->_scripts.end())
   {
-    v8::String::AsciiValue error(try_catch.Exception());
-    return ScriptResult(EMPTY_STRING, false, std::string("Script compile error: ") + std::string(*error));
+    compiled_script = i->second;
+  }
+  else
+  {
+    // Compile the script
+    compiled_script = v8::Script::Compile(v8::String::New(code.c_str(), code.length()));
+    if (compiled_script.IsEmpty())
+    {
+      v8::String::AsciiValue error(try_catch.Exception());
+      return ScriptResult(EMPTY_STRING, false, std::string("Script compile error: ") + std::string(*error));
+    }
+
+    if (cache)
+    {
+      // Expressions come from styles, so the set is normally small; if it isn't,
+      // just start over rather than tracking usage.
+      if (ic->_scripts.size() >= MAX_CACHED_SCRIPTS)
+      {
+        for (i = ic->_scripts.begin(); i != ic->_scripts.end(); ++i)
+          i->second.Dispose();
+        ic->_scripts.clear();
+      }
+
+      ic->_scripts[code] = v8::Persistent<v8::Script>::New(compiled_script);
+    }
   }
 
   // Run the script
@@ -145,26 +240,60 @@ JavascriptEngineV8::run(const std::string& code, osgEarth::Features::Feature con
   if (code.empty())
     return ScriptResult(EMPTY_STRING, false, "Script is empty.");
 
-  v8::Locker locker;
+  ScopedContext scoped(this);
+  IsolateContext* ic = scoped._ic;
+
+  // No other thread holds this context, so the lock is uncontended.
+  v8::Locker locker(ic->_isolate);
+  v8::Isolate::Scope isolate_scope(ic->_isolate);
   v8::HandleScope handle_scope;
+  v8::Context::Scope context_scope(ic->_context);
 
-  //Create a separate context
-  //v8::Persistent<v8::Context> context = v8::Context::New(NULL, _globalTemplate);
-  //v8::Context::Scope context_scope(context);
-  v8::Context::Scope context_scope(_globalContext);
+  setGlobals(ic, feature, context);
 
-  v8::Handle<v8::Object> fObj = JSFeature::WrapFeature(const_cast<Feature*>(feature));
-  _globalContext->Global()->Set(v8::String::New("feature"), fObj);
+  // Compile (or fetch) and run the script
+  return executeScript(ic, code);
+}
+
+bool
+JavascriptEngineV8::runBatch(const std::string& code, const osgEarth::Features::FeatureList& features, std::vector<ScriptResult>& out_results, osgEarth::Features::FilterContext const* context)
+{
+  if (code.empty())
+  {
+    out_results.resize(out_results.size() + features.size(), ScriptResult(EMPTY_STRING, false, "Script is empty."));
+    return false;
+  }
+
+  ScopedContext scoped(this);
+  IsolateContext* ic = scoped._ic;
+
+  // Enter the isolate and context once for the whole batch.
+  v8::Locker locker(ic->_isolate);
+  v8::Isolate::Scope isolate_scope(ic->_isolate);
+  v8::HandleScope handle_scope;
+  v8::Context::Scope context_scope(ic->_context);
 
   v8::Handle<v8::Object> cObj = JSFilterContext::WrapFilterContext(const_cast<FilterContext*>(context));
-  _globalContext->Global()->Set(v8::String::New("context"), cObj);
+  ic->_context->Global()->Set(v8::String::New("context"), cObj);
+
+  v8::Handle<v8::String> featureName = v8::String::New("feature");
 
-  // Compile and run the script
-  ScriptResult result = executeScript(v8::String::New(code.c_str(), code.length()));
+  bool ok = true;
+  out_results.reserve(out_results.size() + features.size());
 
-  //context.Dispose();
+  for (FeatureList::const_iterator i = features.begin(); i != features.end(); ++i)
+  {
+    // Scope the per-feature wrapper so handles don't pile up over a large batch.
+    v8::HandleScope feature_scope;
+
+    v8::Handle<v8::Object> fObj = JSFeature::WrapFeature(const_cast<Feature*>(i->get()));
+    ic->_context->Global()->Set(featureName, fObj);
+
+    out_results.push_back(executeScript(ic, code));
+    ok = ok && out_results.back().success();
+  }
 
-  return result;
+  return ok;
 }
 
 ScriptResult
@@ -173,16 +302,20 @@ JavascriptEngineV8::call(const std::string& function, osgEarth::Features::Featur
   if (function.empty())
     return ScriptResult(EMPTY_STRING, false, "Empty function name parameter.");
 
+  ScopedContext scoped(this);
+  IsolateContext* ic = scoped._ic;
+
   // Lock for V8 multithreaded uses
-  v8::Locker locker;
+  v8::Locker locker(ic->_isolate);
+  v8::Isolate::Scope isolate_scope(ic->_isolate);
 
   v8::HandleScope handle_scope;
 
-  v8::Context::Scope context_scope(_globalContext);
+  v8::Context::Scope context_scope(ic->_context);
 
   // Attempt to fetch the function from the global object.
   v8::Handle<v8::String> func_name = v8::String::New(function.c_str(), function.length());
-  v8::Handle<v8::Value> func_val = _globalContext->Global()->Get(func_name);
+  v8::Handle<v8::Value> func_val = ic->_context->Global()->Get(func_name);
 
   // If there is no function, or if it is not a function, bail out
   if (!func_val->IsFunction())
@@ -190,20 +323,13 @@ JavascriptEngineV8::call(const std::string& function, osgEarth::Features::Featur
 
   v8::Handle<v8::Function> func_func = v8::Handle<v8::Function>::Cast(func_val);
 
-  v8::Handle<v8::Object> fObj = JSFeature::WrapFeature(const_cast<Feature*>(feature));
-  _globalContext->Global()->Set(v8::String::New("feature"), fObj);
-
-  v8::Handle<v8::Object> cObj = JSFilterContext::WrapFilterContext(const_cast<FilterContext*>(context));
-  _globalContext->Global()->Set(v8::String::New("context"), cObj);
+  setGlobals(ic, feature, context);
 
   // Set up an exception handler before calling the Eval function
   v8::TryCatch try_catch;
 
   // Invoke the specifed function
-  //const int argc = 1;
-  //v8::Handle<v8::Value> argv[argc] = { fObj };
-  //v8::Handle<v8::Value> result = func_func->Call(_globalContext->Global(), argc, argv);
-  v8::Handle<v8::Value> result = func_func->Call(_globalContext->Global(), 0, NULL);
+  v8::Handle<v8::Value> result = func_func->Call(ic->_context->Global(), 0, NULL);
 
   if (result.IsEmpty())
   {
@@ -20,7 +20,10 @@
 #include <osgEarth/TileSource>
 #include <osgEarth/ImageToHeightFieldConverter>
 #include <osgEarth/Registry>
+#include <osgEarth/Cache>
 #include <osgEarth/XmlUtils>
+#include <osgEarth/TaskService>
+#include <osgEarth/ThreadingUtils>
 #include <osgEarthUtil/WMS>
 #include <osgDB/FileNameUtils>
 #include <osgDB/FileUtils>
@@ -28,6 +31,7 @@
 #include <osgDB/ReadFile>
 #include <osgDB/WriteFile>
 #include <osg/ImageSequence>
+#include <osg/observer_ptr>
 #include <sstream>
 #include <stdlib.h>
 #include <string.h>
@@ -57,11 +61,161 @@ public:
     }
 };
 
+//----------------------------------------------------------------------------
+
+namespace
+{
+    // reads the image out of a WMS response, reporting any service exception.
+    osg::Image* readResponseImage( const HTTPResponse& response, const std::string& uri )
+    {
+        if ( !response.isOK() )
+            return 0L;
+
+        const std::string& mt = response.getMimeType();
+
+        if ( mt == "application/vnd.ogc.se_xml" || mt == "text/xml" )
+        {
+            // an XML result means there was a WMS service exception:
+            Config se;
+            if ( se.fromXML( response.getPartStream(0) ) )
+            {
+                Config ex = se.child("serviceexceptionreport").child("serviceexception");
+                if ( !ex.empty() ) {
+                    OE_NOTICE << "WMS Service Exception: " << ex.toJSON(true) << std::endl;
+                }
+                else {
+                    OE_NOTICE << "WMS Response: " << se.toJSON(true) << std::endl;
+                }
+            }
+            else {
+                OE_NOTICE << "WMS: unknown error." << std::endl;
+            }
+            return 0L;
+        }
+
+        // really ought to use mime-type support here -GW
+        std::string typeExt = mt.substr( mt.find_last_of("/")+1 );
+        osgDB::ReaderWriter* reader = osgDB::Registry::instance()->getReaderWriterForExtension( typeExt );
+        if ( !reader ) {
+            OE_NOTICE << "WMS: no reader registered; URI=" << uri << std::endl;
+            return 0L;
+        }
+
+        osgDB::ReaderWriter::ReadResult readResult = reader->readImage( response.getPartStream( 0 ), 0L ); //getOptions() );
+        if ( readResult.error() ) {
+            OE_WARN << "WMS: image read failed for " << uri << std::endl;
+            return 0L;
+        }
+
+        return readResult.takeImage();
+    }
+
+    // receives the images of a tile's time steps, in time order.
+    struct TimeStepSink
+    {
+        virtual ~TimeStepSink() { }
+
+        // "image" is NULL if the step failed; return false to stop fetching.
+        virtual bool accept( unsigned index, osg::Image* image ) =0;
+    };
+
+    // Fetches a list of time-step URIs, keeping up to "maxInFlight" requests
+    // outstanding at once, and delivers the images to the sink in order.
+    void fetchTimeSteps(const std::vector<std::string>& uris,
+                        unsigned                        maxInFlight,
+                        ProgressCallback*               progress,
+                        TimeStepSink&                   sink)
+    {
+        std::vector< osg::ref_ptr<HTTPFuture> > futures( uris.size() );
+        unsigned next = 0;
+        unsigned i    = 0;
+
+        for( ; i < uris.size(); ++i )
+        {
+            // keep the window full:
+            for( ; next < uris.size() && next < i + osg::maximum(maxInFlight, 1u); ++next )
+            {
+                futures[next] = HTTPClient::getAsync( HTTPRequest(uris[next]), 0L, progress );
+            }
+
+            // stop waiting as soon as the caller gives up.
+            if ( !futures[i]->wait(progress) )
+                break;
+
+            osg::ref_ptr<osg::Image> image = readResponseImage( futures[i]->getResponse(), uris[i] );
+            futures[i] = 0L;
+
+            if ( !sink.accept(i, image.get()) || (progress && progress->isCanceled()) )
+                break;
+        }
+
+        // abandon anything still in flight.
+        for( ; i < next; ++i )
+        {
+            if ( futures[i].valid() )
+                futures[i]->cancel();
+        }
+    }
+
+    // collects time steps into a vector.
+    struct VectorSink : public TimeStepSink
+    {
+        VectorSink( unsigned size ) : _images(size) { }
+
+        bool accept( unsigned index, osg::Image* image ) {
+            _images[index] = image;
+            return true;
+        }
+
+        std::vector< osg::ref_ptr<osg::Image> > _images;
+    };
+
+    // appends time steps to an image sequence, for as long as the sequence
+    // is still in use.
+    struct SequenceSink : public TimeStepSink
+    {
+        SequenceSink( osg::ImageSequence* seq ) : _seq(seq) { }
+
+        bool accept( unsigned index, osg::Image* image ) {
+            osg::ref_ptr<osg::ImageSequence> seq;
+            if ( !_seq.lock(seq) )
+                return false;
+            if ( image )
+                seq->addImage( image );
+            return true;
+        }
+
+        osg::observer_ptr<osg::ImageSequence> _seq;
+    };
+
+    // loads the remaining frames of a progressive image sequence.
+    struct SequenceLoader : public TaskRequest
+    {
+        SequenceLoader(osg::ImageSequence*             seq,
+                       const std::vector<std::string>& uris,
+                       unsigned                        maxInFlight )
+            : _seq(seq), _uris(uris), _maxInFlight(maxInFlight) { }
+
+        void operator()( ProgressCallback* progress )
+        {
+            SequenceSink sink( _seq.get() );
+            fetchTimeSteps( _uris, _maxInFlight, progress, sink );
+        }
+
+        osg::observer_ptr<osg::ImageSequence> _seq;
+        std::vector<std::string>              _uris;
+        unsigned                              _maxInFlight;
+    };
+
+}
+
+//----------------------------------------------------------------------------
 
 class WMSSource : public TileSource
 {
 public:
-	WMSSource( const TileSourceOptions& options ) : TileSource( options ), _options(options)
+	WMSSource( const TileSourceOptions& options ) : TileSource( options ), _options(options),
+        _progressive( false )
     {
         if ( _options.times().isSet() )
         {
@@ -79,6 +233,16 @@ public:
     {
         osg::ref_ptr<const Profile> result;
 
+        // A progressive sequence is returned before all its frames arrive, so the layer
+        // would write it to the cache with only the first frame. Only go progressive
+        // when there is no cache to write to.
+        _progressive = _options.progressive() == true;
+        if ( _progressive && Cache::get( options ) != 0L )
+        {
+            OE_INFO << LC << "Layer has a cache; disabling progressive WMS-T loading" << std::endl;
+            _progressive = false;
+        }
+
         char sep = _options.url()->full().find_first_of('?') == std::string::npos? '?' : '&';
 
         URI capUrl = _options.capabilitiesUrl().value();
@@ -266,61 +430,6 @@ public:
 
 public:
 
-    // fetch a tile from the WMS service and report any exceptions.
-    osgDB::ReaderWriter* fetchTileAndReader( 
-        const TileKey&     key, 
-        const std::string& extraAttrs,
-        ProgressCallback*  progress, 
-        HTTPResponse&      out_response )
-    {
-        osgDB::ReaderWriter* result = 0L;
-
-        std::string uri = createURI(key);
-        if ( !extraAttrs.empty() )
-        {
-            std::string delim = uri.find("?") == std::string::npos ? "?" : "&";
-            uri = uri + delim + extraAttrs;
-        }
-
-
-        out_response = HTTPClient::get( uri, 0L, progress ); //getOptions(), progress );
-
-        if ( out_response.isOK() )
-        {
-            const std::string& mt = out_response.getMimeType();
-
-            if ( mt == "application/vnd.ogc.se_xml" || mt == "text/xml" )
-            {
-                // an XML result means there was a WMS service exception:
-                Config se;
-                if ( se.fromXML( out_response.getPartStream(0) ) )
-                {
-                    Config ex = se.child("serviceexceptionreport").child("serviceexception");
-                    if ( !ex.empty() ) {
-                        OE_NOTICE << "WMS Service Exception: " << ex.toJSON(true) << std::endl;
-                    }
-                    else {
-                        OE_NOTICE << "WMS Response: " << se.toJSON(true) << std::endl;
-                    }
-                }
-                else {
-                    OE_NOTICE << "WMS: unknown error." << std::endl;
-                }
-            }
-            else
-            {
-                // really ought to use mime-type support here -GW
-                std::string typeExt = mt.substr( mt.find_last_of("/")+1 );
-                result = osgDB::Registry::instance()->getReaderWriterForExtension( typeExt );
-                if ( !result ) {
-                    OE_NOTICE << "WMS: no reader registered; URI=" << createURI(key) << std::endl;
-                }
-            }
-        }
-        return result;
-    }
-
-
     /** override */
     osg::Image* createImage( const TileKey& key, ProgressCallback* progress )
     {
@@ -336,18 +445,9 @@ public:
             if ( _timesVec.size() == 1 )
                 extras = std::string("TIME=") + _timesVec[0];
 
-            HTTPResponse response;
-            osgDB::ReaderWriter* reader = fetchTileAndReader( key, extras, progress, response );
-            if ( reader )
-            {
-                osgDB::ReaderWriter::ReadResult readResult = reader->readImage( response.getPartStream( 0 ), 0L ); //getOptions() );
-                if ( readResult.error() ) {
-                    OE_WARN << "WMS: image read failed for " << createURI(key) << std::endl;
-                }
-                else {
-                    image = readResult.getImage();
-                }
-            }
+            std::string uri = createURI( key, extras );
+            HTTPResponse response = HTTPClient::get( uri, 0L, progress ); //getOptions(), progress );
+            image = readResponseImage( response, uri );
         }
 
         return image.release();
@@ -358,38 +458,33 @@ public:
     {
         osg::ref_ptr<osg::Image> image;
 
-        for( unsigned int r=0; r<_timesVec.size(); ++r )
+        std::vector<std::string> uris;
+        createTimeURIs( key, uris );
+
+        VectorSink steps( uris.size() );
+        fetchTimeSteps( uris, _options.maxConcurrentTimes().value(), progress, steps );
+
+        for( unsigned int r=0; r<steps._images.size(); ++r )
         {
-            std::string extraAttrs = std::string("TIME=") + _timesVec[r];
-            HTTPResponse response;
-            osgDB::ReaderWriter* reader = fetchTileAndReader( key, extraAttrs, progress, response );
-            if ( reader )
+            osg::Image* timeImage = steps._images[r].get();
+            if ( !timeImage )
+                continue;
+
+            if ( !image.valid() )
             {
-                osgDB::ReaderWriter::ReadResult readResult = reader->readImage( response.getPartStream( 0 ), 0L ); //getOptions() );
-                if ( readResult.error() ) {
-                    OE_WARN << "WMS: image read failed for " << createURI(key) << std::endl;
-                }
-                else
-                {
-                    osg::ref_ptr<osg::Image> timeImage = readResult.getImage();
-
-                    if ( !image.valid() )
-                    {
-                        image = new osg::Image();
-                        image->allocateImage(
-                            timeImage->s(), timeImage->t(), _timesVec.size(),
-                            timeImage->getPixelFormat(),
-                            timeImage->getDataType(),
-                            timeImage->getPacking() );
-                        image->setInternalTextureFormat( timeImage->getInternalTextureFormat() );
-                    }
-
-                    memcpy( 
-                        image->data(0,0,r), 
-                        timeImage->data(), 
-                        osg::minimum(image->getImageSizeInBytes(), timeImage->getImageSizeInBytes()) );
-                }
+                image = new osg::Image();
+                image->allocateImage(
+                    timeImage->s(), timeImage->t(), _timesVec.size(),
+                    timeImage->getPixelFormat(),
+                    timeImage->getDataType(),
+                    timeImage->getPacking() );
+                image->setInternalTextureFormat( timeImage->getInternalTextureFormat() );
             }
+
+            memcpy( 
+                image->data(0,0,r), 
+                timeImage->data(), 
+                osg::minimum(image->getImageSizeInBytes(), timeImage->getImageSizeInBytes()) );
         }
 
         return image.release();
@@ -398,33 +493,43 @@ public:
     /** creates a 3D image from timestamped data. */
     osg::Image* createImageSequence( const TileKey& key, ProgressCallback* progress )
     {
-        osg::ImageSequence* seq = new SyncImageSequence();
+        osg::ref_ptr<osg::ImageSequence> seq = new SyncImageSequence();
 
         seq->setLoopingMode( osg::ImageStream::LOOPING );
         seq->setLength( _options.secondsPerFrame().value() * (double)_timesVec.size() );
         seq->play();
 
-        for( unsigned int r=0; r<_timesVec.size(); ++r )
-        {
-            std::string extraAttrs = std::string("TIME=") + _timesVec[r];
+        std::vector<std::string> uris;
+        createTimeURIs( key, uris );
 
-            HTTPResponse response;
-            osgDB::ReaderWriter* reader = fetchTileAndReader( key, extraAttrs, progress, response );
-            if ( reader )
-            {
-                osgDB::ReaderWriter::ReadResult readResult = reader->readImage( response.getPartStream( 0 ), 0L ); //getOptions() );
-                if ( !readResult.error() )
-                {
-                    seq->addImage( readResult.getImage() );
-                }
-                else
-                {
-                    OE_WARN << "WMS: image read failed for " << createURI(key) << std::endl;
-                }
-            }
+        // In progressive mode, only wait for the first frame; the rest load in the
+        // background and the sequence picks them up as they arrive.
+        unsigned numNow = _progressive ? 1u : uris.size();
+
+        SequenceSink sink( seq.get() );
+        fetchTimeSteps(
+            std::vector<std::string>( uris.begin(), uris.begin() + numNow ),
+            _options.maxConcurrentTimes().value(),
+            progress, 
+            sink );
+
+        if ( numNow < uris.size() && !(progress && progress->isCanceled()) )
+        {
+            TaskService::getShared( "WMS-T loader", 2 )->add( new SequenceLoader(
+                seq.get(),
+                std::vector<std::string>( uris.begin() + numNow, uris.end() ),
+                _options.maxConcurrentTimes().value() ) );
         }
 
-        return seq;
+        return seq.release();
+    }
+
+    // one GetMap URI per WMS-T time step.
+    void createTimeURIs( const TileKey& key, std::vector<std::string>& out_uris ) const
+    {
+        out_uris.reserve( _timesVec.size() );
+        for( unsigned int r=0; r<_timesVec.size(); ++r )
+            out_uris.push_back( createURI(key, std::string("TIME=") + _timesVec[r]) );
     }
 
 
@@ -467,6 +572,17 @@ public:
         return uri;
     }
 
+    std::string createURI( const TileKey& key, const std::string& extraAttrs ) const
+    {
+        std::string uri = createURI( key );
+        if ( !extraAttrs.empty() )
+        {
+            std::string delim = uri.find("?") == std::string::npos ? "?" : "&";
+            uri = uri + delim + extraAttrs;
+        }
+        return uri;
+    }
+
     virtual int getPixelsPerTile() const
     {
         return _options.tileSize().value();
@@ -485,6 +601,7 @@ private:
     osg::ref_ptr<const Profile> _profile;
     std::string _prototype;
     std::vector<std::string> _timesVec;
+    bool _progressive;
 };
 
 
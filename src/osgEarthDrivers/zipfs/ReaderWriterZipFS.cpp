@@ -24,18 +24,299 @@
 #include <osgDB/ReadFile>
 #include <osgDB/WriteFile>
 
+#include <osgEarth/ThreadingUtils>
+#include <osgEarth/IOTypes>
+
 #include <OpenThreads/ReentrantMutex>
 
 #include <sstream>
+#include <map>
+#include <vector>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#   include <io.h>
+#else
+#   include <unistd.h>
+#   include <sys/mman.h>
+#endif
 
 #include "zip.h"
 
 using namespace osg;
 using namespace osgDB;
+using namespace osgEarth;
 
+// serializes writes (libzip rewrites the whole archive on close)
 static OpenThreads::ReentrantMutex s_mutex;
 
+namespace
+{
+    inline unsigned readU16( const unsigned char* p ) { return p[0] | (p[1] << 8); }
+    inline unsigned readU32( const unsigned char* p ) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24); }
+
+    /**
+     * An open zip archive, shared by all reads of that archive. The entry names
+     * are indexed once when it opens. Stored (uncompressed) entries are read
+     * straight out of a read-only memory map, with no locking; compressed entries
+     * go through a libzip handle checked out of a small pool for each read.
+     */
+    class ZipArchive : public osg::Referenced
+    {
+    public:
+        struct Entry
+        {
+            int          _index;      // libzip index (central directory order)
+            unsigned     _size;
+            const char*  _mappedData; // start of the data in the memory map, if stored
+        };
+
+        ZipArchive( const std::string& path ) : _path( path ), _map( 0L ), _mapSize( 0 ) { }
+
+        bool open()
+        {
+            mapFile();
+            if ( _map && indexFromMap() )
+                return true;
+
+            // no map, or an archive we don't parse ourselves (e.g. ZIP64): index through libzip.
+            _entries.clear();
+            ScopedHandle handle( this );
+            zip* z = handle._zip;
+            if ( !z )
+                return false;
+
+            int numFiles = zip_get_num_files( z );
+            for( int i = 0; i < numFiles; ++i )
+            {
+                struct zip_stat st;
+                if ( zip_stat_index( z, i, 0, &st ) == 0 && st.name )
+                {
+                    Entry& e = _entries[st.name];
+                    e._index = i;
+                    e._size = (unsigned)st.size;
+                    e._mappedData = 0L;
+                }
+            }
+            return true;
+        }
+
+        const Entry* find( const std::string& name ) const
+        {
+            std::map<std::string, Entry>::const_iterator i = _entries.find( name );
+            return i != _entries.end() ? &i->second : 0L;
+        }
+
+        /** Reads a compressed entry through a pooled handle. */
+        bool read( const Entry& entry, std::string& out )
+        {
+            ScopedHandle handle( this );
+            zip* z = handle._zip;
+            if ( !z )
+                return false;
+
+            zip_file* zf = zip_fopen_index( z, entry._index, 0 );
+            if ( !zf )
+                return false;
+
+            out.resize( entry._size );
+            int n = entry._size > 0 ? zip_fread( zf, &out[0], entry._size ) : 0;
+            zip_fclose( zf );
+            return n == (int)entry._size;
+        }
+
+    protected:
+        virtual ~ZipArchive()
+        {
+            for( HandleVector::iterator i = _idleHandles.begin(); i != _idleHandles.end(); ++i )
+                zip_close( *i );
+#ifndef _WIN32
+            if ( _map )
+                ::munmap( (void*)_map, _mapSize );
+#endif
+        }
+
+        // idle handles kept open for reuse; more concurrent readers than this get
+        // a handle of their own that is closed when they're done with it.
+        enum { MAX_IDLE_HANDLES = 8 };
+
+        /**
+         * Takes an idle libzip handle from the pool, opening a new one if they are all
+         * in use. A handle is used by one thread at a time, and none are left behind
+         * by exited threads.
+         */
+        zip* acquireHandle()
+        {
+            {
+                Threading::ScopedMutexLock lock( _handlesMutex );
+                if ( !_idleHandles.empty() )
+                {
+                    zip* z = _idleHandles.back();
+                    _idleHandles.pop_back();
+                    return z;
+                }
+            }
+
+            int err;
+            return zip_open( _path.c_str(), 0, &err );
+        }
+
+        /** Returns a handle to the pool, or closes it if the pool is full. */
+        void releaseHandle( zip* z )
+        {
+            if ( !z )
+                return;
+            {
+                Threading::ScopedMutexLock lock( _handlesMutex );
+                if ( _idleHandles.size() < MAX_IDLE_HANDLES )
+                {
+                    _idleHandles.push_back( z );
+                    return;
+                }
+            }
+            zip_close( z );
+        }
+
+        /** Holds a pooled handle for the lifetime of the object. */
+        struct ScopedHandle
+        {
+            ScopedHandle( ZipArchive* archive ) : _archive( archive ), _zip( archive->acquireHandle() ) { }
+            ~ScopedHandle() { _archive->releaseHandle( _zip ); }
+            ZipArchive* _archive;
+            zip*        _zip;
+        };
+        friend struct ScopedHandle;
+
+        void mapFile()
+        {
+#ifndef _WIN32
+            int fd = ::open( _path.c_str(), O_RDONLY );
+            if ( fd < 0 )
+                return;
+
+            struct stat buf;
+            if ( ::fstat(fd, &buf) == 0 && buf.st_size > 0 )
+            {
+                void* mem = ::mmap( 0L, buf.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+                if ( mem != MAP_FAILED )
+                {
+                    _map = (const unsigned char*)mem;
+                    _mapSize = buf.st_size;
+                }
+            }
+            ::close( fd );
+#endif
+        }
+
+        /** Builds the entry index from the central directory in the memory map. */
+        bool indexFromMap()
+        {
+            // find the end-of-central-directory record, which sits behind a comment of up to 64K.
+            if ( _mapSize < 22 )
+                return false;
+
+            const unsigned char* eocd = 0L;
+            std::size_t minPos = _mapSize > 22 + 0xFFFF ? _mapSize - 22 - 0xFFFF : 0;
+            for( std::size_t pos = _mapSize - 22; ; --pos )
+            {
+                if ( readU32(_map + pos) == 0x06054b50 )
+                {
+                    eocd = _map + pos;
+                    break;
+                }
+                if ( pos == minPos )
+                    break;
+            }
+            if ( !eocd )
+                return false;
+
+            unsigned numEntries = readU16( eocd + 10 );
+            unsigned dirSize    = readU32( eocd + 12 );
+            unsigned dirOffset  = readU32( eocd + 16 );
+            if ( numEntries == 0xFFFF || dirOffset == 0xFFFFFFFF || (std::size_t)dirOffset + dirSize > _mapSize )
+                return false;
+
+            const unsigned char* p   = _map + dirOffset;
+            const unsigned char* end = p + dirSize;
+            for( unsigned i = 0; i < numEntries; ++i )
+            {
+                if ( end - p < 46 || readU32(p) != 0x02014b50 )
+                    return false;
+
+                unsigned flags       = readU16( p + 8 );
+                unsigned method      = readU16( p + 10 );
+                unsigned compSize    = readU32( p + 20 );
+                unsigned size        = readU32( p + 24 );
+                unsigned nameLen     = readU16( p + 28 );
+                unsigned extraLen    = readU16( p + 30 );
+                unsigned commentLen  = readU16( p + 32 );
+                unsigned localOffset = readU32( p + 42 );
+
+                if ( (std::size_t)(end - p) < 46 + nameLen + extraLen + commentLen )
+                    return false;
+
+                Entry& e = _entries[ std::string((const char*)p + 46, nameLen) ];
+                e._index = i;
+                e._size = size;
+                e._mappedData = 0L;
+
+                // stored and unencrypted: point straight at the data.
+                if ( method == 0 && (flags & 1) == 0 && compSize == size &&
+                     (std::size_t)localOffset + 30 <= _mapSize &&
+                     readU32(_map + localOffset) == 0x04034b50 )
+                {
+                    const unsigned char* local = _map + localOffset;
+                    std::size_t dataOffset = localOffset + 30 + readU16(local + 26) + readU16(local + 28);
+                    if ( dataOffset + size <= _mapSize )
+                        e._mappedData = (const char*)_map + dataOffset;
+                }
+
+                p += 46 + nameLen + extraLen + commentLen;
+            }
+            return true;
+        }
+
+        typedef std::vector<zip*> HandleVector;
+
+        std::string                  _path;
+        std::map<std::string, Entry> _entries;
+        const unsigned char*         _map;
+        std::size_t                  _mapSize;
+        HandleVector                 _idleHandles;
+        Threading::Mutex             _handlesMutex;
+    };
+
+    typedef std::map< std::string, osg::ref_ptr<ZipArchive> > ZipArchiveMap;
+
+    Threading::Mutex s_archivesMutex;
+    ZipArchiveMap    s_archives;
+
+    ZipArchive* getArchive( const std::string& path )
+    {
+        Threading::ScopedMutexLock lock( s_archivesMutex );
+        ZipArchiveMap::iterator i = s_archives.find( path );
+        if ( i != s_archives.end() )
+            return i->second.get();
+
+        osg::ref_ptr<ZipArchive> archive = new ZipArchive( path );
+        if ( !archive->open() )
+            return 0L;
+
+        s_archives[path] = archive.get();
+        return archive.get();
+    }
+
+    /** Drops an archive from the cache after it changes; readers holding it keep the old one. */
+    void closeArchive( const std::string& path )
+    {
+        Threading::ScopedMutexLock lock( s_archivesMutex );
+        s_archives.erase( path );
+    }
+}
+
 /**
 * The ZipFS plugin allows you to treat zip files almost like a virtual file system.
 * You can read and write objects from zips using paths like c:/data/models.zip/cow.osg where cow.osg is a file within the models.zip file.
@@ -131,8 +412,6 @@ public:
 
     ReadResult readFile(ObjectType objectType, const std::string &fullFileName, const osgDB::ReaderWriter::Options* options) const
     {
-        OpenThreads::ScopedLock<OpenThreads::ReentrantMutex> lock(s_mutex);
-
         //This plugin allows you to treat zip files almost like virtual directories.  So, the pathname to the file you want in the zip should
         //be of the format c:\data\myzip.zip\images\foo.png
 
@@ -176,61 +455,38 @@ public:
          }
 
 
-        int err;
-
-        //Open the zip file
-        struct zip* pZip = zip_open(zipFile.c_str(), ZIP_CHECKCONS, &err);
-        if (pZip)
+        //Open (or reuse) the zip file
+        osg::ref_ptr<ZipArchive> archive = getArchive( osgDB::convertFileNameToNativeStyle(osgDB::getRealPath(zipFile)) );
+        if ( !archive.valid() )
         {
-            //List the files
-            /*int numFiles = zip_get_num_files(pZip);
-            osg::notify(osg::NOTICE) << zipFile << " has " << numFiles << " files " << std::endl;
-            for (int i = 0; i < numFiles; ++i)
-            {
-            osg::notify(osg::NOTICE) << i << ": " << zip_get_name(pZip, i, 0) << std::endl;
-            }*/
-
-            //Find the index within the zip file for the given zip entry
-            int zipIndex = zip_name_locate(pZip, zipEntry.c_str(), 0);
+            osg::notify(osg::NOTICE) << "ReaderWriterZipFS::readFile couldn't open zip " << zipFile << " full filename " << fullFileName << std::endl;
+            return ReadResult::FILE_NOT_HANDLED;
+        }
 
-            osg::notify(osg::INFO) << "ReaderWriterZipFS: ZipFile index " << zipIndex << std::endl;
-            if (zipIndex < 0)
-            {
-                osg::notify(osg::INFO) << "Could not find zip entry " << zipEntry << " in " << zipFile << std::endl;
-                //Make sure to close the zipfile
-                zip_close(pZip);
-                return ReadResult::FILE_NOT_FOUND;  
-            }
-            
-            //Open the entry for reading
-            zip_file* pZipFile = zip_fopen_index(pZip, zipIndex, 0);
+        //Find the zip entry
+        const ZipArchive::Entry* entry = archive->find( zipEntry );
+        if ( !entry )
+        {
+            osg::notify(osg::INFO) << "Could not find zip entry " << zipEntry << " in " << zipFile << std::endl;
+            return ReadResult::FILE_NOT_FOUND;
+        }
 
-            if (pZipFile) 
-            {
-                //Read the data from the entry into a std::string
-                int dataSize = 0;
-                std::string data;
-                do{
-                    char buffer[1024];
-                    dataSize = zip_fread(pZipFile, buffer, 1024);
-                    if (dataSize > 0)
-                    {
-                       data.append((char*)buffer, dataSize);
-                    }
-                }while (dataSize > 0);
-
-                //Close the zip entry and the actual zip file itself
-                zip_fclose(pZipFile);
-                zip_close(pZip);
-
-                std::stringstream strstream(data);
-                return readFile(objectType, rw, strstream, options);
-            }
+        if ( entry->_mappedData )
+        {
+            //Stored entry; read it in place
+            MemoryStreamBuf buf( entry->_mappedData, entry->_size );
+            std::istream strstream( &buf );
+            return readFile(objectType, rw, strstream, options);
         }
-        else
+
+        std::string data;
+        if ( archive->read(*entry, data) )
         {
-            osg::notify(osg::NOTICE) << "ReaderWriterZipFS::readFile couldn't open zip " << zipFile << " full filename " << fullFileName << std::endl;
+            MemoryStreamBuf buf( data.data(), data.size() );
+            std::istream strstream( &buf );
+            return readFile(objectType, rw, strstream, options);
         }
+
         return ReadResult::FILE_NOT_HANDLED;
     }
 
@@ -314,6 +570,9 @@ public:
             }
             zip_close(pZip);
             delete[] data;
+
+            //Readers must reopen the archive to see the new entry
+            closeArchive( osgDB::convertFileNameToNativeStyle(zipFile) );
             return wr;
         }
         else
@@ -21,10 +21,12 @@
 #include <osgEarthSymbology/MeshSubdivider>
 #include <osgEarthSymbology/MeshConsolidator>
 #include <osgEarth/ECEF>
+#include <osgEarth/TaskService>
 #include <osg/ClusterCullingCallback>
 #include <osg/Geode>
 #include <osg/Geometry>
 #include <osg/MatrixTransform>
+#include <osg/TriangleIndexFunctor>
 #include <osgUtil/Tessellator>
 #include <osgUtil/Optimizer>
 #include <osgUtil/SmoothingVisitor>
@@ -77,7 +79,10 @@ _maxAngle_deg       ( 5.0 ),
 _mergeGeometry      ( true ),
 _wallAngleThresh_deg( 60.0 ),
 _styleDirty         ( true ),
-_makeStencilVolume  ( false )
+_makeStencilVolume  ( false ),
+_useSharedBuffers   ( false ),
+_numThreads         ( 1 ),
+_weldVertices       ( false )
 {
     //NOP
 }
@@ -94,6 +99,7 @@ ExtrudeGeometryFilter::reset( const FilterContext& context )
 {
     _cosWallAngleThresh = cos( _wallAngleThresh_deg );
     _geodes.clear();
+    _consolidationStats = MeshConsolidator::Stats();
     
     if ( _styleDirty )
     {
@@ -641,6 +647,166 @@ ExtrudeGeometryFilter::addDrawable(osg::Drawable*      drawable,
     }
 }
 
+bool
+ExtrudeGeometryFilter::buildPart(Feature*                     input,
+                                 Geometry*                    part,
+                                 Random&                      wallSkinPRNG,
+                                 Random&                      roofSkinPRNG,
+                                 optional<NumericExpression>& heightExpr,
+                                 optional<NumericExpression>& heightOffsetExpr,
+                                 bool                         threaded,
+                                 osg::Geometry*               walls,
+                                 osg::Geometry*               rooflines,
+                                 osg::Geometry*               baselines,
+                                 osg::Geometry*               outlines,
+                                 osg::StateSet*&              wallStateSet,
+                                 osg::StateSet*&              roofStateSet,
+                                 FilterContext&               context )
+{
+    wallStateSet = 0L;
+    roofStateSet = 0L;
+
+    // calculate the extrusion height:
+    float height;
+
+    if ( _heightCallback.valid() )
+    {
+        height = _heightCallback->operator()(input, context);
+    }
+    else if ( heightExpr.isSet() )
+    {
+        height = input->eval( heightExpr.mutable_value(), &context );
+    }
+    else
+    {
+        height = *_extrusionSymbol->height();
+    }
+
+    // calculate the height offset from the base:
+    float offset = 0.0;
+    if ( heightOffsetExpr.isSet() )
+    {
+        offset = input->eval( heightOffsetExpr.mutable_value(), &context );
+    }
+
+    // calculate the wall texturing:
+    SkinResource* wallSkin = 0L;
+    if ( _wallSkinSymbol.valid() )
+    {
+        if ( _wallResLib.valid() )
+        {
+            SkinSymbol querySymbol( *_wallSkinSymbol.get() );
+            querySymbol.objectHeight() = fabs(height) - offset;
+            wallSkin = _wallResLib->getSkin( &querySymbol, wallSkinPRNG, context.getDBOptions() );
+        }
+
+        else
+        {
+            //TODO: simple single texture?
+        }
+    }
+
+    // calculate the rooftop texture:
+    SkinResource* roofSkin = 0L;
+    if ( _roofSkinSymbol.valid() )
+    {
+        if ( _roofResLib.valid() )
+        {
+            SkinSymbol querySymbol( *_roofSkinSymbol.get() );
+            roofSkin = _roofResLib->getSkin( &querySymbol, roofSkinPRNG, context.getDBOptions() );
+        }
+
+        else
+        {
+            //TODO: simple single texture?
+        }
+    }
+
+    // calculate the colors:
+    osg::Vec4f wallColor(1,1,1,1), roofColor(1,1,1,1), outlineColor(1,1,1,1);
+
+    if ( _wallPolygonSymbol.valid() )
+    {
+        wallColor = _wallPolygonSymbol->fill()->color();
+    }
+    if ( _roofPolygonSymbol.valid() )
+    {
+        roofColor = _roofPolygonSymbol->fill()->color();
+    }
+    if ( _outlineSymbol.valid() )
+    {
+        outlineColor = _outlineSymbol->stroke()->color();
+    }
+
+    // Create the extruded geometry!
+    if ( !extrudeGeometry( 
+            part, height, offset, 
+            *_extrusionSymbol->flatten(),
+            walls, rooflines, baselines, outlines,
+            wallColor, roofColor, outlineColor,
+            wallSkin, roofSkin,
+            context ) )
+    {
+        return false;
+    }
+
+    // the resource cache is not thread-safe, so protect it when extruding in parallel.
+    if ( wallSkin || (rooflines && roofSkin) )
+    {
+        if ( threaded ) _resourceMutex.lock();
+
+        if ( wallSkin )
+            wallStateSet = context.resourceCache()->getStateSet( wallSkin );
+
+        if ( rooflines && roofSkin )
+            roofStateSet = context.resourceCache()->getStateSet( roofSkin );
+
+        if ( threaded ) _resourceMutex.unlock();
+    }
+
+    // generate per-vertex normals, altering the geometry as necessary to avoid
+    // smoothing around sharp corners
+#if OSG_MIN_VERSION_REQUIRED(2,9,9)
+    //Crease angle threshold wasn't added until
+    osgUtil::SmoothingVisitor::smooth(
+        *walls, 
+        osg::DegreesToRadians(_wallAngleThresh_deg) );            
+#else
+    osgUtil::SmoothingVisitor::smooth(*walls);            
+#endif
+
+    // tessellate and add the roofs if necessary:
+    if ( rooflines )
+    {
+        osgUtil::Tessellator tess;
+        tess.setTessellationType( osgUtil::Tessellator::TESS_TYPE_GEOMETRY );
+        tess.setWindingType( osgUtil::Tessellator::TESS_WINDING_ODD );
+        tess.retessellatePolygons( *rooflines );
+
+        // generate default normals (no crease angle necessary; they are all pointing up)
+        // TODO do this manually; probably faster
+        if ( !_makeStencilVolume )
+            osgUtil::SmoothingVisitor::smooth( *rooflines );
+
+        // texture the rooflines if necessary
+        //applyOverlayTexturing( rooflines.get(), input, env );
+
+        // mark this geometry as DYNAMIC because otherwise the OSG optimizer will destroy it.
+        // TODO: why??
+        rooflines->setDataVariance( osg::Object::DYNAMIC );
+    }
+
+    if ( baselines )
+    {
+        osgUtil::Tessellator tess;
+        tess.setTessellationType( osgUtil::Tessellator::TESS_TYPE_GEOMETRY );
+        tess.setWindingType( osgUtil::Tessellator::TESS_WINDING_ODD );
+        tess.retessellatePolygons( *baselines );
+    }
+
+    return true;
+}
+
 bool
 ExtrudeGeometryFilter::process( FeatureList& features, FilterContext& context )
 {
@@ -687,167 +853,497 @@ ExtrudeGeometryFilter::process( FeatureList& features, FilterContext& context )
                 baselines->setUseVertexBufferObjects(USE_VBOS);
             }
 
-            // calculate the extrusion height:
-            float height;
+            osg::StateSet* wallStateSet = 0L;
+            osg::StateSet* roofStateSet = 0L;
 
-            if ( _heightCallback.valid() )
-            {
-                height = _heightCallback->operator()(input, context);
-            }
-            else if ( _heightExpr.isSet() )
-            {
-                height = input->eval( _heightExpr.mutable_value(), &context );
-            }
-            else
+            if ( buildPart(
+                    input, part,
+                    wallSkinPRNG, roofSkinPRNG,
+                    _heightExpr, _heightOffsetExpr,
+                    false,
+                    walls.get(), rooflines.get(), baselines.get(), outlines.get(),
+                    wallStateSet, roofStateSet,
+                    context ) )
             {
-                height = *_extrusionSymbol->height();
-            }
+                std::string name;
+                if ( !_featureNameExpr.empty() )
+                    name = input->eval( _featureNameExpr, &context );
 
-            // calculate the height offset from the base:
-            float offset = 0.0;
-            if ( _heightOffsetExpr.isSet() )
-            {
-                offset = input->eval( _heightOffsetExpr.mutable_value(), &context );
-            }
+                FeatureSourceIndex* index = context.featureIndex();
+                FeatureID fid = input->getFID();
 
-            osg::StateSet* wallStateSet = 0L;
-            osg::StateSet* roofStateSet = 0L;
+                addDrawable( walls.get(), wallStateSet, name, fid, index );
 
-            // calculate the wall texturing:
-            SkinResource* wallSkin = 0L;
-            if ( _wallSkinSymbol.valid() )
-            {
-                if ( _wallResLib.valid() )
+                if ( rooflines.valid() )
                 {
-                    SkinSymbol querySymbol( *_wallSkinSymbol.get() );
-                    querySymbol.objectHeight() = fabs(height) - offset;
-                    wallSkin = _wallResLib->getSkin( &querySymbol, wallSkinPRNG, context.getDBOptions() );
+                    addDrawable( rooflines.get(), roofStateSet, name, fid, index );
                 }
 
-                else
+                if ( baselines.valid() )
                 {
-                    //TODO: simple single texture?
+                    addDrawable( baselines.get(), 0L, name, fid, index );
                 }
-            }
 
-            // calculate the rooftop texture:
-            SkinResource* roofSkin = 0L;
-            if ( _roofSkinSymbol.valid() )
-            {
-                if ( _roofResLib.valid() )
+                if ( outlines.valid() )
                 {
-                    SkinSymbol querySymbol( *_roofSkinSymbol.get() );
-                    roofSkin = _roofResLib->getSkin( &querySymbol, roofSkinPRNG, context.getDBOptions() );
+                    addDrawable( outlines.get(), 0L, name, fid, index );
                 }
+            }   
+        }
+    }
 
-                else
-                {
-                    //TODO: simple single texture?
-                }
-            }
+    return true;
+}
+
+//------------------------------------------------------------------------
+
+// Shared vertex and index storage for all the extruded geometry that shares
+// a single stateset. Parts are appended as they are extruded, so no per-feature
+// geometry survives past the extrusion of that feature.
+struct ExtrudeGeometryFilter::Arena : public osg::Referenced
+{
+    osg::ref_ptr<osg::Vec3Array>        _verts;
+    osg::ref_ptr<osg::Vec3Array>        _normals;
+    osg::ref_ptr<osg::Vec4Array>        _colors;
+    osg::ref_ptr<osg::Vec2Array>        _texCoords;
+    osg::ref_ptr<osg::DrawElementsUInt> _tris;
+    osg::ref_ptr<osg::DrawElementsUInt> _lines;
+    osg::Geometry::PrimitiveSetList     _taggedPrimSets;
+
+    Arena() :
+        _verts( new osg::Vec3Array() ),
+        _tris ( new osg::DrawElementsUInt(GL_TRIANGLES) ),
+        _lines( new osg::DrawElementsUInt(GL_LINES) ) { }
+
+    unsigned size() const { return _verts->size(); }
+
+    // Appends one extruded part. If a tag is provided, the part gets its own
+    // primitive sets (so the feature index can resolve them); otherwise its
+    // indices go into the shared primitive sets.
+    void append( osg::Geometry* src, RefFeatureID* tag );
+
+    // Appends the contents of another arena (used to join parallel ranges).
+    void append( const Arena& rhs );
+
+    // Total memory held by the arena's buffers, in bytes.
+    unsigned getNumBytes() const;
 
-            // calculate the colors:
-            osg::Vec4f wallColor(1,1,1,1), roofColor(1,1,1,1), outlineColor(1,1,1,1);
+    osg::Geometry* createGeometry() const;
+};
 
-            if ( _wallPolygonSymbol.valid() )
+namespace
+{
+    // Appends "count" attributes from "src" to "dest", creating (and back-filling) "dest"
+    // on demand, and padding with a default value when the source lacks the attribute.
+    template<typename A, typename T>
+    void appendAttribs( osg::ref_ptr<A>& dest, const A* src, unsigned offset, unsigned count, const T& defaultValue )
+    {
+        if ( src && src->size() > 0 )
+        {
+            if ( !dest.valid() )
             {
-                wallColor = _wallPolygonSymbol->fill()->color();
+                dest = new A();
+                dest->assign( offset, defaultValue );
             }
-            if ( _roofPolygonSymbol.valid() )
+
+            if ( src->size() == count )
+                dest->insert( dest->end(), src->begin(), src->end() );
+            else
+                dest->insert( dest->end(), count, (*src)[0] ); // overall binding
+        }
+        else if ( dest.valid() )
+        {
+            dest->insert( dest->end(), count, defaultValue );
+        }
+    }
+
+    struct CollectTriangles
+    {
+        osg::DrawElementsUInt* _out;
+        unsigned               _offset;
+
+        void operator()( unsigned i0, unsigned i1, unsigned i2 )
+        {
+            _out->push_back( _offset + i0 );
+            _out->push_back( _offset + i1 );
+            _out->push_back( _offset + i2 );
+        }
+    };
+
+    // Converts all the line-mode primitive sets in a geometry to GL_LINES pairs.
+    void collectLines( osg::Geometry* geom, osg::DrawElementsUInt* out, unsigned offset )
+    {
+        for( unsigned p = 0; p < geom->getNumPrimitiveSets(); ++p )
+        {
+            const osg::PrimitiveSet* pset = geom->getPrimitiveSet(p);
+            unsigned n = pset->getNumIndices();
+            if ( n < 2 )
+                continue;
+
+            switch( pset->getMode() )
             {
-                roofColor = _roofPolygonSymbol->fill()->color();
+            case GL_LINES:
+                for( unsigned i = 0; i+1 < n; i += 2 ) {
+                    out->push_back( offset + pset->index(i) );
+                    out->push_back( offset + pset->index(i+1) );
+                }
+                break;
+
+            case GL_LINE_STRIP:
+            case GL_LINE_LOOP:
+                for( unsigned i = 0; i+1 < n; ++i ) {
+                    out->push_back( offset + pset->index(i) );
+                    out->push_back( offset + pset->index(i+1) );
+                }
+                if ( pset->getMode() == GL_LINE_LOOP ) {
+                    out->push_back( offset + pset->index(n-1) );
+                    out->push_back( offset + pset->index(0) );
+                }
+                break;
+
+            default:
+                break;
             }
-            if ( _outlineSymbol.valid() )
+        }
+    }
+
+    osg::DrawElementsUInt* copyWithOffset( const osg::DrawElementsUInt* src, unsigned offset )
+    {
+        osg::DrawElementsUInt* de = new osg::DrawElementsUInt( src->getMode() );
+        de->reserve( src->size() );
+        for( osg::DrawElementsUInt::const_iterator i = src->begin(); i != src->end(); ++i )
+            de->push_back( *i + offset );
+        de->setUserData( const_cast<osg::Referenced*>(src->getUserData()) );
+        return de;
+    }
+
+    // Clears out a scratch geometry so it can be re-used for the next part.
+    void resetScratch( osg::Geometry* geom )
+    {
+        geom->removePrimitiveSet( 0, geom->getNumPrimitiveSets() );
+        geom->setVertexArray( 0L );
+        geom->setNormalArray( 0L );
+        geom->setColorArray( 0L );
+        geom->setTexCoordArray( 0, 0L );
+    }
+
+}
+
+void
+ExtrudeGeometryFilter::Arena::append( osg::Geometry* src, RefFeatureID* tag )
+{
+    const osg::Vec3Array* srcVerts = dynamic_cast<const osg::Vec3Array*>( src->getVertexArray() );
+    if ( !srcVerts || srcVerts->size() == 0 )
+        return;
+
+    unsigned offset = _verts->size();
+    unsigned count  = srcVerts->size();
+
+    _verts->insert( _verts->end(), srcVerts->begin(), srcVerts->end() );
+
+    appendAttribs( _normals,   dynamic_cast<const osg::Vec3Array*>(src->getNormalArray()),     offset, count, osg::Vec3(0,0,1) );
+    appendAttribs( _colors,    dynamic_cast<const osg::Vec4Array*>(src->getColorArray()),      offset, count, osg::Vec4(1,1,1,1) );
+    appendAttribs( _texCoords, dynamic_cast<const osg::Vec2Array*>(src->getTexCoordArray(0)),  offset, count, osg::Vec2(0,0) );
+
+    osg::DrawElementsUInt* tris  = _tris.get();
+    osg::DrawElementsUInt* lines = _lines.get();
+
+    if ( tag )
+    {
+        tris = new osg::DrawElementsUInt( GL_TRIANGLES );
+        tris->setUserData( tag );
+        lines = new osg::DrawElementsUInt( GL_LINES );
+        lines->setUserData( tag );
+    }
+
+    osg::TriangleIndexFunctor<CollectTriangles> triCollector;
+    triCollector._out    = tris;
+    triCollector._offset = offset;
+    src->accept( triCollector );
+
+    collectLines( src, lines, offset );
+
+    if ( tag )
+    {
+        if ( tris->size() > 0 )
+            _taggedPrimSets.push_back( tris );
+        if ( lines->size() > 0 )
+            _taggedPrimSets.push_back( lines );
+    }
+}
+
+void
+ExtrudeGeometryFilter::Arena::append( const Arena& rhs )
+{
+    unsigned offset = _verts->size();
+    unsigned count  = rhs._verts->size();
+
+    _verts->insert( _verts->end(), rhs._verts->begin(), rhs._verts->end() );
+
+    appendAttribs( _normals,   rhs._normals.get(),   offset, count, osg::Vec3(0,0,1) );
+    appendAttribs( _colors,    rhs._colors.get(),    offset, count, osg::Vec4(1,1,1,1) );
+    appendAttribs( _texCoords, rhs._texCoords.get(), offset, count, osg::Vec2(0,0) );
+
+    _tris->reserve( _tris->size() + rhs._tris->size() );
+    for( osg::DrawElementsUInt::const_iterator i = rhs._tris->begin(); i != rhs._tris->end(); ++i )
+        _tris->push_back( *i + offset );
+
+    _lines->reserve( _lines->size() + rhs._lines->size() );
+    for( osg::DrawElementsUInt::const_iterator i = rhs._lines->begin(); i != rhs._lines->end(); ++i )
+        _lines->push_back( *i + offset );
+
+    for( osg::Geometry::PrimitiveSetList::const_iterator p = rhs._taggedPrimSets.begin(); p != rhs._taggedPrimSets.end(); ++p )
+        _taggedPrimSets.push_back( copyWithOffset(static_cast<const osg::DrawElementsUInt*>(p->get()), offset) );
+}
+
+unsigned
+ExtrudeGeometryFilter::Arena::getNumBytes() const
+{
+    unsigned bytes = _verts->getTotalDataSize();
+    if ( _normals.valid() )   bytes += _normals->getTotalDataSize();
+    if ( _colors.valid() )    bytes += _colors->getTotalDataSize();
+    if ( _texCoords.valid() ) bytes += _texCoords->getTotalDataSize();
+    bytes += _tris->getTotalDataSize() + _lines->getTotalDataSize();
+    for( osg::Geometry::PrimitiveSetList::const_iterator p = _taggedPrimSets.begin(); p != _taggedPrimSets.end(); ++p )
+        bytes += p->get()->getTotalDataSize();
+    return bytes;
+}
+
+osg::Geometry*
+ExtrudeGeometryFilter::Arena::createGeometry() const
+{
+    osg::Geometry* geom = new osg::Geometry();
+    geom->setUseVertexBufferObjects( USE_VBOS );
+
+    geom->setVertexArray( _verts.get() );
+
+    if ( _normals.valid() )
+    {
+        geom->setNormalArray( _normals.get() );
+        geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    if ( _colors.valid() )
+    {
+        geom->setColorArray( _colors.get() );
+        geom->setColorBinding( osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    if ( _texCoords.valid() )
+    {
+        geom->setTexCoordArray( 0, _texCoords.get() );
+    }
+
+    for( osg::Geometry::PrimitiveSetList::const_iterator p = _taggedPrimSets.begin(); p != _taggedPrimSets.end(); ++p )
+        geom->addPrimitiveSet( p->get() );
+
+    if ( _tris->size() > 0 )
+        geom->addPrimitiveSet( _tris.get() );
+
+    if ( _lines->size() > 0 )
+        geom->addPrimitiveSet( _lines.get() );
+
+    return geom;
+}
+
+//------------------------------------------------------------------------
+
+// Extrudes one disjoint range of the input features into its own set of arenas.
+struct ExtrudeGeometryFilter::RangeJob
+{
+    void init( ExtrudeGeometryFilter* filter, FeatureList::iterator begin, FeatureList::iterator end, 
+               FilterContext* context )
+    {
+        _filter     = filter;
+        _begin      = begin;
+        _end        = end;
+        _context    = context;
+    }
+
+    void execute()
+    {
+        _filter->processRange( _begin, _end, true, _arenas, *_context );
+    }
+
+    ExtrudeGeometryFilter* _filter;
+    FeatureList::iterator  _begin, _end;
+    FilterContext*         _context;
+    ArenaMap               _arenas;
+};
+
+void
+ExtrudeGeometryFilter::processRange(FeatureList::iterator begin,
+                                    FeatureList::iterator end,
+                                    bool                  threaded,
+                                    ArenaMap&             arenas,
+                                    FilterContext&        context )
+{
+    unsigned wallSeed = _wallSkinSymbol.valid()? *_wallSkinSymbol->randomSeed() : 0;
+    unsigned roofSeed = _roofSkinSymbol.valid()? *_roofSkinSymbol->randomSeed() : 0;
+
+    // expressions cache their variable values, so each range needs its own copy.
+    optional<NumericExpression> heightExpr       = _heightExpr;
+    optional<NumericExpression> heightOffsetExpr = _heightOffsetExpr;
+
+    // scratch geometries, re-used for every part:
+    osg::ref_ptr<osg::Geometry> walls     = new osg::Geometry();
+    osg::ref_ptr<osg::Geometry> rooflines = new osg::Geometry();
+    osg::ref_ptr<osg::Geometry> baselines = _makeStencilVolume ? new osg::Geometry() : 0L;
+    osg::ref_ptr<osg::Geometry> outlines  = _outlineSymbol.valid() ? new osg::Geometry() : 0L;
+
+    FeatureSourceIndex* index = context.featureIndex();
+
+    for( FeatureList::iterator f = begin; f != end; ++f )
+    {
+        Feature* input = f->get();
+        osg::ref_ptr<RefFeatureID> tag = index ? new RefFeatureID(input->getFID()) : 0L;
+
+        // seed the skin generators per feature, so the selection does not depend
+        // on how the input was split into ranges.
+        Random wallSkinPRNG( wallSeed + (unsigned)input->getFID(), Random::METHOD_FAST );
+        Random roofSkinPRNG( roofSeed + (unsigned)input->getFID(), Random::METHOD_FAST );
+
+        GeometryIterator iter( input->getGeometry(), false );
+        while( iter.hasMore() )
+        {
+            Geometry* part = iter.next();
+
+            bool isPolygon = part->getType() == Geometry::TYPE_POLYGON;
+            if ( isPolygon )
             {
-                outlineColor = _outlineSymbol->stroke()->color();
+                // prep the shapes by making sure all polys are open:
+                static_cast<Polygon*>(part)->open();
             }
 
-            // Create the extruded geometry!
-            if (extrudeGeometry( 
-                    part, height, offset, 
-                    *_extrusionSymbol->flatten(),
-                    walls.get(), rooflines.get(), baselines.get(), outlines.get(),
-                    wallColor, roofColor, outlineColor,
-                    wallSkin, roofSkin,
+            resetScratch( walls.get() );
+            resetScratch( rooflines.get() );
+            if ( baselines.valid() ) resetScratch( baselines.get() );
+            if ( outlines.valid() )  resetScratch( outlines.get() );
+
+            osg::StateSet* wallStateSet = 0L;
+            osg::StateSet* roofStateSet = 0L;
+
+            if ( buildPart(
+                    input, part,
+                    wallSkinPRNG, roofSkinPRNG,
+                    heightExpr, heightOffsetExpr,
+                    threaded,
+                    walls.get(), isPolygon ? rooflines.get() : 0L, baselines.get(), outlines.get(),
+                    wallStateSet, roofStateSet,
                     context ) )
-            {      
-                if ( wallSkin )
+            {
+                osg::ref_ptr<Arena>& wallArena = arenas[wallStateSet];
+                if ( !wallArena.valid() ) wallArena = new Arena();
+                wallArena->append( walls.get(), tag.get() );
+
+                if ( isPolygon )
                 {
-                    wallStateSet = context.resourceCache()->getStateSet( wallSkin );
+                    osg::ref_ptr<Arena>& roofArena = arenas[roofStateSet];
+                    if ( !roofArena.valid() ) roofArena = new Arena();
+                    roofArena->append( rooflines.get(), tag.get() );
                 }
 
-                // generate per-vertex normals, altering the geometry as necessary to avoid
-                // smoothing around sharp corners
-    #if OSG_MIN_VERSION_REQUIRED(2,9,9)
-                //Crease angle threshold wasn't added until
-                osgUtil::SmoothingVisitor::smooth(
-                    *walls.get(), 
-                    osg::DegreesToRadians(_wallAngleThresh_deg) );            
-    #else
-                osgUtil::SmoothingVisitor::smooth(*walls.get());            
-    #endif
-
-                // tessellate and add the roofs if necessary:
-                if ( rooflines.valid() )
+                if ( baselines.valid() || outlines.valid() )
                 {
-                    osgUtil::Tessellator tess;
-                    tess.setTessellationType( osgUtil::Tessellator::TESS_TYPE_GEOMETRY );
-                    tess.setWindingType( osgUtil::Tessellator::TESS_WINDING_ODD );
-                    tess.retessellatePolygons( *(rooflines.get()) );
+                    osg::ref_ptr<Arena>& lineArena = arenas[0L];
+                    if ( !lineArena.valid() ) lineArena = new Arena();
+                    if ( baselines.valid() )
+                        lineArena->append( baselines.get(), tag.get() );
+                    if ( outlines.valid() )
+                        lineArena->append( outlines.get(), tag.get() );
+                }
+            }
+        }
+    }
+}
 
-                    // generate default normals (no crease angle necessary; they are all pointing up)
-                    // TODO do this manually; probably faster
-                    if ( !_makeStencilVolume )
-                        osgUtil::SmoothingVisitor::smooth( *rooflines.get() );
+bool
+ExtrudeGeometryFilter::processShared( FeatureList& features, FilterContext& context )
+{
+    ArenaMap arenas;
 
-                    // texture the rooflines if necessary
-                    //applyOverlayTexturing( rooflines.get(), input, env );
+    unsigned numRanges = std::min( _numThreads, (unsigned)features.size() );
 
-                    // mark this geometry as DYNAMIC because otherwise the OSG optimizer will destroy it.
-                    // TODO: why??
-                    rooflines->setDataVariance( osg::Object::DYNAMIC );
+    // height callbacks are not thread-safe, so anything that may call into one
+    // runs on one thread. (Script engines pool their contexts and are safe here.)
+    if ( _heightCallback.valid() )
+        numRanges = 1;
 
-                    if ( roofSkin )
-                    {
-                        roofStateSet = context.resourceCache()->getStateSet( roofSkin );
-                    }
-                }
+    if ( numRanges <= 1 )
+    {
+        processRange( features.begin(), features.end(), false, arenas, context );
+    }
+    else
+    {
+        // split the input into disjoint ranges and extrude them concurrently.
+        TaskService* service = TaskService::getShared( "ExtrudeGeometryFilter", (int)numRanges );
 
-                if ( baselines.valid() )
-                {
-                    osgUtil::Tessellator tess;
-                    tess.setTessellationType( osgUtil::Tessellator::TESS_TYPE_GEOMETRY );
-                    tess.setWindingType( osgUtil::Tessellator::TESS_WINDING_ODD );
-                    tess.retessellatePolygons( *(baselines.get()) );
-                }
+        Threading::MultiEvent semaphore( numRanges );
+        std::vector< osg::ref_ptr< ParallelTask<RangeJob> > > jobs;
+        jobs.reserve( numRanges );
 
-                std::string name;
-                if ( !_featureNameExpr.empty() )
-                    name = input->eval( _featureNameExpr, &context );
+        unsigned perRange = features.size() / numRanges;
+        FeatureList::iterator begin = features.begin();
 
-                FeatureSourceIndex* index = context.featureIndex();
-                FeatureID fid = input->getFID();
+        for( unsigned r = 0; r < numRanges; ++r )
+        {
+            FeatureList::iterator end = begin;
+            if ( r+1 == numRanges )
+                end = features.end();
+            else
+                std::advance( end, perRange );
 
-                addDrawable( walls.get(), wallStateSet, name, fid, index );
+            ParallelTask<RangeJob>* job = new ParallelTask<RangeJob>( &semaphore );
+            job->init( this, begin, end, &context );
+            jobs.push_back( job );
+            service->add( job );
 
-                if ( rooflines.valid() )
-                {
-                    addDrawable( rooflines.get(), roofStateSet, name, fid, index );
-                }
+            begin = end;
+        }
 
-                if ( baselines.valid() )
-                {
-                    addDrawable( baselines.get(), 0L, name, fid, index );
-                }
+        semaphore.wait();
 
-                if ( outlines.valid() )
-                {
-                    addDrawable( outlines.get(), 0L, name, fid, index );
-                }
-            }   
+        // concatenate the ranges, in order:
+        for( unsigned r = 0; r < jobs.size(); ++r )
+        {
+            ArenaMap& rangeArenas = jobs[r]->_arenas;
+            for( ArenaMap::iterator i = rangeArenas.begin(); i != rangeArenas.end(); ++i )
+            {
+                osg::ref_ptr<Arena>& arena = arenas[i->first];
+                if ( !arena.valid() )
+                    arena = i->second.get();
+                else
+                    arena->append( *i->second.get() );
+            }
+            rangeArenas.clear();
         }
     }
 
+    // one geometry per arena, sorted into geodes by stateset.
+    unsigned numVerts = 0, numBytes = 0;
+    for( ArenaMap::iterator i = arenas.begin(); i != arenas.end(); ++i )
+    {
+        Arena* arena = i->second.get();
+        if ( arena->size() == 0 )
+            continue;
+
+        numVerts += arena->size();
+        numBytes += arena->getNumBytes();
+
+        osg::Geode* geode = _geodes[i->first].get();
+        if ( !geode )
+        {
+            geode = new osg::Geode();
+            geode->setStateSet( i->first );
+            _geodes[i->first] = geode;
+        }
+        geode->addDrawable( arena->createGeometry() );
+    }
+
+    OE_DEBUG << LC << "Extruded " << features.size() << " features into " << arenas.size()
+        << " shared buffers (" << numVerts << " verts, " << numBytes/1024 << " KB) using "
+        << std::max(numRanges, 1u) << " range(s)" << std::endl;
+
     return true;
 }
 
@@ -896,15 +1392,45 @@ ExtrudeGeometryFilter::push( FeatureList& input, FilterContext& context )
     // calculate the localization matrices (_local2world and _world2local)
     computeLocalizers( context );
 
-    // push all the features through the extruder.
-    bool ok = process( input, context );
+    // push all the features through the extruder. In shared-buffer mode the output
+    // is already consolidated, so there's no need to run the MeshConsolidator.
+    bool useSharedBuffers = _useSharedBuffers && _featureNameExpr.empty();
+
+    bool ok = useSharedBuffers ?
+        processShared( input, context ) :
+        process( input, context );
 
     // convert everything to triangles and combine drawables.
-    if ( _mergeGeometry == true && _featureNameExpr.empty() )
+    if ( !useSharedBuffers && _mergeGeometry == true && _featureNameExpr.empty() )
     {
+        MeshConsolidator::Options mcOptions;
+        mcOptions._numThreads = _numThreads;
+        mcOptions._weld       = _weldVertices;
+
         for( SortedGeodeMap::iterator i = _geodes.begin(); i != _geodes.end(); ++i )
         {
-            MeshConsolidator::run( *i->second.get() );
+            if ( _numThreads > 1 || _weldVertices )
+            {
+                MeshConsolidator::Stats stats;
+                MeshConsolidator::run( *i->second.get(), mcOptions, &stats );
+
+                _consolidationStats._numVertsIn      += stats._numVertsIn;
+                _consolidationStats._numVertsOut     += stats._numVertsOut;
+                _consolidationStats._numDrawablesIn  += stats._numDrawablesIn;
+                _consolidationStats._numDrawablesOut += stats._numDrawablesOut;
+                _consolidationStats._time_s          += stats._time_s;
+            }
+            else
+            {
+                MeshConsolidator::run( *i->second.get() );
+            }
+        }
+
+        if ( _consolidationStats._numDrawablesIn > 0 )
+        {
+            OE_DEBUG << LC << "Consolidated " << _consolidationStats._numDrawablesIn << " drawables into "
+                << _consolidationStats._numDrawablesOut << ": verts " << _consolidationStats._numVertsIn
+                << " -> " << _consolidationStats._numVertsOut << " in " << _consolidationStats._time_s << " s" << std::endl;
         }
     }
 
@@ -332,6 +332,135 @@ Feature::eval( StringExpression& expr, FilterContext const* context ) const
     return expr.eval();
 }
 
+namespace
+{
+    /**
+     * For each expression variable, runs the script engine once over the features that
+     * don't carry that variable as an attribute. scripted[v] receives one result per
+     * such feature, in list order.
+     */
+    template<typename VARIABLES>
+    void runScriptedVariables(const VARIABLES&                         vars,
+                              const FeatureList&                       features,
+                              FilterContext const*                     context,
+                              std::vector< std::vector<ScriptResult> >& scripted)
+    {
+        scripted.resize( vars.size() );
+
+        ScriptEngine* engine = context && context->getSession() ? context->getSession()->getScriptEngine() : 0L;
+        if ( !engine )
+            return;
+
+        for( unsigned v = 0; v < vars.size(); ++v )
+        {
+            std::string name = toLower(vars[v].first);
+
+            FeatureList missing;
+            for( FeatureList::const_iterator f = features.begin(); f != features.end(); ++f )
+            {
+                if ( f->valid() && !f->get()->hasAttr(name) )
+                    missing.push_back( f->get() );
+            }
+
+            if ( !missing.empty() )
+            {
+                scripted[v].reserve( missing.size() );
+                engine->runBatch( vars[v].first, missing, scripted[v], context );
+            }
+        }
+    }
+}
+
+void
+Feature::eval( NumericExpression& expr, const FeatureList& features, std::vector<double>& out_values, FilterContext const* context )
+{
+    const NumericExpression::Variables& vars = expr.variables();
+
+    std::vector< std::vector<ScriptResult> > scripted;
+    runScriptedVariables( vars, features, context, scripted );
+    std::vector<unsigned> cursor( vars.size(), 0 );
+
+    out_values.reserve( out_values.size() + features.size() );
+
+    for( FeatureList::const_iterator f = features.begin(); f != features.end(); ++f )
+    {
+        if ( !f->valid() )
+        {
+            out_values.push_back( 0.0 );
+            continue;
+        }
+
+        const AttributeTable& attrs = f->get()->getAttrs();
+        for( unsigned v = 0; v < vars.size(); ++v )
+        {
+            double val = 0.0;
+            AttributeTable::const_iterator ai = attrs.find(toLower(vars[v].first));
+            if ( ai != attrs.end() )
+            {
+                val = ai->second.getDouble(0.0);
+            }
+            else if ( cursor[v] < scripted[v].size() )
+            {
+                ScriptResult& result = scripted[v][cursor[v]++];
+                if ( result.success() )
+                    val = result.asDouble();
+                else
+                    OE_WARN << LC << "Script error:" << result.message() << std::endl;
+            }
+            expr.set( vars[v], val );
+        }
+
+        out_values.push_back( expr.eval() );
+    }
+}
+
+void
+Feature::eval( StringExpression& expr, const FeatureList& features, std::vector<std::string>& out_values, FilterContext const* context )
+{
+    const StringExpression::Variables& vars = expr.variables();
+
+    std::vector< std::vector<ScriptResult> > scripted;
+    runScriptedVariables( vars, features, context, scripted );
+    std::vector<unsigned> cursor( vars.size(), 0 );
+
+    out_values.reserve( out_values.size() + features.size() );
+
+    for( FeatureList::const_iterator f = features.begin(); f != features.end(); ++f )
+    {
+        if ( !f->valid() )
+        {
+            out_values.push_back( EMPTY_STRING );
+            continue;
+        }
+
+        const AttributeTable& attrs = f->get()->getAttrs();
+        for( unsigned v = 0; v < vars.size(); ++v )
+        {
+            std::string val = "";
+            AttributeTable::const_iterator ai = attrs.find(toLower(vars[v].first));
+            if ( ai != attrs.end() )
+            {
+                val = ai->second.getString();
+            }
+            else if ( cursor[v] < scripted[v].size() )
+            {
+                ScriptResult& result = scripted[v][cursor[v]++];
+                if ( result.success() )
+                    val = result.asString();
+                else
+                    OE_WARN << LC << "Script error:" << result.message() << std::endl;
+            }
+
+            // same as the single-feature version, so a batch gives the same
+            // results as evaluating the features one at a time.
+            if ( !val.empty() )
+                expr.set( vars[v], val );
+        }
+
+        out_values.push_back( expr.eval() );
+    }
+}
+
 #if 0
 #define SIGN_OF(x) double(int(x > 0.0) - int(x < 0.0))
 
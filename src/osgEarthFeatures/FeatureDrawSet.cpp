@@ -104,6 +104,9 @@ FeatureDrawSet::slice(osg::Drawable* d) const
 void
 FeatureDrawSet::setVisible( bool visible )
 {
+    if ( visible == _visible )
+        return;
+
     if ( _visible )
     {
         _invisibleMasks.clear();
@@ -119,6 +122,8 @@ FeatureDrawSet::setVisible( bool visible )
             osg::Geometry* geom = slice.drawable->asGeometry();
             for( PrimitiveSets::iterator p = slice.primSets.begin(); p != slice.primSets.end(); ++p )
                 geom->removePrimitiveSet( geom->getPrimitiveSetIndex(p->get()) );
+            if ( slice.revision.valid() )
+                ++slice.revision->value;
         }
     }
 
@@ -136,6 +141,8 @@ FeatureDrawSet::setVisible( bool visible )
             osg::Geometry* geom = slice.drawable->asGeometry();
             for( PrimitiveSets::iterator p = slice.primSets.begin(); p != slice.primSets.end(); ++p )
                 geom->addPrimitiveSet( p->get() );
+            if ( slice.revision.valid() )
+                ++slice.revision->value;
         }
     }
 
@@ -23,12 +23,15 @@
 #include <osgEarth/ThreadingUtils>
 #include <osgEarth/NodeUtils>
 #include <osgEarth/ElevationQuery>
+#include <osgEarth/TaskService>
 #include <osg/PagedLOD>
 #include <osg/ProxyNode>
 #include <osgDB/FileNameUtils>
 #include <osgDB/ReaderWriter>
 #include <osgDB/WriteFile>
 #include <osgUtil/Optimizer>
+#include <osg/Timer>
+#include <OpenThreads/Atomic>
 
 #define LC "[FeatureModelGraph] "
 
@@ -155,6 +158,85 @@ namespace
 }
 
 
+//---------------------------------------------------------------------------
+
+// frames a queued tile may go without being culled before its build is put off
+#define STALE_TILE_FRAMES 10
+
+/**
+ * Placeholder for a tile whose geometry is built in the background. The pager
+ * sees it as the loaded tile; the built geometry is added to it in the update
+ * traversal. Its cull traversal tracks the tile's distance to the camera (the
+ * build priority) and whether it is still in view.
+ */
+class FeatureModelGraph::TileNode : public osg::Group
+{
+public:
+    TileNode( FeatureModelGraph* graph, unsigned lod, unsigned tileX, unsigned tileY, const std::string& uri, unsigned frame )
+        : _graph( graph ), _lod( lod ), _tileX( tileX ), _tileY( tileY ), _uri( uri ),
+          _distance( FLT_MAX ), _lastCullFrame( frame ), _isLoadResult( false ), _builtEmpty( false )
+    {
+        _needsBuild = 0;
+    }
+
+    const char* className() const { return "FeatureTileNode"; }
+
+    void traverse( osg::NodeVisitor& nv )
+    {
+        if ( nv.getVisitorType() == osg::NodeVisitor::CULL_VISITOR )
+        {
+            _distance = nv.getDistanceToViewPoint( getBound().center(), true );
+            if ( nv.getFrameStamp() )
+                _lastCullFrame = nv.getFrameStamp()->getFrameNumber();
+
+            // a build that was put off while out of view: queue it again.
+            if ( _needsBuild.exchange(0) != 0 )
+            {
+                osg::ref_ptr<FeatureModelGraph> graph;
+                if ( _graph.lock(graph) )
+                    graph->requestBuild( this );
+            }
+        }
+        osg::Group::traverse( nv );
+    }
+
+    osg::observer_ptr<FeatureModelGraph> _graph;
+    unsigned                             _lod, _tileX, _tileY;
+    std::string                          _uri;
+    volatile float                       _distance;
+    volatile unsigned                    _lastCullFrame;
+    OpenThreads::Atomic                  _needsBuild;
+
+    // guarded by the graph's blacklist mutex: whether the tile is all that its
+    // URI loaded, and whether its build came up empty. Together they mean the
+    // URI should be blacklisted.
+    bool                                 _isLoadResult;
+    bool                                 _builtEmpty;
+};
+
+/** Builds the next tile in a graph's queue. */
+struct FeatureModelGraph::BuildNextTileTask : public TaskRequest
+{
+    BuildNextTileTask( FeatureModelGraph* graph ) : _graph( graph ) { }
+
+    void operator()( ProgressCallback* progress )
+    {
+        osg::ref_ptr<FeatureModelGraph> graph;
+        if ( _graph.lock(graph) )
+            graph->buildNextTile();
+    }
+
+    osg::observer_ptr<FeatureModelGraph> _graph;
+};
+
+namespace
+{
+    double s_since( osg::Timer_t start )
+    {
+        return osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+    }
+}
+
 //---------------------------------------------------------------------------
 
 FeatureModelGraph::FeatureModelGraph(Session*                         session,
@@ -164,7 +246,9 @@ _session      ( session ),
 _options      ( options ),
 _factory      ( factory ),
 _dirty        ( false ),
-_pendingUpdate( false )
+_pendingUpdate( false ),
+_pendingMerge ( false ),
+_frameNumber  ( 0 )
 {
     _uid = osgEarthFeatureModelPseudoLoader::registerGraph( this );
 
@@ -235,6 +319,13 @@ FeatureModelGraph::~FeatureModelGraph()
     osgEarthFeatureModelPseudoLoader::unregisterGraph( _uid );
 }
 
+FeatureModelGraph::BuildStats
+FeatureModelGraph::getBuildStats() const
+{
+    Threading::ScopedMutexLock lock( _statsMutex );
+    return _stats;
+}
+
 void
 FeatureModelGraph::dirty()
 {
@@ -325,25 +416,16 @@ FeatureModelGraph::load( unsigned lod, unsigned tileX, unsigned tileY, const std
 
         if ( (int)lod >= featureProfile->getFirstLevel() )
         {
-            // The extent of this tile:
-            GeoExtent tileExtent = s_getTileExtent( lod, tileX, tileY, _usableFeatureExtent );
-
-            // Calculate the bounds of this new tile:
-            MapFrame mapf = _session->createMapFrame();
-            osg::BoundingSphered tileBound = getBoundInWorldCoords( tileExtent, &mapf );
-
-            // Apply the tile range multiplier to calculate a max camera range. The max range is
-            // the geographic radius of the tile times the multiplier.
-            float tileFactor = _options.layout().isSet() ? _options.layout()->tileSizeFactor().get() : 15.0f;            
-            double maxRange =  tileBound.radius() * tileFactor;
-            FeatureLevel level( 0, maxRange );
-            //OE_NOTICE << "(" << lod << ": " << tileX << ", " << tileY << ")" << std::endl;
-            //OE_NOTICE << "  extent = " << tileExtent.width() << "x" << tileExtent.height() << std::endl;
-            //OE_NOTICE << "  tileFactor = " << tileFactor << " maxRange=" << maxRange << " radius=" << tileBound.radius() << std::endl;
-            
-            // Construct a tile key that will be used to query the source for this tile.
-            TileKey key(lod, tileX, tileY, featureProfile->getProfile());
-            geometry = build( level, tileExtent, &key );
+            if ( _options.layout().value().buildThreads().value() > 0 )
+            {
+                // build in the background; return a placeholder for now.
+                GeoExtent tileExtent = s_getTileExtent( lod, tileX, tileY, _usableFeatureExtent );
+                geometry = createTileNode( lod, tileX, tileY, uri, tileExtent );
+            }
+            else
+            {
+                geometry = buildTile( lod, tileX, tileY );
+            }
             result = geometry;
         }
 
@@ -404,13 +486,20 @@ FeatureModelGraph::load( unsigned lod, unsigned tileX, unsigned tileY, const std
         if ( level )
         {
             // There exists a real data level at this LOD. So build the geometry that will
-            // represent this tile.
-            GeoExtent tileExtent = 
-                lod > 0 ?
-                s_getTileExtent( lod, tileX, tileY, _usableFeatureExtent ) :
-                _usableFeatureExtent;
+            // represent this tile (or a placeholder, if it's built in the background).
+            if ( _options.layout().value().buildThreads().value() > 0 )
+            {
+                GeoExtent tileExtent = 
+                    lod > 0 ?
+                    s_getTileExtent( lod, tileX, tileY, _usableFeatureExtent ) :
+                    _usableFeatureExtent;
 
-            geometry = build( *level, tileExtent, 0 );
+                geometry = createTileNode( lod, tileX, tileY, uri, tileExtent );
+            }
+            else
+            {
+                geometry = buildTile( lod, tileX, tileY );
+            }
             result = geometry;
         }
 
@@ -445,15 +534,198 @@ FeatureModelGraph::load( unsigned lod, unsigned tileX, unsigned tileY, const std
     if ( result->getNumChildren() == 0 )
     {
         // if the result group contains no data, blacklist it so we never try to load it again.
+        // A placeholder is empty until its background build merges, so leave that decision
+        // to buildNextTile() unless the build already came up empty.
         Threading::ScopedWriteLock exclusiveLock( _blacklistMutex );
-        _blacklist.insert( uri );
-        OE_DEBUG << LC << "Blacklisting: " << uri << std::endl;
+        TileNode* placeholder = dynamic_cast<TileNode*>( result );
+        if ( placeholder && !placeholder->_builtEmpty )
+        {
+            placeholder->_isLoadResult = true;
+        }
+        else
+        {
+            _blacklist.insert( uri );
+            OE_DEBUG << LC << "Blacklisting: " << uri << std::endl;
+        }
     }
 
     return result;
 }
 
 
+osg::Group*
+FeatureModelGraph::buildTile( unsigned lod, unsigned tileX, unsigned tileY )
+{
+    osg::Group* geometry = 0L;
+
+    if ( _useTiledSource )
+    {
+        const FeatureProfile* featureProfile = _session->getFeatureSource()->getFeatureProfile();
+
+        // The extent of this tile:
+        GeoExtent tileExtent = s_getTileExtent( lod, tileX, tileY, _usableFeatureExtent );
+
+        // Calculate the bounds of this new tile:
+        MapFrame mapf = _session->createMapFrame();
+        osg::BoundingSphered tileBound = getBoundInWorldCoords( tileExtent, &mapf );
+
+        // Apply the tile range multiplier to calculate a max camera range. The max range is
+        // the geographic radius of the tile times the multiplier.
+        float tileFactor = _options.layout().isSet() ? _options.layout()->tileSizeFactor().get() : 15.0f;            
+        double maxRange =  tileBound.radius() * tileFactor;
+        FeatureLevel level( 0, maxRange );
+        //OE_NOTICE << "(" << lod << ": " << tileX << ", " << tileY << ")" << std::endl;
+        //OE_NOTICE << "  extent = " << tileExtent.width() << "x" << tileExtent.height() << std::endl;
+        //OE_NOTICE << "  tileFactor = " << tileFactor << " maxRange=" << maxRange << " radius=" << tileBound.radius() << std::endl;
+        
+        // Construct a tile key that will be used to query the source for this tile.
+        TileKey key(lod, tileX, tileY, featureProfile->getProfile());
+        geometry = build( level, tileExtent, &key );
+    }
+
+    else if ( lod < _lodmap.size() && _lodmap[lod] )
+    {
+        GeoExtent tileExtent = 
+            lod > 0 ?
+            s_getTileExtent( lod, tileX, tileY, _usableFeatureExtent ) :
+            _usableFeatureExtent;
+
+        geometry = build( *_lodmap[lod], tileExtent, 0 );
+    }
+
+    {
+        Threading::ScopedMutexLock lock( _statsMutex );
+        _stats._numTiles++;
+    }
+
+    return geometry;
+}
+
+osg::Group*
+FeatureModelGraph::createTileNode( unsigned lod, unsigned tileX, unsigned tileY, const std::string& uri, const GeoExtent& tileExtent )
+{
+    TileNode* tile = new TileNode( this, lod, tileX, tileY, uri, _frameNumber );
+
+    // give the empty placeholder the tile's bounds so that it culls (and so
+    // reports its distance) like the real tile would.
+    MapFrame mapf = _session->createMapFrame();
+    osg::BoundingSphered bs = getBoundInWorldCoords( tileExtent, &mapf );
+    tile->setInitialBound( osg::BoundingSphere(bs.center(), bs.radius()) );
+
+    requestBuild( tile );
+    return tile;
+}
+
+void
+FeatureModelGraph::requestBuild( TileNode* tile )
+{
+    {
+        Threading::ScopedMutexLock lock( _buildMutex );
+        _buildQueue.push_back( tile );
+    }
+
+    // each task builds whichever queued tile is nearest when it runs, so
+    // priorities follow the camera rather than the order of requests.
+    unsigned numThreads = _options.layout().value().buildThreads().value();
+    TaskService::getShared( "FeatureModelGraph tile builder", (int)numThreads )->add( new BuildNextTileTask(this) );
+}
+
+void
+FeatureModelGraph::buildNextTile()
+{
+    osg::ref_ptr<TileNode> tile;
+    {
+        Threading::ScopedMutexLock lock( _buildMutex );
+
+        float bestDistance = FLT_MAX;
+        TileQueue::iterator best = _buildQueue.end();
+
+        for( TileQueue::iterator i = _buildQueue.begin(); i != _buildQueue.end(); )
+        {
+            osg::ref_ptr<TileNode> candidate;
+            if ( !i->lock(candidate) )
+            {
+                // the pager already discarded the tile.
+                i = _buildQueue.erase( i );
+            }
+            else if ( _frameNumber > candidate->_lastCullFrame + STALE_TILE_FRAMES )
+            {
+                // the tile left the view; build it when it comes back.
+                candidate->_needsBuild = 1;
+                i = _buildQueue.erase( i );
+
+                Threading::ScopedMutexLock statsLock( _statsMutex );
+                _stats._numDeferred++;
+            }
+            else
+            {
+                if ( best == _buildQueue.end() || candidate->_distance < bestDistance )
+                {
+                    best = i;
+                    bestDistance = candidate->_distance;
+                }
+                ++i;
+            }
+        }
+
+        if ( best != _buildQueue.end() )
+        {
+            best->lock( tile );
+            _buildQueue.erase( best );
+        }
+    }
+
+    if ( !tile.valid() )
+        return;
+
+    BuiltTile built;
+    built._tile = tile.get();
+    built._node = buildTile( tile->_lod, tile->_tileX, tile->_tileY );
+
+    if ( built._node.valid() )
+    {
+        RemoveEmptyGroupsVisitor::run( built._node.get() );
+    }
+
+    osg::Group* builtGroup = built._node.valid() ? built._node->asGroup() : 0L;
+    if ( !built._node.valid() || (builtGroup && builtGroup->getNumChildren() == 0) )
+    {
+        // nothing to merge. If the placeholder was the whole tile, blacklist its URI
+        // just like load() does for an empty tile built in the foreground.
+        Threading::ScopedWriteLock exclusiveLock( _blacklistMutex );
+        tile->_builtEmpty = true;
+        if ( tile->_isLoadResult )
+        {
+            _blacklist.insert( tile->_uri );
+            OE_DEBUG << LC << "Blacklisting: " << tile->_uri << std::endl;
+        }
+    }
+    else
+    {
+        Threading::ScopedMutexLock lock( _buildMutex );
+        _builtTiles.push_back( built );
+    }
+}
+
+void
+FeatureModelGraph::mergeBuiltTiles()
+{
+    std::vector<BuiltTile> built;
+    {
+        Threading::ScopedMutexLock lock( _buildMutex );
+        built.swap( _builtTiles );
+    }
+
+    for( std::vector<BuiltTile>::iterator i = built.begin(); i != built.end(); ++i )
+    {
+        osg::ref_ptr<TileNode> tile;
+        if ( i->_tile.lock(tile) )
+        {
+            tile->addChild( i->_node.get() );
+        }
+    }
+}
+
 void
 FeatureModelGraph::buildSubTilePagedLODs(unsigned        parentLOD,
                                          unsigned        parentTileX,
@@ -729,6 +1001,9 @@ FeatureModelGraph::createNodeForStyle(const Style&        style,
     // get the extent of the full set of feature data:
     const GeoExtent& extent = featureProfile->getExtent();
     
+    osg::Timer_t stageStart = osg::Timer::instance()->tick();
+    double querySeconds = 0.0, filterSeconds = 0.0, compileSeconds = 0.0;
+
     // query the feature source:
     osg::ref_ptr<FeatureCursor> cursor = _session->getFeatureSource()->createFeatureCursor( query );
 
@@ -745,6 +1020,9 @@ FeatureModelGraph::createNodeForStyle(const Style&        style,
         FeatureList workingSet;
         cursor->fill( workingSet );
 
+        querySeconds = s_since( stageStart );
+        stageStart = osg::Timer::instance()->tick();
+
         CropFilter crop( 
             _options.layout().isSet() && _options.layout()->cropFeatures() == true ? 
             CropFilter::METHOD_CROPPING : CropFilter::METHOD_CENTROID );
@@ -761,6 +1039,9 @@ FeatureModelGraph::createNodeForStyle(const Style&        style,
             context = crop2.push( workingSet, context );
         }
 
+        filterSeconds = s_since( stageStart );
+        stageStart = osg::Timer::instance()->tick();
+
         if ( workingSet.size() > 0 )
         {
             // next ask the implementation to construct OSG geometry for the cell features.
@@ -777,6 +1058,8 @@ FeatureModelGraph::createNodeForStyle(const Style&        style,
                 if ( node.valid() )
                     styleGroup->addChild( node.get() );
             }
+
+            compileSeconds = s_since( stageStart );
         }
 
         CacheStats stats = context.resourceCache()->getSkinStats();
@@ -786,7 +1069,17 @@ FeatureModelGraph::createNodeForStyle(const Style&        style,
             << std::endl;
 
     }
+    else
+    {
+        querySeconds = s_since( stageStart );
+    }
 
+    {
+        Threading::ScopedMutexLock lock( _statsMutex );
+        _stats._querySeconds   += querySeconds;
+        _stats._filterSeconds  += filterSeconds;
+        _stats._compileSeconds += compileSeconds;
+    }
 
     return styleGroup;
 }
@@ -796,11 +1089,25 @@ FeatureModelGraph::traverse(osg::NodeVisitor& nv)
 {
     if ( nv.getVisitorType() == osg::NodeVisitor::EVENT_VISITOR )
     {
+        if ( nv.getFrameStamp() )
+            _frameNumber = nv.getFrameStamp()->getFrameNumber();
+
         if ( !_pendingUpdate && (_dirty || _session->getFeatureSource()->outOfSyncWith(_revision)) )
         {
             _pendingUpdate = true;
             ADJUST_UPDATE_TRAV_COUNT( this, 1 );
         }
+
+        // background-built tiles waiting to be merged into the graph:
+        if ( !_pendingMerge )
+        {
+            Threading::ScopedMutexLock lock( _buildMutex );
+            if ( !_builtTiles.empty() )
+            {
+                _pendingMerge = true;
+                ADJUST_UPDATE_TRAV_COUNT( this, 1 );
+            }
+        }
     }
 
     else if ( nv.getVisitorType() == osg::NodeVisitor::UPDATE_VISITOR )
@@ -811,6 +1118,13 @@ FeatureModelGraph::traverse(osg::NodeVisitor& nv)
             _pendingUpdate = false;
             ADJUST_UPDATE_TRAV_COUNT( this, -1 );
         }
+
+        if ( _pendingMerge )
+        {
+            mergeBuiltTiles();
+            _pendingMerge = false;
+            ADJUST_UPDATE_TRAV_COUNT( this, -1 );
+        }
     }
 
     osg::Group::traverse(nv);
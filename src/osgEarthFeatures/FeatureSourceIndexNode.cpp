@@ -18,6 +18,7 @@
  */
 #include <osgEarthFeatures/FeatureSourceIndexNode>
 #include <osg/MatrixTransform>
+#include <osg/Timer>
 #include <algorithm>
 
 using namespace osgEarth;
@@ -29,14 +30,22 @@ using namespace osgEarth::Features;
 //#undef  OE_DEBUG
 //#define OE_DEBUG OE_INFO
 
+namespace
+{
+    inline unsigned hashFID( FeatureID fid )
+    {
+        // fold in the high bits where FeatureID is 64-bit:
+        FeatureID h = fid ^ ((fid >> 16) >> 16);
+        return (unsigned)h * 2654435761u;
+    }
+}
+
 //-----------------------------------------------------------------------------
 
-FeatureSourceIndexNode::Collect::Collect( FeatureIDDrawSetMap& index ) :
-osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN ),
-_index          ( index ),
-_psets          ( 0 )
+FeatureSourceIndexNode::Collect::Collect() :
+osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN )
 {
-    _index.clear();
+    //nop
 }
 
 void
@@ -45,8 +54,10 @@ FeatureSourceIndexNode::Collect::apply( osg::Node& node )
     RefFeatureID* fid = dynamic_cast<RefFeatureID*>( node.getUserData() );
     if ( fid )
     {
-        FeatureDrawSet& drawSet = _index[*fid];
-        drawSet.nodes().push_back( &node );
+        NodeTag tag;
+        tag._fid  = *fid;
+        tag._node = &node;
+        _nodeTags.push_back( tag );
     }
     traverse(node);
 }
@@ -57,8 +68,10 @@ FeatureSourceIndexNode::Collect::apply( osg::Geode& geode )
     RefFeatureID* fid = dynamic_cast<RefFeatureID*>( geode.getUserData() );
     if ( fid )
     {
-        FeatureDrawSet& drawSet = _index[*fid];
-        drawSet.nodes().push_back( &geode );
+        NodeTag tag;
+        tag._fid  = *fid;
+        tag._node = &geode;
+        _nodeTags.push_back( tag );
     }
     else
     {
@@ -68,17 +81,43 @@ FeatureSourceIndexNode::Collect::apply( osg::Geode& geode )
             if ( geom )
             {
                 osg::Geometry::PrimitiveSetList& psets = geom->getPrimitiveSetList();
+
+                unsigned d = _drawables.size();
+                _drawables.push_back( IndexedDrawable() );
+                IndexedDrawable& indexed = _drawables.back();
+                indexed._drawable = geom;
+                indexed._revision = new FeatureDrawSet::Revision();
+                indexed._indexedRevision = indexed._revision->value;
+                indexed._primSets.reserve( psets.size() );
+                indexed._primStarts.reserve( psets.size()+1 );
+                indexed._entries.assign( psets.size(), 0u );
+
+                unsigned numPrims = 0;
+                unsigned numTagged = 0;
                 for( unsigned p = 0; p < psets.size(); ++p )
                 {
                     osg::PrimitiveSet* pset = psets[p];
+                    indexed._primSets.push_back( pset );
+                    indexed._primStarts.push_back( numPrims );
+                    numPrims += pset->getNumPrimitives();
+
                     RefFeatureID* fid = dynamic_cast<RefFeatureID*>( pset->getUserData() );
                     if ( fid )
                     {
-                        FeatureDrawSet& drawSet = _index[*fid];
-                        drawSet.getOrCreateSlice(geom).push_back(pset);
-                        _psets++;
+                        Tag tag;
+                        tag._fid      = *fid;
+                        tag._drawable = d;
+                        tag._primSet  = p;
+                        _tags.push_back( tag );
+                        numTagged++;
                     }
                 }
+                indexed._primStarts.push_back( numPrims );
+
+                if ( numTagged == 0 )
+                    _drawables.pop_back();
+                else
+                    indexed.buildDirectory();
             }
         }
     }
@@ -88,6 +127,53 @@ FeatureSourceIndexNode::Collect::apply( osg::Geode& geode )
 
 //-----------------------------------------------------------------------------
 
+void
+FeatureSourceIndexNode::IndexedDrawable::buildDirectory()
+{
+    // one bucket per primitive set on average, so a lookup lands on or just
+    // before the right set.
+    unsigned numSets  = _primSets.size();
+    unsigned numPrims = _primStarts.back();
+
+    _directory.clear();
+    _bucketSize = numSets > 0 ? osg::maximum( 1u, (numPrims + numSets - 1) / numSets ) : 1u;
+
+    unsigned p = 0;
+    for( unsigned first = 0; first < numPrims; first += _bucketSize )
+    {
+        while( _primStarts[p+1] <= first )
+            ++p;
+        _directory.push_back( p );
+    }
+}
+
+bool
+FeatureSourceIndexNode::IndexedDrawable::findPrimSet( unsigned primIndex, unsigned& out_primSet ) const
+{
+    if ( primIndex >= _primStarts.back() )
+        return false;
+
+    unsigned p = _directory[primIndex / _bucketSize];
+    while( _primStarts[p+1] <= primIndex )
+        ++p;
+
+    out_primSet = p;
+    return true;
+}
+
+bool
+FeatureSourceIndexNode::IndexedDrawable::isCurrent( const osg::Geometry* geom ) const
+{
+    // Hiding and showing a draw set removes its primitive sets and appends them
+    // again, which bumps the revision; the size check catches sets added or
+    // removed some other way.
+    return
+        _revision->value == _indexedRevision &&
+        geom->getPrimitiveSetList().size() == _primSets.size();
+}
+
+//-----------------------------------------------------------------------------
+
 FeatureSourceIndexNode::FeatureSourceIndexNode(FeatureSource* featureSource) : 
 _featureSource( featureSource )
 {
@@ -99,12 +185,134 @@ _featureSource( featureSource )
 void
 FeatureSourceIndexNode::reindex()
 {
+    osg::Timer_t start = osg::Timer::instance()->tick();
+
+    _entries.clear();
+    _buckets.clear();
+    _spans.clear();
+    _primSets.clear();
+    _nodes.clear();
+    _drawables.clear();
+    _drawableLookup.clear();
     _drawSets.clear();
 
-    Collect c(_drawSets);
+    Collect c;
     this->accept( c );
 
-    OE_DEBUG << LC << "Reindexed; draw sets = " << _drawSets.size() << std::endl;
+    std::sort( c._tags.begin(), c._tags.end() );
+    std::stable_sort( c._nodeTags.begin(), c._nodeTags.end() );
+
+    _drawables.swap( c._drawables );
+    for( unsigned d = 0; d < _drawables.size(); ++d )
+        _drawableLookup[_drawables[d]._drawable.get()] = d;
+
+    _primSets.reserve( c._tags.size() );
+    _nodes.reserve( c._nodeTags.size() );
+
+    // merge the two sorted tag lists into one entry per feature; each feature gets
+    // one span per drawable it appears in.
+    std::vector<Collect::Tag>::const_iterator     t = c._tags.begin();
+    std::vector<Collect::NodeTag>::const_iterator n = c._nodeTags.begin();
+
+    while( t != c._tags.end() || n != c._nodeTags.end() )
+    {
+        FeatureID fid =
+            t == c._tags.end()     ? n->_fid :
+            n == c._nodeTags.end() ? t->_fid :
+            osg::minimum( t->_fid, n->_fid );
+
+        Entry entry;
+        entry._fid       = fid;
+        entry._firstSpan = _spans.size();
+        entry._firstNode = _nodes.size();
+
+        for( ; t != c._tags.end() && t->_fid == fid; ++t )
+        {
+            IndexedDrawable& indexed = _drawables[t->_drawable];
+
+            if ( _spans.size() == entry._firstSpan || _spans.back()._drawable != t->_drawable )
+            {
+                Span span;
+                span._drawable     = t->_drawable;
+                span._firstPrimSet = _primSets.size();
+                span._numPrimSets  = 0;
+                _spans.push_back( span );
+            }
+
+            _primSets.push_back( indexed._drawable->asGeometry()->getPrimitiveSet(t->_primSet) );
+            _spans.back()._numPrimSets++;
+
+            indexed._entries[t->_primSet] = _entries.size() + 1;
+        }
+
+        for( ; n != c._nodeTags.end() && n->_fid == fid; ++n )
+        {
+            _nodes.push_back( n->_node );
+        }
+
+        entry._numSpans = _spans.size() - entry._firstSpan;
+        entry._numNodes = _nodes.size() - entry._firstNode;
+        _entries.push_back( entry );
+    }
+
+    // hash the entries by FeatureID, keeping the table at most half full.
+    unsigned numBuckets = 8;
+    while( numBuckets < 2 * _entries.size() )
+        numBuckets <<= 1;
+
+    _buckets.assign( numBuckets, 0u );
+    for( unsigned e = 0; e < _entries.size(); ++e )
+    {
+        unsigned b = hashFID( _entries[e]._fid ) & (numBuckets-1);
+        while( _buckets[b] != 0 )
+            b = (b+1) & (numBuckets-1);
+        _buckets[b] = e+1;
+    }
+
+    OE_DEBUG << LC << "Reindexed; features = " << _entries.size()
+        << ", primsets = " << _primSets.size()
+        << ", size = " << getIndexSizeBytes()/1024 << " KB"
+        << ", time = " << osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()) << " ms"
+        << std::endl;
+}
+
+
+unsigned
+FeatureSourceIndexNode::getIndexSizeBytes() const
+{
+    unsigned bytes =
+        _entries.capacity()   * sizeof(Entry) +
+        _buckets.capacity()   * sizeof(unsigned) +
+        _spans.capacity()     * sizeof(Span) +
+        _primSets.capacity()  * sizeof(osg::PrimitiveSet*) +
+        _nodes.capacity()     * sizeof(osg::ref_ptr<osg::Node>) +
+        _drawables.capacity() * sizeof(IndexedDrawable) +
+        _drawableLookup.size() * (sizeof(const osg::Drawable*) + sizeof(unsigned) + 4*sizeof(void*));
+
+    for( std::vector<IndexedDrawable>::const_iterator d = _drawables.begin(); d != _drawables.end(); ++d )
+    {
+        bytes += d->_primSets.capacity() * sizeof(const osg::PrimitiveSet*);
+        bytes += (d->_primStarts.capacity() + d->_entries.capacity() + d->_directory.capacity()) * sizeof(unsigned);
+    }
+
+    return bytes;
+}
+
+
+const FeatureSourceIndexNode::Entry*
+FeatureSourceIndexNode::findEntry( FeatureID fid ) const
+{
+    if ( _buckets.empty() )
+        return 0L;
+
+    unsigned mask = _buckets.size() - 1;
+    for( unsigned b = hashFID(fid) & mask; _buckets[b] != 0; b = (b+1) & mask )
+    {
+        const Entry& entry = _entries[_buckets[b]-1];
+        if ( entry._fid == fid )
+            return &entry;
+    }
+    return 0L;
 }
 
 
@@ -160,17 +368,33 @@ FeatureSourceIndexNode::getFID(osg::Drawable* drawable, int primIndex, FeatureID
     if ( drawable == 0L || primIndex < 0 )
         return false;
 
-    for( FeatureIDDrawSetMap::const_iterator i = _drawSets.begin(); i != _drawSets.end(); ++i )
+    std::map<const osg::Drawable*, unsigned>::const_iterator d = _drawableLookup.find( drawable );
+    if ( d != _drawableLookup.end() )
     {
-        const FeatureDrawSet& drawSet = i->second;
-        FeatureDrawSet::DrawableSlices::const_iterator d = drawSet.slice(drawable);
-        if ( d != drawSet.slices().end() )
+        const IndexedDrawable& indexed = _drawables[d->second];
+        const osg::Geometry* geom = drawable->asGeometry();
+        if ( geom )
         {
-            const osg::Geometry* geom = drawable->asGeometry();
-            if ( geom )
-            {
-                const osg::Geometry::PrimitiveSetList& geomPrimSets = geom->getPrimitiveSetList();
+            const osg::Geometry::PrimitiveSetList& geomPrimSets = geom->getPrimitiveSetList();
 
+            // The reverse index is good as long as no draw set has moved the
+            // primitive sets it was built from.
+            unsigned primSet;
+            if ( indexed.findPrimSet((unsigned)primIndex, primSet) && indexed.isCurrent(geom) )
+            {
+                if ( indexed._entries[primSet] > 0 )
+                {
+                    output = _entries[indexed._entries[primSet]-1]._fid;
+                    return true;
+                }
+                else
+                {
+                    OE_DEBUG << LC << "INTERNAL: found primset, but it's not tagged with a FID" << std::endl;
+                    return false;
+                }
+            }
+            else
+            {
                 unsigned encounteredPrims = 0;
                 for( osg::Geometry::PrimitiveSetList::const_iterator p = geomPrimSets.begin(); p != geomPrimSets.end(); ++p )
                 {
@@ -219,5 +443,31 @@ FeatureSourceIndexNode::getDrawSet(const FeatureID& fid )
     static FeatureDrawSet s_empty;
 
     FeatureIDDrawSetMap::iterator i = _drawSets.find(fid);
-    return i != _drawSets.end() ? i->second : s_empty;
+    if ( i != _drawSets.end() )
+        return i->second;
+
+    const Entry* entry = findEntry( fid );
+    if ( !entry )
+        return s_empty;
+
+    // assemble the draw set from the flat tables and keep it, since the caller
+    // may hide it (which removes its primitive sets from the drawables).
+    FeatureDrawSet& drawSet = _drawSets[fid];
+
+    for( unsigned n = 0; n < entry->_numNodes; ++n )
+    {
+        drawSet.nodes().push_back( _nodes[entry->_firstNode + n] );
+    }
+
+    for( unsigned s = 0; s < entry->_numSpans; ++s )
+    {
+        const Span& span = _spans[entry->_firstSpan + s];
+        const IndexedDrawable& indexed = _drawables[span._drawable];
+        FeatureDrawSet::PrimitiveSets& psets = drawSet.getOrCreateSlice( indexed._drawable.get() );
+        drawSet.slice( indexed._drawable.get() )->revision = indexed._revision.get();
+        for( unsigned p = 0; p < span._numPrimSets; ++p )
+            psets.push_back( _primSets[span._firstPrimSet + p] );
+    }
+
+    return drawSet;
 }
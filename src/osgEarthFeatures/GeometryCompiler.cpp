@@ -51,7 +51,11 @@ ConfigOptions      ( conf ),
 _maxGranularity_deg( 1.0 ),
 _mergeGeometry     ( false ),
 _clustering        ( true ),
-_ignoreAlt         ( false )
+_instancing        ( false ),
+_ignoreAlt         ( false ),
+_sharedBuffers     ( false ),
+_extrusionThreads  ( 1 ),
+_weldVertices      ( false )
 {
     fromConfig(_conf);
 }
@@ -62,8 +66,12 @@ GeometryCompilerOptions::fromConfig( const Config& conf )
     conf.getIfSet   ( "max_granularity",  _maxGranularity_deg );
     conf.getIfSet   ( "merge_geometry",   _mergeGeometry );
     conf.getIfSet   ( "clustering",       _clustering );
+    conf.getIfSet   ( "instancing",       _instancing );
     conf.getObjIfSet( "feature_name",     _featureNameExpr );
     conf.getIfSet   ( "ignore_altitude",  _ignoreAlt );
+    conf.getIfSet   ( "shared_buffers",   _sharedBuffers );
+    conf.getIfSet   ( "extrusion_threads", _extrusionThreads );
+    conf.getIfSet   ( "weld_vertices",    _weldVertices );
     conf.getIfSet   ( "geo_interpolation", "great_circle", _geoInterp, GEOINTERP_GREAT_CIRCLE );
     conf.getIfSet   ( "geo_interpolation", "rhumb_line",   _geoInterp, GEOINTERP_RHUMB_LINE );
 }
@@ -75,8 +83,12 @@ GeometryCompilerOptions::getConfig() const
     conf.addIfSet   ( "max_granularity",  _maxGranularity_deg );
     conf.addIfSet   ( "merge_geometry",   _mergeGeometry );
     conf.addIfSet   ( "clustering",       _clustering );
+    conf.addIfSet   ( "instancing",       _instancing );
     conf.addObjIfSet( "feature_name",     _featureNameExpr );
     conf.addIfSet   ( "ignore_altitude",  _ignoreAlt );
+    conf.addIfSet   ( "shared_buffers",   _sharedBuffers );
+    conf.addIfSet   ( "extrusion_threads", _extrusionThreads );
+    conf.addIfSet   ( "weld_vertices",    _weldVertices );
     conf.addIfSet   ( "geo_interpolation", "great_circle", _geoInterp, GEOINTERP_GREAT_CIRCLE );
     conf.addIfSet   ( "geo_interpolation", "rhumb_line",   _geoInterp, GEOINTERP_RHUMB_LINE );
     return conf;
@@ -275,6 +287,7 @@ GeometryCompiler::compile(FeatureList&          workingSet,
         }
 
         sub.setClustering( *_options.clustering() );
+        sub.setInstancing( *_options.instancing() );
         if ( _options.featureName().isSet() )
             sub.setFeatureNameExpr( *_options.featureName() );
 
@@ -303,6 +316,10 @@ GeometryCompiler::compile(FeatureList&          workingSet,
         if ( _options.featureName().isSet() )
             extrude.setFeatureNameExpr( *_options.featureName() );
 
+        extrude.setUseSharedBuffers( *_options.sharedBuffers() );
+        extrude.setNumThreads( *_options.extrusionThreads() );
+        extrude.setWeldVertices( *_options.weldVertices() );
+
         osg::Node* node = extrude.push( workingSet, sharedCX );
         if ( node )
         {
@@ -50,6 +50,8 @@ _dbOptions     ( dbOptions )
     // if the caller did not provide a dbOptions, take it from the map.
     if ( map && !dbOptions )
         _dbOptions = map->getDBOptions();
+
+    _resourceCache = new ResourceCache( _dbOptions.get(), true );
 }
 
 Session::~Session()
@@ -21,11 +21,19 @@
 #include <osgEarthSymbology/MeshConsolidator>
 #include <osgEarth/HTTPClient>
 #include <osgEarth/ECEF>
+#include <osgEarth/ThreadingUtils>
+#include <osgEarth/Registry>
+#include <osgEarth/Capabilities>
+#include <osgEarth/ShaderComposition>
 #include <osg/AutoTransform>
+#include <osg/ComputeBoundsVisitor>
 #include <osg/Drawable>
 #include <osg/Geode>
+#include <osg/Geometry>
 #include <osg/MatrixTransform>
 #include <osg/NodeVisitor>
+#include <osg/Texture2D>
+#include <osg/Timer>
 #include <osgUtil/Optimizer>
 #include <list>
 #include <deque>
@@ -46,13 +54,34 @@ namespace
 //------------------------------------------------------------------------
 
 SubstituteModelFilter::SubstituteModelFilter( const Style& style ) :
-_style   ( style ),
-_cluster ( false ),
-_merge   ( true )
+_style          ( style ),
+_cluster        ( false ),
+_instancing     ( false ),
+_forceInstancing( false ),
+_merge          ( true )
 {
     //NOP
 }
 
+MarkerResource*
+SubstituteModelFilter::findMarker( const URI& markerURI, FilterContext& context )
+{
+    MarkerResource* marker = 0L;
+    MarkerCache::Record rec = _markerCache.get( markerURI );
+    if ( rec.valid() ) {
+        marker = rec.value();
+    }
+    else if ( _markerLib.valid() ) {
+        marker = _markerLib->getMarker( markerURI.base(), context.getDBOptions() );
+    }
+    else {
+        marker = new MarkerResource();
+        marker->uri() = markerURI;
+        _markerCache.insert( markerURI, marker );
+    }
+    return marker;
+}
+
 bool
 SubstituteModelFilter::process(const FeatureList&           features,                               
                                const MarkerSymbol*          symbol,
@@ -78,19 +107,7 @@ SubstituteModelFilter::process(const FeatureList&           features,
         URI markerURI( input->eval(uriEx, &context), uriEx.uriContext() );
 
         // find the corresponding marker in the cache
-        MarkerResource* marker = 0L;
-        MarkerCache::Record rec = _markerCache.get( markerURI );
-        if ( rec.valid() ) {
-            marker = rec.value();
-        }
-        else if ( _markerLib.valid() ) {
-            marker = _markerLib->getMarker( markerURI.base(), context.getDBOptions() );
-        }
-        else {
-            marker = new MarkerResource();
-            marker->uri() = markerURI;
-            _markerCache.insert( markerURI, marker );
-        }
+        MarkerResource* marker = findMarker( markerURI, context );
 
         // evalute the scale expression (if there is one)
         float scale = 1.0f;
@@ -392,6 +409,374 @@ SubstituteModelFilter::cluster(const FeatureList&           features,
     return true;
 }
 
+//------------------------------------------------------------------------
+
+namespace
+{
+    // texture unit holding each chunk's instance transforms.
+    const int INSTANCE_DATA_UNIT = 7;
+
+    // max number of instances drawn by one chunk. Each instance uses 3 texels
+    // of the chunk's data texture, so this also bounds the texture width.
+    const unsigned MAX_INSTANCES_PER_CHUNK = 512;
+
+    // Each instance's transform is stored as the first three columns of its
+    // matrix; the vertex is transformed with one dot product per column. This
+    // runs before the built-in texturing and lighting functions.
+    static char s_instancingVertexFunction[] =
+        "#version 110 \n"
+        "#extension GL_ARB_draw_instanced : enable \n"
+        "uniform sampler2D osgearth_InstanceData; \n"
+        "uniform float     osgearth_InstanceDataWidth; \n"
+        "vec4 oe_instancing_column( float i ) \n"
+        "{ \n"
+        "    return texture2DLod( osgearth_InstanceData, vec2((i+0.5)/osgearth_InstanceDataWidth, 0.5), 0.0 ); \n"
+        "} \n"
+        "vec3 oe_instancing_normal() \n"
+        "{ \n"
+        "    float i = float(gl_InstanceIDARB) * 3.0; \n"
+        "    return vec3( dot(gl_Normal, oe_instancing_column(i).xyz), dot(gl_Normal, oe_instancing_column(i+1.0).xyz), dot(gl_Normal, oe_instancing_column(i+2.0).xyz) ); \n"
+        "} \n"
+        "void oe_instancing_setPosition() \n"
+        "{ \n"
+        "    float i = float(gl_InstanceIDARB) * 3.0; \n"
+        "    vec4 vertex = vec4( dot(gl_Vertex, oe_instancing_column(i)), dot(gl_Vertex, oe_instancing_column(i+1.0)), dot(gl_Vertex, oe_instancing_column(i+2.0)), 1.0 ); \n"
+        "    gl_Position = gl_ModelViewProjectionMatrix * vertex; \n"
+        "} \n";
+
+    // the default per-vertex lighting, but with the instance's normal.
+    static char s_instancingLightingVertexShader[] =
+        "#version 110 \n"
+        "vec3 oe_instancing_normal(); \n"
+        "void osgearth_vert_setupLighting() \n"
+        "{ \n"
+        "    vec3 normal = normalize( gl_NormalMatrix * oe_instancing_normal() ); \n"
+        "    float NdotL = dot( normal, normalize(gl_LightSource[0].position.xyz) ); \n"
+        "    NdotL = max( 0.0, NdotL ); \n"
+        "    float NdotHV = dot( normal, gl_LightSource[0].halfVector.xyz ); \n"
+        "    NdotHV = max( 0.0, NdotHV ); \n"
+        "    gl_FrontColor = gl_FrontLightModelProduct.sceneColor + \n"
+        "                    gl_FrontLightProduct[0].ambient + \n"
+        "                    gl_FrontLightProduct[0].diffuse * NdotL; \n"
+        "    gl_FrontSecondaryColor = vec4(0.0); \n"
+        "    if ( NdotL * NdotHV > 0.0 ) \n"
+        "        gl_FrontSecondaryColor = gl_FrontLightProduct[0].specular * \n"
+        "                                 pow( NdotHV, gl_FrontMaterial.shininess ); \n"
+        "    gl_BackColor = gl_FrontColor; \n"
+        "    gl_BackSecondaryColor = gl_FrontSecondaryColor; \n"
+        "} \n";
+
+    // whether this platform can draw instances from a float texture of transforms.
+    bool supportsInstancing()
+    {
+#if defined(OSG_GLES1_AVAILABLE) || defined(OSG_GLES2_AVAILABLE)
+        return false;
+#else
+        const Capabilities& caps = Registry::instance()->getCapabilities();
+        return
+            caps.supportsGLSL()                   &&
+            caps.supportsDrawInstanced()          &&
+            caps.supportsTextureFloat()           &&
+            caps.getMaxGPUVertexTextureUnits() > 0 &&
+            caps.getMaxGPUTextureUnits() > INSTANCE_DATA_UNIT;
+#endif
+    }
+
+    // state shared by all instanced chunks: the shader components, and a white
+    // texture so that untextured models still sample something on unit 0.
+    osg::StateSet* getInstancingStateSet()
+    {
+        static Threading::Mutex           s_mutex;
+        static osg::ref_ptr<osg::StateSet> s_stateSet;
+
+        Threading::ScopedMutexLock lock( s_mutex );
+        if ( !s_stateSet.valid() )
+        {
+            osg::StateSet* ss = new osg::StateSet();
+
+            const ShaderFactory* sf = Registry::instance()->getShaderFactory();
+
+            VirtualProgram* vp = new VirtualProgram();
+            vp->setShader( "osgearth_vert_setupTexturing",  sf->createDefaultTextureVertexShader( 1 ) );
+            vp->setShader( "osgearth_vert_setupLighting",   new osg::Shader( osg::Shader::VERTEX, s_instancingLightingVertexShader ) );
+            vp->setShader( "osgearth_frag_applyTexturing",  sf->createDefaultTextureFragmentShader( 1 ) );
+            vp->setShader( "osgearth_frag_applyLighting",   sf->createDefaultLightingFragmentShader() );
+            vp->setFunction( "oe_instancing_setPosition", s_instancingVertexFunction, ShaderComp::LOCATION_VERTEX_PRE_TEXTURING );
+            ss->setAttributeAndModes( vp, osg::StateAttribute::ON );
+
+            osg::Image* white = new osg::Image();
+            white->allocateImage( 1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+            *(unsigned*)white->data() = 0xFFFFFFFF;
+            ss->setTextureAttributeAndModes( 0, new osg::Texture2D( white ), osg::StateAttribute::ON );
+
+            // feature models don't sit under the terrain engine, which is what
+            // normally maintains the lighting uniform.
+            ss->addUniform( new osg::Uniform( "osgearth_LightingEnabled", true ) );
+            ss->addUniform( new osg::Uniform( "tex0", 0 ) );
+            ss->addUniform( new osg::Uniform( "osgearth_InstanceData", INSTANCE_DATA_UNIT ) );
+
+            s_stateSet = ss;
+        }
+        return s_stateSet.get();
+    }
+
+    // fixed bounds covering every instance in a chunk, since the drawable's
+    // own vertices only describe the prototype.
+    struct InstanceBoundsCallback : public osg::Drawable::ComputeBoundingBoxCallback
+    {
+        InstanceBoundsCallback( const osg::BoundingBox& box ) : _box( box ) { }
+        osg::BoundingBox computeBound( const osg::Drawable& ) const { return _box; }
+        osg::BoundingBox _box;
+    };
+
+    // turns a (cloned) prototype into an instanced draw of N instances.
+    struct ConvertToInstancedVisitor : public osg::NodeVisitor
+    {
+        unsigned         _numInstances;
+        osg::BoundingBox _box;
+
+        ConvertToInstancedVisitor( unsigned numInstances, const osg::BoundingBox& box )
+            : osg::NodeVisitor( TRAVERSE_ALL_CHILDREN ), _numInstances( numInstances ), _box( box ) { }
+
+        void apply( osg::Geode& geode )
+        {
+            for( unsigned i=0; i<geode.getNumDrawables(); ++i )
+            {
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if ( geom )
+                {
+                    // arrays are shared with the prototype, so leave their
+                    // buffer objects alone and draw from client arrays.
+                    geom->setUseDisplayList( false );
+
+                    for( unsigned p=0; p<geom->getNumPrimitiveSets(); ++p )
+                        geom->getPrimitiveSet(p)->setNumInstances( _numInstances );
+
+                    geom->setComputeBoundingBoxCallback( new InstanceBoundsCallback(_box) );
+                    geom->dirtyBound();
+                }
+            }
+            geode.dirtyBound();
+        }
+    };
+
+    typedef std::vector<osg::Matrixd> MatrixVector;
+
+    osg::Node* createInstancedChunk( osg::Node* prototype, const osg::BoundingBox& protoBox, MatrixVector::const_iterator begin, MatrixVector::const_iterator end )
+    {
+        unsigned numInstances = end - begin;
+
+        // pack the transforms, and bound the instances as we go.
+        osg::Image* image = new osg::Image();
+        image->allocateImage( 3*numInstances, 1, 1, GL_RGBA, GL_FLOAT );
+        image->setInternalTextureFormat( GL_RGBA32F_ARB );
+
+        GLfloat* ptr = reinterpret_cast<GLfloat*>( image->data() );
+        osg::BoundingBox box;
+
+        for( MatrixVector::const_iterator m = begin; m != end; ++m )
+        {
+            for( unsigned col=0; col<3; ++col )
+                for( unsigned row=0; row<4; ++row )
+                    *ptr++ = (GLfloat)(*m)(row, col);
+
+            for( unsigned c=0; c<8; ++c )
+                box.expandBy( protoBox.corner(c) * (*m) );
+        }
+
+        osg::Texture2D* data = new osg::Texture2D( image );
+        data->setInternalFormat( GL_RGBA32F_ARB );
+        data->setSourceFormat( GL_RGBA );
+        data->setSourceType( GL_FLOAT );
+        data->setFilter( osg::Texture::MIN_FILTER, osg::Texture::NEAREST );
+        data->setFilter( osg::Texture::MAG_FILTER, osg::Texture::NEAREST );
+        data->setWrap( osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE );
+        data->setWrap( osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE );
+        data->setResizeNonPowerOfTwoHint( false );
+
+        // copy the nodes and primitive sets; vertex arrays and statesets stay
+        // shared with the prototype.
+        osg::Node* clone = osg::clone( prototype,
+            osg::CopyOp::DEEP_COPY_NODES | osg::CopyOp::DEEP_COPY_DRAWABLES | osg::CopyOp::DEEP_COPY_PRIMITIVES );
+
+        ConvertToInstancedVisitor convert( numInstances, box );
+        clone->accept( convert );
+
+        osg::Group* chunk = new osg::Group();
+        chunk->addChild( clone );
+
+        osg::StateSet* ss = chunk->getOrCreateStateSet();
+        ss->setTextureAttribute( INSTANCE_DATA_UNIT, data );
+        ss->addUniform( new osg::Uniform( "osgearth_InstanceDataWidth", (float)(3*numInstances) ) );
+
+        return chunk;
+    }
+}
+
+//instancing:
+//  load an instancing prototype for each marker from the session's resource cache,
+//  so that tiles share one copy of the geometry. gather the instance transforms per
+//  prototype, bucket them into a grid over the local XY plane, and emit one
+//  instanced clone of the prototype per bucket. Models that cannot be instanced
+//  go through the normal process() path.
+bool
+SubstituteModelFilter::instance(const FeatureList&           features,
+                                const MarkerSymbol*          symbol,
+                                Session*                     session,
+                                osg::Group*                  attachPoint,
+                                FilterContext&               context )
+{
+#if OSG_MIN_VERSION_REQUIRED(3,0,0)
+    if ( !_forceInstancing && !supportsInstancing() )
+    {
+        static bool s_warned = false;
+        if ( !s_warned )
+            OE_INFO << LC << "Instancing needs GLSL, instanced draws, float textures and vertex texture fetch; "
+                << "falling back to transforms" << std::endl;
+        s_warned = true;
+        return process( features, symbol, session, attachPoint, context );
+    }
+
+    osg::Timer_t startTime = osg::Timer::instance()->tick();
+
+    bool makeECEF = session->getMapInfo().isGeocentric();
+    const SpatialReference* srs = context.profile()->getSRS();
+
+    StringExpression  uriEx   = *symbol->url();
+    NumericExpression scaleEx = *symbol->scale();
+
+    osg::Matrixd rotationMatrix;
+    if ( symbol->orientation().isSet() )
+    {
+        osg::Vec3d hpr = *symbol->orientation();
+        rotationMatrix.makeRotate( 
+            osg::DegreesToRadians(hpr.y()), osg::Vec3(1,0,0),
+            osg::DegreesToRadians(hpr.x()), osg::Vec3(0,0,1),
+            osg::DegreesToRadians(hpr.z()), osg::Vec3(0,1,0) );
+    }
+
+    typedef std::map< osg::ref_ptr<osg::Node>, MatrixVector > PrototypeInstances;
+    PrototypeInstances instances;
+    FeatureList        fallback;
+
+    for( FeatureList::const_iterator f = features.begin(); f != features.end(); ++f )
+    {
+        Feature* input = f->get();
+
+        URI markerURI( input->eval(uriEx, &context), uriEx.uriContext() );
+        MarkerResource* marker = findMarker( markerURI, context );
+
+        osg::ref_ptr<osg::Node> prototype;
+        if ( marker )
+            prototype = session->getResourceCache()->getInstancedMarkerNode( marker );
+
+        if ( !prototype.valid() )
+        {
+            fallback.push_back( input );
+            continue;
+        }
+
+        osg::Matrixd scaleMatrix;
+        if ( symbol->scale().isSet() )
+        {
+            double scale = input->eval( scaleEx, &context );
+            if ( scale == 0.0 )
+                scale = 1.0;
+            scaleMatrix.makeScale( scale, scale, scale );
+        }
+
+        MatrixVector& matrices = instances[prototype];
+
+        GeometryIterator gi( input->getGeometry(), false );
+        while( gi.hasMore() )
+        {
+            Geometry* geom = gi.next();
+
+            for( unsigned i=0; i<geom->size(); ++i )
+            {
+                osg::Vec3d point = (*geom)[i];
+                if ( makeECEF )
+                {
+                    osg::Matrixd rotation;
+                    ECEF::transformAndGetRotationMatrix( point, srs, point, rotation );
+                    matrices.push_back( rotationMatrix * rotation * scaleMatrix * osg::Matrixd::translate(point) * _world2local );
+                }
+                else
+                {
+                    matrices.push_back( rotationMatrix * scaleMatrix * osg::Matrixd::translate(point) * _world2local );
+                }
+            }
+        }
+    }
+
+    unsigned numInstances = 0, numChunks = 0;
+
+    if ( !instances.empty() )
+    {
+        osg::Group* group = new osg::Group();
+        group->setStateSet( getInstancingStateSet() );
+        attachPoint->addChild( group );
+
+        for( PrototypeInstances::const_iterator p = instances.begin(); p != instances.end(); ++p )
+        {
+            osg::Node*          prototype = p->first.get();
+            const MatrixVector& matrices  = p->second;
+            if ( matrices.empty() )
+                continue;
+
+            osg::ComputeBoundsVisitor cbv;
+            prototype->accept( cbv );
+            const osg::BoundingBox& protoBox = cbv.getBoundingBox();
+
+            // lay a grid over the instance locations, sized so that a uniform
+            // distribution fills each cell to about the chunk limit.
+            osg::BoundingBox extent;
+            for( MatrixVector::const_iterator m = matrices.begin(); m != matrices.end(); ++m )
+                extent.expandBy( m->getTrans() );
+
+            unsigned dim = osg::maximum( 1u, (unsigned)::ceil( ::sqrt( (double)matrices.size() / (double)MAX_INSTANCES_PER_CHUNK ) ) );
+            double cellWidth  = (extent.xMax() - extent.xMin()) / (double)dim;
+            double cellHeight = (extent.yMax() - extent.yMin()) / (double)dim;
+
+            std::vector<MatrixVector> cells( dim*dim );
+            for( MatrixVector::const_iterator m = matrices.begin(); m != matrices.end(); ++m )
+            {
+                osg::Vec3d t = m->getTrans();
+                unsigned col = cellWidth  > 0.0 ? osg::minimum( dim-1, (unsigned)((t.x()-extent.xMin())/cellWidth) )  : 0u;
+                unsigned row = cellHeight > 0.0 ? osg::minimum( dim-1, (unsigned)((t.y()-extent.yMin())/cellHeight) ) : 0u;
+                cells[row*dim + col].push_back( *m );
+            }
+
+            // crowded cells are split into several chunks.
+            for( std::vector<MatrixVector>::const_iterator c = cells.begin(); c != cells.end(); ++c )
+            {
+                for( unsigned begin = 0; begin < c->size(); begin += MAX_INSTANCES_PER_CHUNK )
+                {
+                    unsigned end = osg::minimum( (unsigned)c->size(), begin + MAX_INSTANCES_PER_CHUNK );
+                    group->addChild( createInstancedChunk( prototype, protoBox, c->begin() + begin, c->begin() + end ) );
+                    ++numChunks;
+                }
+            }
+
+            numInstances += matrices.size();
+        }
+    }
+
+    OE_DEBUG << LC << "Instanced " << numInstances << " models in " << numChunks << " chunks ("
+        << osg::Timer::instance()->delta_m( startTime, osg::Timer::instance()->tick() ) << " ms); "
+        << fallback.size() << " features not instanceable" << std::endl;
+
+    if ( !fallback.empty() )
+        return process( fallback, symbol, session, attachPoint, context );
+
+    return true;
+
+#else
+    OE_WARN << LC << "Instancing requires OSG 3.0 or newer; falling back to transforms" << std::endl;
+    return process( features, symbol, session, attachPoint, context );
+#endif
+}
+
 osg::Node*
 SubstituteModelFilter::push(FeatureList& features, FilterContext& context)
 {
@@ -434,7 +819,12 @@ SubstituteModelFilter::push(FeatureList& features, FilterContext& context)
 
     bool ok = true;
 
-    if ( _cluster )
+    if ( _instancing )
+    {
+        ok = instance( features, symbol, context.getSession(), group, newContext );
+    }
+
+    else if ( _cluster )
     {
         ok = cluster( features, symbol, context.getSession(), group, newContext );
     }
@@ -18,11 +18,14 @@
 */
 
 #include <osgEarthSymbology/MeshConsolidator>
+#include <osgEarth/TaskService>
+#include <osg/Timer>
 #include <osg/TriangleFunctor>
 #include <osg/TriangleIndexFunctor>
 #include <limits>
 #include <map>
 #include <iterator>
+#include <algorithm>
 
 using namespace osgEarth::Symbology;
 
@@ -464,3 +467,493 @@ MeshConsolidator::run( osg::Geode& geode )
     for( std::vector<osg::ref_ptr<osg::Geometry> >::iterator i = nonOptimizedGeoms.begin(); i != nonOptimizedGeoms.end(); ++i )
         geode.addDrawable( i->get() );
 }
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    // Source geometry and its location in the consolidated output.
+    struct Slot
+    {
+        osg::Geometry*                  _geom;
+        unsigned                        _offset;
+        osg::Geometry::PrimitiveSetList _primSets;
+    };
+
+    typedef std::vector<Slot> Slots;
+
+    // The consolidated output arrays.
+    struct Layout
+    {
+        osg::ref_ptr<osg::Vec3Array>  _verts;
+        osg::ref_ptr<osg::Vec3Array>  _normals;
+        osg::ref_ptr<osg::Vec4Array>  _colors;
+        std::vector<unsigned>         _texUnits;
+        std::vector< osg::ref_ptr<osg::Vec2Array> > _texCoords;
+    };
+
+    // Whether the indexed mode can copy this geometry directly.
+    bool canCopy( osg::Geometry& geom, const std::vector<unsigned>& texUnits )
+    {
+        if ( !canOptimize(geom) )
+            return false;
+
+        if ( geom.getNumVertexAttribArrays() > 0 )
+            return false;
+
+        unsigned numVerts = geom.getVertexArray()->getNumElements();
+
+        if ( !dynamic_cast<osg::Vec3Array*>(geom.getVertexArray()) )
+            return false;
+
+        if ( geom.getNormalArray() && (!dynamic_cast<osg::Vec3Array*>(geom.getNormalArray()) || geom.getNormalArray()->getNumElements() != numVerts) )
+            return false;
+
+        if ( geom.getColorArray() && (!dynamic_cast<osg::Vec4Array*>(geom.getColorArray()) || geom.getColorArray()->getNumElements() != numVerts) )
+            return false;
+
+        for( unsigned u=0; u<texUnits.size(); ++u )
+        {
+            osg::Array* tc = geom.getTexCoordArray(texUnits[u]);
+            if ( tc && (!dynamic_cast<osg::Vec2Array*>(tc) || tc->getNumElements() != numVerts) )
+                return false;
+        }
+
+        // the output only carries the units used by the first geometry; anything
+        // using another unit would lose its texture coordinates.
+        for( unsigned u=0; u<geom.getNumTexCoordArrays(); ++u )
+        {
+            if ( geom.getTexCoordArray(u) && std::find(texUnits.begin(), texUnits.end(), u) == texUnits.end() )
+                return false;
+        }
+
+        // DrawArrayLengths can't be expressed as a single indexed set.
+        for( unsigned p=0; p<geom.getNumPrimitiveSets(); ++p )
+        {
+            if ( geom.getPrimitiveSet(p)->getType() == osg::PrimitiveSet::DrawArrayLengthsPrimitiveType )
+                return false;
+        }
+
+        return true;
+    }
+
+    template<typename A, typename T>
+    void copyAttribs( A* dest, const osg::Array* src, unsigned offset, unsigned count, const T& defaultValue )
+    {
+        if ( !dest )
+            return;
+
+        const A* srcA = static_cast<const A*>( src );
+        if ( srcA )
+            std::copy( srcA->begin(), srcA->end(), dest->begin() + offset );
+        else
+            std::fill( dest->begin() + offset, dest->begin() + offset + count, defaultValue );
+    }
+
+    // Copies a range of source geometries into their preassigned slots in the
+    // output arrays and rebases their primitive sets. Slots are disjoint, so any
+    // number of these can run at once.
+    struct CopySlots
+    {
+        void init( Slots& slots, unsigned begin, unsigned end, Layout& layout )
+        {
+            _slots  = &slots;
+            _begin  = begin;
+            _end    = end;
+            _layout = &layout;
+        }
+
+        void execute()
+        {
+            for( unsigned s = _begin; s < _end; ++s )
+            {
+                Slot& slot = (*_slots)[s];
+                osg::Geometry* geom = slot._geom;
+
+                // triangulate first:
+                MeshConsolidator::run( *geom );
+
+                const osg::Vec3Array* verts = static_cast<const osg::Vec3Array*>( geom->getVertexArray() );
+                unsigned count = verts->size();
+
+                std::copy( verts->begin(), verts->end(), _layout->_verts->begin() + slot._offset );
+                copyAttribs( _layout->_normals.get(), geom->getNormalArray(), slot._offset, count, osg::Vec3(0,0,1) );
+                copyAttribs( _layout->_colors.get(),  geom->getColorArray(),  slot._offset, count, osg::Vec4(1,1,1,1) );
+
+                for( unsigned u=0; u<_layout->_texUnits.size(); ++u )
+                    copyAttribs( _layout->_texCoords[u].get(), geom->getTexCoordArray(_layout->_texUnits[u]), slot._offset, count, osg::Vec2(0,0) );
+
+                for( unsigned p=0; p<geom->getNumPrimitiveSets(); ++p )
+                {
+                    const osg::PrimitiveSet* pset = geom->getPrimitiveSet(p);
+                    unsigned n = pset->getNumIndices();
+
+                    osg::DrawElementsUInt* de = new osg::DrawElementsUInt( pset->getMode() );
+                    de->reserve( n );
+                    for( unsigned i=0; i<n; ++i )
+                        de->push_back( slot._offset + pset->index(i) );
+
+                    de->setUserData( const_cast<osg::Referenced*>(pset->getUserData()) );
+                    slot._primSets.push_back( de );
+                }
+            }
+        }
+
+        Slots*   _slots;
+        unsigned _begin, _end;
+        Layout*  _layout;
+    };
+
+    //..................................................................
+
+    // Open-addressing spatial hash used to weld vertices. Positions are
+    // quantized into cells of the weld tolerance; candidates are searched in
+    // the vertex's own cell and its neighbors.
+    struct WeldHash
+    {
+        struct Entry { int _x, _y, _z; unsigned _index; bool _used; };
+
+        std::vector<Entry> _table;
+        unsigned           _mask;
+        double             _invCell;
+
+        WeldHash( unsigned numVerts, float tolerance )
+        {
+            unsigned size = 16;
+            while( size < numVerts * 2 ) size <<= 1;
+            _table.resize( size );
+            for( unsigned i=0; i<size; ++i ) _table[i]._used = false;
+            _mask = size - 1;
+            _invCell = tolerance > 0.0f ? 1.0/(double)tolerance : 0.0;
+        }
+
+        void cell( const osg::Vec3& p, int& x, int& y, int& z ) const
+        {
+            if ( _invCell > 0.0 ) {
+                x = (int)floor(p.x()*_invCell);
+                y = (int)floor(p.y()*_invCell);
+                z = (int)floor(p.z()*_invCell);
+            }
+            else {
+                // exact matching: hash the bit patterns.
+                union { float f; int i; } ux, uy, uz;
+                ux.f = p.x(); uy.f = p.y(); uz.f = p.z();
+                x = ux.i; y = uy.i; z = uz.i;
+            }
+        }
+
+        unsigned hash( int x, int y, int z ) const
+        {
+            return ((unsigned)x * 73856093u ^ (unsigned)y * 19349663u ^ (unsigned)z * 83492791u) & _mask;
+        }
+
+        void insert( int x, int y, int z, unsigned index )
+        {
+            unsigned h = hash(x, y, z);
+            while( _table[h]._used ) h = (h+1) & _mask;
+            Entry& e = _table[h];
+            e._x = x; e._y = y; e._z = z; e._index = index; e._used = true;
+        }
+    };
+
+    bool sameVertex( const Layout& in, unsigned a, unsigned b, float tolerance )
+    {
+        const osg::Vec3& pa = (*in._verts)[a];
+        const osg::Vec3& pb = (*in._verts)[b];
+        if ( fabs(pa.x()-pb.x()) > tolerance || fabs(pa.y()-pb.y()) > tolerance || fabs(pa.z()-pb.z()) > tolerance )
+            return false;
+        if ( in._normals.valid() && (*in._normals)[a] != (*in._normals)[b] )
+            return false;
+        if ( in._colors.valid() && (*in._colors)[a] != (*in._colors)[b] )
+            return false;
+        for( unsigned u=0; u<in._texCoords.size(); ++u )
+            if ( (*in._texCoords[u])[a] != (*in._texCoords[u])[b] )
+                return false;
+        return true;
+    }
+
+    // Welds identical vertices in place; returns the remapping table from old
+    // vertex index to new vertex index.
+    void weld( Layout& layout, float tolerance, std::vector<unsigned>& remap )
+    {
+        unsigned numVerts = layout._verts->size();
+        remap.resize( numVerts );
+
+        WeldHash hash( numVerts, tolerance );
+        int range = tolerance > 0.0f ? 1 : 0;
+
+        Layout out;
+        out._verts = new osg::Vec3Array();
+        out._verts->reserve( numVerts );
+        if ( layout._normals.valid() ) { out._normals = new osg::Vec3Array(); out._normals->reserve(numVerts); }
+        if ( layout._colors.valid() )  { out._colors  = new osg::Vec4Array(); out._colors->reserve(numVerts); }
+        out._texUnits = layout._texUnits;
+        for( unsigned u=0; u<layout._texCoords.size(); ++u ) {
+            out._texCoords.push_back( new osg::Vec2Array() );
+            out._texCoords.back()->reserve( numVerts );
+        }
+
+        for( unsigned v=0; v<numVerts; ++v )
+        {
+            int cx, cy, cz;
+            hash.cell( (*layout._verts)[v], cx, cy, cz );
+
+            int match = -1;
+            for( int dx=-range; dx<=range && match<0; ++dx )
+            for( int dy=-range; dy<=range && match<0; ++dy )
+            for( int dz=-range; dz<=range && match<0; ++dz )
+            {
+                unsigned h = hash.hash(cx+dx, cy+dy, cz+dz);
+                while( hash._table[h]._used && match < 0 )
+                {
+                    const WeldHash::Entry& e = hash._table[h];
+                    if ( e._x == cx+dx && e._y == cy+dy && e._z == cz+dz && sameVertex(layout, e._index, v, tolerance) )
+                        match = e._index;
+                    h = (h+1) & hash._mask;
+                }
+            }
+
+            if ( match >= 0 )
+            {
+                remap[v] = remap[match];
+            }
+            else
+            {
+                remap[v] = out._verts->size();
+                out._verts->push_back( (*layout._verts)[v] );
+                if ( out._normals.valid() ) out._normals->push_back( (*layout._normals)[v] );
+                if ( out._colors.valid() )  out._colors->push_back( (*layout._colors)[v] );
+                for( unsigned u=0; u<out._texCoords.size(); ++u )
+                    out._texCoords[u]->push_back( (*layout._texCoords[u])[v] );
+
+                hash.insert( cx, cy, cz, v );
+            }
+        }
+
+        layout = out;
+    }
+
+    // Rewrites a DrawElementsUInt through a remap table, dropping triangles
+    // that became degenerate, and narrows it to 16 bits if possible.
+    osg::PrimitiveSet* finish( osg::DrawElementsUInt* de, const std::vector<unsigned>* remap, unsigned numVerts )
+    {
+        if ( remap )
+        {
+            if ( de->getMode() == GL_TRIANGLES )
+            {
+                unsigned w = 0;
+                for( unsigned i=0; i+2 < de->size(); i += 3 )
+                {
+                    unsigned i0 = (*remap)[(*de)[i]], i1 = (*remap)[(*de)[i+1]], i2 = (*remap)[(*de)[i+2]];
+                    if ( i0 != i1 && i1 != i2 && i0 != i2 )
+                    {
+                        (*de)[w++] = i0; (*de)[w++] = i1; (*de)[w++] = i2;
+                    }
+                }
+                de->resize( w );
+            }
+            else
+            {
+                for( unsigned i=0; i<de->size(); ++i )
+                    (*de)[i] = (*remap)[(*de)[i]];
+            }
+        }
+
+        if ( numVerts < 0x10000 )
+        {
+            osg::DrawElementsUShort* de16 = new osg::DrawElementsUShort( de->getMode() );
+            de16->reserve( de->size() );
+            for( osg::DrawElementsUInt::const_iterator i = de->begin(); i != de->end(); ++i )
+                de16->push_back( (unsigned short)*i );
+            de16->setUserData( de->getUserData() );
+            return de16;
+        }
+
+        return de;
+    }
+}
+
+void
+MeshConsolidator::run( osg::Geode& geode, const Options& options, Stats* stats )
+{
+    osg::Timer_t t0 = osg::Timer::instance()->tick();
+
+    // find the texture units in use:
+    std::vector<unsigned> texUnits;
+    for( unsigned i=0; i<geode.getNumDrawables() && texUnits.size() == 0; ++i )
+    {
+        osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+        if ( geom && geom->getVertexArray() )
+        {
+            for( unsigned u=0; u<32; ++u )
+                if ( geom->getTexCoordArray(u) != 0L )
+                    texUnits.push_back( u );
+        }
+    }
+
+    // first pass: compute the output offset of each geometry and the output layout.
+    Slots slots;
+    slots.reserve( geode.getNumDrawables() );
+
+    std::vector< osg::ref_ptr<osg::Drawable> > nonOptimized;
+
+    unsigned numVerts   = 0;
+    bool     hasNormals = false;
+    bool     hasColors  = false;
+    bool     useVBOs    = false;
+    GLenum   usage      = GL_STATIC_DRAW_ARB;
+    osg::StateSet* unifiedStateSet = 0L;
+
+    for( unsigned i=0; i<geode.getNumDrawables(); ++i )
+    {
+        osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+        if ( !geom || !canCopy(*geom, texUnits) )
+        {
+            nonOptimized.push_back( geode.getDrawable(i) );
+            continue;
+        }
+
+        if ( geom->getUseVertexBufferObjects() )
+        {
+            useVBOs = true;
+            osg::BufferObject* bo = geom->getVertexArray()->getVertexBufferObject();
+            if ( bo )
+                usage = bo->getUsage();
+        }
+
+        // merge in the stateset:
+        if ( unifiedStateSet == 0L )
+            unifiedStateSet = geom->getStateSet();
+        else if ( geom->getStateSet() )
+            unifiedStateSet->merge( *geom->getStateSet() );
+
+        Slot slot;
+        slot._geom   = geom;
+        slot._offset = numVerts;
+        slots.push_back( slot );
+
+        numVerts   += geom->getVertexArray()->getNumElements();
+        hasNormals |= geom->getNormalArray() != 0L;
+        hasColors  |= geom->getColorArray() != 0L;
+    }
+
+    if ( stats )
+    {
+        stats->_numVertsIn     = numVerts;
+        stats->_numDrawablesIn = geode.getNumDrawables();
+    }
+
+    if ( slots.size() < 2 )
+    {
+        if ( stats )
+        {
+            stats->_numVertsOut     = numVerts;
+            stats->_numDrawablesOut = geode.getNumDrawables();
+        }
+        return;
+    }
+
+    // preallocate the output arrays:
+    Layout layout;
+    layout._verts = new osg::Vec3Array( numVerts );
+    if ( hasNormals ) layout._normals = new osg::Vec3Array( numVerts );
+    if ( hasColors )  layout._colors  = new osg::Vec4Array( numVerts );
+    layout._texUnits = texUnits;
+    for( unsigned u=0; u<texUnits.size(); ++u )
+        layout._texCoords.push_back( new osg::Vec2Array(numVerts) );
+
+    // second pass: copy everything into place.
+    unsigned numJobs = std::min( std::max(options._numThreads, 1u), (unsigned)slots.size() );
+    if ( numJobs <= 1 )
+    {
+        CopySlots job;
+        job.init( slots, 0, slots.size(), layout );
+        job.execute();
+    }
+    else
+    {
+        TaskService* service = TaskService::getShared( "MeshConsolidator", (int)numJobs );
+        Threading::MultiEvent semaphore( numJobs );
+        unsigned perJob = slots.size() / numJobs;
+
+        for( unsigned j=0; j<numJobs; ++j )
+        {
+            unsigned begin = j*perJob;
+            unsigned end   = j+1 == numJobs ? slots.size() : begin+perJob;
+
+            ParallelTask<CopySlots>* job = new ParallelTask<CopySlots>( &semaphore );
+            job->init( slots, begin, end, layout );
+            service->add( job );
+        }
+
+        semaphore.wait();
+    }
+
+    // optionally weld identical vertices:
+    std::vector<unsigned> remap;
+    if ( options._weld )
+    {
+        weld( layout, options._weldTolerance, remap );
+    }
+
+    unsigned numVertsOut = layout._verts->size();
+
+    // assemble the new geometry.
+    osg::Geometry* newGeom = new osg::Geometry();
+    newGeom->setUseVertexBufferObjects( useVBOs );
+
+    newGeom->setVertexArray( layout._verts.get() );
+    if ( useVBOs && layout._verts->getVertexBufferObject() )
+        layout._verts->getVertexBufferObject()->setUsage( usage );
+
+    if ( layout._normals.valid() )
+    {
+        newGeom->setNormalArray( layout._normals.get() );
+        newGeom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    if ( layout._colors.valid() )
+    {
+        newGeom->setColorArray( layout._colors.get() );
+        newGeom->setColorBinding( osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    for( unsigned u=0; u<layout._texUnits.size(); ++u )
+    {
+        newGeom->setTexCoordArray( layout._texUnits[u], layout._texCoords[u].get() );
+    }
+
+    for( Slots::iterator s = slots.begin(); s != slots.end(); ++s )
+    {
+        for( osg::Geometry::PrimitiveSetList::iterator p = s->_primSets.begin(); p != s->_primSets.end(); ++p )
+        {
+            osg::PrimitiveSet* pset = finish(
+                static_cast<osg::DrawElementsUInt*>(p->get()),
+                options._weld ? &remap : 0L,
+                numVertsOut );
+
+            if ( pset->getNumIndices() > 0 )
+                newGeom->addPrimitiveSet( pset );
+        }
+    }
+
+    newGeom->setStateSet( unifiedStateSet );
+
+    // replace the geode's drawables
+    geode.removeDrawables( 0, geode.getNumDrawables() );
+    geode.addDrawable( newGeom );
+    for( std::vector< osg::ref_ptr<osg::Drawable> >::iterator i = nonOptimized.begin(); i != nonOptimized.end(); ++i )
+        geode.addDrawable( i->get() );
+
+    double time_s = osg::Timer::instance()->delta_s( t0, osg::Timer::instance()->tick() );
+
+    if ( stats )
+    {
+        stats->_numVertsOut     = numVertsOut;
+        stats->_numDrawablesOut = geode.getNumDrawables();
+        stats->_time_s          = time_s;
+    }
+
+    OE_DEBUG << LC << "Consolidated " << slots.size() << " drawables: verts "
+        << numVerts << " -> " << numVertsOut << " in " << time_s << " s" << std::endl;
+}
@@ -17,10 +17,46 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include <osgEarthSymbology/ResourceCache>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/Transform>
+#include <osg/MatrixTransform>
+#include <osgUtil/Optimizer>
 
 using namespace osgEarth;
 using namespace osgEarth::Symbology;
 
+namespace
+{
+    // finds anything that would stop a model from being drawn with instancing.
+    struct CanInstanceVisitor : public osg::NodeVisitor
+    {
+        bool _ok;
+
+        CanInstanceVisitor() : osg::NodeVisitor(TRAVERSE_ALL_CHILDREN), _ok(true) { }
+
+        void apply( osg::Transform& xform )
+        {
+            // only plain static matrix transforms can be flattened away.
+            if ( !dynamic_cast<osg::MatrixTransform*>(&xform) || xform.getDataVariance() == osg::Object::DYNAMIC )
+                _ok = false;
+            else
+                traverse( xform );
+        }
+
+        void apply( osg::Geode& geode )
+        {
+            for( unsigned i=0; i<geode.getNumDrawables() && _ok; ++i )
+            {
+                // instanced draws need vertex arrays (no per-primitive bindings)
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if ( !geom || !geom->areFastPathsUsed() )
+                    _ok = false;
+            }
+        }
+    };
+}
+
 ResourceCache::ResourceCache(const osgDB::Options* dbOptions,
                              bool                  threadSafe ) :
 _dbOptions ( dbOptions ),
@@ -36,35 +72,19 @@ ResourceCache::getStateSet( SkinResource* skin )
 
     if ( _threadSafe )
     {
-        // first check if it exists
-        {
-            Threading::ScopedReadLock shared( _mutex );
+        // LRUCache::get() reorders the cache, so even a lookup needs the exclusive lock.
+        Threading::ScopedWriteLock exclusive( _mutex );
 
-            SkinCache::Record rec = _skinCache.get( skin );
-            if ( rec.valid() )
-            {
-                result = rec.value();
-            }
+        SkinCache::Record rec = _skinCache.get( skin );
+        if ( rec.valid() )
+        {
+            result = rec.value();
         }
-
-        // no? exclusive lock and create it.
-        if ( !result )
+        else
         {
-            Threading::ScopedWriteLock exclusive( _mutex );
-            
-            // double check to avoid race condition
-            SkinCache::Record rec = _skinCache.get( skin );
-            if ( rec.valid() )
-            {
-                result = rec.value();
-            }
-            else
-            {
-                // still not there, make it.
-                result = skin->createStateSet( _dbOptions.get() );
-                if ( result )
-                    _skinCache.insert( skin, result );
-            }
+            result = skin->createStateSet( _dbOptions.get() );
+            if ( result )
+                _skinCache.insert( skin, result );
         }
     }
 
@@ -93,35 +113,19 @@ ResourceCache::getMarkerNode( MarkerResource* marker )
 
     if ( _threadSafe )
     {
-        // first check if it exists
-        {
-            Threading::ScopedReadLock shared( _mutex );
+        // LRUCache::get() reorders the cache, so even a lookup needs the exclusive lock.
+        Threading::ScopedWriteLock exclusive( _mutex );
 
-            MarkerCache::Record rec = _markerCache.get( marker );
-            if ( rec.valid() )
-            {
-                result = rec.value();
-            }
+        MarkerCache::Record rec = _markerCache.get( marker );
+        if ( rec.valid() )
+        {
+            result = rec.value();
         }
-
-        // no? exclusive lock and create it.
-        if ( !result )
+        else
         {
-            Threading::ScopedWriteLock exclusive( _mutex );
-            
-            // double check to avoid race condition
-            MarkerCache::Record rec = _markerCache.get( marker );
-            if ( rec.valid() )
-            {
-                result = rec.value();
-            }
-            else
-            {
-                // still not there, make it.
-                result = marker->createNode( _dbOptions.get() );
-                if ( result )
-                    _markerCache.insert( marker, result );
-            }
+            result = marker->createNode( _dbOptions.get() );
+            if ( result )
+                _markerCache.insert( marker, result );
         }
     }
 
@@ -142,3 +146,75 @@ ResourceCache::getMarkerNode( MarkerResource* marker )
 
     return result;
 }
+
+osg::Node*
+ResourceCache::getInstancedMarkerNode( MarkerResource* marker )
+{
+    osg::Node* result = 0L;
+
+    // the marker's node comes from its URI alone, so that's the key. Markers that
+    // can't be instanced are cached too (as NULL) so we only try them once.
+    const std::string key = marker->uri()->full();
+
+    if ( _threadSafe )
+    {
+        // LRUCache::get() reorders the cache, so even a lookup needs the exclusive lock.
+        Threading::ScopedWriteLock exclusive( _mutex );
+
+        InstancedMarkerCache::Record rec = _instancedMarkerCache.get( key );
+        if ( rec.valid() )
+        {
+            result = rec.value();
+        }
+        else
+        {
+            result = createInstancedMarkerNode( marker );
+            _instancedMarkerCache.insert( key, result );
+        }
+    }
+
+    else
+    {
+        InstancedMarkerCache::Record rec = _instancedMarkerCache.get( key );
+        if ( rec.valid() )
+        {
+            result = rec.value();
+        }
+        else
+        {
+            result = createInstancedMarkerNode( marker );
+            _instancedMarkerCache.insert( key, result );
+        }
+    }
+
+    return result;
+}
+
+osg::Node*
+ResourceCache::createInstancedMarkerNode( MarkerResource* marker )
+{
+    osg::ref_ptr<osg::Node> model = marker->createNode( _dbOptions.get() );
+    if ( !model.valid() )
+        return 0L;
+
+    CanInstanceVisitor check;
+    model->accept( check );
+    if ( !check._ok )
+        return 0L;
+
+    // copy everything the flattener will modify, but share the statesets.
+    osg::ref_ptr<osg::Group> root = new osg::Group();
+    root->addChild( osg::clone(
+        model.get(),
+        osg::CopyOp::DEEP_COPY_NODES | osg::CopyOp::DEEP_COPY_DRAWABLES |
+        osg::CopyOp::DEEP_COPY_ARRAYS | osg::CopyOp::DEEP_COPY_PRIMITIVES) );
+
+    osgUtil::Optimizer optimizer;
+    optimizer.optimize( root.get(), osgUtil::Optimizer::FLATTEN_STATIC_TRANSFORMS_DUPLICATING_SHARED_SUBGRAPHS );
+
+    // bounds are computed lazily; do it now so that threads sharing the
+    // prototype never race to compute them.
+    root->getBound();
+
+    return root.release();
+}
@@ -17,9 +17,14 @@
 * along with this program.  If not, see <http://www.gnu.org/licenses/>
 */
 #include <osgEarthUtil/LineOfSight>
+#include <osgEarth/ElevationQuery>
+#include <osgEarth/TaskService>
 #include <osgSim/LineOfSight>
 #include <osgUtil/IntersectionVisitor>
 #include <osgUtil/LineSegmentIntersector>
+#include <OpenThreads/Thread>
+#include <cfloat>
+#include <cmath>
 
 using namespace osgEarth;
 using namespace osgEarth::Util;
@@ -583,6 +588,282 @@ private:
     RadialLineOfSightNode* _los;
 };
 
+/**
+ * Evaluates the spokes of a RadialLineOfSightNode against the map's elevation
+ * data. One evaluation runs at a time per node; requests that arrive in the
+ * meantime collapse into the most recent one. The elevation samples outlive each
+ * evaluation so that a new radius or observer height can reuse them.
+ */
+class RadialLineOfSightNode::HeightfieldEngine : public osg::Referenced
+{
+public:
+    struct Params
+    {
+        osg::Vec3d       _center;
+        AltitudeModeEnum _altitudeMode;
+        double           _radius;
+        int              _numSpokes;
+        double           _spacing;
+    };
+
+    HeightfieldEngine( RadialLineOfSightNode* node ) :
+      _node         ( node ),
+      _map          ( node->getMapNode()->getMap() ),
+      _hasNext      ( false ),
+      _running      ( false ),
+      _spacing      ( 0.0 ),
+      _centerTerrain( 0.0 )
+    {
+    }
+
+    /** Schedules an evaluation, replacing any queued one that has not started. */
+    void request( const Params& params )
+    {
+        Threading::ScopedMutexLock lock( _mutex );
+        _next    = params;
+        _hasNext = true;
+        if ( !_running )
+        {
+            _running = true;
+            TaskService::getShared( "RadialLineOfSight", 2 )->add( new RunTask(this) );
+        }
+    }
+
+private:
+    /** Terrain samples along one spoke, and how far the spoke is known to be visible. */
+    struct Profile
+    {
+        Profile() : _clear(0), _hit(0) { }
+        std::vector<double> _terrain; // terrain height under samples 1..n
+        unsigned            _clear;   // samples 1.._clear are visible from the current center
+        unsigned            _hit;     // first blocking sample, or 0 if none found yet
+    };
+
+    struct RunTask : public TaskRequest
+    {
+        RunTask( HeightfieldEngine* engine ) : _engine( engine ) { }
+        void operator()( ProgressCallback* progress ) { _engine->run(); }
+        osg::ref_ptr<HeightfieldEngine> _engine;
+    };
+
+    struct EvaluateSpokes
+    {
+        void init( HeightfieldEngine* engine, unsigned first, unsigned last )
+        {
+            _engine = engine; _first = first; _last = last;
+        }
+
+        void execute()
+        {
+            ElevationQuery eq( _engine->_map.get() );
+            for( unsigned i = _first; i < _last; ++i )
+                _engine->evaluate( i, eq );
+        }
+
+        HeightfieldEngine* _engine;
+        unsigned           _first, _last;
+    };
+    friend struct RunTask;
+    friend struct EvaluateSpokes;
+
+    void run();
+    void compute( const Params& params );
+    void evaluate( unsigned i, ElevationQuery& eq );
+    double clearance( ElevationQuery& eq, Profile& profile, unsigned k, const osg::Vec3d& world );
+
+    osg::observer_ptr<RadialLineOfSightNode> _node;
+    osg::ref_ptr<const Map>                  _map;
+    Threading::Mutex                         _mutex;
+    Params                                   _next;
+    bool                                     _hasNext;
+    bool                                     _running;
+
+    // evaluation state; only the thread in run() touches these
+    Revision             _mapRevision;
+    osg::Vec2d           _origin;
+    double               _spacing;
+    double               _centerTerrain;
+    osg::Vec3d           _centerWorld;
+    std::vector<Profile> _profiles;
+    SpokeVector          _spokes;
+};
+
+void
+RadialLineOfSightNode::HeightfieldEngine::run()
+{
+    for( ;; )
+    {
+        Params params;
+        {
+            Threading::ScopedMutexLock lock( _mutex );
+            if ( !_hasNext )
+            {
+                _running = false;
+                return;
+            }
+            params   = _next;
+            _hasNext = false;
+        }
+
+        compute( params );
+
+        // publish even if a newer request is waiting, so that a continuously
+        // moving observer still sees results.
+        osg::ref_ptr<RadialLineOfSightNode> node;
+        if ( _node.lock(node) )
+        {
+            Threading::ScopedMutexLock lock( node->_pendingMutex );
+            node->_pendingCenterWorld = _centerWorld;
+            node->_pendingSpokes      = _spokes;
+            node->_hasPendingSpokes   = true;
+        }
+    }
+}
+
+void
+RadialLineOfSightNode::HeightfieldEngine::compute( const Params& params )
+{
+    const SpatialReference* srs = _map->getProfile()->getSRS();
+
+    double spacing = params._spacing;
+    if ( spacing <= 0.0 )
+    {
+        // keep the automatic spacing across moderate radius changes so the samples stay usable
+        spacing = _spacing;
+        if ( spacing <= 0.0 || params._radius / spacing > 512.0 || params._radius / spacing < 32.0 )
+            spacing = params._radius / 128.0;
+    }
+
+    // the samples describe the terrain around one spot; start over when that changes.
+    bool reset =
+        (int)_map->getDataModelRevision() != (int)_mapRevision ||
+        params._center.x() != _origin.x() ||
+        params._center.y() != _origin.y() ||
+        params._numSpokes  != (int)_profiles.size() ||
+        spacing            != _spacing;
+
+    if ( reset )
+    {
+        _mapRevision = _map->getDataModelRevision();
+        _origin.set( params._center.x(), params._center.y() );
+        _spacing = spacing;
+        _profiles.assign( params._numSpokes, Profile() );
+
+        ElevationQuery eq( _map.get() );
+        if ( !eq.getElevation( GeoPoint(srs, params._center.x(), params._center.y()), _centerTerrain ) )
+            _centerTerrain = 0.0;
+    }
+
+    osg::Vec3d center = params._center;
+    if ( params._altitudeMode != AltitudeMode::ABSOLUTE )
+        center.z() += _centerTerrain;
+
+    osg::Vec3d centerWorld;
+    _map->toWorldPoint( GeoPoint(srs, center), centerWorld );
+
+    // A new observer height changes what is visible but not the terrain. The
+    // samples stay where they were taken, which for a vertical move is within
+    // a fraction of the spacing of where the new spokes pass.
+    if ( reset || centerWorld != _centerWorld )
+    {
+        for( std::vector<Profile>::iterator p = _profiles.begin(); p != _profiles.end(); ++p )
+        {
+            p->_clear = 0;
+            p->_hit   = 0;
+        }
+        _centerWorld = centerWorld;
+    }
+
+    osg::Vec3d up = osg::Vec3d(_centerWorld);
+    up.normalize();
+
+    //Get the "side" vector
+    osg::Vec3d side = up ^ osg::Vec3d(0,0,1);
+
+    double delta = osg::PI * 2.0 / (double)params._numSpokes;
+
+    _spokes.resize( params._numSpokes );
+    for( unsigned i = 0; i < _spokes.size(); ++i )
+    {
+        osg::Quat quat( delta * (double)i, up );
+        _spokes[i]._start = _centerWorld;
+        _spokes[i]._end   = _centerWorld + quat * (side * params._radius);
+    }
+
+    TaskService* service = TaskService::getShared( "RadialLineOfSight spokes", osg::maximum(2, (int)OpenThreads::GetNumberOfProcessors()) );
+    unsigned numTasks = osg::minimum( (unsigned)service->getNumThreads(), (unsigned)_spokes.size() );
+
+    Threading::MultiEvent semaphore( numTasks );
+    std::vector< osg::ref_ptr< ParallelTask<EvaluateSpokes> > > tasks( numTasks );
+
+    for( unsigned t = 0; t < numTasks; ++t )
+    {
+        tasks[t] = new ParallelTask<EvaluateSpokes>( &semaphore );
+        tasks[t]->init( this, (t * _spokes.size()) / numTasks, ((t+1) * _spokes.size()) / numTasks );
+        service->add( tasks[t].get() );
+    }
+
+    semaphore.wait();
+}
+
+void
+RadialLineOfSightNode::HeightfieldEngine::evaluate( unsigned i, ElevationQuery& eq )
+{
+    Spoke&   spoke   = _spokes[i];
+    Profile& profile = _profiles[i];
+
+    osg::Vec3d dir    = spoke._end - spoke._start;
+    double     length = dir.normalize();
+    unsigned   n      = (unsigned)floor( length / _spacing );
+
+    // walk outward from the last visible sample until something blocks the ray.
+    while ( profile._clear < n && profile._hit == 0 )
+    {
+        unsigned k = profile._clear + 1;
+        if ( clearance(eq, profile, k, spoke._start + dir * (_spacing * (double)k)) < 0.0 )
+            profile._hit = k;
+        else
+            profile._clear = k;
+    }
+
+    spoke._hasLOS = profile._clear >= n;
+    if ( !spoke._hasLOS )
+    {
+        // place the hit where the ray crosses the terrain between the last visible sample and the blocking one.
+        unsigned k  = profile._hit;
+        double   c0 = clearance( eq, profile, k-1, spoke._start + dir * (_spacing * (double)(k-1)) );
+        double   c1 = clearance( eq, profile, k,   spoke._start + dir * (_spacing * (double)k) );
+        double   t  = c0 > 0.0 ? c0 / (c0 - c1) : 0.0;
+        spoke._hit = spoke._start + dir * (_spacing * ((double)(k-1) + t));
+    }
+}
+
+double
+RadialLineOfSightNode::HeightfieldEngine::clearance( ElevationQuery& eq, Profile& profile, unsigned k, const osg::Vec3d& world )
+{
+    GeoPoint mapPoint;
+    _map->worldPointToMapPoint( world, mapPoint );
+
+    double terrain;
+    if ( k == 0 )
+    {
+        terrain = _centerTerrain;
+    }
+    else if ( k <= profile._terrain.size() )
+    {
+        terrain = profile._terrain[k-1];
+    }
+    else
+    {
+        // samples are always taken in order, so this is the next one.
+        if ( !eq.getElevation( GeoPoint(mapPoint.getSRS(), mapPoint.x(), mapPoint.y()), terrain ) )
+            terrain = -DBL_MAX;
+        profile._terrain.push_back( terrain );
+    }
+
+    return mapPoint.z() - terrain;
+}
+
 
 RadialLineOfSightNode::RadialLineOfSightNode( MapNode* mapNode):
 _mapNode( mapNode ),
@@ -595,7 +876,10 @@ _outlineColor( 1.0f, 1.0f, 1.0f, 1.0f),
 _displayMode( MODE_SPLIT ),
 _altitudeMode( AltitudeMode::ABSOLUTE ),
 _fill(false),
-_terrainOnly( false )
+_terrainOnly( false ),
+_useHeightfields( false ),
+_sampleSpacing( 0.0 ),
+_hasPendingSpokes( false )
 {
     compute(getNode());
     _terrainChangedCallback = new RadialLineOfSightNodeTerrainChangedCallback( this );
@@ -710,6 +994,49 @@ void RadialLineOfSightNode::setTerrainOnly( bool terrainOnly )
     }
 }
 
+void
+RadialLineOfSightNode::getSpokes( SpokeVector& out_spokes )
+{
+    Threading::ScopedMutexLock lock( _pendingMutex );
+    out_spokes = _spokes;
+}
+
+bool
+RadialLineOfSightNode::getUseHeightfields() const
+{
+    return _useHeightfields;
+}
+
+void
+RadialLineOfSightNode::setUseHeightfields( bool value )
+{
+    if (_useHeightfields != value)
+    {
+        _useHeightfields = value;
+        if (_useHeightfields && !_engine.valid())
+        {
+            _engine = new HeightfieldEngine( this );
+        }
+        compute(getNode());
+    }
+}
+
+double
+RadialLineOfSightNode::getSampleSpacing() const
+{
+    return _sampleSpacing;
+}
+
+void
+RadialLineOfSightNode::setSampleSpacing( double meters )
+{
+    if (_sampleSpacing != meters)
+    {
+        _sampleSpacing = osg::maximum(meters, 0.0);
+        compute(getNode());
+    }
+}
+
 osg::Node*
 RadialLineOfSightNode::getNode()
 {
@@ -722,6 +1049,10 @@ void
 RadialLineOfSightNode::terrainChanged( const osgEarth::TileKey& tileKey, osg::Node* terrain )
 {
     OE_DEBUG << "RadialLineOfSightNode::terrainChanged" << std::endl;
+    //The heightfield engine reads the elevation data directly, so paged terrain doesn't change its results.
+    if (_useHeightfields)
+        return;
+
     //Make a temporary group that contains both the old MapNode as well as the new incoming terrain.
     //Because this function is called from the database pager thread we need to include both b/c 
     //the new terrain isn't yet merged with the new terrain.
@@ -734,19 +1065,19 @@ RadialLineOfSightNode::terrainChanged( const osgEarth::TileKey& tileKey, osg::No
 void
 RadialLineOfSightNode::compute(osg::Node* node, bool backgroundThread)
 {
-    if (_fill)
-    {
-        compute_fill( node, backgroundThread );
-    }
-    else
+    if (_useHeightfields)
     {
-        compute_line( node, backgroundThread );
+        //The results arrive asynchronously and are installed during the update traversal
+        HeightfieldEngine::Params params;
+        params._center       = _center;
+        params._altitudeMode = _altitudeMode;
+        params._radius       = _radius;
+        params._numSpokes    = _numSpokes;
+        params._spacing      = _sampleSpacing;
+        _engine->request( params );
+        return;
     }
-}
 
-void
-RadialLineOfSightNode::compute_line(osg::Node* node, bool backgroundThread)
-{    
     //Get the center point in geocentric    
     if (_altitudeMode == AltitudeMode::ABSOLUTE)
     {
@@ -758,6 +1089,34 @@ RadialLineOfSightNode::compute_line(osg::Node* node, bool backgroundThread)
         getRelativeWorld(_center.x(), _center.y(), _center.z(), _mapNode.get(), _centerWorld );
     }
 
+    SpokeVector spokes;
+    compute_spokes( node, spokes );
+
+    osg::Node* result = _fill ? createFillNode( _centerWorld, spokes ) : createLineNode( _centerWorld, spokes );
+
+    {
+        Threading::ScopedMutexLock lock( _pendingMutex );
+        _spokes.swap( spokes );
+    }
+
+    if (!backgroundThread)
+    {
+        //Remove all the children
+        removeChildren(0, getNumChildren());
+        addChild( result );
+    }
+    else
+    {
+        Threading::ScopedMutexLock lock( _pendingMutex );
+        _pendingNode = result;
+    }
+
+    fireChanged();
+}
+
+void
+RadialLineOfSightNode::compute_spokes(osg::Node* node, SpokeVector& out_spokes)
+{
     osg::Vec3d up = osg::Vec3d(_centerWorld);
     up.normalize();
 
@@ -766,22 +1125,6 @@ RadialLineOfSightNode::compute_line(osg::Node* node, bool backgroundThread)
 
     //Get the number of spokes
     double delta = osg::PI * 2.0 / (double)_numSpokes;
-    
-    osg::Geometry* geometry = new osg::Geometry;
-    geometry->setUseVertexBufferObjects(true);
-
-    osg::Vec3Array* verts = new osg::Vec3Array();
-    verts->reserve(_numSpokes * 5);
-    geometry->setVertexArray( verts );
-
-    osg::Vec4Array* colors = new osg::Vec4Array();
-    colors->reserve( _numSpokes * 5 );
-
-    geometry->setColorArray( colors );
-    geometry->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
-
-    osg::Vec3d previousEnd;
-    osg::Vec3d firstEnd;
 
     osgSim::LineOfSight los;
     los.setDatabaseCacheReadCallback(0);
@@ -797,23 +1140,50 @@ RadialLineOfSightNode::compute_line(osg::Node* node, bool backgroundThread)
 
     los.computeIntersections(node);
 
+    out_spokes.resize( _numSpokes );
     for (unsigned int i = 0; i < _numSpokes; i++)
     {
-        osg::Vec3d start = los.getStartPoint(i);
-        osg::Vec3d end = los.getEndPoint(i);
-
-        osgSim::LineOfSight::Intersections hits = los.getIntersections(i);
-        osg::Vec3d hit;
-        bool hasLOS = hits.empty();
-        if (!hasLOS)
+        Spoke& spoke = out_spokes[i];
+        spoke._start = los.getStartPoint(i);
+        spoke._end = los.getEndPoint(i);
+        spoke._hasLOS = los.getIntersections(i).empty();
+        if (!spoke._hasLOS)
         {
-            hit = *hits.begin();
+            spoke._hit = *los.getIntersections(i).begin();
         }
+    }
+}
+
+osg::Node*
+RadialLineOfSightNode::createLineNode(const osg::Vec3d& centerWorld, const SpokeVector& spokes)
+{    
+    osg::Geometry* geometry = new osg::Geometry;
+    geometry->setUseVertexBufferObjects(true);
+
+    osg::Vec3Array* verts = new osg::Vec3Array();
+    verts->reserve(spokes.size() * 5);
+    geometry->setVertexArray( verts );
+
+    osg::Vec4Array* colors = new osg::Vec4Array();
+    colors->reserve( spokes.size() * 5 );
+
+    geometry->setColorArray( colors );
+    geometry->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
+
+    osg::Vec3d previousEnd;
+    osg::Vec3d firstEnd;
+
+    for (unsigned int i = 0; i < spokes.size(); i++)
+    {
+        osg::Vec3d start = spokes[i]._start;
+        osg::Vec3d end = spokes[i]._end;
+        osg::Vec3d hit = spokes[i]._hit;
+        bool hasLOS = spokes[i]._hasLOS;
 
         if (hasLOS)
         {
-            verts->push_back( start - _centerWorld );
-            verts->push_back( end - _centerWorld );
+            verts->push_back( start - centerWorld );
+            verts->push_back( end - centerWorld );
             colors->push_back( _goodColor );
             colors->push_back( _goodColor );
         }
@@ -821,20 +1191,20 @@ RadialLineOfSightNode::compute_line(osg::Node* node, bool backgroundThread)
         {
             if (_displayMode == MODE_SPLIT)
             {
-                verts->push_back( start - _centerWorld );
-                verts->push_back( hit - _centerWorld  );
+                verts->push_back( start - centerWorld );
+                verts->push_back( hit - centerWorld  );
                 colors->push_back( _goodColor );
                 colors->push_back( _goodColor );
 
-                verts->push_back( hit - _centerWorld );
-                verts->push_back( end - _centerWorld );
+                verts->push_back( hit - centerWorld );
+                verts->push_back( end - centerWorld );
                 colors->push_back( _badColor );
                 colors->push_back( _badColor );
             }
             else if (_displayMode == MODE_SINGLE)
             {
-                verts->push_back( start - _centerWorld );
-                verts->push_back( end - _centerWorld );
+                verts->push_back( start - centerWorld );
+                verts->push_back( end - centerWorld );
                 colors->push_back( _badColor );                                
                 colors->push_back( _badColor );                
             }
@@ -843,8 +1213,8 @@ RadialLineOfSightNode::compute_line(osg::Node* node, bool backgroundThread)
 
         if (i > 0)
         {
-            verts->push_back( end - _centerWorld );
-            verts->push_back( previousEnd - _centerWorld );
+            verts->push_back( end - centerWorld );
+            verts->push_back( previousEnd - centerWorld );
             colors->push_back( _outlineColor );
             colors->push_back( _outlineColor );
         }
@@ -858,8 +1228,8 @@ RadialLineOfSightNode::compute_line(osg::Node* node, bool backgroundThread)
 
 
     //Add the last outside of circle
-    verts->push_back( firstEnd - _centerWorld );
-    verts->push_back( previousEnd - _centerWorld );
+    verts->push_back( firstEnd - centerWorld );
+    verts->push_back( previousEnd - centerWorld );
     colors->push_back( osg::Vec4(1,1,1,1));
     colors->push_back( osg::Vec4(1,1,1,1));
 
@@ -871,100 +1241,51 @@ RadialLineOfSightNode::compute_line(osg::Node* node, bool backgroundThread)
     getOrCreateStateSet()->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
 
     osg::MatrixTransform* mt = new osg::MatrixTransform;
-    mt->setMatrix(osg::Matrixd::translate(_centerWorld));
+    mt->setMatrix(osg::Matrixd::translate(centerWorld));
     mt->addChild(geode);
-    
-    if (!backgroundThread)
-    {
-        //Remove all the children
-        removeChildren(0, getNumChildren());
-        addChild( mt );  
-    }
-    else
-    {
-        _pendingNode = mt;
-    }
-
-    for( ChangedCallbackList::iterator i = _changedCallbacks.begin(); i != _changedCallbacks.end(); i++ )
-    {
-        i->get()->onChanged();
-    }	
+    return mt;
 }
 
-void
-RadialLineOfSightNode::compute_fill(osg::Node* node, bool backgroundThread)
+osg::Node*
+RadialLineOfSightNode::createFillNode(const osg::Vec3d& centerWorld, const SpokeVector& spokes)
 {    
-    //Get the center point in geocentric    
-    if (_altitudeMode == AltitudeMode::ABSOLUTE)
-    {
-        GeoPoint centerMap(_mapNode->getMapSRS(), _center);
-        _mapNode->getMap()->toWorldPoint( centerMap, _centerWorld );
-    }
-    else
-    {
-        getRelativeWorld(_center.x(), _center.y(), _center.z(), _mapNode.get(), _centerWorld );
-    }
-
-    osg::Vec3d up = osg::Vec3d(_centerWorld);
-    up.normalize();
-
-    //Get the "side" vector
-    osg::Vec3d side = up ^ osg::Vec3d(0,0,1);
-
-    //Get the number of spokes
-    double delta = osg::PI * 2.0 / (double)_numSpokes;
-    
     osg::Geometry* geometry = new osg::Geometry;
     geometry->setUseVertexBufferObjects(true);
 
     osg::Vec3Array* verts = new osg::Vec3Array();
-    verts->reserve(_numSpokes * 2);
+    verts->reserve(spokes.size() * 2);
     geometry->setVertexArray( verts );
 
     osg::Vec4Array* colors = new osg::Vec4Array();
-    colors->reserve( _numSpokes * 2 );
+    colors->reserve( spokes.size() * 2 );
 
     geometry->setColorArray( colors );
     geometry->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
 
-    osgSim::LineOfSight los;
-    los.setDatabaseCacheReadCallback(0);
-
-    for (unsigned int i = 0; i < _numSpokes; i++)
-    {
-        double angle = delta * (double)i;
-        osg::Quat quat(angle, up );
-        osg::Vec3d spoke = quat * (side * _radius);
-        osg::Vec3d end = _centerWorld + spoke;        
-        los.addLOS( _centerWorld, end);      
-    }
-
-    los.computeIntersections(node);
-
-    for (unsigned int i = 0; i < _numSpokes; i++)
+    for (unsigned int i = 0; i < spokes.size(); i++)
     {
         //Get the current hit
-        osg::Vec3d currEnd = los.getEndPoint(i);
-        bool currHasLOS = los.getIntersections(i).empty();
-        osg::Vec3d currHit = currHasLOS ? osg::Vec3d() : *los.getIntersections(i).begin();
+        osg::Vec3d currEnd = spokes[i]._end;
+        bool currHasLOS = spokes[i]._hasLOS;
+        osg::Vec3d currHit = currHasLOS ? osg::Vec3d() : spokes[i]._hit;
 
         unsigned int nextIndex = i + 1;
-        if (nextIndex == _numSpokes) nextIndex = 0;
+        if (nextIndex == spokes.size()) nextIndex = 0;
         //Get the current hit
-        osg::Vec3d nextEnd = los.getEndPoint(nextIndex);
-        bool nextHasLOS = los.getIntersections(nextIndex).empty();
-        osg::Vec3d nextHit = nextHasLOS ? osg::Vec3d() : *los.getIntersections(nextIndex).begin();
+        osg::Vec3d nextEnd = spokes[nextIndex]._end;
+        bool nextHasLOS = spokes[nextIndex]._hasLOS;
+        osg::Vec3d nextHit = nextHasLOS ? osg::Vec3d() : spokes[nextIndex]._hit;
         
         if (currHasLOS && nextHasLOS)
         {
             //Both rays have LOS            
-            verts->push_back( _centerWorld - _centerWorld );
+            verts->push_back( centerWorld - centerWorld );
             colors->push_back( _goodColor );
             
-            verts->push_back( nextEnd - _centerWorld );
+            verts->push_back( nextEnd - centerWorld );
             colors->push_back( _goodColor );
             
-            verts->push_back( currEnd - _centerWorld );                       
+            verts->push_back( currEnd - centerWorld );                       
             colors->push_back( _goodColor );
         }        
         else if (!currHasLOS && !nextHasLOS)
@@ -972,32 +1293,32 @@ RadialLineOfSightNode::compute_fill(osg::Node* node, bool backgroundThread)
             //Both rays do NOT have LOS
 
             //Draw the "good triangle"            
-            verts->push_back( _centerWorld - _centerWorld );
+            verts->push_back( centerWorld - centerWorld );
             colors->push_back( _goodColor );
             
-            verts->push_back( nextHit - _centerWorld );
+            verts->push_back( nextHit - centerWorld );
             colors->push_back( _goodColor );
             
-            verts->push_back( currHit - _centerWorld );                       
+            verts->push_back( currHit - centerWorld );                       
             colors->push_back( _goodColor );
 
             //Draw the two bad triangles
-            verts->push_back( currHit - _centerWorld );
+            verts->push_back( currHit - centerWorld );
             colors->push_back( _badColor );
             
-            verts->push_back( nextHit - _centerWorld );
+            verts->push_back( nextHit - centerWorld );
             colors->push_back( _badColor );
             
-            verts->push_back( nextEnd - _centerWorld );                       
+            verts->push_back( nextEnd - centerWorld );                       
             colors->push_back( _badColor );
 
-            verts->push_back( currHit - _centerWorld );
+            verts->push_back( currHit - centerWorld );
             colors->push_back( _badColor );
             
-            verts->push_back( nextEnd - _centerWorld );
+            verts->push_back( nextEnd - centerWorld );
             colors->push_back( _badColor );
             
-            verts->push_back( currEnd - _centerWorld );                       
+            verts->push_back( currEnd - centerWorld );                       
             colors->push_back( _badColor );
         }
         else if (!currHasLOS && nextHasLOS)
@@ -1005,46 +1326,46 @@ RadialLineOfSightNode::compute_fill(osg::Node* node, bool backgroundThread)
             //Current does not have LOS but next does
 
             //Draw the good portion
-            verts->push_back( _centerWorld - _centerWorld );
+            verts->push_back( centerWorld - centerWorld );
             colors->push_back( _goodColor );
             
-            verts->push_back( nextEnd - _centerWorld );
+            verts->push_back( nextEnd - centerWorld );
             colors->push_back( _goodColor );
             
-            verts->push_back( currHit - _centerWorld );                       
+            verts->push_back( currHit - centerWorld );                       
             colors->push_back( _goodColor );
 
             //Draw the bad portion
-            verts->push_back( currHit - _centerWorld );
+            verts->push_back( currHit - centerWorld );
             colors->push_back( _badColor );
             
-            verts->push_back( nextEnd - _centerWorld );
+            verts->push_back( nextEnd - centerWorld );
             colors->push_back( _badColor );
             
-            verts->push_back( currEnd - _centerWorld );                       
+            verts->push_back( currEnd - centerWorld );                       
             colors->push_back( _badColor );
         }
         else if (currHasLOS && !nextHasLOS)
         {
             //Current does not have LOS but next does
             //Draw the good portion
-            verts->push_back( _centerWorld - _centerWorld );
+            verts->push_back( centerWorld - centerWorld );
             colors->push_back( _goodColor );
             
-            verts->push_back( nextHit - _centerWorld );
+            verts->push_back( nextHit - centerWorld );
             colors->push_back( _goodColor );
             
-            verts->push_back( currEnd - _centerWorld );                       
+            verts->push_back( currEnd - centerWorld );                       
             colors->push_back( _goodColor );
 
             //Draw the bad portion
-            verts->push_back( nextHit - _centerWorld );
+            verts->push_back( nextHit - centerWorld );
             colors->push_back( _badColor );
             
-            verts->push_back( nextEnd - _centerWorld );
+            verts->push_back( nextEnd - centerWorld );
             colors->push_back( _badColor );
             
-            verts->push_back( currEnd - _centerWorld );                       
+            verts->push_back( currEnd - centerWorld );                       
             colors->push_back( _badColor );
         }               
     }
@@ -1059,20 +1380,14 @@ RadialLineOfSightNode::compute_fill(osg::Node* node, bool backgroundThread)
     getOrCreateStateSet()->setMode(GL_BLEND, osg::StateAttribute::ON);
 
     osg::MatrixTransform* mt = new osg::MatrixTransform;
-    mt->setMatrix(osg::Matrixd::translate(_centerWorld));
+    mt->setMatrix(osg::Matrixd::translate(centerWorld));
     mt->addChild(geode);
-    
-    if (!backgroundThread)
-    {
-        //Remove all the children
-        removeChildren(0, getNumChildren());
-        addChild( mt );  
-    }
-    else
-    {
-        _pendingNode = mt;
-    }
+    return mt;
+}
 
+void
+RadialLineOfSightNode::fireChanged()
+{
     for( ChangedCallbackList::iterator i = _changedCallbacks.begin(); i != _changedCallbacks.end(); i++ )
     {
         i->get()->onChanged();
@@ -1084,11 +1399,37 @@ RadialLineOfSightNode::traverse(osg::NodeVisitor& nv)
 {
     if (nv.getVisitorType() == osg::NodeVisitor::UPDATE_VISITOR)
     {
-        if (_pendingNode.valid())
+        osg::ref_ptr< osg::Node > pendingNode;
+        SpokeVector spokes;
+        bool hasSpokes = false;
+        {
+            Threading::ScopedMutexLock lock( _pendingMutex );
+            pendingNode = _pendingNode;
+            _pendingNode = 0;
+            if (_hasPendingSpokes)
+            {
+                _centerWorld = _pendingCenterWorld;
+                spokes.swap( _pendingSpokes );
+                _spokes = spokes;
+                _hasPendingSpokes = false;
+                hasSpokes = true;
+            }
+        }
+
+        if (hasSpokes)
+        {
+            pendingNode = _fill ? createFillNode( _centerWorld, spokes ) : createLineNode( _centerWorld, spokes );
+        }
+
+        if (pendingNode.valid())
         {
             removeChildren(0, getNumChildren());
-            addChild( _pendingNode.get());
-            _pendingNode = 0;            
+            addChild( pendingNode.get());
+        }
+
+        if (hasSpokes)
+        {
+            fireChanged();
         }
     }
     osg::Group::traverse(nv);
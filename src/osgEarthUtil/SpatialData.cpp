@@ -23,6 +23,7 @@
 #include <osg/Geometry>
 #include <osg/Depth>
 #include <osgText/Text>
+#include <algorithm>
 #include <sstream>
 
 #define LC "[GeoGraph] "
@@ -86,26 +87,16 @@ namespace
         return geode;
     }
 
-    GeoObjectCollection::iterator
-    findObject( GeoObjectCollection& objects, GeoObject* object )
+    GeoCell* getParentCell( GeoCell* cell )
     {
-        float key = object->getPriority();
-        GeoObjectCollection::iterator first = objects.find(key);
-        if ( first == objects.end() )
-            return objects.end();
-
-        GeoObjectCollection::iterator last = objects.upper_bound(key);
-        for( ; first != last; ++first )
-            if ( first->second.get() == object )
-                return first;
-
-        return objects.end();
+        return cell->getNumParents() > 0 ? dynamic_cast<GeoCell*>( cell->getParent(0) ) : 0L;
     }
 }
 
 //------------------------------------------------------------------------
 
-GeoObject::GeoObject()
+GeoObject::GeoObject() :
+_priority( 0.0f )
 {
     //NOP
 }
@@ -165,6 +156,56 @@ GeoGraph::insertObject( GeoObject* object )
     }
 }
 
+unsigned
+GeoGraph::insertObjects( const GeoObjectVector& objects )
+{
+    unsigned numReindexed = 0;
+
+    BulkEntryVector entries;
+    entries.reserve( objects.size() );
+
+    for( GeoObjectVector::const_iterator i = objects.begin(); i != objects.end(); ++i )
+    {
+        GeoObject* object = i->get();
+        if ( !object )
+            continue;
+
+        if ( object->getGeoCell() )
+        {
+            if ( reindexObject(object) )
+                ++numReindexed;
+            continue;
+        }
+
+        BulkEntry entry;
+        if ( object->getLocation(entry._location) && _extent.contains(entry._location.x(), entry._location.y()) )
+        {
+            entry._object   = object;
+            entry._priority = object->getPriority();
+            entry._index    = getIndex( _extent, entry._location, _rootWidth, _rootHeight );
+            entries.push_back( entry );
+        }
+    }
+
+    // group the objects by root cell and hand each group down in one batch. The
+    // sort is stable so that equal-priority objects keep their arrival order.
+    std::stable_sort( entries.begin(), entries.end(), lessIndex );
+
+    for( BulkEntryVector::iterator first = entries.begin(); first != entries.end(); )
+    {
+        BulkEntryVector::iterator last = first;
+        while( last != entries.end() && last->_index == first->_index )
+            ++last;
+
+        static_cast<GeoCell*>(getChild(first->_index))->insertObjects( first, last );
+        first = last;
+    }
+
+    _count += entries.size();
+
+    return numReindexed + entries.size();
+}
+
 //------------------------------------------------------------------------
 
 GeoCell::GeoCell(const GeoExtent& extent, float maxRange, unsigned maxObjects,
@@ -178,7 +219,8 @@ _depth( depth ),
 _minObjects( (maxObjects/10)*8 ), // 80%
 _count( 0 ),
 _boundaryPoints( 10 ),
-_frameStamp( 0 )
+_frameStamp( 0 ),
+_clusterDirty( false )
 {
     generateBoundaries();
     //generateBoundaryGeometry();
@@ -328,6 +370,10 @@ GeoCell::traverse( osg::NodeVisitor& nv )
 
             // passed cull, so record the framestamp.
             _frameStamp = cv->getFrameStamp()->getFrameNumber();
+
+            // only cells whose count changed need a new cluster geode.
+            if ( _clusterDirty )
+                refreshClusterGeode();
         }
 
         if ( _objects.size() > 0 )
@@ -357,27 +403,35 @@ void
 GeoCell::adjustCount( int delta )
 {
     _count += delta;
+    _clusterDirty = true;
 
     if ( _depth > 0 && getNumParents() > 0 )
     {
         static_cast<GeoCell*>(getParent(0))->adjustCount( delta );        
+    }
+}
 
+void
+GeoCell::refreshClusterGeode()
+{
 #if 0
-        if ( !_clusterGeode.valid() )
-        {
-            _clusterGeode = makeClusterGeode( _extent, _count );
-        }
-        else
-        {
-            osgText::Text* t = static_cast<osgText::Text*>( _clusterGeode->getDrawable(0) );
-            std::stringstream buf;
-            buf << _count;
-            std::string str;
-            str = buf.str();
-            t->setText( str );
-        }
+    if ( !_clusterGeode.valid() )
+    {
+        _clusterGeode = makeClusterGeode( _extent, _count );
+    }
+    else
 #endif
+    if ( _clusterGeode.valid() )
+    {
+        osgText::Text* t = static_cast<osgText::Text*>( _clusterGeode->getDrawable(0) );
+        std::stringstream buf;
+        buf << _count;
+        std::string str;
+        str = buf.str();
+        t->setText( str );
     }
+
+    _clusterDirty = false;
 }
 
 bool
@@ -387,7 +441,9 @@ GeoCell::insertObject( GeoObject* object )
     if ( object->getLocation(location) && _extent.contains(location.x(), location.y()) )
     {
         object->_cell = this;
-        _objects.insert( std::make_pair(object->getPriority(), object) );
+        object->_priority = object->getPriority();
+        object->_slot = _objects.insert( std::make_pair(object->_priority, object) );
+        adjustCount( 1 );
 
         if ( _objects.size() > _maxObjects )
         {
@@ -402,8 +458,10 @@ GeoCell::insertObject( GeoObject* object )
             bool insertedOK = static_cast<GeoCell*>(getChild(index))->insertObject( lowPriObject );
             if ( insertedOK )
             {
-                // remove it from this cell.
+                // remove it from this cell. The child counted it again on
+                // the way up, so take back this cell's share.
                 _objects.erase( low );
+                adjustCount( -1 );
             }
             else
             {
@@ -452,30 +510,30 @@ GeoCell::split()
 bool
 GeoCell::removeObject( GeoObject* object )
 {
-    if ( object->_cell.get() == this )
+    GeoCell* owner = object->_cell.get();
+    if ( !owner )
+        return false;
+
+    // the object knows its cell; just make sure that cell is in this graph.
+    for( GeoCell* cell = owner; cell != this; )
     {
-        object->_cell = 0L;
-        _objects.erase( findObject(_objects, object) );
-        adjustCount( -1 );
+        cell = getParentCell( cell );
+        if ( !cell )
+            return false;
+    }
 
-        // if we just fell beneath the threshold, pull one up from below.
-        if ( _objects.size() == _minObjects-1 )
-        {
-            //TODO.
-        }
+    object->_cell = 0L;
+    owner->_objects.erase( object->_slot );
+    owner->adjustCount( -1 );
 
-        // TODO: rebalance, merge the tree, etc.
-        return true;
-    }
-    else
+    // if we just fell beneath the threshold, pull one up from below.
+    if ( owner->_objects.size() == owner->_minObjects-1 )
     {
-        for( unsigned i=0; i<getNumChildren(); ++i )
-        {
-            if ( static_cast<GeoCell*>(getChild(i))->removeObject( object ) )
-                return true;
-        }
+        //TODO.
     }
-    return false;
+
+    // TODO: rebalance, merge the tree, etc.
+    return true;
 }
 
 void
@@ -493,10 +551,13 @@ GeoCell::reindexObject( GeoObject* object )
         osg::Vec3d location;
         if ( object->getLocation(location) && !owner->_extent.contains(location.x(), location.y()) )
         {
+            // hold a reference; the cell may own the only one.
+            osg::ref_ptr<GeoObject> safeObject = object;
+
             // first remove from its current cell
             owner->removeObject( object );
 
-            GeoCell* cell = dynamic_cast<GeoCell*>( owner->getParent(0) );
+            GeoCell* cell = getParentCell( owner );
             while( cell )
             {
                 if ( cell->getExtent().contains(location.x(), location.y()) )
@@ -504,8 +565,20 @@ GeoCell::reindexObject( GeoObject* object )
                     if ( cell->insertObject( object ) )
                         return true;
                 }
-                cell = dynamic_cast<GeoCell*>( cell->getParent(0) );
+                cell = getParentCell( cell );
             }
+
+            // moved out of the graph altogether.
+            return false;
+        }
+
+        else if ( object->getPriority() != object->_priority )
+        {
+            // same cell, new priority; re-file it under the new key.
+            osg::ref_ptr<GeoObject> safeObject = object;
+            owner->_objects.erase( object->_slot );
+            object->_priority = object->getPriority();
+            object->_slot = owner->_objects.insert( std::make_pair(object->_priority, safeObject) );
         }
 
         // no change
@@ -517,6 +590,86 @@ GeoCell::reindexObject( GeoObject* object )
     }
 }
 
+bool
+GeoCell::lessIndex( const BulkEntry& lhs, const BulkEntry& rhs )
+{
+    return lhs._index < rhs._index;
+}
+
+bool
+GeoCell::morePriority( const BulkEntry& lhs, const BulkEntry& rhs )
+{
+    return lhs._priority > rhs._priority;
+}
+
+void
+GeoCell::insertObjects( BulkEntryVector::iterator begin, BulkEntryVector::iterator end )
+{
+    if ( begin == end )
+        return;
+
+    // every object in the batch ends up somewhere in this cell's subtree.
+    _count += (unsigned)(end - begin);
+    _clusterDirty = true;
+
+    // fill this cell in priority order. Like insertObject, the cell keeps its
+    // highest-priority objects and sends the rest down to its children; among
+    // equal priorities the newest stays, so keep the arrival order.
+    std::stable_sort( begin, end, morePriority );
+
+    BulkEntryVector pushDown;
+
+    for( BulkEntryVector::iterator i = begin; i != end; ++i )
+    {
+        if ( _objects.size() >= _maxObjects && !_objects.empty() && i->_priority < _objects.begin()->first )
+        {
+            // the cell is full and the rest of the batch ranks below all of it. (An
+            // object that ties the lowest one goes in and evicts the older one,
+            // just as insertObject would.)
+            pushDown.insert( pushDown.end(), i, end );
+            break;
+        }
+
+        GeoObject* object = i->_object.get();
+        object->_cell     = this;
+        object->_priority = i->_priority;
+        object->_slot     = _objects.insert( std::make_pair(i->_priority, i->_object) );
+
+        if ( _objects.size() > _maxObjects )
+        {
+            // evict the lowest-priority object, which may be one this cell already held.
+            GeoObjectCollection::iterator low = _objects.begin();
+            BulkEntry entry;
+            entry._object   = low->second.get();
+            entry._priority = low->first;
+            entry._object->getLocation( entry._location );
+            pushDown.push_back( entry );
+            _objects.erase( low );
+        }
+    }
+
+    if ( pushDown.empty() )
+        return;
+
+    if ( getNumChildren() == 0 )
+        split();
+
+    for( BulkEntryVector::iterator i = pushDown.begin(); i != pushDown.end(); ++i )
+        i->_index = getIndex( _extent, i->_location, _splitDim, _splitDim );
+
+    std::stable_sort( pushDown.begin(), pushDown.end(), lessIndex );
+
+    for( BulkEntryVector::iterator first = pushDown.begin(); first != pushDown.end(); )
+    {
+        BulkEntryVector::iterator last = first;
+        while( last != pushDown.end() && last->_index == first->_index )
+            ++last;
+
+        static_cast<GeoCell*>(getChild(first->_index))->insertObjects( first, last );
+        first = last;
+    }
+}
+
 #if 0
 bool
 GeoCell::reindex( GeoObject* object )